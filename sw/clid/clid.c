@@ -13,12 +13,17 @@
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <stddef.h>
+#include <time.h>
+#include <limits.h>
 
 #include <itc.h>
 #include <traceIf.h>
 
 #include "cli-daemon-tpt-provider.h"
 #include "tcp_proto.h"
+#include "tcp_proto_v2.h"
+#include "clid_capture.h"
+#include "clid_beacon.h"
 #include "cmdProto.h"
 
 /*****************************************************************************\/
@@ -32,6 +37,28 @@
 #define MAX_SUB_CMD_NAME_LENGTH	255
 #define MAX_CMD_DESC_LENGTH	128
 #define MAX_CMD_NAME_LENGTH	32
+#define MAX_NUM_CMD_ARGS	64
+#define CLID_V2_RX_CHUNK	4096
+#define CLID_V1_MAX_PAYLOAD_LENGTH	(64 * 1024)
+#define CLID_CAPTURE_BUFFER_SIZE	(256 * 1024)
+#define CLID_MAX_TRACE_SPANS	4096
+#define NSEC_PER_USEC		1000ULL
+#define NSEC_PER_SEC		1000000000ULL
+#define CLID_NUM_PRIO_CLASSES	2 // CMDIF_PRIO_INTERACTIVE and CMDIF_PRIO_BULK
+#define CLID_MAX_JOBS_IN_FLIGHT	16 // Upper bound of "-j"
+#define CLID_DEFAULT_JOBS_IN_FLIGHT	2 // One running in the handler, one already waiting in its ITC queue
+#define CLID_INTERACTIVE_BURST	8 // Interactive jobs forwarded in a row while bulk ones wait, then one bulk job gets its turn
+#define CLID_DRR_MIN_QUANTUM_US	100 // Also the cost expected from a mailbox that never replied yet
+#define CLID_DRR_MAX_QUANTA	64 // A job never has to wait more than this many rounds, however expensive it looks
+#define CLID_COST_EWMA_SHIFT	3 // Each new handler time weighs 1/8 in the average
+#define CLID_MAX_GROUP_MEMBERS	32
+#define CLID_DEFAULT_MEMBER_TIMEOUT	3 // Seconds, default of "-g"
+#define CLID_BATCH_WINDOW	8 // Commands of a CLID_BATCH_PARALLEL batch waiting for their handler at once
+#define CLID_DEFAULT_BEACON_INTERVAL	5 // Seconds, default of "-b", shells forget a device after 15 seconds of silence
+#define CLID_MAX_PROBES_PER_ROUND	64 // A storm of probes does not keep shell clients waiting
+#define CLID_PROBE_SOURCES	64 // Rate limited apart, sources hashing to the same one share its budget
+#define CLID_PROBE_BURST	4 // Probes answered back to back to one source, a shell probes once per interface
+#define CLID_PROBE_RATE		2 // Probes answered per second to one source once its burst is used up
 #define NET_INTERFACE_ETH0	"eth0"
 #define CLID_LOG_FILENAME	"clid.log"
 #define CLID_MBOX_NAME		"clidMailbox"
@@ -41,12 +68,134 @@ struct shell_client {
 	int			fd;
 	int			job_timer_fd;
 	unsigned long long	current_job_id;
+	uint32_t		current_request_id; // v2 only, echoed back in the reply of the current job
+	uint8_t			proto_version; // CLID_PROTO_V1 until negotiated otherwise by CLID_HELLO_REQUEST
+	uint8_t			*rx_buff; // v2 only, holds partially received frames
+	size_t			rx_len;
+	size_t			rx_cap;
+	uint64_t		rx_ns; // When the last bytes came from this client
+	uint64_t		job_received_ns; // Per-hop timestamps of the current job, see record_job_span()
+	uint64_t		job_forwarded_ns;
+	bool			is_timing_requested; // v2 CLID_V2_FLAG_TIMING, reply with CLID_EXE_CMD_TIMING first
+	bool			is_job_sampled;
+	char			job_cmd_name[MAX_CMD_NAME_LENGTH];
+	time_t			job_timeout;
+	union itc_msg		*queued_job; // CMDIF_EXE_CMD_REQUEST of the current job while it waits in queued_on
+	struct mbox_queue	*queued_on;
+	uint8_t			queued_class; // CMDIF_PRIO_*
+	struct shell_client	*next_queued;
+	uint32_t		queued_cost_us; // Expected handler time of the queued job
+	uint32_t		deficit_us; // Deficit round robin credit, only valid for jobs to deficit_on
+	struct mbox_queue	*deficit_on;
+	struct group_job	*group_job; // Current job is a broadcast to a command group, NULL otherwise
+	struct batch_job	*batch_job; // Current job is a CLID_EXE_BATCH_REQUEST, NULL otherwise
 };
 
-struct command {
+struct cmd_arg {
+	const char		*str; // Not NUL-terminated
+	uint16_t		len;
+};
+
+struct group_member {
 	itc_mbox_id_t		mbox_id;
+	char			name[MAX_CMD_NAME_LENGTH];
+};
+
+struct command {
+	itc_mbox_id_t		mbox_id; // ITC_NO_MBOX_ID for a group, see members
+	uint8_t			priority; // CMDIF_PRIO_*, as registered
+	struct mbox_queue	*mbox_queue;
+	uint32_t		cost_us; // Moving average of its handler time, 0 until the first reply
 	char			cmd_name[MAX_CMD_NAME_LENGTH];
 	char			cmd_desc[MAX_CMD_DESC_LENGTH];
+	bool			is_group; // Joined by CMDIF_REG_FLAG_GROUP, each job goes to all members at once
+	uint16_t		member_count;
+	struct group_member	members[CLID_MAX_GROUP_MEMBERS];
+	uint8_t			*syntax; // From CMDIF_REG_SYNTAX_REQUEST, NULL if its handler sent none, served as is by CLID_GET_SYNTAX_REPLY
+	uint32_t		syntax_len;
+	bool			is_syntax_pending; // Registered with CMDIF_REG_FLAG_SYNTAX, kept from v2 shells until its syntax arrives
+};
+
+struct member_reply {
+	struct group_member	member;
+	bool			is_replied;
+	uint32_t		result;
+	uint64_t		elapsed_ns;
+	char			*output;
+	uint32_t		output_len;
+};
+
+/* One broadcast job: the members it was sent to and what they answered so far. Members bypass the mbox_queue scheduling,
+a broadcast is an operator's diagnostic that has to reach every process at the same time */
+struct group_job {
+	unsigned long long	first_job_id; // Member i got first_job_id + i
+	uint64_t		started_ns;
+	time_t			member_timeout;
+	uint16_t		member_count;
+	uint16_t		reply_count;
+	struct member_reply	replies[CLID_MAX_GROUP_MEMBERS];
+};
+
+#define BATCH_CMD_PENDING	0
+#define BATCH_CMD_RUNNING	1
+#define BATCH_CMD_DONE		2
+
+struct batch_cmd {
+	uint16_t		num_args;
+	uint32_t		first_arg; // Index of its cmd_name in batch_job.args
+	uint8_t			state; // BATCH_CMD_*
+	uint32_t		result; // CLID_BATCH_RESULT_SKIPPED until done
+	char			*output;
+	uint32_t		output_len;
+};
+
+/* One CLID_EXE_BATCH_REQUEST. Each command runs as an ordinary job of the client with its own job_id through the mbox_queue scheduling,
+the sequential policies one at a time, CLID_BATCH_PARALLEL ones up to CLID_BATCH_WINDOW at a time. The shell only gets one reply,
+once all commands are done or skipped */
+struct batch_job {
+	uint8_t			policy; // CLID_BATCH_*
+	time_t			timeout; // Of each command
+	unsigned long long	first_job_id; // Command i runs as job first_job_id + i
+	uint32_t		cmd_count;
+	uint32_t		next; // First command not started yet
+	uint32_t		in_flight;
+	bool			is_stopped; // An error under CLID_BATCH_STOP_ON_ERROR or an expiry, nothing is started anymore
+	bool			is_bulk; // v2 CLID_V2_FLAG_BULK, applies to all of its commands
+	uint8_t			*payload; // Copy of the request payload, args point into it
+	struct cmd_arg		*args;
+	struct batch_cmd	cmds[];
+};
+
+struct job_queue {
+	struct shell_client	*head; // Linked through shell_client.next_queued, a client has at most one job
+	struct shell_client	*tail;
+};
+
+struct in_flight_job {
+	unsigned long long	job_id; // 0 if this slot is free
+	struct mbox_queue	*mbox_queue;
+	struct command		*command; // NULL once deregistered
+	uint64_t		forwarded_ns;
+	uint64_t		deadline_ns; // The job timer of its client is gone by then, stop waiting for the reply
+};
+
+/* Jobs of all commands served by one handler mailbox. Only a bounded number of them is forwarded at once,
+the others wait here per priority class, so that a newly typed interactive job overtakes a backlog of bulk ones.
+Within a class, the waiting clients share the handler time by deficit round robin, see pick_next_job() */
+struct mbox_queue {
+	itc_mbox_id_t		mbox_id; // ITC_NO_MBOX_ID if this entry is free
+	uint16_t		cmd_count; // Registered commands served by this mailbox
+	uint32_t		cost_us; // Moving average of the handler time of all its commands, expected for a command not seen yet
+	struct job_queue	queues[CLID_NUM_PRIO_CLASSES]; // Round robin order of the waiting clients
+	uint32_t		interactive_streak;
+	uint32_t		in_flight;
+	struct in_flight_job	slots[CLID_MAX_JOBS_IN_FLIGHT];
+};
+
+/* Token bucket of the probes answered to the sources hashing here */
+struct probe_source {
+	uint32_t				tokens;
+	uint64_t				refill_ns;
 };
 
 struct clid_instance {
@@ -57,8 +206,52 @@ struct clid_instance {
 	uint16_t				cmd_count;
 	struct command				cmds[MAX_NUM_CMDS];
 	void					*cmd_tree;
+	uint32_t				registry_epoch; // Tells this run of clid from the previous ones, see CLID_GET_LIST_CMD_REPLY
+	uint32_t				registry_version; // Bumped on every change of cmds, see notify_cmd_list_changed()
+	struct mbox_queue			mbox_queues[MAX_NUM_CMDS]; // A mailbox serves at least one command
+	void					*mbox_queue_tree;
+	void					*in_flight_tree;
 	int					mbox_fd;
 	itc_mbox_id_t				mbox_id;
+	int					beacon_fd; // Sends the beacon and takes the probes, CLID_PROBE_PORT
+	int					beacon_timer_fd;
+	struct sockaddr_in			beacon_addr; // Broadcast address of NET_INTERFACE_ETH0
+	struct clid_beacon			beacon; // The fields that never change are filled in once by setup_beacon()
+	struct in_addr				probe_mask; // Netmask of NET_INTERFACE_ETH0, only probes from its network are answered
+	struct probe_source			probe_sources[CLID_PROBE_SOURCES];
+};
+
+/* Traffic capture, see clid_capture.h. Only active with "-r <file>", SIGUSR1 pauses/resumes it at runtime */
+struct clid_capture {
+	FILE					*file;
+	struct timespec				start;
+	bool					is_paused;
+	volatile sig_atomic_t			toggle_requested;
+};
+
+/* Where the time of one job went, all timestamps in clid's CLOCK_MONOTONIC except the cmdif durations */
+struct job_span {
+	unsigned long long			job_id;
+	int					fd;
+	char					cmd_name[MAX_CMD_NAME_LENGTH];
+	uint32_t				result;
+	uint64_t				received_ns;
+	uint64_t				forwarded_ns;
+	uint64_t				replied_ns;
+	uint64_t				relayed_ns;
+	uint64_t				cmdif_queue_ns; // Measured by cmdif on the handler's clock
+	uint64_t				handler_ns;
+};
+
+/* Sampled job spans, only active with "-t <file>". Kept in a ring and dumped as Chrome trace-event JSON on SIGUSR2 and on SIGTERM/SIGINT */
+struct clid_trace {
+	const char				*path;
+	uint32_t				sample_period; // One job out of sample_period, jobs asking for CLID_V2_FLAG_TIMING always
+	struct job_span				*spans;
+	size_t					next;
+	size_t					count;
+	volatile sig_atomic_t			dump_requested;
+	volatile sig_atomic_t			exit_signo; // SIGTERM/SIGINT, left to the main loop which dumps the spans before it terminates
 };
 
 
@@ -67,6 +260,11 @@ struct clid_instance {
 *******************************************************************************/
 static struct clid_instance clid_inst;
 static unsigned long long m_job_id = 0; // global job id, each requested cmd execution from a shell client has a unique job_id (count up to max of unsigned long long)
+static struct clid_capture m_capture = { .file = NULL };
+static struct clid_trace m_trace = { .path = NULL, .sample_period = 1, .spans = NULL };
+static uint32_t m_max_jobs_in_flight = CLID_DEFAULT_JOBS_IN_FLIGHT; // Per handler mailbox
+static time_t m_member_timeout = CLID_DEFAULT_MEMBER_TIMEOUT;
+static uint32_t m_beacon_interval = CLID_DEFAULT_BEACON_INTERVAL;
 
 
 /*****************************************************************************\/
@@ -81,31 +279,95 @@ static bool setup_tcp_server(void);
 static struct in_addr get_ip_address_from_network_interface(int sockfd, char *interface);
 static bool handle_accept_new_connection(int sockfd);
 static int compare_fd_in_client_tree(const void *pa, const void *pb);
-static int compare_timerfd_in_client_tree(const void *pa, const void *pb);
-static int compare_jobid_in_client_tree(const void *pa, const void *pb);
+static struct shell_client *find_client_by_timerfd(int timerfd);
+static struct shell_client *find_client_by_job_id(unsigned long long job_id);
 static int compare_client_in_client_tree(const void *pa, const void *pb);
 static bool setup_shell_clients(void);
 static bool setup_command_list(void);
 static bool handle_receive_tcp_packet(int sockfd);
 static int recv_data(int sockfd, void *rx_buff, int nr_bytes_to_read);
+static int send_data(int sockfd, const void *tx_buff, size_t nr_bytes_to_send);
 static bool release_shell_client_resources(int sockfd);
-static bool handle_receive_get_list_cmd_request(int sockfd, struct ethtcp_header *header);
-static bool handle_receive_exe_cmd_request(int sockfd, struct ethtcp_header *header);
+static void drop_shell_client(int sockfd);
+static bool handle_receive_hello_request(int sockfd, struct ethtcp_header *header);
+static bool handle_receive_get_list_cmd_request(int sockfd, char *payload, uint32_t payload_len);
+static bool handle_receive_exe_cmd_request(int sockfd, char *payload, uint32_t payload_len);
+static bool handle_receive_v2_data(struct shell_client *client);
+static bool handle_receive_v2_frame(struct shell_client *client, const struct clid_v2_frame *frame);
+static bool handle_receive_v2_exe_cmd_request(struct shell_client *client, const struct clid_v2_frame *frame);
+static bool start_new_job(int sockfd, time_t timeout, uint16_t num_args, const struct cmd_arg *args, bool is_timing_requested, bool is_bulk);
+static bool handle_receive_v2_batch_request(struct shell_client *client, const struct clid_v2_frame *frame);
+static bool run_batch_job(struct shell_client *client);
+static bool start_batch_cmd(struct shell_client *client, uint32_t index);
+static bool handle_receive_batch_cmd_reply(struct shell_client *client, union itc_msg *msg);
+static bool record_batch_cmd_result(struct batch_job *batch_job, uint32_t index, uint32_t result, const char *output, uint32_t output_len);
+static bool expire_batch_job(struct shell_client *client);
+static bool finish_batch_job(struct shell_client *client);
+static void release_batch_job(struct shell_client *client);
 static void do_nothing(void *tree_node_data);
+static bool send_hello_reply(int sockfd, uint32_t version);
 static bool send_get_list_cmd_reply(int sockfd);
-static bool send_exe_cmd_reply(int sockfd, uint32_t result, char *output);
+static bool send_v2_get_list_cmd_reply(struct shell_client *client, const struct clid_v2_frame *frame);
+static bool send_v2_get_syntax_reply(struct shell_client *client, const struct clid_v2_frame *frame);
+static bool send_exe_cmd_reply(int sockfd, uint32_t result, const char *output, uint32_t output_len);
+static bool send_v2_exe_cmd_reply(struct shell_client *client, uint32_t result, const char *output, uint32_t output_len);
+static void send_v2_exe_cmd_timing(struct shell_client *client, const struct CmdIfExeCmdTimedReplyS *reply, uint64_t replied_ns);
+static void notify_cmd_list_changed(uint32_t change, const struct command *command);
 static bool restart_job_timer(int sockfd, time_t timeout);
 static bool set_time_job_timer(int timerfd, time_t timeout);
 static bool is_job_timer_running(int timerfd);
 static bool reassign_current_job_id(int sockfd, unsigned long long new_job_id);
 static bool handle_receive_itc_msg(int mbox_fd);
 static bool handle_receive_reg_cmd_request(union itc_msg *msg);
+static void get_reg_cmd_ext(union itc_msg *msg, struct CmdIfRegCmdExtS *ext);
 static int compare_cmdname_in_cmd_tree(const void *pa, const void *pb);
 static int compare_command_in_cmd_tree(const void *pa, const void *pb);
 static bool handle_receive_dereg_cmd_request(union itc_msg *msg);
-static bool forward_exe_cmd_request(unsigned long long job_id, char *cmd_name, uint16_t num_args, uint32_t pl_len, char *pl);
+static bool handle_receive_reg_syntax_request(union itc_msg *msg);
+static void add_group_member(struct command *command, itc_mbox_id_t mbox_id, const char *member_name);
+static bool start_group_job(struct shell_client *client, const struct command *command, union itc_msg *fwd, size_t msg_size);
+static bool handle_receive_group_member_reply(struct shell_client *client, union itc_msg *msg, uint64_t replied_ns);
+static bool finish_group_job(struct shell_client *client);
+static void release_group_job(struct shell_client *client);
+static const char *get_result_name(uint32_t result);
+static struct command *find_command(const struct cmd_arg *cmd_name);
+static union itc_msg *build_exe_cmd_request(unsigned long long job_id, uint16_t num_args, const struct cmd_arg *args, size_t *msg_size);
+static bool queue_exe_cmd_request(struct shell_client *client, unsigned long long job_id, uint16_t num_args, const struct cmd_arg *args, bool is_bulk);
+static void dequeue_exe_cmd_request(struct shell_client *client);
+static bool dispatch_queued_jobs(struct mbox_queue *mbox_queue);
+static struct shell_client *pick_next_job(struct job_queue *queue);
+static void update_job_cost(const struct in_flight_job *slot, const struct CmdIfExeCmdTimedReplyS *reply, uint64_t replied_ns);
+static void update_moving_average(uint32_t *average_us, uint64_t sample_ns);
+static bool forward_exe_cmd_request(struct shell_client *client, struct mbox_queue *mbox_queue);
+static void release_in_flight_job(struct in_flight_job *slot);
+static struct mbox_queue *get_mbox_queue(itc_mbox_id_t mbox_id);
+static void release_mbox_queue(struct mbox_queue *mbox_queue);
+static int compare_mbox_id_in_mbox_queue_tree(const void *pa, const void *pb);
+static int compare_mbox_queue_in_mbox_queue_tree(const void *pa, const void *pb);
+static int compare_job_id_in_in_flight_tree(const void *pa, const void *pb);
+static int compare_in_flight_job_in_in_flight_tree(const void *pa, const void *pb);
+static bool upgrade_exe_cmd_reply(union itc_msg **msg);
+static bool check_exe_cmd_timed_reply(union itc_msg *msg);
 static bool handle_receive_exe_cmd_reply(union itc_msg *msg);
 static bool handle_job_timer_expired(int timerfd);
+static bool setup_beacon(void);
+static void send_beacon(const struct sockaddr_in *to);
+static void handle_receive_probe(void);
+static bool is_probe_answered(const struct sockaddr_in *from);
+static void handle_beacon_timer_expired(void);
+static bool setup_capture(const char *path);
+static void capture_sig_handler(int signo);
+static void handle_capture_toggle(void);
+static void stop_capture(void);
+static bool capture_begin(uint8_t kind, int conn, unsigned long long job_id, uint32_t body_length);
+static void capture_append(const void *data, size_t len);
+static void capture_record(uint8_t kind, int conn, unsigned long long job_id, const void *body, uint32_t body_length);
+static uint64_t get_time_ns(void);
+static bool setup_trace(const char *path, uint32_t sample_period);
+static void trace_sig_handler(int signo);
+static void record_job_span(const struct shell_client *client, const struct CmdIfExeCmdTimedReplyS *reply, uint64_t replied_ns, uint64_t relayed_ns);
+static void dump_trace(void);
+static void write_trace_event(FILE *file, const char *name, int tid, uint64_t begin_ns, uint64_t end_ns);
 
 
 
@@ -119,19 +381,60 @@ int main(int argc, char* argv[])
 
 	int opt = 0;
 	bool is_daemon = false;
+	const char *capture_path = NULL;
+	const char *trace_path = NULL;
+	uint32_t sample_period = 1;
 
-	while((opt = getopt(argc, argv, "d")) != -1)
+	while((opt = getopt(argc, argv, "dr:t:s:j:g:b:")) != -1)
 	{
 		switch (opt)
 		{
 		case 'd':
 			is_daemon = true;
 			break;
+
+		case 'r':
+			capture_path = optarg;
+			break;
+
+		case 't':
+			trace_path = optarg;
+			break;
+
+		case 's':
+			sample_period = (uint32_t)strtoul(optarg, NULL, 10);
+			sample_period = sample_period ? sample_period : 1;
+			break;
+
+		case 'j':
+			m_max_jobs_in_flight = (uint32_t)strtoul(optarg, NULL, 10);
+			m_max_jobs_in_flight = m_max_jobs_in_flight == 0 ? 1 : m_max_jobs_in_flight;
+			m_max_jobs_in_flight = m_max_jobs_in_flight > CLID_MAX_JOBS_IN_FLIGHT ? CLID_MAX_JOBS_IN_FLIGHT : m_max_jobs_in_flight;
+			break;
+
+		case 'g':
+			m_member_timeout = (time_t)strtoul(optarg, NULL, 10);
+			m_member_timeout = m_member_timeout ? m_member_timeout : 1;
+			break;
+
+		case 'b':
+			m_beacon_interval = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
 		
 		default:
-			printf("ERROR: Usage:\t%s\t[-d]\n", argv[0]);
+			printf("ERROR: Usage:\t%s\t[-d] [-r <capture_file>] [-t <trace_file> [-s <sample_period>]] [-j <max_jobs_in_flight>] [-g <member_timeout>] [-b <beacon_interval>]\n", argv[0]);
 			printf("Example:\t%s\t-d\n", argv[0]);
 			printf("=> This will start clid as a daemon!\n");
+			printf("Example:\t%s\t-r /tmp/clid.cap\n", argv[0]);
+			printf("=> This will append all inbound frames and handler replies to /tmp/clid.cap, send SIGUSR1 to pause/resume!\n");
+			printf("Example:\t%s\t-t /tmp/clid.json -s 100\n", argv[0]);
+			printf("=> This will keep per-hop spans of one job out of 100, send SIGUSR2 to write them to /tmp/clid.json as Chrome trace JSON!\n");
+			printf("Example:\t%s\t-j 4\n", argv[0]);
+			printf("=> This will forward up to 4 jobs at once to each handler mailbox (default %d, at most %d), the others wait in clid, interactive ones first!\n", CLID_DEFAULT_JOBS_IN_FLIGHT, CLID_MAX_JOBS_IN_FLIGHT);
+			printf("Example:\t%s\t-g 5\n", argv[0]);
+			printf("=> This will wait up to 5 seconds for all members of a command group to reply, then reply with what is there (default %d)!\n", CLID_DEFAULT_MEMBER_TIMEOUT);
+			printf("Example:\t%s\t-b 0\n", argv[0]);
+			printf("=> This will not broadcast the discovery beacon with this clid's load, sent every %d seconds by default, and will not answer the probes of shells either!\n", CLID_DEFAULT_BEACON_INTERVAL);
 			exit(EXIT_FAILURE);
 			break;
 		}
@@ -168,6 +471,24 @@ int main(int argc, char* argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if(capture_path != NULL && !setup_capture(capture_path))
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to setup capture file %s!", capture_path);
+		exit(EXIT_FAILURE);
+	}
+
+	if(trace_path != NULL && !setup_trace(trace_path, sample_period))
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to setup trace file %s!", trace_path);
+		exit(EXIT_FAILURE);
+	}
+
+	// Shells still find this device by the ITCGW broadcast, only without its load
+	if(!setup_beacon())
+	{
+		TPT_TRACE(TRACE_ABN, "Failed to setup discovery beacon, going on without it!");
+	}
+
 	fd_set fdset;
 	int max_fd = -1;
 	int res = 0;
@@ -178,6 +499,16 @@ int main(int argc, char* argv[])
 		max_fd = MAX_OF(clid_inst.tcp_fd, max_fd);
 		FD_SET(clid_inst.mbox_fd, &fdset);
 		max_fd = MAX_OF(clid_inst.mbox_fd, max_fd);
+		if(clid_inst.beacon_fd != -1)
+		{
+			FD_SET(clid_inst.beacon_fd, &fdset);
+			max_fd = MAX_OF(clid_inst.beacon_fd, max_fd);
+		}
+		if(clid_inst.beacon_timer_fd != -1)
+		{
+			FD_SET(clid_inst.beacon_timer_fd, &fdset);
+			max_fd = MAX_OF(clid_inst.beacon_timer_fd, max_fd);
+		}
 
 		for(int i = 0; i < MAX_NUM_SHELL_CLIENTS; i++)
 		{
@@ -195,8 +526,30 @@ int main(int argc, char* argv[])
 		}
 
 		res = select(max_fd + 1, &fdset, NULL, NULL, NULL);
+		if(m_capture.toggle_requested)
+		{
+			handle_capture_toggle();
+		}
+
+		if(m_trace.dump_requested)
+		{
+			m_trace.dump_requested = 0;
+			dump_trace();
+		}
+
+		if(m_trace.exit_signo != 0)
+		{
+			dump_trace();
+			clid_sig_handler(m_trace.exit_signo);
+		}
+
 		if(res < 0)
 		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
 			TPT_TRACE(TRACE_ERROR, "Failed to select()!");
 			exit(EXIT_FAILURE);
 		}
@@ -219,6 +572,16 @@ int main(int argc, char* argv[])
 			}
 		}
 
+		if(clid_inst.beacon_fd != -1 && FD_ISSET(clid_inst.beacon_fd, &fdset))
+		{
+			handle_receive_probe();
+		}
+
+		if(clid_inst.beacon_timer_fd != -1 && FD_ISSET(clid_inst.beacon_timer_fd, &fdset))
+		{
+			handle_beacon_timer_expired();
+		}
+
 		for(int i = 0; i < MAX_NUM_SHELL_CLIENTS; i++)
 		{
 			if(clid_inst.clients[i].fd != -1)
@@ -267,6 +630,13 @@ static void clid_init(void)
 
 static void clid_sig_handler(int signo)
 {
+	// dump_trace() uses stdio which is not async-signal-safe, a requested stop waits for the main loop to dump first
+	if(m_trace.spans != NULL && m_trace.exit_signo == 0 && (signo == SIGTERM || signo == SIGINT))
+	{
+		m_trace.exit_signo = signo;
+		return;
+	}
+
 	// Call our own exit_handler
 	TPT_TRACE(TRACE_INFO, "CLID is terminated with SIG = %d, calling exit handler...", signo);
 	clid_exit_handler();
@@ -281,8 +651,21 @@ static void clid_exit_handler(void)
 	TPT_TRACE(TRACE_INFO, "CLID is terminated, calling exit handler...");
 
 	close(clid_inst.tcp_fd);
+	if(clid_inst.beacon_fd != -1)
+	{
+		close(clid_inst.beacon_fd);
+	}
+	if(clid_inst.beacon_timer_fd != -1)
+	{
+		close(clid_inst.beacon_timer_fd);
+	}
 	tdestroy(clid_inst.client_tree, do_nothing);
 	tdestroy(clid_inst.cmd_tree, do_nothing);
+	tdestroy(clid_inst.mbox_queue_tree, do_nothing);
+	tdestroy(clid_inst.in_flight_tree, do_nothing);
+	stop_capture();
+	free(m_trace.spans);
+	m_trace.spans = NULL;
 	itc_delete_mailbox(clid_inst.mbox_id);
 	itc_exit();
 	
@@ -434,6 +817,7 @@ static bool handle_accept_new_connection(int sockfd)
 			{
 				clid_inst.clients[i].fd = new_fd;
 				tsearch(&clid_inst.clients[i], &clid_inst.client_tree, compare_client_in_client_tree);
+				capture_record(CLID_CAP_CONNECT, new_fd, 0, NULL, 0);
 				break;
 			}
 		}
@@ -465,38 +849,50 @@ static int compare_fd_in_client_tree(const void *pa, const void *pb)
 	}
 }
 
-static int compare_timerfd_in_client_tree(const void *pa, const void *pb)
+/* client_tree is ordered by fd, it cannot be searched by any other key, so scan the (small, fixed) client array instead */
+static struct shell_client *find_client_by_timerfd(int timerfd)
 {
-	const int *timerfd = pa;
-	const struct shell_client *client = pb;
-
-	if(*timerfd == client->job_timer_fd)
-	{
-		return 0;
-	} else if(*timerfd > client->job_timer_fd)
-	{
-		return 1;
-	} else
+	for(int i = 0; i < MAX_NUM_SHELL_CLIENTS; i++)
 	{
-		return -1;
+		if(clid_inst.clients[i].fd != -1 && clid_inst.clients[i].job_timer_fd == timerfd)
+		{
+			return &clid_inst.clients[i];
+		}
 	}
+
+	return NULL;
 }
 
-static int compare_jobid_in_client_tree(const void *pa, const void *pb)
+static struct shell_client *find_client_by_job_id(unsigned long long job_id)
 {
-	const unsigned long long *job_id = pa;
-	const struct shell_client *client = pb;
-
-	if(*job_id == client->current_job_id)
-	{
-		return 0;
-	} else if(*job_id > client->current_job_id)
+	if(job_id == 0)
 	{
-		return 1;
-	} else
+		return NULL; // Idle clients
+	}
+
+	for(int i = 0; i < MAX_NUM_SHELL_CLIENTS; i++)
 	{
-		return -1;
+		if(clid_inst.clients[i].fd != -1 && clid_inst.clients[i].current_job_id == job_id)
+		{
+			return &clid_inst.clients[i];
+		}
+
+		// Every command of a batch has its own job_id, parallel ones are outstanding at the same time
+		const struct batch_job *batch_job = clid_inst.clients[i].batch_job;
+		if(batch_job != NULL && job_id >= batch_job->first_job_id && job_id - batch_job->first_job_id < batch_job->cmd_count)
+		{
+			return &clid_inst.clients[i];
+		}
+
+		// So does every member of a group job
+		const struct group_job *group_job = clid_inst.clients[i].group_job;
+		if(group_job != NULL && job_id >= group_job->first_job_id && job_id - group_job->first_job_id < group_job->member_count)
+		{
+			return &clid_inst.clients[i];
+		}
 	}
+
+	return NULL;
 }
 
 static int compare_client_in_client_tree(const void *pa, const void *pb)
@@ -539,6 +935,20 @@ static bool setup_shell_clients(void)
 		clid_inst.clients[i].fd = -1;
 		clid_inst.clients[i].job_timer_fd = -1;
 		clid_inst.clients[i].current_job_id = 0;
+		clid_inst.clients[i].current_request_id = 0;
+		clid_inst.clients[i].proto_version = CLID_PROTO_V1;
+		clid_inst.clients[i].rx_buff = NULL;
+		clid_inst.clients[i].rx_len = 0;
+		clid_inst.clients[i].rx_cap = 0;
+		clid_inst.clients[i].is_timing_requested = false;
+		clid_inst.clients[i].is_job_sampled = false;
+		clid_inst.clients[i].queued_job = NULL;
+		clid_inst.clients[i].queued_on = NULL;
+		clid_inst.clients[i].next_queued = NULL;
+		clid_inst.clients[i].deficit_us = 0;
+		clid_inst.clients[i].deficit_on = NULL;
+		clid_inst.clients[i].group_job = NULL;
+		clid_inst.clients[i].batch_job = NULL;
 	}
 
 	return true;
@@ -548,6 +958,10 @@ static bool setup_command_list(void)
 {
 	clid_inst.cmd_count = 0;
 
+	// Only has to differ from the previous runs of clid on this device, 0 is left for "nothing cached"
+	clid_inst.registry_epoch = ((uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16)) | 1;
+	clid_inst.registry_version = 0;
+
 	// strcpy(clid_inst.cmds[0].cmd_name, "aclocal");
 	// strcpy(clid_inst.cmds[0].cmd_desc, "Run aclocal command.");
 	// clid_inst.cmd_count++;
@@ -563,8 +977,19 @@ static bool setup_command_list(void)
 	for(int i = 0; i < MAX_NUM_CMDS; i++)
 	{
 		clid_inst.cmds[i].mbox_id = ITC_NO_MBOX_ID;
+		clid_inst.cmds[i].priority = CMDIF_PRIO_INTERACTIVE;
+		clid_inst.cmds[i].mbox_queue = NULL;
+		clid_inst.cmds[i].cost_us = 0;
 		clid_inst.cmds[i].cmd_name[0] = '\0';
 		clid_inst.cmds[i].cmd_desc[0] = '\0';
+		clid_inst.cmds[i].is_group = false;
+		clid_inst.cmds[i].member_count = 0;
+		clid_inst.cmds[i].syntax = NULL;
+		clid_inst.cmds[i].syntax_len = 0;
+		clid_inst.cmds[i].is_syntax_pending = false;
+
+		memset(&clid_inst.mbox_queues[i], 0, sizeof(struct mbox_queue));
+		clid_inst.mbox_queues[i].mbox_id = ITC_NO_MBOX_ID;
 	}
 
 	return true;
@@ -572,6 +997,13 @@ static bool setup_command_list(void)
 
 static bool handle_receive_tcp_packet(int sockfd)
 {
+	struct shell_client **iter;
+	iter = tfind(&sockfd, &clid_inst.client_tree, compare_fd_in_client_tree);
+	if(iter != NULL && (*iter)->proto_version == CLID_PROTO_V2)
+	{
+		return handle_receive_v2_data(*iter);
+	}
+
 	struct ethtcp_header *header;
 	int header_size = sizeof(struct ethtcp_header);
 	char rxbuff[header_size];
@@ -594,6 +1026,14 @@ static bool handle_receive_tcp_packet(int sockfd)
 		return false;
 	}
 
+	if(iter != NULL)
+	{
+		(*iter)->rx_ns = get_time_ns();
+	}
+
+	struct ethtcp_header raw_header;
+	memcpy(&raw_header, rxbuff, header_size);
+
 	header = (struct ethtcp_header *)rxbuff;
 	header->msgno 			= ntohl(header->msgno);
 	header->payloadLen 		= ntohl(header->payloadLen);
@@ -608,16 +1048,56 @@ static bool handle_receive_tcp_packet(int sockfd)
 	TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: receiver: %u", header->receiver);
 	TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: sender: %u", header->sender);
 
+	if(header->payloadLen > CLID_V1_MAX_PAYLOAD_LENGTH)
+	{
+		TPT_TRACE(TRACE_ABN, "Shell client fd %d announced a payload of %u bytes, which is too large, disconnect it!", sockfd, header->payloadLen);
+		if(!release_shell_client_resources(sockfd))
+		{
+			TPT_TRACE(TRACE_ERROR, "Failed to release_shell_client_resources()!");
+		}
+
+		return true;
+	}
+
+	// Read the whole frame before handling it, so that it can also be captured as is
+	uint32_t payload_len = header->payloadLen;
+	char payload[payload_len + 1];
+	if(payload_len > 0)
+	{
+		size = recv_data(sockfd, payload, payload_len);
+		if(size <= 0)
+		{
+			TPT_TRACE(TRACE_ABN, "Failed to receive payload from this shell client, fd = %d, drop it!", sockfd);
+			if(!release_shell_client_resources(sockfd))
+			{
+				TPT_TRACE(TRACE_ERROR, "Failed to release_shell_client_resources()!");
+			}
+
+			return true;
+		}
+	}
+
+	if(capture_begin(CLID_CAP_INBOUND, sockfd, 0, header_size + payload_len))
+	{
+		capture_append(&raw_header, header_size);
+		capture_append(payload, payload_len);
+	}
+
 	switch (header->msgno)
 	{
+	case CLID_HELLO_REQUEST:
+		TPT_TRACE(TRACE_INFO, "Received CLID_HELLO_REQUEST!");
+		handle_receive_hello_request(sockfd, header);
+		break;
+
 	case CLID_GET_LIST_CMD_REQUEST:
 		TPT_TRACE(TRACE_INFO, "Received CLID_GET_LIST_CMD_REQUEST!");
-		handle_receive_get_list_cmd_request(sockfd, header);
+		handle_receive_get_list_cmd_request(sockfd, payload, payload_len);
 		break;
 	
 	case CLID_EXE_CMD_REQUEST:
 		TPT_TRACE(TRACE_INFO, "Received CLID_EXE_CMD_REQUEST!");
-		handle_receive_exe_cmd_request(sockfd, header);
+		handle_receive_exe_cmd_request(sockfd, payload, payload_len);
 		break;
 	
 	default:
@@ -648,6 +1128,29 @@ static int recv_data(int sockfd, void *rx_buff, int nr_bytes_to_read)
 	return read_count;
 }
 
+static int send_data(int sockfd, const void *tx_buff, size_t nr_bytes_to_send)
+{
+	size_t sent_count = 0;
+
+	while(sent_count < nr_bytes_to_send)
+	{
+		ssize_t length = send(sockfd, (const char *)tx_buff + sent_count, nr_bytes_to_send - sent_count, 0);
+		if(length < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			return -1;
+		}
+
+		sent_count += length;
+	}
+
+	return (int)sent_count;
+}
+
 static bool release_shell_client_resources(int sockfd)
 {
 	struct shell_client **iter;
@@ -658,44 +1161,90 @@ static bool release_shell_client_resources(int sockfd)
 		return false;
 	}
 
+	// The tree is ordered by fd, remove the client before its fd is reset, otherwise tdelete() could not find it anymore
+	struct shell_client *client = *iter;
+	tdelete(client, &clid_inst.client_tree, compare_client_in_client_tree);
+
+	capture_record(CLID_CAP_DISCONNECT, sockfd, 0, NULL, 0);
 	close(sockfd);
-	(*iter)->fd = -1;
+	client->fd = -1;
 
-	if((*iter)->job_timer_fd != -1 && !set_time_job_timer((*iter)->job_timer_fd, 0))
+	// Nobody waits for a job that has not reached its handler yet, one already forwarded keeps its in-flight slot until replied
+	dequeue_exe_cmd_request(client);
+	client->deficit_us = 0;
+	client->deficit_on = NULL;
+	release_group_job(client);
+	release_batch_job(client);
+
+	if(client->job_timer_fd != -1 && !set_time_job_timer(client->job_timer_fd, 0))
 	{
-		TPT_TRACE(TRACE_ERROR, "Could not stop job timer fd = %d!", (*iter)->job_timer_fd);
+		TPT_TRACE(TRACE_ERROR, "Could not stop job timer fd = %d!", client->job_timer_fd);
 		return false;
 	}
 
-	close((*iter)->job_timer_fd);
-	(*iter)->job_timer_fd = -1;
+	close(client->job_timer_fd);
+	client->job_timer_fd = -1;
 
-	(*iter)->current_job_id = 0;
+	client->current_job_id = 0;
+	client->current_request_id = 0;
+	client->proto_version = CLID_PROTO_V1;
 
-	tdelete(*iter, &clid_inst.client_tree, compare_client_in_client_tree);
+	free(client->rx_buff);
+	client->rx_buff = NULL;
+	client->rx_len = 0;
+	client->rx_cap = 0;
+	client->is_timing_requested = false;
+	client->is_job_sampled = false;
 
 	return true;
 }
 
-static bool handle_receive_get_list_cmd_request(int sockfd, struct ethtcp_header *header)
+/* Only this client is given up on, clid goes on. Its socket is shut down rather than released right here: select() reports the
+hang-up at once and the main loop releases it as any client that went away, never under a caller still working on its jobs */
+static void drop_shell_client(int sockfd)
 {
-	struct clid_get_list_cmd_request *req;
-	uint32_t payloadLen = header->payloadLen;
-	char rxbuff[payloadLen];
-	int size = 0;
+	TPT_TRACE(TRACE_ABN, "Shell client fd %d does not take what is sent to it, disconnect it!", sockfd);
+	shutdown(sockfd, SHUT_RDWR);
+}
 
-	size = recv_data(sockfd, rxbuff, payloadLen);
+static bool handle_receive_hello_request(int sockfd, struct ethtcp_header *header)
+{
+	// CLID_HELLO_REQUEST never carries any payload, the offered version is in header->protRev
+	uint32_t version = header->protRev >= CLID_PROTO_V2 ? CLID_PROTO_V2 : CLID_PROTO_V1;
+
+	struct shell_client **iter;
+	iter = tfind(&sockfd, &clid_inst.client_tree, compare_fd_in_client_tree);
+	if(iter == NULL)
+	{
+		TPT_TRACE(TRACE_ABN, "This fd %d not found in client tree, something wrong!", sockfd);
+		return false;
+	}
 
-	if(size <= 0)
+	// Reply is still v1 framed, switch to the agreed version afterwards
+	if(!send_hello_reply(sockfd, version))
 	{
-		TPT_TRACE(TRACE_ERROR, "Failed to receive data from this shell client, fd = %d!", sockfd);
 		return false;
 	}
 
-	req = (struct clid_get_list_cmd_request *)rxbuff;
+	(*iter)->proto_version = (uint8_t)version;
+	TPT_TRACE(TRACE_INFO, "Shell client fd %d offered protocol version %u, agreed on version %u", sockfd, header->protRev, version);
+	return true;
+}
+
+static bool handle_receive_get_list_cmd_request(int sockfd, char *payload, uint32_t payload_len)
+{
+	struct clid_get_list_cmd_request *req;
+
+	if(payload_len < sizeof(struct clid_get_list_cmd_request))
+	{
+		TPT_TRACE(TRACE_ABN, "Malformed CLID_GET_LIST_CMD_REQUEST from fd %d, drop it!", sockfd);
+		return true;
+	}
+
+	req = (struct clid_get_list_cmd_request *)payload;
 	req->errorcode = ntohl(req->errorcode);
 
-	TPT_TRACE(TRACE_INFO, "Receiving %d bytes from fd %d", size, sockfd);
+	TPT_TRACE(TRACE_INFO, "Receiving %u bytes from fd %d", payload_len, sockfd);
 	TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: errorcode: %u", req->errorcode);
 
 	if(!send_get_list_cmd_reply(sockfd))
@@ -706,64 +1255,81 @@ static bool handle_receive_get_list_cmd_request(int sockfd, struct ethtcp_header
 	return true;
 }
 
-static bool handle_receive_exe_cmd_request(int sockfd, struct ethtcp_header *header)
+static bool handle_receive_exe_cmd_request(int sockfd, char *payload, uint32_t payload_len)
 {
 	struct clid_exe_cmd_request *req;
-	uint32_t payloadLen = header->payloadLen;
-	char rxbuff[payloadLen];
-	int size = 0;
-
-	size = recv_data(sockfd, rxbuff, payloadLen);
 
-	if(size <= 0)
+	if(payload_len < offsetof(struct clid_exe_cmd_request, payload))
 	{
-		TPT_TRACE(TRACE_ERROR, "Failed to receive data from this shell client, fd = %d!", sockfd);
-		return false;
+		TPT_TRACE(TRACE_ABN, "Malformed CLID_EXE_CMD_REQUEST from fd %d, drop it!", sockfd);
+		return true;
 	}
 
-	req = (struct clid_exe_cmd_request *)rxbuff;
+	req = (struct clid_exe_cmd_request *)payload;
 	req->errorcode = ntohl(req->errorcode);
 	req->timeout = ntohl(req->timeout);
 	req->payload_length = ntohl(req->payload_length);
 
-	TPT_TRACE(TRACE_INFO, "Receiving %d bytes from fd %d", size, sockfd);
+	TPT_TRACE(TRACE_INFO, "Receiving %u bytes from fd %d", payload_len, sockfd);
 	TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: errorcode: %u", req->errorcode);
 	TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: timeout: %u", req->timeout);
 	TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: payload_length: %u", req->payload_length);
 
-	unsigned long offset = 0;
-	char cmd_name[MAX_CMD_NAME_LENGTH];
+	// v1 payload is a series of NUL-terminated strings, never trust them to be terminated within the payload though
+	const char *pl = req->payload;
+	const char *pl_end = payload + payload_len;
+	if(req->payload_length < (uint32_t)(pl_end - pl))
+	{
+		pl_end = pl + req->payload_length;
+	}
 
-	strcpy(cmd_name, (req->payload + offset));
-	TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: cmd_name_len: %hu", strlen(cmd_name));
-	offset += strlen(cmd_name) + 1;
-	TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: cmd_name: %s", cmd_name);
+	const char *cmd_name_end = memchr(pl, '\0', pl_end - pl);
+	if(cmd_name_end == NULL || pl_end - (cmd_name_end + 1) < (long)sizeof(uint16_t))
+	{
+		TPT_TRACE(TRACE_ABN, "Malformed CLID_EXE_CMD_REQUEST from fd %d, drop it!", sockfd);
+		return true;
+	}
+	TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: cmd_name: %s", pl);
 
-	uint16_t num_args = *((uint16_t *)(req->payload + offset));
-	offset += 2;
+	uint16_t num_args = 0;
+	memcpy(&num_args, cmd_name_end + 1, sizeof(uint16_t));
 	TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: num_args: %hu", num_args);
 
-	char *payload = (req->payload + offset);
-	uint32_t payload_len = req->payload_length - offset;
+	if(num_args == 0 || num_args > MAX_NUM_CMD_ARGS)
+	{
+		TPT_TRACE(TRACE_ABN, "Invalid number of arguments %hu from fd %d, drop it!", num_args, sockfd);
+		return true;
+	}
 
-	/* DEBUG PURPOSE ONLY */
-	char args[MAX_CMD_NAME_LENGTH];
+	struct cmd_arg args[MAX_NUM_CMD_ARGS];
+	const char *pos = cmd_name_end + 1 + sizeof(uint16_t);
 	for(int i = 0; i < num_args; i++)
 	{
-		/* This is arguments */
-		strcpy(args, (req->payload + offset));
-		offset += strlen(args);
-		TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: arg_len %d: %hu", i, strlen(args));
-		TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: args %d: %s", i, args);
+		const char *arg_end = memchr(pos, '\0', pl_end - pos);
+		if(arg_end == NULL)
+		{
+			TPT_TRACE(TRACE_ABN, "Malformed argument %d in CLID_EXE_CMD_REQUEST from fd %d, drop it!", i, sockfd);
+			return true;
+		}
+
+		args[i].str = pos;
+		args[i].len = (uint16_t)(arg_end - pos);
+		TPT_TRACE(TRACE_INFO, "Re-interpret TCP packet: args %d: %s", i, pos);
+		pos = arg_end + 1;
 	}
 
+	return start_new_job(sockfd, (time_t)req->timeout, num_args, args, false, false);
+}
+
+static bool start_new_job(int sockfd, time_t timeout, uint16_t num_args, const struct cmd_arg *args, bool is_timing_requested, bool is_bulk)
+{
 	// Prepare a new job_id assigned to this execution
 	// Prevent from the case unsigned long long is overflowed, jump from maxof(unsigned long long) to 1 directly.
 	// Value of 0 indicates current client has no job execution running, in idle state.
 	unsigned long long new_job_id = ++m_job_id ? m_job_id : ++m_job_id;
 
 	// Restart job_timer for this shell client
-	if(!restart_job_timer(sockfd, (time_t)req->timeout))
+	if(!restart_job_timer(sockfd, timeout))
 	{
 		TPT_TRACE(TRACE_ERROR, "Failed to restart_job_timer() for this new execution, sockfd = %d", sockfd);
 		return false;
@@ -775,398 +1341,2401 @@ static bool handle_receive_exe_cmd_request(int sockfd, struct ethtcp_header *hea
 		return false;
 	}
 
-	if(!forward_exe_cmd_request(new_job_id, cmd_name, num_args, payload_len, payload))
+	struct shell_client **iter;
+	iter = tfind(&sockfd, &clid_inst.client_tree, compare_fd_in_client_tree);
+	if(iter == NULL)
+	{
+		TPT_TRACE(TRACE_ABN, "This fd %d not found in client tree, something wrong!", sockfd);
+		return false;
+	}
+
+	struct shell_client *client = *iter;
+	client->job_received_ns = client->rx_ns;
+	client->job_timeout = timeout;
+	client->is_timing_requested = is_timing_requested;
+	client->is_job_sampled = m_trace.spans != NULL && (is_timing_requested || new_job_id % m_trace.sample_period == 0);
+	snprintf(client->job_cmd_name, MAX_CMD_NAME_LENGTH, "%.*s", (int)args[0].len, args[0].str);
+
+	// The previous job of this client is superseded, if it is still waiting for its handler it will never be forwarded
+	dequeue_exe_cmd_request(client);
+	release_group_job(client);
+	release_batch_job(client);
+
+	if(!queue_exe_cmd_request(client, new_job_id, num_args, args, is_bulk))
 	{
 		return false;
 	}
 
-	TPT_TRACE(TRACE_INFO, "Forward new job execution sockfd = %d, job_id = %llu", sockfd, new_job_id);
+	TPT_TRACE(TRACE_INFO, "Queue new job execution sockfd = %d, job_id = %llu", sockfd, new_job_id);
 	
 	return true;
 }
 
-static void do_nothing(void *tree_node_data)
-{
-	(void)tree_node_data;
-}
-
-static bool send_get_list_cmd_reply(int sockfd)
+static bool handle_receive_v2_data(struct shell_client *client)
 {
-	uint32_t total_len = 2; // First two bytes for number of cmds
-	uint16_t cmd_len = 0;
-	char cmds_buff[2 + clid_inst.cmd_count*(2 + MAX_CMD_NAME_LENGTH + 2 + MAX_CMD_DESC_LENGTH)];
+	int sockfd = client->fd;
 
-	for(int i = 0; i < MAX_NUM_CMDS; i++)
+	if(client->rx_cap - client->rx_len < CLID_V2_RX_CHUNK)
 	{
-		if(clid_inst.cmds[i].cmd_name[0] != '\0')
+		size_t new_cap = client->rx_cap ? client->rx_cap * 2 : CLID_V2_RX_CHUNK * 2;
+		if(new_cap > 2 * (CLID_V2_MAX_HEADER_SIZE + CLID_V2_MAX_PAYLOAD_LENGTH))
 		{
-			cmd_len = strlen(clid_inst.cmds[i].cmd_name);
-			*((uint16_t *)(&cmds_buff[total_len])) = cmd_len;
-			total_len += 2;
-			strcpy(&cmds_buff[total_len], clid_inst.cmds[i].cmd_name);
-			total_len += cmd_len;
+			TPT_TRACE(TRACE_ABN, "Shell client fd %d exceeds maximum frame size, disconnect it!", sockfd);
+			if(!release_shell_client_resources(sockfd))
+			{
+				TPT_TRACE(TRACE_ERROR, "Failed to release_shell_client_resources()!");
+			}
 
-			cmd_len = strlen(clid_inst.cmds[i].cmd_desc);
-			*((uint16_t *)(&cmds_buff[total_len])) = cmd_len;
-			total_len += 2;
-			strcpy(&cmds_buff[total_len], clid_inst.cmds[i].cmd_desc);
-			total_len += cmd_len;
+			return true;
 		}
-	}
 
-	*((uint16_t *)(&cmds_buff[0])) = clid_inst.cmd_count;
+		uint8_t *new_buff = realloc(client->rx_buff, new_cap);
+		if(new_buff == NULL)
+		{
+			TPT_TRACE(TRACE_ERROR, "Failed to realloc rx buffer for fd %d!", sockfd);
+			return false;
+		}
 
-	size_t msg_len = offsetof(struct ethtcp_msg, payload) + offsetof(struct clid_get_list_cmd_reply, payload) + total_len;
-	struct ethtcp_msg *rep = malloc(msg_len);
-	if(rep == NULL)
-	{
-		TPT_TRACE(TRACE_ERROR, "Failed to malloc locate mbox reply message!");
-		return false;
+		client->rx_buff = new_buff;
+		client->rx_cap = new_cap;
 	}
 
-	uint32_t payload_length = offsetof(struct clid_get_list_cmd_reply, payload) + total_len;
-	rep->header.sender 					= htonl((uint32_t)getpid());
-	rep->header.receiver 					= htonl(111);
-	rep->header.protRev 					= htonl(15);
-	rep->header.msgno 					= htonl(CLID_GET_LIST_CMD_REPLY);
-	rep->header.payloadLen 					= htonl(payload_length);
-
-	rep->payload.clid_get_list_cmd_reply.errorcode		= htonl(CLID_STATUS_OK);
-	rep->payload.clid_get_list_cmd_reply.payload_length	= htonl(total_len);
+	ssize_t size = recv(sockfd, client->rx_buff + client->rx_len, client->rx_cap - client->rx_len, 0);
+	if(size == 0)
+	{
+		TPT_TRACE(TRACE_INFO, "Shell client from this fd %d just disconnected, remove it from our client list!", sockfd);
+		if(!release_shell_client_resources(sockfd))
+		{
+			TPT_TRACE(TRACE_ERROR, "Failed to release_shell_client_resources()!");
+		}
+
+		return true;
+	} else if(size < 0)
+	{
+		if(errno == EINTR || errno == EAGAIN)
+		{
+			return true;
+		}
+
+		TPT_TRACE(TRACE_ABN, "Receive data from this shell client failed, fd = %d, errno = %d, disconnect it!", sockfd, errno);
+		if(!release_shell_client_resources(sockfd))
+		{
+			TPT_TRACE(TRACE_ERROR, "Failed to release_shell_client_resources()!");
+		}
+
+		return true;
+	}
+
+	client->rx_len += size;
+	client->rx_ns = get_time_ns();
+	TPT_TRACE(TRACE_INFO, "Receiving %zd bytes from fd %d", size, sockfd);
+
+	// Decode as many complete frames as we have, each of them in a single pass
+	size_t offset = 0;
+	struct clid_v2_frame frame;
+	long frame_size = 0;
+	while((frame_size = clid_v2_decode_frame(client->rx_buff + offset, client->rx_len - offset, &frame)) > 0)
+	{
+		capture_record(CLID_CAP_INBOUND, sockfd, 0, client->rx_buff + offset, (uint32_t)frame_size);
+
+		if(!handle_receive_v2_frame(client, &frame))
+		{
+			return false;
+		}
+
+		offset += frame_size;
+	}
+
+	if(frame_size < 0)
+	{
+		TPT_TRACE(TRACE_ABN, "Received malformed v2 frame from fd %d, disconnect it!", sockfd);
+		if(!release_shell_client_resources(sockfd))
+		{
+			TPT_TRACE(TRACE_ERROR, "Failed to release_shell_client_resources()!");
+		}
+
+		return true;
+	}
+
+	if(offset > 0)
+	{
+		memmove(client->rx_buff, client->rx_buff + offset, client->rx_len - offset);
+		client->rx_len -= offset;
+	}
+
+	return true;
+}
+
+static bool handle_receive_v2_frame(struct shell_client *client, const struct clid_v2_frame *frame)
+{
+	TPT_TRACE(TRACE_INFO, "Re-interpret v2 frame: type: 0x%02x, flags: 0x%02x, request_id: %u, payload_length: %u", frame->type, frame->flags, frame->request_id, frame->payload_length);
+
+	switch (frame->type)
+	{
+	case CLID_V2_TYPE(CLID_GET_LIST_CMD_REQUEST):
+		TPT_TRACE(TRACE_INFO, "Received v2 CLID_GET_LIST_CMD_REQUEST!");
+		return send_v2_get_list_cmd_reply(client, frame);
+
+	case CLID_V2_TYPE(CLID_GET_SYNTAX_REQUEST):
+		TPT_TRACE(TRACE_INFO, "Received v2 CLID_GET_SYNTAX_REQUEST!");
+		return send_v2_get_syntax_reply(client, frame);
+
+	case CLID_V2_TYPE(CLID_EXE_CMD_REQUEST):
+		TPT_TRACE(TRACE_INFO, "Received v2 CLID_EXE_CMD_REQUEST!");
+		return handle_receive_v2_exe_cmd_request(client, frame);
+
+	case CLID_V2_TYPE(CLID_EXE_BATCH_REQUEST):
+		TPT_TRACE(TRACE_INFO, "Received v2 CLID_EXE_BATCH_REQUEST!");
+		return handle_receive_v2_batch_request(client, frame);
+
+	default:
+		TPT_TRACE(TRACE_ABN, "Received unknown v2 frame type 0x%02x, drop it!", frame->type);
+		break;
+	}
+
+	return true;
+}
+
+static bool handle_receive_v2_exe_cmd_request(struct shell_client *client, const struct clid_v2_frame *frame)
+{
+	struct clid_v2_reader reader;
+	clid_v2_reader_init(&reader, frame->payload, frame->payload_length);
+
+	uint32_t timeout = clid_v2_read_varint(&reader);
+	uint32_t num_args = clid_v2_read_varint(&reader);
+	if(reader.error || num_args == 0 || num_args > MAX_NUM_CMD_ARGS)
+	{
+		TPT_TRACE(TRACE_ABN, "Malformed v2 CLID_EXE_CMD_REQUEST from fd %d, num_args = %u, drop it!", client->fd, num_args);
+		return true;
+	}
+
+	struct cmd_arg args[MAX_NUM_CMD_ARGS];
+	for(uint32_t i = 0; i < num_args; i++)
+	{
+		uint32_t len = 0;
+		args[i].str = clid_v2_read_string(&reader, &len);
+		args[i].len = (uint16_t)len;
+		if(len > UINT16_MAX)
+		{
+			reader.error = true;
+		}
+	}
+
+	if(reader.error)
+	{
+		TPT_TRACE(TRACE_ABN, "Malformed arguments in v2 CLID_EXE_CMD_REQUEST from fd %d, drop it!", client->fd);
+		return true;
+	}
+
+	TPT_TRACE(TRACE_INFO, "Re-interpret v2 frame: timeout: %u, num_args: %u, cmd_name: %.*s", timeout, num_args, (int)args[0].len, args[0].str);
+
+	client->current_request_id = frame->request_id;
+	return start_new_job(client->fd, (time_t)timeout, (uint16_t)num_args, args, (frame->flags & CLID_V2_FLAG_TIMING) != 0, (frame->flags & CLID_V2_FLAG_BULK) != 0);
+}
+
+static bool handle_receive_v2_batch_request(struct shell_client *client, const struct clid_v2_frame *frame)
+{
+	// Commands run long after the rx buffer moved on, their arguments point into this copy instead
+	uint8_t *payload = malloc(frame->payload_length);
+	if(payload == NULL && frame->payload_length > 0)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to malloc batch payload of %u bytes for fd %d!", frame->payload_length, client->fd);
+		return false;
+	}
+	memcpy(payload, frame->payload, frame->payload_length);
+
+	struct clid_v2_reader reader;
+	clid_v2_reader_init(&reader, payload, frame->payload_length);
+
+	uint32_t timeout = clid_v2_read_varint(&reader);
+	uint32_t policy = clid_v2_read_varint(&reader);
+	uint32_t num_cmds = clid_v2_read_varint(&reader);
+	if(reader.error || policy > CLID_BATCH_PARALLEL || num_cmds == 0 || num_cmds > CLID_MAX_BATCH_CMDS)
+	{
+		TPT_TRACE(TRACE_ABN, "Malformed v2 CLID_EXE_BATCH_REQUEST from fd %d, policy = %u, num_cmds = %u, drop it!", client->fd, policy, num_cmds);
+		free(payload);
+		return true;
+	}
+
+	// First pass only validates and counts, so that a malformed batch never starts any of its commands
+	const uint8_t *cmds_pos = reader.pos;
+	uint32_t total_args = 0;
+	for(uint32_t i = 0; i < num_cmds && !reader.error; i++)
+	{
+		uint32_t num_args = clid_v2_read_varint(&reader);
+		if(num_args == 0 || num_args > MAX_NUM_CMD_ARGS)
+		{
+			reader.error = true;
+		}
+
+		for(uint32_t j = 0; j < num_args && !reader.error; j++)
+		{
+			uint32_t len = 0;
+			clid_v2_read_string(&reader, &len);
+			if(len > UINT16_MAX)
+			{
+				reader.error = true;
+			}
+		}
+
+		total_args += num_args;
+	}
+
+	if(reader.error)
+	{
+		TPT_TRACE(TRACE_ABN, "Malformed commands in v2 CLID_EXE_BATCH_REQUEST from fd %d, drop it!", client->fd);
+		free(payload);
+		return true;
+	}
+
+	struct batch_job *batch_job = calloc(1, sizeof(struct batch_job) + num_cmds * sizeof(struct batch_cmd));
+	struct cmd_arg *args = malloc(total_args * sizeof(struct cmd_arg));
+	if(batch_job == NULL || args == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to allocate batch of %u commands for fd %d!", num_cmds, client->fd);
+		free(batch_job);
+		free(args);
+		free(payload);
+		return false;
+	}
+
+	reader.pos = cmds_pos;
+	uint32_t arg_index = 0;
+	for(uint32_t i = 0; i < num_cmds; i++)
+	{
+		batch_job->cmds[i].num_args = (uint16_t)clid_v2_read_varint(&reader);
+		batch_job->cmds[i].first_arg = arg_index;
+		for(uint16_t j = 0; j < batch_job->cmds[i].num_args; j++)
+		{
+			uint32_t len = 0;
+			args[arg_index].str = clid_v2_read_string(&reader, &len);
+			args[arg_index].len = (uint16_t)len;
+			arg_index++;
+		}
+	}
+
+	batch_job->policy = (uint8_t)policy;
+	batch_job->timeout = (time_t)timeout;
+	batch_job->cmd_count = num_cmds;
+	batch_job->is_bulk = (frame->flags & CLID_V2_FLAG_BULK) != 0;
+	batch_job->payload = payload;
+	batch_job->args = args;
+
+	// One job_id per command, taken as a range so that a reply finds its command by subtraction
+	if(m_job_id > ULLONG_MAX - num_cmds)
+	{
+		m_job_id = 0;
+	}
+	batch_job->first_job_id = m_job_id + 1;
+	m_job_id += num_cmds;
+
+	// Also creates the job timer of a client that never ran a job before
+	if(!restart_job_timer(client->fd, batch_job->timeout))
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to restart_job_timer() for batch of fd %d", client->fd);
+		free(args);
+		free(payload);
+		free(batch_job);
+		return false;
+	}
+
+	// The previous job of this client is superseded, as in start_new_job()
+	dequeue_exe_cmd_request(client);
+	release_group_job(client);
+	release_batch_job(client);
+
+	client->batch_job = batch_job;
+	client->current_request_id = frame->request_id;
+	client->current_job_id = batch_job->first_job_id;
+	client->job_received_ns = client->rx_ns;
+	client->job_timeout = batch_job->timeout;
+	client->is_timing_requested = false;
+	client->is_job_sampled = false;
+
+	TPT_TRACE(TRACE_INFO, "Start batch of %u commands with policy %u for fd %d, job_id = %llu..%llu", num_cmds, policy, client->fd, batch_job->first_job_id, m_job_id);
+
+	return run_batch_job(client);
+}
+
+static void do_nothing(void *tree_node_data)
+{
+	(void)tree_node_data;
+}
+
+static bool send_hello_reply(int sockfd, uint32_t version)
+{
+	struct ethtcp_header rep;
+	rep.sender 						= htonl((uint32_t)getpid());
+	rep.receiver 						= htonl(CLID_V1_RECEIVER);
+	rep.protRev 						= htonl(version);
+	rep.msgno 						= htonl(CLID_HELLO_REPLY);
+	rep.payloadLen 						= htonl(0);
+
+	if(send_data(sockfd, &rep, sizeof(struct ethtcp_header)) < 0)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to send CLID_HELLO_REPLY, errno = %d!", errno);
+		return false;
+	}
+
+	TPT_TRACE(TRACE_INFO, "Sent CLID_HELLO_REPLY successfully!");
+	return true;
+}
+
+static bool send_get_list_cmd_reply(int sockfd)
+{
+	uint32_t total_len = 2; // First two bytes for number of cmds
+	uint16_t cmd_len = 0;
+	char cmds_buff[2 + clid_inst.cmd_count*(2 + MAX_CMD_NAME_LENGTH + 2 + MAX_CMD_DESC_LENGTH)];
+
+	for(int i = 0; i < MAX_NUM_CMDS; i++)
+	{
+		if(clid_inst.cmds[i].cmd_name[0] != '\0')
+		{
+			cmd_len = strlen(clid_inst.cmds[i].cmd_name);
+			*((uint16_t *)(&cmds_buff[total_len])) = cmd_len;
+			total_len += 2;
+			strcpy(&cmds_buff[total_len], clid_inst.cmds[i].cmd_name);
+			total_len += cmd_len;
+
+			cmd_len = strlen(clid_inst.cmds[i].cmd_desc);
+			*((uint16_t *)(&cmds_buff[total_len])) = cmd_len;
+			total_len += 2;
+			strcpy(&cmds_buff[total_len], clid_inst.cmds[i].cmd_desc);
+			total_len += cmd_len;
+		}
+	}
+
+	*((uint16_t *)(&cmds_buff[0])) = clid_inst.cmd_count;
+
+	size_t msg_len = offsetof(struct ethtcp_msg, payload) + offsetof(struct clid_get_list_cmd_reply, payload) + total_len;
+	struct ethtcp_msg *rep = malloc(msg_len);
+	if(rep == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to malloc locate mbox reply message!");
+		return false;
+	}
+
+	uint32_t payload_length = offsetof(struct clid_get_list_cmd_reply, payload) + total_len;
+	rep->header.sender 					= htonl((uint32_t)getpid());
+	rep->header.receiver 					= htonl(CLID_V1_RECEIVER);
+	rep->header.protRev 					= htonl(CLID_V1_PROT_REV);
+	rep->header.msgno 					= htonl(CLID_GET_LIST_CMD_REPLY);
+	rep->header.payloadLen 					= htonl(payload_length);
+
+	rep->payload.clid_get_list_cmd_reply.errorcode		= htonl(CLID_STATUS_OK);
+	rep->payload.clid_get_list_cmd_reply.payload_length	= htonl(total_len);
 	memcpy(rep->payload.clid_get_list_cmd_reply.payload, cmds_buff, total_len);
 
-	int res = send(sockfd, rep, msg_len, 0);
-	if(res < 0)
+	int res = send_data(sockfd, rep, msg_len);
+	free(rep);
+	if(res < 0)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to send CLID_GET_LIST_CMD_REPLY, errno = %d!", errno);
+		return false;
+	}
+
+	TPT_TRACE(TRACE_INFO, "Sent CLID_GET_LIST_CMD_REPLY successfully!");
+	return true;
+}
+
+static bool send_v2_get_list_cmd_reply(struct shell_client *client, const struct clid_v2_frame *frame)
+{
+	// A shell that cached the current list gets nothing but the version back
+	struct clid_v2_reader reader;
+	clid_v2_reader_init(&reader, frame->payload, frame->payload_length);
+	uint32_t cached_epoch = frame->payload_length > 0 ? clid_v2_read_varint(&reader) : 0;
+	uint32_t cached_version = clid_v2_read_varint(&reader);
+	bool is_unchanged = !reader.error && cached_epoch == clid_inst.registry_epoch && cached_version == clid_inst.registry_version;
+
+	size_t max_len = CLID_V2_MAX_HEADER_SIZE + 4 * CLID_VARINT_MAX_SIZE + MAX_NUM_CMDS*(2 * CLID_VARINT_MAX_SIZE + MAX_CMD_NAME_LENGTH + MAX_CMD_DESC_LENGTH);
+	uint8_t *txbuff = malloc(max_len);
+	if(txbuff == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to malloc v2 CLID_GET_LIST_CMD_REPLY!");
+		return false;
+	}
+
+	uint32_t num_cmds = 0;
+	for(int i = 0; i < MAX_NUM_CMDS && !is_unchanged; i++)
+	{
+		// Not announced yet, it comes with its CLID_CMD_LIST_CHANGED push
+		num_cmds += (clid_inst.cmds[i].cmd_name[0] != '\0' && !clid_inst.cmds[i].is_syntax_pending);
+	}
+
+	// Payload is written right after the largest possible header, then the header is put just in front of it
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, txbuff + CLID_V2_MAX_HEADER_SIZE, max_len - CLID_V2_MAX_HEADER_SIZE);
+	clid_v2_write_varint(&writer, is_unchanged ? CLID_STATUS_LIST_UNCHANGED : CLID_STATUS_OK);
+	clid_v2_write_varint(&writer, num_cmds);
+	for(int i = 0; i < MAX_NUM_CMDS && !is_unchanged; i++)
+	{
+		if(clid_inst.cmds[i].cmd_name[0] != '\0' && !clid_inst.cmds[i].is_syntax_pending)
+		{
+			clid_v2_write_string(&writer, clid_inst.cmds[i].cmd_name, strlen(clid_inst.cmds[i].cmd_name));
+			clid_v2_write_string(&writer, clid_inst.cmds[i].cmd_desc, strlen(clid_inst.cmds[i].cmd_desc));
+		}
+	}
+	clid_v2_write_varint(&writer, clid_inst.registry_epoch);
+	clid_v2_write_varint(&writer, clid_inst.registry_version);
+
+	size_t header_len = clid_v2_header_size(frame->request_id, writer.len);
+	uint8_t *start = txbuff + CLID_V2_MAX_HEADER_SIZE - header_len;
+	clid_v2_encode_header(start, CLID_V2_TYPE(CLID_GET_LIST_CMD_REPLY), 0, frame->request_id, writer.len);
+
+	int res = writer.error ? -1 : send_data(client->fd, start, header_len + writer.len);
+	free(txbuff);
+	if(res < 0)
+	{
+		TPT_TRACE(TRACE_ABN, "Failed to send v2 CLID_GET_LIST_CMD_REPLY, errno = %d!", errno);
+		drop_shell_client(client->fd);
+		return true;
+	}
+
+	TPT_TRACE(TRACE_INFO, "Sent v2 CLID_GET_LIST_CMD_REPLY successfully, %s, version %u!", is_unchanged ? "unchanged" : "full list", clid_inst.registry_version);
+	return true;
+}
+
+static bool send_v2_get_syntax_reply(struct shell_client *client, const struct clid_v2_frame *frame)
+{
+	struct clid_v2_reader reader;
+	clid_v2_reader_init(&reader, frame->payload, frame->payload_length);
+	uint32_t num_requested = clid_v2_read_varint(&reader);
+	if(reader.error || num_requested > MAX_NUM_CMDS)
+	{
+		TPT_TRACE(TRACE_ABN, "Malformed v2 CLID_GET_SYNTAX_REQUEST from fd %d, num_cmds = %u, drop it!", client->fd, num_requested);
+		return true;
+	}
+
+	// Requested names are read twice, once to size the reply and once to write it
+	struct clid_v2_reader names = reader;
+	size_t max_len = CLID_V2_MAX_HEADER_SIZE + 2 * CLID_VARINT_MAX_SIZE;
+	uint32_t num_cmds = 0;
+	for(int i = 0; i < MAX_NUM_CMDS && num_requested == 0; i++)
+	{
+		if(clid_inst.cmds[i].cmd_name[0] != '\0' && clid_inst.cmds[i].syntax != NULL)
+		{
+			max_len += 2 * CLID_VARINT_MAX_SIZE + MAX_CMD_NAME_LENGTH + clid_inst.cmds[i].syntax_len;
+			num_cmds++;
+		}
+	}
+
+	for(uint32_t i = 0; i < num_requested; i++)
+	{
+		struct cmd_arg cmd_name;
+		uint32_t len = 0;
+		cmd_name.str = clid_v2_read_string(&reader, &len);
+		cmd_name.len = len < MAX_CMD_NAME_LENGTH ? (uint16_t)len : MAX_CMD_NAME_LENGTH;
+		if(reader.error)
+		{
+			TPT_TRACE(TRACE_ABN, "Truncated v2 CLID_GET_SYNTAX_REQUEST from fd %d, drop it!", client->fd);
+			return true;
+		}
+
+		const struct command *command = find_command(&cmd_name);
+		max_len += 2 * CLID_VARINT_MAX_SIZE + len + (command != NULL ? command->syntax_len : 0);
+	}
+
+	uint8_t *txbuff = malloc(max_len);
+	if(txbuff == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to malloc v2 CLID_GET_SYNTAX_REPLY!");
+		return false;
+	}
+
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, txbuff + CLID_V2_MAX_HEADER_SIZE, max_len - CLID_V2_MAX_HEADER_SIZE);
+	clid_v2_write_varint(&writer, CLID_STATUS_OK);
+	clid_v2_write_varint(&writer, num_requested > 0 ? num_requested : num_cmds);
+	for(int i = 0; i < MAX_NUM_CMDS && num_requested == 0; i++)
+	{
+		if(clid_inst.cmds[i].cmd_name[0] != '\0' && clid_inst.cmds[i].syntax != NULL)
+		{
+			clid_v2_write_string(&writer, clid_inst.cmds[i].cmd_name, strlen(clid_inst.cmds[i].cmd_name));
+			clid_v2_write_string(&writer, (const char *)clid_inst.cmds[i].syntax, clid_inst.cmds[i].syntax_len);
+		}
+	}
+
+	for(uint32_t i = 0; i < num_requested; i++)
+	{
+		struct cmd_arg cmd_name;
+		uint32_t len = 0;
+		cmd_name.str = clid_v2_read_string(&names, &len);
+		cmd_name.len = len < MAX_CMD_NAME_LENGTH ? (uint16_t)len : MAX_CMD_NAME_LENGTH;
+
+		// An unknown command is echoed back with an empty syntax, the requester learns there is none
+		const struct command *command = find_command(&cmd_name);
+		bool has_syntax = command != NULL && command->syntax != NULL;
+		clid_v2_write_string(&writer, cmd_name.str, len);
+		clid_v2_write_string(&writer, has_syntax ? (const char *)command->syntax : "", has_syntax ? command->syntax_len : 0);
+	}
+
+	size_t header_len = clid_v2_header_size(frame->request_id, writer.len);
+	uint8_t *start = txbuff + CLID_V2_MAX_HEADER_SIZE - header_len;
+	clid_v2_encode_header(start, CLID_V2_TYPE(CLID_GET_SYNTAX_REPLY), 0, frame->request_id, writer.len);
+
+	int res = writer.error ? -1 : send_data(client->fd, start, header_len + writer.len);
+	free(txbuff);
+	if(res < 0)
+	{
+		TPT_TRACE(TRACE_ABN, "Failed to send v2 CLID_GET_SYNTAX_REPLY, errno = %d!", errno);
+		drop_shell_client(client->fd);
+		return true;
+	}
+
+	TPT_TRACE(TRACE_INFO, "Sent v2 CLID_GET_SYNTAX_REPLY successfully, %u commands!", num_requested > 0 ? num_requested : num_cmds);
+	return true;
+}
+
+static bool send_exe_cmd_reply(int sockfd, uint32_t result, const char *output, uint32_t output_len)
+{
+	struct shell_client **iter;
+	iter = tfind(&sockfd, &clid_inst.client_tree, compare_fd_in_client_tree);
+	if(iter != NULL && (*iter)->proto_version == CLID_PROTO_V2)
+	{
+		return send_v2_exe_cmd_reply(*iter, result, output, output_len);
+	}
+
+	// v1 output is always NUL-terminated on the wire
+	size_t msg_len = offsetof(struct ethtcp_msg, payload) + offsetof(struct clid_exe_cmd_reply, payload) + output_len + 1;
+	struct ethtcp_msg *rep = malloc(msg_len);
+	if(rep == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to malloc locate mbox reply message!");
+		return false;
+	}
+
+	uint32_t payload_length = offsetof(struct clid_exe_cmd_reply, payload) + output_len + 1;
+	rep->header.sender 					= htonl((uint32_t)getpid());
+	rep->header.receiver 					= htonl(CLID_V1_RECEIVER);
+	rep->header.protRev 					= htonl(CLID_V1_PROT_REV);
+	rep->header.msgno 					= htonl(CLID_EXE_CMD_REPLY);
+	rep->header.payloadLen 					= htonl(payload_length);
+
+	rep->payload.clid_exe_cmd_reply.errorcode		= htonl(CLID_STATUS_OK);
+	rep->payload.clid_exe_cmd_reply.result			= htonl(result);
+	rep->payload.clid_exe_cmd_reply.payload_length		= htonl(output_len + 1);
+	memcpy(rep->payload.clid_exe_cmd_reply.payload, output, output_len);
+	rep->payload.clid_exe_cmd_reply.payload[output_len]	= '\0';
+
+	int res = send_data(sockfd, rep, msg_len);
+	free(rep);
+	if(res < 0)
+	{
+		TPT_TRACE(TRACE_ABN, "Failed to send CLID_EXE_CMD_REPLY, errno = %d!", errno);
+		drop_shell_client(sockfd);
+		return true;
+	}
+
+	TPT_TRACE(TRACE_INFO, "Sent CLID_EXE_CMD_REPLY successfully!");
+	return true;
+}
+
+static bool send_v2_exe_cmd_reply(struct shell_client *client, uint32_t result, const char *output, uint32_t output_len)
+{
+	uint8_t txbuff[CLID_V2_MAX_HEADER_SIZE + 2 * CLID_VARINT_MAX_SIZE + CLID_V2_MAX_FRAGMENT_LENGTH];
+	uint32_t sent_len = 0;
+	bool is_first = true;
+
+	// Large outputs are split into fragments, so that neither side ever needs to hold a whole frame of CLID_V2_MAX_PAYLOAD_LENGTH
+	do
+	{
+		uint8_t result_buff[2 * CLID_VARINT_MAX_SIZE];
+		struct clid_v2_writer writer;
+		clid_v2_writer_init(&writer, result_buff, sizeof(result_buff));
+		if(is_first)
+		{
+			clid_v2_write_varint(&writer, CLID_STATUS_OK);
+			clid_v2_write_varint(&writer, result);
+		}
+
+		uint32_t chunk_len = MIN_OF(output_len - sent_len, (uint32_t)CLID_V2_MAX_FRAGMENT_LENGTH);
+		uint8_t flags = (sent_len + chunk_len < output_len) ? CLID_V2_FLAG_MORE : 0;
+		uint32_t payload_length = writer.len + chunk_len;
+
+		size_t len = clid_v2_encode_header(txbuff, CLID_V2_TYPE(CLID_EXE_CMD_REPLY), flags, client->current_request_id, payload_length);
+		memcpy(txbuff + len, result_buff, writer.len);
+		len += writer.len;
+		memcpy(txbuff + len, output + sent_len, chunk_len);
+		len += chunk_len;
+
+		if(send_data(client->fd, txbuff, len) < 0)
+		{
+			TPT_TRACE(TRACE_ABN, "Failed to send v2 CLID_EXE_CMD_REPLY, errno = %d!", errno);
+			drop_shell_client(client->fd);
+			return true;
+		}
+
+		sent_len += chunk_len;
+		is_first = false;
+	} while(sent_len < output_len);
+
+	TPT_TRACE(TRACE_INFO, "Sent v2 CLID_EXE_CMD_REPLY successfully, request_id = %u, %u bytes output!", client->current_request_id, output_len);
+	return true;
+}
+
+/* Diagnostics only, a client that cannot take it is dropped as for any other reply but nothing else depends on it */
+static void send_v2_exe_cmd_timing(struct shell_client *client, const struct CmdIfExeCmdTimedReplyS *reply, uint64_t replied_ns)
+{
+	// cmdif timestamps are on the handler's clock, only their differences can be put next to ours
+	uint64_t cmdif_ns = reply->doneNs > reply->receivedNs ? reply->doneNs - reply->receivedNs : 0;
+	uint64_t round_trip_ns = replied_ns - client->job_forwarded_ns;
+	uint64_t durations_ns[] = {
+		client->job_forwarded_ns - client->job_received_ns,
+		round_trip_ns > cmdif_ns ? round_trip_ns - cmdif_ns : 0,
+		reply->startedNs > reply->receivedNs ? reply->startedNs - reply->receivedNs : 0,
+		reply->doneNs > reply->startedNs ? reply->doneNs - reply->startedNs : 0,
+		get_time_ns() - replied_ns
+	};
+
+	uint8_t txbuff[CLID_V2_MAX_HEADER_SIZE + 5 * CLID_VARINT_MAX_SIZE];
+	uint8_t payload[5 * CLID_VARINT_MAX_SIZE];
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, payload, sizeof(payload));
+	for(size_t i = 0; i < sizeof(durations_ns) / sizeof(durations_ns[0]); i++)
+	{
+		uint64_t duration_us = durations_ns[i] / NSEC_PER_USEC;
+		clid_v2_write_varint(&writer, duration_us > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_us);
+	}
+
+	// The reply itself follows with the same request_id
+	size_t len = clid_v2_encode_header(txbuff, CLID_V2_TYPE(CLID_EXE_CMD_TIMING), CLID_V2_FLAG_MORE, client->current_request_id, writer.len);
+	memcpy(txbuff + len, payload, writer.len);
+	len += writer.len;
+
+	if(send_data(client->fd, txbuff, len) < 0)
+	{
+		TPT_TRACE(TRACE_ABN, "Failed to send v2 CLID_EXE_CMD_TIMING, errno = %d!", errno);
+		drop_shell_client(client->fd);
+	}
+}
+
+/* Push the change to every v2 client, a client that cannot take it finds out on its next request anyway */
+static void notify_cmd_list_changed(uint32_t change, const struct command *command)
+{
+	// Lists cached by shells are stale from now on
+	clid_inst.registry_version++;
+
+	uint8_t txbuff[CLID_V2_MAX_HEADER_SIZE + 3 * CLID_VARINT_MAX_SIZE + MAX_CMD_NAME_LENGTH + MAX_CMD_DESC_LENGTH];
+	uint8_t payload[3 * CLID_VARINT_MAX_SIZE + MAX_CMD_NAME_LENGTH + MAX_CMD_DESC_LENGTH];
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, payload, sizeof(payload));
+	clid_v2_write_varint(&writer, change);
+	clid_v2_write_string(&writer, command->cmd_name, strlen(command->cmd_name));
+	clid_v2_write_string(&writer, command->cmd_desc, change == CLID_CMD_ADDED ? strlen(command->cmd_desc) : 0);
+
+	size_t len = clid_v2_encode_header(txbuff, CLID_V2_TYPE(CLID_CMD_LIST_CHANGED), 0, CLID_V2_PUSH_REQUEST_ID, writer.len);
+	memcpy(txbuff + len, payload, writer.len);
+	len += writer.len;
+
+	for(int i = 0; i < MAX_NUM_SHELL_CLIENTS; i++)
+	{
+		if(clid_inst.clients[i].fd != -1 && clid_inst.clients[i].proto_version == CLID_PROTO_V2 && send_data(clid_inst.clients[i].fd, txbuff, len) < 0)
+		{
+			TPT_TRACE(TRACE_ABN, "Failed to send v2 CLID_CMD_LIST_CHANGED to fd %d, errno = %d!", clid_inst.clients[i].fd, errno);
+		}
+	}
+}
+
+static bool restart_job_timer(int sockfd, time_t timeout)
+{
+	struct shell_client **iter;
+	iter = tfind(&sockfd, &clid_inst.client_tree, compare_fd_in_client_tree);
+	if(iter == NULL)
+	{
+		TPT_TRACE(TRACE_ABN, "This fd %d not found in client tree, something wrong!", sockfd);
+		return false;
+	}
+
+	if((*iter)->job_timer_fd <= 0)
+	{
+		// The first job for this shell client
+		TPT_TRACE(TRACE_INFO, "Starting the first job for this shell client, sockfd = %d", sockfd);
+		(*iter)->job_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+		if((*iter)->job_timer_fd < 0)
+		{
+			TPT_TRACE(TRACE_ERROR, "Failed to timerfd_create(), errno = %d!", errno);
+			return false;
+		}
+
+		;
+	}
+
+	// Whether either one of two scenarios below happens, do a same thing.
+	// 1. There is another job for this client still running, skip it.
+	// When job results of the discarded job sent back to clid daemon from application threads just discard it
+	// because current_job_id for this shell client should be changed by the caller of this function,
+	// The shell client did not need the discarded job anymore (probably they press Ctrl-C and send us this new job).
+	// 2. No job is running for this shell client, set new timeout for the job_timer
+
+	if(!set_time_job_timer((*iter)->job_timer_fd, timeout))
+	{
+		TPT_TRACE(TRACE_ERROR, "Could not start job timer for this shell client sockfd = %d!", sockfd);
+		return false;
+	}
+
+	return true;
+}
+
+static bool set_time_job_timer(int timerfd, time_t timeout)
+{
+	struct timespec now;
+	struct itimerspec its;
+	int res = -1;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(&its, 0, sizeof(struct itimerspec));
+	its.it_value.tv_sec = now.tv_sec + (time_t)timeout;
+	its.it_value.tv_nsec = now.tv_nsec;
+	res = timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+	if(res < 0)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to timerfd_settime(), errno = %d!", errno);
+		return false;
+	}
+
+	return true;
+}
+
+static bool is_job_timer_running(int timerfd)
+{
+	struct itimerspec remaining_time;
+
+	int res = timerfd_gettime(timerfd, &remaining_time);
+	if(res < 0)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to timerfd_gettime(), errno = %d!", errno);
+		return false;
+	}
+
+	TPT_TRACE(TRACE_INFO, "Job timer for timerfd %d will expire in: %ld.%ld seconds!", timerfd, remaining_time.it_value.tv_sec, remaining_time.it_value.tv_nsec / 1000000);
+
+	if(remaining_time.it_value.tv_sec == 0 && remaining_time.it_value.tv_nsec == 0)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+static bool reassign_current_job_id(int sockfd, unsigned long long new_job_id)
+{
+	struct shell_client **iter;
+	iter = tfind(&sockfd, &clid_inst.client_tree, compare_fd_in_client_tree);
+	if(iter == NULL)
+	{
+		TPT_TRACE(TRACE_ABN, "This fd %d not found in client tree, something wrong!", sockfd);
+		return false;
+	}
+
+	(*iter)->current_job_id = new_job_id;
+
+	return true;
+}
+
+static bool handle_receive_itc_msg(int mbox_fd)
+{
+	(void)mbox_fd;
+	union itc_msg *msg;
+
+	msg = itc_receive(ITC_NO_WAIT);
+
+	if(msg == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Fatal error, clid daemon received a NULL itc_msg!");
+		return false;
+	}
+
+	switch (msg->msgno)
+	{
+	case CMDIF_REG_CMD_REQUEST:
+		TPT_TRACE(TRACE_INFO, "Received CMDIF_REG_CMD_REQUEST mbox_id = 0x%08x", msg->cmdIfRegCmdRequest.mbox_id);
+		TPT_TRACE(TRACE_INFO, "Received CMDIF_REG_CMD_REQUEST cmd_name = %s", msg->cmdIfRegCmdRequest.cmd_name);
+		TPT_TRACE(TRACE_INFO, "Received CMDIF_REG_CMD_REQUEST cmd_desc = %s", msg->cmdIfRegCmdRequest.cmd_desc);
+		handle_receive_reg_cmd_request(msg);
+		break;
+
+	case CMDIF_DEREG_CMD_REQUEST:
+		TPT_TRACE(TRACE_INFO, "Received CMDIF_DEREG_CMD_REQUEST cmd_name = %s", msg->cmdIfDeregCmdRequest.cmd_name);
+		handle_receive_dereg_cmd_request(msg);
+		break;
+
+	case CMDIF_REG_SYNTAX_REQUEST:
+		TPT_TRACE(TRACE_INFO, "Received CMDIF_REG_SYNTAX_REQUEST cmd_name = %.*s, syntaxLen = %u", MAX_CMD_NAME_LENGTH, msg->cmdIfRegSyntaxRequest.cmd_name, msg->cmdIfRegSyntaxRequest.syntaxLen);
+		handle_receive_reg_syntax_request(msg);
+		break;
+
+	case CMDIF_EXE_CMD_REPLY:
+		if(upgrade_exe_cmd_reply(&msg))
+		{
+			TPT_TRACE(TRACE_INFO, "Received CMDIF_EXE_CMD_REPLY output = %s", msg->cmdIfExeCmdTimedReply.output);
+			handle_receive_exe_cmd_reply(msg);
+		}
+		break;
+
+	case CMDIF_EXE_CMD_TIMED_REPLY:
+		if(check_exe_cmd_timed_reply(msg))
+		{
+			TPT_TRACE(TRACE_INFO, "Received CMDIF_EXE_CMD_TIMED_REPLY output = %s", msg->cmdIfExeCmdTimedReply.output);
+			handle_receive_exe_cmd_reply(msg);
+		}
+		break;
+
+	default:
+		TPT_TRACE(TRACE_ABN, "Received invalid message msgno = 0x%08x", msg->msgno);
+		break;
+	}
+
+	itc_free(&msg);
+	return true;
+}
+
+static bool handle_receive_reg_cmd_request(union itc_msg *msg)
+{
+	struct CmdIfRegCmdExtS ext;
+	get_reg_cmd_ext(msg, &ext);
+	bool is_group = (ext.flags & CMDIF_REG_FLAG_GROUP) != 0;
+	ext.member_name[MAX_CMD_NAME_LENGTH - 1] = '\0';
+
+	struct command **iter;
+	iter = tfind(msg->cmdIfRegCmdRequest.cmd_name, &clid_inst.cmd_tree, compare_cmdname_in_cmd_tree);
+	if(iter != NULL)
+	{
+		if(is_group && (*iter)->is_group)
+		{
+			add_group_member(*iter, msg->cmdIfRegCmdRequest.mbox_id, ext.member_name);
+			return true;
+		}
+
+		TPT_TRACE(TRACE_ABN, "This cmdName %s already registered by mailbox id 0x%08x, something abnormal!", msg->cmdIfRegCmdRequest.cmd_name, (*iter)->mbox_id);
+		return true;
+	}
+
+	int i = 0;
+	for(; i < MAX_NUM_CMDS; i++)
+	{
+		if(clid_inst.cmds[i].cmd_name[0] == '\0' && is_group)
+		{
+			clid_inst.cmds[i].is_group = true;
+			clid_inst.cmds[i].member_count = 0;
+			add_group_member(&clid_inst.cmds[i], msg->cmdIfRegCmdRequest.mbox_id, ext.member_name);
+			strcpy(clid_inst.cmds[i].cmd_name, msg->cmdIfRegCmdRequest.cmd_name);
+			strcpy(clid_inst.cmds[i].cmd_desc, msg->cmdIfRegCmdRequest.cmd_desc);
+			tsearch(&clid_inst.cmds[i], &clid_inst.cmd_tree, compare_command_in_cmd_tree);
+			clid_inst.cmd_count++;
+			break;
+		} else if(clid_inst.cmds[i].cmd_name[0] == '\0')
+		{
+			struct mbox_queue *mbox_queue = get_mbox_queue(msg->cmdIfRegCmdRequest.mbox_id);
+			if(mbox_queue == NULL)
+			{
+				TPT_TRACE(TRACE_ERROR, "No more than %d handler mailboxes can be served!", MAX_NUM_CMDS);
+				return false;
+			}
+
+			mbox_queue->cmd_count++;
+			clid_inst.cmds[i].mbox_queue = mbox_queue;
+			clid_inst.cmds[i].cost_us = 0;
+			clid_inst.cmds[i].priority = ext.priority == CMDIF_PRIO_BULK ? CMDIF_PRIO_BULK : CMDIF_PRIO_INTERACTIVE;
+			clid_inst.cmds[i].mbox_id = msg->cmdIfRegCmdRequest.mbox_id;
+			clid_inst.cmds[i].is_syntax_pending = (ext.flags & CMDIF_REG_FLAG_SYNTAX) != 0;
+			strcpy(clid_inst.cmds[i].cmd_name, msg->cmdIfRegCmdRequest.cmd_name);
+			strcpy(clid_inst.cmds[i].cmd_desc, msg->cmdIfRegCmdRequest.cmd_desc);
+			tsearch(&clid_inst.cmds[i], &clid_inst.cmd_tree, compare_command_in_cmd_tree);
+			clid_inst.cmd_count++;
+			break;
+		}
+	}
+
+	if(i == MAX_NUM_CMDS)
+	{
+		TPT_TRACE(TRACE_ERROR, "No more than %d cmdName is accepted to be registered!", MAX_NUM_CMDS);
+		return false;
+	}
+
+	if(clid_inst.cmds[i].is_syntax_pending)
+	{
+		// Shells fetch the syntax as soon as they learn about the command, announce it once there is one to fetch
+		return true;
+	}
+
+	notify_cmd_list_changed(CLID_CMD_ADDED, &clid_inst.cmds[i]);
+	return true;
+}
+
+/* The CmdIfRegCmdExtS after cmd_desc, all zero if the registrant sent none: an interactive command without flags */
+static void get_reg_cmd_ext(union itc_msg *msg, struct CmdIfRegCmdExtS *ext)
+{
+	memset(ext, 0, sizeof(*ext));
+
+	size_t size = itc_size(msg);
+	size_t desc_offset = offsetof(struct CmdIfRegCmdRequestS, cmd_desc);
+	if(size <= desc_offset)
+	{
+		return;
+	}
+
+	// Past the end of the message if cmd_desc has no '\0' in it. A registrant may be built before the last fields of the trailer, the others are still taken
+	size_t ext_offset = desc_offset + strnlen(msg->cmdIfRegCmdRequest.cmd_desc, size - desc_offset) + 1;
+	size_t ext_len = ext_offset < size ? MIN_OF(size - ext_offset, sizeof(*ext)) : 0;
+	if(ext_len >= offsetof(struct CmdIfRegCmdExtS, member_name))
+	{
+		memcpy(ext, (const char *)msg + ext_offset, ext_len);
+	}
+}
+
+static bool handle_receive_dereg_cmd_request(union itc_msg *msg)
+{
+	struct command **iter;
+	iter = tfind(msg->cmdIfDeregCmdRequest.cmd_name, &clid_inst.cmd_tree, compare_cmdname_in_cmd_tree);
+	if(iter == NULL)
+	{
+		TPT_TRACE(TRACE_ABN, "This cmdName %s not registered yet, something wrong!", msg->cmdIfDeregCmdRequest.cmd_name);
+		return true;
+	}
+
+	struct command *command = *iter;
+	if(command->is_group)
+	{
+		// Only the sender leaves the group, the group itself goes with its last member
+		itc_mbox_id_t sender = itc_sender(msg);
+		for(int i = 0; i < command->member_count; i++)
+		{
+			if(command->members[i].mbox_id == sender)
+			{
+				command->members[i] = command->members[--command->member_count];
+				break;
+			}
+		}
+
+		if(command->member_count > 0)
+		{
+			return true;
+		}
+	}
+
+	if(!command->is_syntax_pending)
+	{
+		notify_cmd_list_changed(CLID_CMD_REMOVED, command);
+	}
+
+	// The tree is ordered by cmd_name, remove the command before its name is cleared, otherwise tdelete() could not find it anymore
+	tdelete(command, &clid_inst.cmd_tree, compare_command_in_cmd_tree);
+
+	if(command->mbox_queue != NULL)
+	{
+		for(int i = 0; i < CLID_MAX_JOBS_IN_FLIGHT; i++)
+		{
+			if(command->mbox_queue->slots[i].command == command)
+			{
+				command->mbox_queue->slots[i].command = NULL;
+			}
+		}
+
+		if(--command->mbox_queue->cmd_count == 0)
+		{
+			release_mbox_queue(command->mbox_queue);
+		}
+	}
+
+	command->mbox_id = ITC_NO_MBOX_ID;
+	command->priority = CMDIF_PRIO_INTERACTIVE;
+	command->mbox_queue = NULL;
+	command->cmd_name[0] = '\0';
+	command->cmd_desc[0] = '\0';
+	command->is_group = false;
+	command->member_count = 0;
+	free(command->syntax);
+	command->syntax = NULL;
+	command->syntax_len = 0;
+	command->is_syntax_pending = false;
+	clid_inst.cmd_count--;
+
+	return true;
+}
+
+static bool handle_receive_reg_syntax_request(union itc_msg *msg)
+{
+	msg->cmdIfRegSyntaxRequest.cmd_name[MAX_CMD_NAME_LENGTH - 1] = '\0';
+
+	struct command **iter;
+	iter = tfind(msg->cmdIfRegSyntaxRequest.cmd_name, &clid_inst.cmd_tree, compare_cmdname_in_cmd_tree);
+	if(iter == NULL || (*iter)->is_group || (*iter)->mbox_id != itc_sender(msg))
+	{
+		TPT_TRACE(TRACE_ABN, "Syntax of cmdName %s does not come from its handler mailbox, drop it!", msg->cmdIfRegSyntaxRequest.cmd_name);
+		return true;
+	}
+
+	struct command *command = *iter;
+	uint32_t syntax_len = msg->cmdIfRegSyntaxRequest.syntaxLen;
+	uint8_t *syntax = NULL;
+	if(syntax_len == 0 || syntax_len > CMDIF_MAX_SYNTAX_LENGTH)
+	{
+		TPT_TRACE(TRACE_ABN, "Syntax of cmdName %s has invalid length %u, drop it!", msg->cmdIfRegSyntaxRequest.cmd_name, syntax_len);
+	} else if((syntax = malloc(syntax_len)) == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to malloc syntax of cmdName %s!", msg->cmdIfRegSyntaxRequest.cmd_name);
+	} else
+	{
+		memcpy(syntax, msg->cmdIfRegSyntaxRequest.syntax, syntax_len);
+		free(command->syntax);
+		command->syntax = syntax;
+		command->syntax_len = syntax_len;
+	}
+
+	// Announced even without a usable syntax, the command itself works regardless
+	if(command->is_syntax_pending)
+	{
+		command->is_syntax_pending = false;
+		notify_cmd_list_changed(CLID_CMD_ADDED, command);
+	}
+
+	return true;
+}
+
+static void add_group_member(struct command *command, itc_mbox_id_t mbox_id, const char *member_name)
+{
+	for(int i = 0; i < command->member_count; i++)
+	{
+		if(command->members[i].mbox_id == mbox_id)
+		{
+			TPT_TRACE(TRACE_ABN, "Mailbox id 0x%08x already joined group %s, something abnormal!", mbox_id, command->cmd_name);
+			return;
+		}
+	}
+
+	if(command->member_count == CLID_MAX_GROUP_MEMBERS)
+	{
+		TPT_TRACE(TRACE_ABN, "No more than %d members can join group %s, mailbox id 0x%08x is not added!", CLID_MAX_GROUP_MEMBERS, command->cmd_name, mbox_id);
+		return;
+	}
+
+	struct group_member *member = &command->members[command->member_count++];
+	member->mbox_id = mbox_id;
+	if(member_name[0] != '\0')
+	{
+		strcpy(member->name, member_name);
+	} else
+	{
+		snprintf(member->name, MAX_CMD_NAME_LENGTH, "0x%08x", mbox_id);
+	}
+
+	TPT_TRACE(TRACE_INFO, "Mailbox id 0x%08x joined group %s as %s, %u members", mbox_id, command->cmd_name, member->name, command->member_count);
+}
+
+static bool start_group_job(struct shell_client *client, const struct command *command, union itc_msg *fwd, size_t msg_size)
+{
+	struct group_job *group_job = calloc(1, sizeof(struct group_job));
+	if(group_job == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to calloc group job for fd %d!", client->fd);
+		itc_free(&fwd);
+		return false;
+	}
+
+	unsigned long long job_id = fwd->cmdIfExeCmdRequest.job_id;
+	capture_record(CLID_CAP_JOB, client->fd, job_id, fwd->cmdIfExeCmdRequest.payload, fwd->cmdIfExeCmdRequest.payloadLen);
+
+	// Members that join or leave from now on do not change this job
+	group_job->started_ns = get_time_ns();
+	group_job->member_count = command->member_count;
+	group_job->member_timeout = client->job_timeout > 0 && client->job_timeout < m_member_timeout ? client->job_timeout : m_member_timeout;
+	client->group_job = group_job;
+	client->job_forwarded_ns = group_job->started_ns;
+	client->is_timing_requested = false;
+	client->is_job_sampled = false;
+
+	// One job_id per member, taken as a range like a batch does. A reply finds its member by subtraction,
+	// whichever mailbox or thread the member answers from
+	if(m_job_id > ULLONG_MAX - group_job->member_count)
+	{
+		m_job_id = 0;
+	}
+	group_job->first_job_id = m_job_id + 1;
+	m_job_id += group_job->member_count;
+
+	for(int i = 0; i < group_job->member_count; i++)
+	{
+		group_job->replies[i].member = command->members[i];
+
+		union itc_msg *copy = fwd;
+		if(i + 1 < group_job->member_count)
+		{
+			copy = itc_alloc(msg_size, CMDIF_EXE_CMD_REQUEST);
+			memcpy(copy, fwd, msg_size);
+		}
+		copy->cmdIfExeCmdRequest.job_id = group_job->first_job_id + i;
+
+		if(!itc_send(&copy, command->members[i].mbox_id, ITC_MY_MBOX_ID, NULL))
+		{
+			TPT_TRACE(TRACE_ERROR, "Failed to send CMDIF_EXE_CMD_REQUEST for job_id = %llu to group %s member %s", job_id, command->cmd_name, command->members[i].name);
+			if(copy != fwd)
+			{
+				itc_free(&fwd);
+			}
+			itc_free(&copy);
+			return false;
+		}
+	}
+
+	// The job timer now bounds the wait for the slowest member rather than the whole job
+	if(!set_time_job_timer(client->job_timer_fd, group_job->member_timeout))
+	{
+		TPT_TRACE(TRACE_ERROR, "Could not start job timer for group job of fd %d!", client->fd);
+		return false;
+	}
+
+	TPT_TRACE(TRACE_INFO, "Broadcast job_id = %llu to %u members of group %s", job_id, group_job->member_count, command->cmd_name);
+
+	return true;
+}
+
+static bool handle_receive_group_member_reply(struct shell_client *client, union itc_msg *msg, uint64_t replied_ns)
+{
+	struct group_job *group_job = client->group_job;
+	unsigned long long index = msg->cmdIfExeCmdTimedReply.job_id - group_job->first_job_id;
+	if(index >= group_job->member_count || group_job->replies[index].is_replied)
+	{
+		TPT_TRACE(TRACE_ABN, "Received CMDIF_EXE_CMD_REPLY, job_id = %llu, which no member of this group job waits for, drop it!", msg->cmdIfExeCmdTimedReply.job_id);
+		return true;
+	}
+
+	struct member_reply *reply = &group_job->replies[index];
+
+	reply->output = malloc(msg->cmdIfExeCmdTimedReply.outputLen);
+	if(reply->output == NULL && msg->cmdIfExeCmdTimedReply.outputLen > 0)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to malloc output of group member %s!", reply->member.name);
+		return false;
+	}
+
+	memcpy(reply->output, msg->cmdIfExeCmdTimedReply.output, msg->cmdIfExeCmdTimedReply.outputLen);
+	reply->output_len = msg->cmdIfExeCmdTimedReply.outputLen;
+	reply->result = msg->cmdIfExeCmdTimedReply.result;
+	reply->elapsed_ns = replied_ns - group_job->started_ns;
+	reply->is_replied = true;
+	group_job->reply_count++;
+
+	if(group_job->reply_count < group_job->member_count)
+	{
+		return true;
+	}
+
+	return finish_group_job(client);
+}
+
+/* Merge what the members answered into one reply: each output under a header line, then the members that did not answer in time */
+static bool finish_group_job(struct shell_client *client)
+{
+	struct group_job *group_job = client->group_job;
+
+	size_t cap = 128 + group_job->member_count * (MAX_CMD_NAME_LENGTH + 2);
+	for(int i = 0; i < group_job->member_count; i++)
+	{
+		cap += 128 + group_job->replies[i].output_len;
+	}
+
+	char *output = malloc(cap);
+	if(output == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to malloc merged reply of group job for fd %d!", client->fd);
+		return false;
+	}
+
+	size_t len = 0;
+	uint32_t result = group_job->reply_count == group_job->member_count ? CMDIF_RET_SUCCESS : CMDIF_RET_FAIL;
+	for(int i = 0; i < group_job->member_count; i++)
+	{
+		const struct member_reply *reply = &group_job->replies[i];
+		if(!reply->is_replied)
+		{
+			continue;
+		}
+
+		len += snprintf(output + len, cap - len, "=== %s: %s in %.1f ms ===\n", reply->member.name, get_result_name(reply->result), (double)reply->elapsed_ns / 1000000.0);
+		memcpy(output + len, reply->output, reply->output_len);
+		len += reply->output_len;
+		if(reply->output_len > 0 && reply->output[reply->output_len - 1] != '\n')
+		{
+			output[len++] = '\n';
+		}
+
+		result = reply->result == CMDIF_RET_SUCCESS ? result : CMDIF_RET_FAIL;
+	}
+
+	if(group_job->reply_count < group_job->member_count)
+	{
+		len += snprintf(output + len, cap - len, "=== %u of %u members replied, no reply within %ld s from:", group_job->reply_count, group_job->member_count, (long)group_job->member_timeout);
+		for(int i = 0; i < group_job->member_count; i++)
+		{
+			if(!group_job->replies[i].is_replied)
+			{
+				len += snprintf(output + len, cap - len, " %s", group_job->replies[i].member.name);
+			}
+		}
+		len += snprintf(output + len, cap - len, " ===\n");
+	}
+
+	if(client->job_timer_fd != -1 && !set_time_job_timer(client->job_timer_fd, 0))
+	{
+		TPT_TRACE(TRACE_ERROR, "Could not stop job timer fd = %d!", client->job_timer_fd);
+		free(output);
+		return false;
+	}
+
+	release_group_job(client);
+
+	// Within a batch the merged reply is only the result of one of its commands, the batch goes on with the next one
+	bool is_done = false;
+	struct batch_job *batch_job = client->batch_job;
+	if(batch_job != NULL)
+	{
+		batch_job->in_flight--;
+		is_done = record_batch_cmd_result(batch_job, (uint32_t)(client->current_job_id - batch_job->first_job_id), result, output, (uint32_t)len) && run_batch_job(client);
+	} else
+	{
+		is_done = send_exe_cmd_reply(client->fd, result, output, (uint32_t)len);
+		client->current_job_id = 0;
+	}
+
+	free(output);
+	return is_done;
+}
+
+static void release_group_job(struct shell_client *client)
+{
+	if(client->group_job == NULL)
+	{
+		return;
+	}
+
+	for(int i = 0; i < client->group_job->member_count; i++)
+	{
+		free(client->group_job->replies[i].output);
+	}
+
+	free(client->group_job);
+	client->group_job = NULL;
+}
+
+static const char *get_result_name(uint32_t result)
+{
+	switch (result)
+	{
+	case CMDIF_RET_SUCCESS:
+		return "OK";
+
+	case CMDIF_RET_INVALID_ARGS:
+		return "invalid arguments";
+
+	default:
+		return "failed";
+	}
+}
+
+/* Start as many commands as the policy lets wait for their handlers at once, and reply once there is nothing left to start or wait for.
+Like any client, a batch waits in a mbox_queue with one job at a time, forward_exe_cmd_request() comes back here for its next one */
+static bool run_batch_job(struct shell_client *client)
+{
+	struct batch_job *batch_job = client->batch_job;
+	uint32_t window = batch_job->policy == CLID_BATCH_PARALLEL ? CLID_BATCH_WINDOW : 1;
+	while(!batch_job->is_stopped && batch_job->next < batch_job->cmd_count && batch_job->in_flight < window && client->queued_on == NULL)
+	{
+		if(!start_batch_cmd(client, batch_job->next++))
+		{
+			return false;
+		}
+	}
+
+	if(batch_job->in_flight == 0)
+	{
+		return finish_batch_job(client);
+	}
+
+	// Each command gets the whole timeout, a parallel batch expires once none of its commands completed for that long.
+	// A group job bounds its members on its own, see start_group_job()
+	if(client->group_job == NULL && !set_time_job_timer(client->job_timer_fd, batch_job->timeout))
+	{
+		TPT_TRACE(TRACE_ERROR, "Could not start job timer for batch of fd %d!", client->fd);
+		return false;
+	}
+
+	return true;
+}
+
+static bool start_batch_cmd(struct shell_client *client, uint32_t index)
+{
+	struct batch_job *batch_job = client->batch_job;
+	struct batch_cmd *cmd = &batch_job->cmds[index];
+	const struct cmd_arg *args = &batch_job->args[cmd->first_arg];
+	unsigned long long job_id = batch_job->first_job_id + index;
+
+	// These fail right away, a reply from clid itself never counts against the window
+	struct command *command = find_command(&args[0]);
+	if(command == NULL)
+	{
+		const char *output = "Unknown command!";
+		return record_batch_cmd_result(batch_job, index, CMDIF_RET_FAIL, output, strlen(output));
+	}
+
+	if(command->is_group && batch_job->policy == CLID_BATCH_PARALLEL)
+	{
+		const char *output = "Command groups cannot run in a parallel batch!";
+		return record_batch_cmd_result(batch_job, index, CMDIF_RET_FAIL, output, strlen(output));
+	}
+
+	cmd->state = BATCH_CMD_RUNNING;
+	batch_job->in_flight++;
+	snprintf(client->job_cmd_name, MAX_CMD_NAME_LENGTH, "%s", command->cmd_name);
+
+	// Parallel commands are found by the job_id range of the batch, see find_client_by_job_id()
+	if(batch_job->policy != CLID_BATCH_PARALLEL)
+	{
+		client->current_job_id = job_id;
+	}
+
+	return queue_exe_cmd_request(client, job_id, cmd->num_args, args, batch_job->is_bulk);
+}
+
+static bool handle_receive_batch_cmd_reply(struct shell_client *client, union itc_msg *msg)
+{
+	struct batch_job *batch_job = client->batch_job;
+	unsigned long long index = msg->cmdIfExeCmdTimedReply.job_id - batch_job->first_job_id;
+	if(index >= batch_job->cmd_count || batch_job->cmds[index].state != BATCH_CMD_RUNNING)
+	{
+		// Its command already expired
+		TPT_TRACE(TRACE_ABN, "Received CMDIF_EXE_CMD_REPLY, job_id = %llu, for a batch command which is not waiting anymore, drop it!", msg->cmdIfExeCmdTimedReply.job_id);
+		return true;
+	}
+
+	batch_job->in_flight--;
+	if(!record_batch_cmd_result(batch_job, (uint32_t)index, msg->cmdIfExeCmdTimedReply.result, msg->cmdIfExeCmdTimedReply.output, msg->cmdIfExeCmdTimedReply.outputLen))
+	{
+		return false;
+	}
+
+	return run_batch_job(client);
+}
+
+static bool record_batch_cmd_result(struct batch_job *batch_job, uint32_t index, uint32_t result, const char *output, uint32_t output_len)
+{
+	struct batch_cmd *cmd = &batch_job->cmds[index];
+	cmd->output = malloc(output_len);
+	if(cmd->output == NULL && output_len > 0)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to malloc output of batch command %u!", index);
+		return false;
+	}
+
+	memcpy(cmd->output, output, output_len);
+	cmd->output_len = output_len;
+	cmd->result = result;
+	cmd->state = BATCH_CMD_DONE;
+
+	if(batch_job->policy == CLID_BATCH_STOP_ON_ERROR && result != CMDIF_RET_SUCCESS)
+	{
+		batch_job->is_stopped = true;
+	}
+
+	return true;
+}
+
+/* What still waits for its handler is failed as "Expired!". A sequential batch goes on with its next command,
+a parallel one got no reply at all for a whole timeout and skips the rest */
+static bool expire_batch_job(struct shell_client *client)
+{
+	struct batch_job *batch_job = client->batch_job;
+	struct mbox_queue *mbox_queue = client->queued_on;
+	dequeue_exe_cmd_request(client);
+
+	const char *output = "Expired!";
+	for(uint32_t i = 0; i < batch_job->next; i++)
+	{
+		if(batch_job->cmds[i].state == BATCH_CMD_RUNNING && !record_batch_cmd_result(batch_job, i, CMDIF_RET_FAIL, output, strlen(output)))
+		{
+			return false;
+		}
+	}
+
+	batch_job->in_flight = 0;
+	if(batch_job->policy == CLID_BATCH_PARALLEL)
+	{
+		batch_job->is_stopped = true;
+	}
+
+	// Also a chance to reclaim slots of jobs their handler never answered
+	if(mbox_queue != NULL && !dispatch_queued_jobs(mbox_queue))
+	{
+		return false;
+	}
+
+	return run_batch_job(client);
+}
+
+static bool finish_batch_job(struct shell_client *client)
+{
+	struct batch_job *batch_job = client->batch_job;
+
+	size_t cap = 2 * CLID_VARINT_MAX_SIZE;
+	for(uint32_t i = 0; i < batch_job->cmd_count; i++)
+	{
+		cap += 2 * CLID_VARINT_MAX_SIZE + batch_job->cmds[i].output_len;
+	}
+
+	uint8_t *payload = malloc(cap);
+	if(payload == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to malloc batch reply of %zu bytes for fd %d!", cap, client->fd);
+		return false;
+	}
+
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, payload, cap);
+	clid_v2_write_varint(&writer, CLID_STATUS_OK);
+	clid_v2_write_varint(&writer, batch_job->cmd_count);
+	for(uint32_t i = 0; i < batch_job->cmd_count; i++)
+	{
+		clid_v2_write_varint(&writer, batch_job->cmds[i].result);
+		clid_v2_write_string(&writer, batch_job->cmds[i].output, batch_job->cmds[i].output_len);
+	}
+
+	// Plain cut into fragments, the shell reassembles the payload before decoding any entry
+	uint8_t txbuff[CLID_V2_MAX_HEADER_SIZE + CLID_V2_MAX_FRAGMENT_LENGTH];
+	size_t sent_len = 0;
+	bool is_sent = true;
+	do
+	{
+		size_t chunk_len = MIN_OF(writer.len - sent_len, (size_t)CLID_V2_MAX_FRAGMENT_LENGTH);
+		uint8_t flags = (sent_len + chunk_len < writer.len) ? CLID_V2_FLAG_MORE : 0;
+
+		size_t len = clid_v2_encode_header(txbuff, CLID_V2_TYPE(CLID_EXE_BATCH_REPLY), flags, client->current_request_id, (uint32_t)chunk_len);
+		memcpy(txbuff + len, payload + sent_len, chunk_len);
+		len += chunk_len;
+
+		if(send_data(client->fd, txbuff, len) < 0)
+		{
+			TPT_TRACE(TRACE_ABN, "Failed to send v2 CLID_EXE_BATCH_REPLY, errno = %d!", errno);
+			drop_shell_client(client->fd);
+			is_sent = false;
+			break;
+		}
+
+		sent_len += chunk_len;
+	} while(sent_len < writer.len);
+
+	free(payload);
+	if(is_sent)
+	{
+		TPT_TRACE(TRACE_INFO, "Sent v2 CLID_EXE_BATCH_REPLY, request_id = %u, %u commands, %zu bytes!", client->current_request_id, batch_job->cmd_count, writer.len);
+	}
+
+	if(client->job_timer_fd != -1 && !set_time_job_timer(client->job_timer_fd, 0))
+	{
+		TPT_TRACE(TRACE_ERROR, "Could not stop job timer fd = %d!", client->job_timer_fd);
+		return false;
+	}
+
+	// Even when the client was dropped, its batch is done with and clid goes on
+	release_batch_job(client);
+	client->current_job_id = 0;
+
+	return true;
+}
+
+static void release_batch_job(struct shell_client *client)
+{
+	if(client->batch_job == NULL)
+	{
+		return;
+	}
+
+	for(uint32_t i = 0; i < client->batch_job->cmd_count; i++)
+	{
+		free(client->batch_job->cmds[i].output);
+	}
+
+	free(client->batch_job->args);
+	free(client->batch_job->payload);
+	free(client->batch_job);
+	client->batch_job = NULL;
+}
+
+static struct command *find_command(const struct cmd_arg *cmd_name)
+{
+	char name[MAX_CMD_NAME_LENGTH];
+	if(cmd_name->len >= MAX_CMD_NAME_LENGTH)
+	{
+		TPT_TRACE(TRACE_ABN, "This cmdName %.*s is too long, something abnormal!", (int)cmd_name->len, cmd_name->str);
+		return NULL;
+	}
+	memcpy(name, cmd_name->str, cmd_name->len);
+	name[cmd_name->len] = '\0';
+
+	struct command **iter;
+	iter = tfind(name, &clid_inst.cmd_tree, compare_cmdname_in_cmd_tree);
+	if(iter == NULL)
+	{
+		TPT_TRACE(TRACE_ABN, "This cmdName %s not found in command tree, something abnormal!", name);
+		return NULL;
+	}
+
+	return *iter;
+}
+
+/* args[0] must be the name of a registered command, see find_command() */
+static union itc_msg *build_exe_cmd_request(unsigned long long job_id, uint16_t num_args, const struct cmd_arg *args, size_t *msg_size)
+{
+	uint32_t pl_len = 0;
+	for(int i = 0; i < num_args; i++)
+	{
+		pl_len += sizeof(uint16_t) + args[i].len;
+	}
+
+	*msg_size = offsetof(struct CmdIfExeCmdRequestS, payload) + pl_len;
+	union itc_msg* fwd = itc_alloc(*msg_size, CMDIF_EXE_CMD_REQUEST);
+
+	fwd->cmdIfExeCmdRequest.job_id = job_id;
+	memset(fwd->cmdIfExeCmdRequest.cmd_name, 0, MAX_CMD_NAME_LENGTH);
+	memcpy(fwd->cmdIfExeCmdRequest.cmd_name, args[0].str, args[0].len);
+	fwd->cmdIfExeCmdRequest.num_args = num_args;
+	fwd->cmdIfExeCmdRequest.payloadLen = pl_len;
+
+	// Length-prefixed arguments, see CmdIfExeCmdRequestS
+	char *pl = fwd->cmdIfExeCmdRequest.payload;
+	for(int i = 0; i < num_args; i++)
+	{
+		memcpy(pl, &args[i].len, sizeof(uint16_t));
+		pl += sizeof(uint16_t);
+		memcpy(pl, args[i].str, args[i].len);
+		pl += args[i].len;
+	}
+
+	return fwd;
+}
+
+static bool queue_exe_cmd_request(struct shell_client *client, unsigned long long job_id, uint16_t num_args, const struct cmd_arg *args, bool is_bulk)
+{
+	struct command *command = find_command(&args[0]);
+	if(command == NULL)
+	{
+		return true;
+	}
+
+	// Build the request right away, the arguments only live in the client's rx buffer until this returns
+	size_t msg_size = 0;
+	union itc_msg* fwd = build_exe_cmd_request(job_id, num_args, args, &msg_size);
+
+	if(command->is_group)
+	{
+		return start_group_job(client, command, fwd, msg_size);
+	}
+
+	// A client can only move its own jobs down to bulk, never up to interactive
+	struct mbox_queue *mbox_queue = command->mbox_queue;
+	struct job_queue *queue = &mbox_queue->queues[is_bulk ? CMDIF_PRIO_BULK : command->priority];
+
+	client->queued_job = fwd;
+	client->queued_on = mbox_queue;
+	client->queued_class = is_bulk ? CMDIF_PRIO_BULK : command->priority;
+	client->next_queued = NULL;
+	client->queued_cost_us = command->cost_us ? command->cost_us : mbox_queue->cost_us;
+	if(client->deficit_on != mbox_queue)
+	{
+		client->deficit_us = 0;
+		client->deficit_on = mbox_queue;
+	}
+	if(queue->tail != NULL)
+	{
+		queue->tail->next_queued = client;
+	} else
+	{
+		queue->head = client;
+	}
+	queue->tail = client;
+
+	return dispatch_queued_jobs(mbox_queue);
+}
+
+static void dequeue_exe_cmd_request(struct shell_client *client)
+{
+	if(client->queued_on == NULL)
+	{
+		return;
+	}
+
+	struct job_queue *queue = &client->queued_on->queues[client->queued_class];
+	struct shell_client *prev = NULL;
+	for(struct shell_client *cur = queue->head; cur != NULL; prev = cur, cur = cur->next_queued)
+	{
+		if(cur == client)
+		{
+			if(prev != NULL)
+			{
+				prev->next_queued = cur->next_queued;
+			} else
+			{
+				queue->head = cur->next_queued;
+			}
+
+			if(queue->tail == cur)
+			{
+				queue->tail = prev;
+			}
+			break;
+		}
+	}
+
+	itc_free(&client->queued_job);
+	client->queued_job = NULL;
+	client->queued_on = NULL;
+	client->next_queued = NULL;
+}
+
+static bool dispatch_queued_jobs(struct mbox_queue *mbox_queue)
+{
+	// Handlers that never reply must not hold their slots forever, their clients got "Expired!" long ago
+	uint64_t now = get_time_ns();
+	for(int i = 0; i < CLID_MAX_JOBS_IN_FLIGHT; i++)
+	{
+		if(mbox_queue->slots[i].job_id != 0 && mbox_queue->slots[i].deadline_ns <= now)
+		{
+			TPT_TRACE(TRACE_ABN, "No reply for job_id = %llu from mbox id 0x%08x in time, stop waiting for it!", mbox_queue->slots[i].job_id, mbox_queue->mbox_id);
+			release_in_flight_job(&mbox_queue->slots[i]);
+		}
+	}
+
+	struct job_queue *interactive = &mbox_queue->queues[CMDIF_PRIO_INTERACTIVE];
+	struct job_queue *bulk = &mbox_queue->queues[CMDIF_PRIO_BULK];
+	while(mbox_queue->in_flight < m_max_jobs_in_flight)
+	{
+		// Interactive first, but every CLID_INTERACTIVE_BURST of them a waiting bulk job goes too, so bulk never starves
+		struct job_queue *queue = NULL;
+		if(interactive->head != NULL && (bulk->head == NULL || mbox_queue->interactive_streak < CLID_INTERACTIVE_BURST))
+		{
+			queue = interactive;
+			mbox_queue->interactive_streak = bulk->head != NULL ? mbox_queue->interactive_streak + 1 : 0;
+		} else if(bulk->head != NULL)
+		{
+			queue = bulk;
+			mbox_queue->interactive_streak = 0;
+		} else
+		{
+			break;
+		}
+
+		struct shell_client *client = pick_next_job(queue);
+		if(!forward_exe_cmd_request(client, mbox_queue))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Deficit round robin over the clients waiting in this class: each visit credits a client one quantum, and its job
+is only forwarded once the credit covers the job's expected handler time. What is left is kept for its next job to this mailbox,
+so a client sending expensive jobs gets them forwarded less often instead of taking a larger share of the handler time.
+The quantum is the cheapest waiting job, which therefore never waits more than one round */
+static struct shell_client *pick_next_job(struct job_queue *queue)
+{
+	uint32_t quantum = UINT32_MAX;
+	for(struct shell_client *client = queue->head; client != NULL; client = client->next_queued)
+	{
+		quantum = client->queued_cost_us < quantum ? client->queued_cost_us : quantum;
+	}
+	quantum = MAX_OF(quantum, CLID_DRR_MIN_QUANTUM_US);
+	uint32_t max_cost = CLID_DRR_MAX_QUANTA * quantum;
+
+	while(1)
+	{
+		struct shell_client *client = queue->head;
+		queue->head = client->next_queued;
+		if(queue->head == NULL)
+		{
+			queue->tail = NULL;
+		}
+		client->next_queued = NULL;
+
+		// A client has a single job, every visit is a new round for it
+		client->deficit_us += quantum;
+		uint32_t cost = MIN_OF(client->queued_cost_us, max_cost);
+		if(cost <= client->deficit_us)
+		{
+			client->deficit_us -= cost;
+			client->queued_on = NULL;
+			return client;
+		}
+
+		// Not enough credit yet, next round
+		if(queue->tail != NULL)
+		{
+			queue->tail->next_queued = client;
+		} else
+		{
+			queue->head = client;
+		}
+		queue->tail = client;
+	}
+}
+
+static bool forward_exe_cmd_request(struct shell_client *client, struct mbox_queue *mbox_queue)
+{
+	union itc_msg *fwd = client->queued_job;
+	client->queued_job = NULL;
+
+	struct in_flight_job *slot = NULL;
+	for(int i = 0; i < CLID_MAX_JOBS_IN_FLIGHT && slot == NULL; i++)
+	{
+		if(mbox_queue->slots[i].job_id == 0)
+		{
+			slot = &mbox_queue->slots[i];
+		}
+	}
+
+	if(slot == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "No free in-flight slot for mbox id 0x%08x, in_flight = %u, something wrong!", mbox_queue->mbox_id, mbox_queue->in_flight);
+		itc_free(&fwd);
+		return false;
+	}
+
+	unsigned long long job_id = fwd->cmdIfExeCmdRequest.job_id;
+	struct command **command;
+	command = tfind(fwd->cmdIfExeCmdRequest.cmd_name, &clid_inst.cmd_tree, compare_cmdname_in_cmd_tree);
+	slot->job_id = job_id;
+	slot->mbox_queue = mbox_queue;
+	slot->command = command != NULL ? *command : NULL;
+	slot->forwarded_ns = get_time_ns();
+	slot->deadline_ns = client->job_timeout > 0 ? get_time_ns() + (uint64_t)client->job_timeout * NSEC_PER_SEC : UINT64_MAX;
+	tsearch(slot, &clid_inst.in_flight_tree, compare_in_flight_job_in_in_flight_tree);
+	mbox_queue->in_flight++;
+
+	// The message is gone once sent
+	capture_record(CLID_CAP_JOB, client->fd, job_id, fwd->cmdIfExeCmdRequest.payload, fwd->cmdIfExeCmdRequest.payloadLen);
+
+	if(!itc_send(&fwd, mbox_queue->mbox_id, ITC_MY_MBOX_ID, NULL))
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to send CMDIF_EXE_CMD_REQUEST for job_id = %llu to mbox id 0x%08x", job_id, mbox_queue->mbox_id);
+		itc_free(&fwd);
+		return false;
+	}
+
+	client->job_forwarded_ns = get_time_ns();
+	TPT_TRACE(TRACE_INFO, "Forwarded CMDIF_EXE_CMD_REQUEST for job_id = %llu to mbox id 0x%08x, %u in flight", job_id, mbox_queue->mbox_id, mbox_queue->in_flight);
+
+	// The client left the queue, a parallel batch may queue its next command now
+	if(client->batch_job != NULL && client->batch_job->policy == CLID_BATCH_PARALLEL)
+	{
+		return run_batch_job(client);
+	}
+
+	return true;
+}
+
+static void release_in_flight_job(struct in_flight_job *slot)
+{
+	tdelete(slot, &clid_inst.in_flight_tree, compare_in_flight_job_in_in_flight_tree);
+	slot->mbox_queue->in_flight--;
+	slot->job_id = 0;
+	slot->mbox_queue = NULL;
+	slot->command = NULL;
+}
+
+static void update_job_cost(const struct in_flight_job *slot, const struct CmdIfExeCmdTimedReplyS *reply, uint64_t replied_ns)
+{
+	// Handler time as cmdif measured it, a handler without those timestamps is charged the whole ITC round trip instead
+	uint64_t cost_ns = reply->doneNs > reply->startedNs && reply->startedNs != 0 ? reply->doneNs - reply->startedNs : replied_ns - slot->forwarded_ns;
+
+	update_moving_average(&slot->mbox_queue->cost_us, cost_ns);
+	if(slot->command != NULL)
+	{
+		update_moving_average(&slot->command->cost_us, cost_ns);
+	}
+}
+
+static void update_moving_average(uint32_t *average_us, uint64_t sample_ns)
+{
+	uint64_t sample_us = sample_ns / NSEC_PER_USEC;
+	sample_us = sample_us > UINT32_MAX ? UINT32_MAX : sample_us;
+
+	if(*average_us == 0)
+	{
+		*average_us = (uint32_t)sample_us;
+		return;
+	}
+
+	*average_us = *average_us - (*average_us >> CLID_COST_EWMA_SHIFT) + (uint32_t)(sample_us >> CLID_COST_EWMA_SHIFT);
+}
+
+/* Find the entry of this mailbox, or take a free one for it */
+static struct mbox_queue *get_mbox_queue(itc_mbox_id_t mbox_id)
+{
+	struct mbox_queue **iter;
+	iter = tfind(&mbox_id, &clid_inst.mbox_queue_tree, compare_mbox_id_in_mbox_queue_tree);
+	if(iter != NULL)
+	{
+		return *iter;
+	}
+
+	for(int i = 0; i < MAX_NUM_CMDS; i++)
+	{
+		if(clid_inst.mbox_queues[i].mbox_id == ITC_NO_MBOX_ID)
+		{
+			clid_inst.mbox_queues[i].mbox_id = mbox_id;
+			clid_inst.mbox_queues[i].cost_us = CLID_DRR_MIN_QUANTUM_US;
+			tsearch(&clid_inst.mbox_queues[i], &clid_inst.mbox_queue_tree, compare_mbox_queue_in_mbox_queue_tree);
+			return &clid_inst.mbox_queues[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Last command of this mailbox is gone: queued jobs are dropped and left to their job timers, as for an unknown command */
+static void release_mbox_queue(struct mbox_queue *mbox_queue)
+{
+	for(int prio = 0; prio < CLID_NUM_PRIO_CLASSES; prio++)
+	{
+		while(mbox_queue->queues[prio].head != NULL)
+		{
+			dequeue_exe_cmd_request(mbox_queue->queues[prio].head);
+		}
+	}
+
+	for(int i = 0; i < CLID_MAX_JOBS_IN_FLIGHT; i++)
+	{
+		if(mbox_queue->slots[i].job_id != 0)
+		{
+			release_in_flight_job(&mbox_queue->slots[i]);
+		}
+	}
+
+	tdelete(mbox_queue, &clid_inst.mbox_queue_tree, compare_mbox_queue_in_mbox_queue_tree);
+	memset(mbox_queue, 0, sizeof(struct mbox_queue));
+	mbox_queue->mbox_id = ITC_NO_MBOX_ID;
+}
+
+static int compare_mbox_id_in_mbox_queue_tree(const void *pa, const void *pb)
+{
+	const itc_mbox_id_t *mbox_id = pa;
+	const struct mbox_queue *mbox_queue = pb;
+
+	if(*mbox_id == mbox_queue->mbox_id)
+	{
+		return 0;
+	} else if(*mbox_id > mbox_queue->mbox_id)
+	{
+		return 1;
+	} else
+	{
+		return -1;
+	}
+}
+
+static int compare_mbox_queue_in_mbox_queue_tree(const void *pa, const void *pb)
+{
+	const struct mbox_queue *mbox_queue_a = pa;
+
+	return compare_mbox_id_in_mbox_queue_tree(&mbox_queue_a->mbox_id, pb);
+}
+
+static int compare_job_id_in_in_flight_tree(const void *pa, const void *pb)
+{
+	const unsigned long long *job_id = pa;
+	const struct in_flight_job *slot = pb;
+
+	if(*job_id == slot->job_id)
+	{
+		return 0;
+	} else if(*job_id > slot->job_id)
+	{
+		return 1;
+	} else
+	{
+		return -1;
+	}
+}
+
+static int compare_in_flight_job_in_in_flight_tree(const void *pa, const void *pb)
+{
+	const struct in_flight_job *slot_a = pa;
+
+	return compare_job_id_in_in_flight_tree(&slot_a->job_id, pb);
+}
+
+/* Handlers built before CMDIF_EXE_CMD_TIMED_REPLY still send CMDIF_EXE_CMD_REPLY, whose output ends at its '\0'.
+*msg becomes the same reply as a timed one without spans, false if it cannot even hold its header */
+static bool upgrade_exe_cmd_reply(union itc_msg **msg)
+{
+	size_t size = itc_size(*msg);
+	if(size < offsetof(struct CmdIfExeCmdReplyS, output))
+	{
+		TPT_TRACE(TRACE_ABN, "Received CMDIF_EXE_CMD_REPLY of only %zu bytes, drop it!", size);
+		return false;
+	}
+
+	// An output without its '\0' is cut at the end of the message, never read past it
+	uint32_t output_len = strnlen((*msg)->cmdIfExeCmdReply.output, size - offsetof(struct CmdIfExeCmdReplyS, output));
+	union itc_msg *timed = itc_alloc(offsetof(struct CmdIfExeCmdTimedReplyS, output) + output_len + 1, CMDIF_EXE_CMD_TIMED_REPLY);
+
+	timed->cmdIfExeCmdTimedReply.job_id = (*msg)->cmdIfExeCmdReply.job_id;
+	timed->cmdIfExeCmdTimedReply.result = (*msg)->cmdIfExeCmdReply.result;
+	timed->cmdIfExeCmdTimedReply.receivedNs = 0;
+	timed->cmdIfExeCmdTimedReply.startedNs = 0;
+	timed->cmdIfExeCmdTimedReply.doneNs = 0;
+	timed->cmdIfExeCmdTimedReply.outputLen = output_len;
+	memcpy(timed->cmdIfExeCmdTimedReply.output, (*msg)->cmdIfExeCmdReply.output, output_len);
+	timed->cmdIfExeCmdTimedReply.output[output_len] = '\0';
+
+	itc_free(msg);
+	*msg = timed;
+	return true;
+}
+
+/* outputLen comes from the handler, it is only taken if the output and its '\0' fit in the message */
+static bool check_exe_cmd_timed_reply(union itc_msg *msg)
+{
+	size_t size = itc_size(msg);
+	size_t header_size = offsetof(struct CmdIfExeCmdTimedReplyS, output);
+	if(size <= header_size || msg->cmdIfExeCmdTimedReply.outputLen >= size - header_size)
+	{
+		TPT_TRACE(TRACE_ABN, "Received CMDIF_EXE_CMD_TIMED_REPLY of %zu bytes, too short for its output, drop it!", size);
+		return false;
+	}
+
+	msg->cmdIfExeCmdTimedReply.output[msg->cmdIfExeCmdTimedReply.outputLen] = '\0';
+	return true;
+}
+
+static bool handle_receive_exe_cmd_reply(union itc_msg *msg)
+{
+	uint64_t replied_ns = get_time_ns();
+	struct shell_client *client = find_client_by_job_id(msg->cmdIfExeCmdTimedReply.job_id);
+
+	// The handler is free for the next queued job, whether or not anybody still waits for this one
+	struct in_flight_job **slot;
+	slot = tfind(&msg->cmdIfExeCmdTimedReply.job_id, &clid_inst.in_flight_tree, compare_job_id_in_in_flight_tree);
+	if(slot != NULL)
+	{
+		struct mbox_queue *mbox_queue = (*slot)->mbox_queue;
+		update_job_cost(*slot, &msg->cmdIfExeCmdTimedReply, replied_ns);
+		release_in_flight_job(*slot);
+		if(!dispatch_queued_jobs(mbox_queue))
+		{
+			return false;
+		}
+	}
+
+	uint8_t result[CLID_VARINT_MAX_SIZE];
+	size_t result_len = clid_varint_encode(result, msg->cmdIfExeCmdTimedReply.result);
+	if(capture_begin(CLID_CAP_ITC_REPLY, client ? client->fd : 0, msg->cmdIfExeCmdTimedReply.job_id, result_len + msg->cmdIfExeCmdTimedReply.outputLen))
+	{
+		capture_append(result, result_len);
+		capture_append(msg->cmdIfExeCmdTimedReply.output, msg->cmdIfExeCmdTimedReply.outputLen);
+	}
+
+	if(client == NULL)
+	{
+		// There are some potential situation:
+		// 1. Job timer was already expired
+		// 2. Shell client pressed Ctrl-C to cancel the previous job execution
+		// 3. Shell client was disconnected
+		// -> Suggest to check log's flow to see what is the reason
+
+		TPT_TRACE(TRACE_ABN, "Received CMDIF_EXE_CMD_REPLY, job_id = %llu, which is not valid anymore, something wrong!", msg->cmdIfExeCmdTimedReply.job_id);
+		return true;
+	}
+
+	// Group members reply with job_ids of their own, see start_group_job()
+	const struct group_job *group_job = client->group_job;
+	if(group_job != NULL && msg->cmdIfExeCmdTimedReply.job_id >= group_job->first_job_id && msg->cmdIfExeCmdTimedReply.job_id - group_job->first_job_id < group_job->member_count)
+	{
+		return handle_receive_group_member_reply(client, msg, replied_ns);
+	}
+
+	if(client->batch_job != NULL)
+	{
+		return handle_receive_batch_cmd_reply(client, msg);
+	}
+
+	if(client->is_timing_requested && client->proto_version == CLID_PROTO_V2)
+	{
+		send_v2_exe_cmd_timing(client, &msg->cmdIfExeCmdTimedReply, replied_ns);
+	}
+
+	if(!send_exe_cmd_reply(client->fd, msg->cmdIfExeCmdTimedReply.result, msg->cmdIfExeCmdTimedReply.output, msg->cmdIfExeCmdTimedReply.outputLen))
+	{
+		return false;
+	}
+
+	if(client->is_job_sampled)
+	{
+		record_job_span(client, &msg->cmdIfExeCmdTimedReply, replied_ns, get_time_ns());
+	}
+
+	// Done this job execution, stop the respective job timer and unset current_job_id.
+	if(client->job_timer_fd != -1 && !set_time_job_timer(client->job_timer_fd, 0))
+	{
+		TPT_TRACE(TRACE_ERROR, "Could not stop job timer fd = %d!", client->job_timer_fd);
+		return false;
+	}
+
+	client->current_job_id = 0;
+
+	return true;
+}
+
+static bool handle_job_timer_expired(int timerfd)
+{
+	struct shell_client *client = find_client_by_timerfd(timerfd);
+	if(client == NULL)
+	{
+		TPT_TRACE(TRACE_ABN, "Job timer fd = %d not found in client tree, something wrong!", timerfd);
+		return true;
+	}
+
+	capture_record(CLID_CAP_JOB_EXPIRED, client->fd, client->current_job_id, NULL, 0);
+
+	if(client->group_job != NULL)
+	{
+		// Stragglers are reported in the reply, along with what the other members answered
+		return finish_group_job(client);
+	}
+
+	if(client->batch_job != NULL)
+	{
+		return expire_batch_job(client);
+	}
+
+	// Still queued behind other jobs of the same mailbox, it will not be forwarded anymore
+	struct mbox_queue *mbox_queue = client->queued_on;
+	dequeue_exe_cmd_request(client);
+
+	const char *output = "Expired!";
+	if(!send_exe_cmd_reply(client->fd, (uint32_t)CMDIF_RET_FAIL, output, strlen(output)))
+	{
+		return false;
+	}
+
+	client->current_job_id = 0;
+
+	// Also a chance to reclaim slots of jobs their handler never answered
+	if(mbox_queue != NULL && !dispatch_queued_jobs(mbox_queue))
 	{
-		TPT_TRACE(TRACE_ERROR, "Failed to send CLID_GET_LIST_CMD_REPLY, errno = %d!", errno);
 		return false;
 	}
 
-	free(rep);
-	TPT_TRACE(TRACE_INFO, "Sent CLID_GET_LIST_CMD_REPLY successfully!");
 	return true;
 }
 
-static bool send_exe_cmd_reply(int sockfd, uint32_t result, char *output)
+static bool setup_beacon(void)
 {
-	/* MOCK PURPOSE ONLY */
-	// char cmd_output[512];
-	// strcpy(cmd_output, "This is a notification toward user notifying that the command was executing successfully!");
-	// uint32_t output_len = strlen(cmd_output);
+	clid_inst.beacon_fd = -1;
+	clid_inst.beacon_timer_fd = -1;
 
-	uint32_t output_len = strlen(output);
+	// A clid that does not beacon does not answer probes either
+	if(m_beacon_interval == 0)
+	{
+		TPT_TRACE(TRACE_INFO, "No discovery beacon, probes are not answered either");
+		return true;
+	}
 
-	size_t msg_len = offsetof(struct ethtcp_msg, payload) + offsetof(struct clid_exe_cmd_reply, payload) + output_len + 1;
-	struct ethtcp_msg *rep = malloc(msg_len);
-	if(rep == NULL)
+	// Also where the probes of shells come in
+	int beacon_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(beacon_fd < 0)
 	{
-		TPT_TRACE(TRACE_ERROR, "Failed to malloc locate mbox reply message!");
+		TPT_TRACE(TRACE_ERROR, "Failed to get UDP socket(), errno = %d!", errno);
 		return false;
 	}
 
-	uint32_t payload_length = offsetof(struct clid_exe_cmd_reply, payload) + output_len + 1;
-	rep->header.sender 					= htonl((uint32_t)getpid());
-	rep->header.receiver 					= htonl(111);
-	rep->header.protRev 					= htonl(15);
-	rep->header.msgno 					= htonl(CLID_EXE_CMD_REPLY);
-	rep->header.payloadLen 					= htonl(payload_length);
-
-	rep->payload.clid_exe_cmd_reply.errorcode		= htonl(CLID_STATUS_OK);
-	rep->payload.clid_exe_cmd_reply.result			= htonl(result);
-	rep->payload.clid_exe_cmd_reply.payload_length		= htonl(output_len + 1);
-	memcpy(rep->payload.clid_exe_cmd_reply.payload, output, output_len + 1);
-
-	int res = send(sockfd, rep, msg_len, 0);
-	if(res < 0)
+	int opt = 1;
+	if(setsockopt(beacon_fd, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(int)) < 0 || setsockopt(beacon_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) < 0)
 	{
-		TPT_TRACE(TRACE_ERROR, "Failed to send CLID_EXE_CMD_REPLY, errno = %d!", errno);
+		TPT_TRACE(TRACE_ERROR, "Failed to set sockopt SO_BROADCAST/SO_REUSEADDR, errno = %d!", errno);
+		close(beacon_fd);
 		return false;
 	}
 
-	free(rep);
-	TPT_TRACE(TRACE_INFO, "Sent CLID_EXE_CMD_REPLY successfully!");
-	return true;
-}
-
-static bool restart_job_timer(int sockfd, time_t timeout)
-{
-	struct shell_client **iter;
-	iter = tfind(&sockfd, &clid_inst.client_tree, compare_fd_in_client_tree);
-	if(iter == NULL)
+	struct sockaddr_in probe_addr;
+	memset(&probe_addr, 0, sizeof(struct sockaddr_in));
+	probe_addr.sin_family = AF_INET;
+	probe_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	probe_addr.sin_port = htons(CLID_PROBE_PORT);
+	if(bind(beacon_fd, (struct sockaddr *)&probe_addr, sizeof(struct sockaddr_in)) < 0)
 	{
-		TPT_TRACE(TRACE_ABN, "This fd %d not found in client tree, something wrong!", sockfd);
+		TPT_TRACE(TRACE_ERROR, "Failed to bind probe port %d, errno = %d!", CLID_PROBE_PORT, errno);
+		close(beacon_fd);
 		return false;
 	}
 
-	if((*iter)->job_timer_fd <= 0)
+	memset(&clid_inst.beacon_addr, 0, sizeof(struct sockaddr_in));
+	clid_inst.beacon_addr.sin_family = AF_INET;
+	clid_inst.beacon_addr.sin_port = htons(CLID_BEACON_PORT);
+	clid_inst.beacon_addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+
+	// The limited broadcast only goes out of the interface of the default route, rather use the one clid listens on
+	struct ifreq ifrq;
+	memset(&ifrq, 0, sizeof(struct ifreq));
+	strncpy(ifrq.ifr_name, NET_INTERFACE_ETH0, IFNAMSIZ - 1);
+	if(ioctl(beacon_fd, SIOCGIFBRDADDR, &ifrq) == 0)
 	{
-		// The first job for this shell client
-		TPT_TRACE(TRACE_INFO, "Starting the first job for this shell client, sockfd = %d", sockfd);
-		(*iter)->job_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
-		if((*iter)->job_timer_fd < 0)
-		{
-			TPT_TRACE(TRACE_ERROR, "Failed to timerfd_create(), errno = %d!", errno);
-			return false;
-		}
+		memcpy(&clid_inst.beacon_addr.sin_addr, &((struct sockaddr_in *)(void *)&ifrq.ifr_broadaddr)->sin_addr, sizeof(struct in_addr));
+	}
 
-		;
+	// Without its netmask only probes from clid's own address are answered
+	clid_inst.probe_mask.s_addr = htonl(INADDR_BROADCAST);
+	if(ioctl(beacon_fd, SIOCGIFNETMASK, &ifrq) == 0)
+	{
+		memcpy(&clid_inst.probe_mask, &((struct sockaddr_in *)(void *)&ifrq.ifr_netmask)->sin_addr, sizeof(struct in_addr));
 	}
 
-	// Whether either one of two scenarios below happens, do a same thing.
-	// 1. There is another job for this client still running, skip it.
-	// When job results of the discarded job sent back to clid daemon from application threads just discard it
-	// because current_job_id for this shell client should be changed by the caller of this function,
-	// The shell client did not need the discarded job anymore (probably they press Ctrl-C and send us this new job).
-	// 2. No job is running for this shell client, set new timeout for the job_timer
+	memset(&clid_inst.beacon, 0, sizeof(struct clid_beacon));
+	if(gethostname(clid_inst.beacon.hostname, sizeof(clid_inst.beacon.hostname)) < 0)
+	{
+		strcpy(clid_inst.beacon.hostname, "unknown");
+	}
+	clid_inst.beacon.hostname[CLID_BEACON_MAX_HOSTNAME] = '\0';
+	clid_inst.beacon.tcp_ip = clid_inst.tcp_addr.sin_addr.s_addr;
+	clid_inst.beacon.tcp_port = TCP_CLID_PORT;
+	clid_inst.beacon.registry_epoch = clid_inst.registry_epoch;
+	clid_inst.beacon_fd = beacon_fd;
 
-	if(!set_time_job_timer((*iter)->job_timer_fd, timeout))
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(timer_fd < 0)
 	{
-		TPT_TRACE(TRACE_ERROR, "Could not start job timer for this shell client sockfd = %d!", sockfd);
+		TPT_TRACE(TRACE_ERROR, "Failed to timerfd_create(), errno = %d!", errno);
 		return false;
 	}
 
-	return true;
-}
-
-static bool set_time_job_timer(int timerfd, time_t timeout)
-{
-	struct timespec now;
 	struct itimerspec its;
-	int res = -1;
-
-	clock_gettime(CLOCK_REALTIME, &now);
 	memset(&its, 0, sizeof(struct itimerspec));
-	its.it_value.tv_sec = now.tv_sec + (time_t)timeout;
-	its.it_value.tv_nsec = now.tv_nsec;
-	res = timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
-	if(res < 0)
+	its.it_value.tv_sec = (time_t)m_beacon_interval;
+	its.it_interval.tv_sec = (time_t)m_beacon_interval;
+	if(timerfd_settime(timer_fd, 0, &its, NULL) < 0)
 	{
 		TPT_TRACE(TRACE_ERROR, "Failed to timerfd_settime(), errno = %d!", errno);
+		close(timer_fd);
 		return false;
 	}
+	clid_inst.beacon_timer_fd = timer_fd;
 
+	TPT_TRACE(TRACE_INFO, "Broadcasting discovery beacon to %s:%d every %u seconds, answering probes on port %d", inet_ntoa(clid_inst.beacon_addr.sin_addr), CLID_BEACON_PORT, m_beacon_interval, CLID_PROBE_PORT);
+	send_beacon(&clid_inst.beacon_addr);
 	return true;
 }
 
-static bool is_job_timer_running(int timerfd)
+/* A lost beacon is no harm, the next one follows in m_beacon_interval seconds, or the shell probes again */
+static void send_beacon(const struct sockaddr_in *to)
 {
-	struct itimerspec remaining_time;
-
-	int res = timerfd_gettime(timerfd, &remaining_time);
-	if(res < 0)
+	uint32_t active_clients = 0;
+	uint32_t jobs_in_flight = 0;
+	for(int i = 0; i < MAX_NUM_SHELL_CLIENTS; i++)
 	{
-		TPT_TRACE(TRACE_ERROR, "Failed to timerfd_gettime(), errno = %d!", errno);
-		return false;
+		if(clid_inst.clients[i].fd != -1)
+		{
+			active_clients++;
+			jobs_in_flight += clid_inst.clients[i].current_job_id != 0 ? 1 : 0;
+		}
 	}
 
-	TPT_TRACE(TRACE_INFO, "Job timer for timerfd %d will expire in: %ld.%ld seconds!", timerfd, remaining_time.it_value.tv_sec, remaining_time.it_value.tv_nsec / 1000000);
+	clid_inst.beacon.registry_version = clid_inst.registry_version;
+	clid_inst.beacon.active_clients = (uint16_t)active_clients;
+	clid_inst.beacon.jobs_in_flight = (uint16_t)jobs_in_flight;
 
-	if(remaining_time.it_value.tv_sec == 0 && remaining_time.it_value.tv_nsec == 0)
+	uint8_t buff[CLID_BEACON_MAX_SIZE];
+	size_t len = clid_beacon_encode(buff, &clid_inst.beacon);
+	if(sendto(clid_inst.beacon_fd, buff, len, MSG_DONTWAIT, (const struct sockaddr *)to, sizeof(struct sockaddr_in)) < 0)
 	{
-		return false;
+		TPT_TRACE(TRACE_ABN, "Failed to sendto() discovery beacon to %s:%hu, errno = %d!", inet_ntoa(to->sin_addr), ntohs(to->sin_port), errno);
 	}
-
-	return true;
 }
 
-static bool reassign_current_job_id(int sockfd, unsigned long long new_job_id)
+/* A probe gets the beacon back to its sender right away, so a starting shell sees the devices without waiting for broadcasts.
+A probe is padded to the largest beacon, answering it never sends more than was received */
+static void handle_receive_probe(void)
 {
-	struct shell_client **iter;
-	iter = tfind(&sockfd, &clid_inst.client_tree, compare_fd_in_client_tree);
-	if(iter == NULL)
+	for(int i = 0; i < CLID_MAX_PROBES_PER_ROUND; i++)
 	{
-		TPT_TRACE(TRACE_ABN, "This fd %d not found in client tree, something wrong!", sockfd);
-		return false;
-	}
-
-	(*iter)->current_job_id = new_job_id;
+		uint8_t buff[CLID_PROBE_SIZE];
+		struct sockaddr_in from;
+		socklen_t from_len = sizeof(struct sockaddr_in);
+		ssize_t res = recvfrom(clid_inst.beacon_fd, buff, sizeof(buff), 0, (struct sockaddr *)&from, &from_len);
+		if(res < 0)
+		{
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				TPT_TRACE(TRACE_ABN, "Failed to recvfrom() probe, errno = %d!", errno);
+			}
+			return;
+		}
 
-	return true;
+		if(clid_is_probe(buff, (size_t)res) && from_len == sizeof(struct sockaddr_in) && from.sin_family == AF_INET && is_probe_answered(&from))
+		{
+			send_beacon(&from);
+		}
+	}
 }
 
-static bool handle_receive_itc_msg(int mbox_fd)
+/* Only shells on the network of NET_INTERFACE_ETH0 get an answer, each source at most CLID_PROBE_RATE a second after a burst,
+so that nobody can have clid flood a spoofed source with beacons */
+static bool is_probe_answered(const struct sockaddr_in *from)
 {
-	(void)mbox_fd;
-	union itc_msg *msg;
-
-	msg = itc_receive(ITC_NO_WAIT);
-
-	if(msg == NULL)
+	if(((from->sin_addr.s_addr ^ clid_inst.tcp_addr.sin_addr.s_addr) & clid_inst.probe_mask.s_addr) != 0)
 	{
-		TPT_TRACE(TRACE_ERROR, "Fatal error, clid daemon received a NULL itc_msg!");
 		return false;
 	}
 
-	switch (msg->msgno)
+	struct probe_source *source = &clid_inst.probe_sources[ntohl(from->sin_addr.s_addr) % CLID_PROBE_SOURCES];
+	uint64_t now = get_time_ns();
+	uint64_t refills = (now - source->refill_ns) / (NSEC_PER_SEC / CLID_PROBE_RATE);
+	if(refills > 0)
 	{
-	case CMDIF_REG_CMD_REQUEST:
-		TPT_TRACE(TRACE_INFO, "Received CMDIF_REG_CMD_REQUEST mbox_id = 0x%08x", msg->cmdIfRegCmdRequest.mbox_id);
-		TPT_TRACE(TRACE_INFO, "Received CMDIF_REG_CMD_REQUEST cmd_name = %s", msg->cmdIfRegCmdRequest.cmd_name);
-		TPT_TRACE(TRACE_INFO, "Received CMDIF_REG_CMD_REQUEST cmd_desc = %s", msg->cmdIfRegCmdRequest.cmd_desc);
-		handle_receive_reg_cmd_request(msg);
-		break;
-
-	case CMDIF_DEREG_CMD_REQUEST:
-		TPT_TRACE(TRACE_INFO, "Received CMDIF_DEREG_CMD_REQUEST cmd_name = %s", msg->cmdIfDeregCmdRequest.cmd_name);
-		handle_receive_dereg_cmd_request(msg);
-		break;
-
-	case CMDIF_EXE_CMD_REPLY:
-		TPT_TRACE(TRACE_INFO, "Received CMDIF_EXE_CMD_REPLY output = %s", msg->cmdIfExeCmdReply.output);
-		handle_receive_exe_cmd_reply(msg);
-		break;
+		source->tokens = refills < CLID_PROBE_BURST - source->tokens ? source->tokens + (uint32_t)refills : CLID_PROBE_BURST;
+		source->refill_ns = now;
+	}
 
-	default:
-		TPT_TRACE(TRACE_ABN, "Received invalid message msgno = 0x%08x", msg->msgno);
-		break;
+	if(source->tokens == 0)
+	{
+		TPT_TRACE(TRACE_INFO, "Too many probes from %s, not answered!", inet_ntoa(from->sin_addr));
+		return false;
 	}
 
-	itc_free(&msg);
+	source->tokens--;
 	return true;
 }
 
-static bool handle_receive_reg_cmd_request(union itc_msg *msg)
+static void handle_beacon_timer_expired(void)
 {
-	struct command **iter;
-	iter = tfind(msg->cmdIfRegCmdRequest.cmd_name, &clid_inst.cmd_tree, compare_cmdname_in_cmd_tree);
-	if(iter != NULL)
+	uint64_t expirations;
+	if(read(clid_inst.beacon_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
 	{
-		TPT_TRACE(TRACE_ABN, "This cmdName %s already registered by mailbox id 0x%08x, something abnormal!", msg->cmdIfRegCmdRequest.cmd_name, (*iter)->mbox_id);
-		return true;
+		TPT_TRACE(TRACE_ABN, "Failed to read() beacon timer, errno = %d!", errno);
 	}
 
-	int i = 0;
-	for(; i < MAX_NUM_CMDS; i++)
-	{
-		if(clid_inst.cmds[i].cmd_name[0] == '\0')
-		{
-			clid_inst.cmds[i].mbox_id = msg->cmdIfRegCmdRequest.mbox_id;
-			strcpy(clid_inst.cmds[i].cmd_name, msg->cmdIfRegCmdRequest.cmd_name);
-			strcpy(clid_inst.cmds[i].cmd_desc, msg->cmdIfRegCmdRequest.cmd_desc);
-			tsearch(&clid_inst.cmds[i], &clid_inst.cmd_tree, compare_command_in_cmd_tree);
-			clid_inst.cmd_count++;
-			break;
-		}
-	}
+	send_beacon(&clid_inst.beacon_addr);
+}
 
-	if(i == MAX_NUM_CMDS)
+static bool setup_capture(const char *path)
+{
+	m_capture.file = fopen(path, "ab");
+	if(m_capture.file == NULL)
 	{
-		TPT_TRACE(TRACE_ERROR, "No more than %d cmdName is accepted to be registered!", MAX_NUM_CMDS);
+		TPT_TRACE(TRACE_ERROR, "Failed to open capture file %s, errno = %d!", path, errno);
 		return false;
 	}
 
-	return true;
-}
+	// Records are small and frequent, let stdio batch them into large writes instead of one syscall each
+	setvbuf(m_capture.file, NULL, _IOFBF, CLID_CAPTURE_BUFFER_SIZE);
 
-static bool handle_receive_dereg_cmd_request(union itc_msg *msg)
-{
-	struct command **iter;
-	iter = tfind(msg->cmdIfDeregCmdRequest.cmd_name, &clid_inst.cmd_tree, compare_cmdname_in_cmd_tree);
-	if(iter == NULL)
+	if(ftell(m_capture.file) == 0 && fwrite(CLID_CAPTURE_MAGIC, 1, CLID_CAPTURE_MAGIC_SIZE, m_capture.file) != CLID_CAPTURE_MAGIC_SIZE)
 	{
-		TPT_TRACE(TRACE_ABN, "This cmdName %s not registered yet, something wrong!", msg->cmdIfDeregCmdRequest.cmd_name);
-		return true;
+		TPT_TRACE(TRACE_ERROR, "Failed to write capture file header to %s!", path);
+		stop_capture();
+		return false;
 	}
 
-	(*iter)->mbox_id = ITC_NO_MBOX_ID;
-	(*iter)->cmd_name[0] = '\0';
-	(*iter)->cmd_desc[0] = '\0';
+	clock_gettime(CLOCK_MONOTONIC, &m_capture.start);
+	m_capture.is_paused = false;
+	m_capture.toggle_requested = 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint8_t wall_clock[CLID_CAP_VARINT64_MAX_SIZE];
+	size_t wall_clock_len = clid_cap_varint64_encode(wall_clock, (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+	capture_record(CLID_CAP_SESSION, 0, 0, wall_clock, wall_clock_len);
 
-	tdelete(*iter, &clid_inst.cmd_tree, compare_command_in_cmd_tree);
+	signal(SIGUSR1, capture_sig_handler);
 
+	TPT_TRACE(TRACE_INFO, "Capturing traffic into %s, send SIGUSR1 to pause/resume!", path);
 	return true;
 }
 
-static bool forward_exe_cmd_request(unsigned long long job_id, char *cmd_name, uint16_t num_args, uint32_t pl_len, char *pl)
+static void capture_sig_handler(int signo)
 {
-	struct command **iter;
-	iter = tfind(cmd_name, &clid_inst.cmd_tree, compare_cmdname_in_cmd_tree);
-	if(iter == NULL)
+	(void)signo;
+	// Only flag it here, the capture file is a stdio stream and is toggled from the main loop
+	m_capture.toggle_requested = 1;
+}
+
+static void handle_capture_toggle(void)
+{
+	m_capture.toggle_requested = 0;
+	if(m_capture.file == NULL)
 	{
-		TPT_TRACE(TRACE_ABN, "This cmdName %s not found in command tree, something abnormal!", cmd_name);
-		return true;
+		return;
 	}
 
-	union itc_msg* fwd = itc_alloc(offsetof(struct CmdIfExeCmdRequestS, payload) + pl_len, CMDIF_EXE_CMD_REQUEST);
-
-	// TPT_TRACE(TRACE_DEBUG, "fwd = 0x%016x", fwd);
-	// TPT_TRACE(TRACE_DEBUG, "job_id = 0x%016x", &(fwd->cmdIfExeCmdRequest.job_id));
-	// TPT_TRACE(TRACE_DEBUG, "cmd_name = 0x%016x", (unsigned long long)(fwd->cmdIfExeCmdRequest.cmd_name));
-	// TPT_TRACE(TRACE_DEBUG, "num_args = 0x%016x", &(fwd->cmdIfExeCmdRequest.num_args));
-	// TPT_TRACE(TRACE_DEBUG, "payloadLen = 0x%016x", &(fwd->cmdIfExeCmdRequest.payloadLen));
-	// TPT_TRACE(TRACE_DEBUG, "payload = 0x%016x", (unsigned long long)(fwd->cmdIfExeCmdRequest.payload));
-
-	fwd->cmdIfExeCmdRequest.job_id = job_id;
-	memset(fwd->cmdIfExeCmdRequest.cmd_name, 0, MAX_CMD_NAME_LENGTH);
-	strcpy(fwd->cmdIfExeCmdRequest.cmd_name, cmd_name);
-	fwd->cmdIfExeCmdRequest.num_args = num_args;
-	fwd->cmdIfExeCmdRequest.payloadLen = pl_len;
-	memcpy(fwd->cmdIfExeCmdRequest.payload, pl, pl_len);
-
-	if(!itc_send(&fwd, (*iter)->mbox_id, ITC_MY_MBOX_ID, NULL))
+	m_capture.is_paused = !m_capture.is_paused;
+	if(m_capture.is_paused)
 	{
-		TPT_TRACE(TRACE_ERROR, "Failed to send CMDIF_EXE_CMD_REQUEST for cmdName %s to mbox id 0x%08x", cmd_name, (*iter)->mbox_id);
-		return false;
+		fflush(m_capture.file);
 	}
 
-	TPT_TRACE(TRACE_INFO, "Forwarded CMDIF_EXE_CMD_REQUEST for cmdName %s to mbox id 0x%08x", cmd_name, (*iter)->mbox_id);
-	return true;
-
+	TPT_TRACE(TRACE_INFO, "Traffic capture %s!", m_capture.is_paused ? "paused" : "resumed");
 }
 
-static bool handle_receive_exe_cmd_reply(union itc_msg *msg)
+static void stop_capture(void)
 {
-	struct shell_client **iter;
-	iter = tfind(&(msg->cmdIfExeCmdReply.job_id), &clid_inst.client_tree, compare_jobid_in_client_tree);
-	if(iter == NULL)
+	if(m_capture.file != NULL)
 	{
-		// There are some potential situation:
-		// 1. Job timer was already expired
-		// 2. Shell client pressed Ctrl-C to cancel the previous job execution
-		// 3. Shell client was disconnected
-		// -> Suggest to check log's flow to see what is the reason
-
-		TPT_TRACE(TRACE_ABN, "Received CMDIF_EXE_CMD_REPLY, job_id = %d, which is not valid anymore, something wrong!", msg->cmdIfExeCmdReply.job_id);
-		return true;
+		fclose(m_capture.file);
+		m_capture.file = NULL;
 	}
+}
 
-	if(!send_exe_cmd_reply((*iter)->fd, msg->cmdIfExeCmdReply.result, msg->cmdIfExeCmdReply.output))
+static bool capture_begin(uint8_t kind, int conn, unsigned long long job_id, uint32_t body_length)
+{
+	if(m_capture.file == NULL || m_capture.is_paused)
 	{
 		return false;
 	}
 
-	// Done this job execution, stop the respective job timer and unset current_job_id.
-	if((*iter)->job_timer_fd != -1 && !set_time_job_timer((*iter)->job_timer_fd, 0))
+	if(ferror(m_capture.file))
 	{
-		TPT_TRACE(TRACE_ERROR, "Could not stop job timer fd = %d!", (*iter)->job_timer_fd);
+		// Never let a full disk take the daemon down, just stop capturing
+		TPT_TRACE(TRACE_ERROR, "Failed to write to capture file, stop capturing!");
+		stop_capture();
 		return false;
 	}
 
-	(*iter)->current_job_id = 0;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t time_us = (uint64_t)(now.tv_sec - m_capture.start.tv_sec) * 1000000 + (now.tv_nsec - m_capture.start.tv_nsec) / 1000;
+
+	uint8_t header[CLID_CAP_MAX_HEADER_SIZE];
+	size_t header_len = clid_cap_encode_header(header, kind, time_us, conn < 0 ? 0 : (uint32_t)conn, job_id, body_length);
+	capture_append(header, header_len);
 
 	return true;
 }
 
-static bool handle_job_timer_expired(int timerfd)
+static void capture_append(const void *data, size_t len)
 {
-	struct shell_client **iter;
-	iter = tfind(&timerfd, &clid_inst.client_tree, compare_timerfd_in_client_tree);
-	if(iter == NULL)
+	if(len > 0)
 	{
-		TPT_TRACE(TRACE_ABN, "Job timer fd = %d not found in client tree, something wrong!", timerfd);
-		return true;
+		fwrite(data, 1, len, m_capture.file);
 	}
+}
 
-	char *output = "Expired!";
-	if(!send_exe_cmd_reply((*iter)->fd, (uint32_t)CMDIF_RET_FAIL, output))
+static void capture_record(uint8_t kind, int conn, unsigned long long job_id, const void *body, uint32_t body_length)
+{
+	if(capture_begin(kind, conn, job_id, body_length))
 	{
-		return false;
+		capture_append(body, body_length);
 	}
+}
+
+
+
+
+
+
+
+
+
+
 
-	(*iter)->current_job_id = 0;
 
-	return true;
-}
 
 
 
@@ -1185,14 +3754,127 @@ static bool handle_job_timer_expired(int timerfd)
 
 
 
+static uint64_t get_time_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static bool setup_trace(const char *path, uint32_t sample_period)
+{
+	m_trace.spans = malloc(CLID_MAX_TRACE_SPANS * sizeof(struct job_span));
+	if(m_trace.spans == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to malloc trace spans!");
+		return false;
+	}
 
+	m_trace.path = path;
+	m_trace.sample_period = sample_period;
+	m_trace.next = 0;
+	m_trace.count = 0;
+	m_trace.dump_requested = 0;
 
+	signal(SIGUSR2, trace_sig_handler);
 
+	TPT_TRACE(TRACE_INFO, "Sampling one job out of %u, send SIGUSR2 to write the last %d spans to %s!", sample_period, CLID_MAX_TRACE_SPANS, path);
+	return true;
+}
+
+static void trace_sig_handler(int signo)
+{
+	(void)signo;
+	m_trace.dump_requested = 1;
+}
+
+static void record_job_span(const struct shell_client *client, const struct CmdIfExeCmdTimedReplyS *reply, uint64_t replied_ns, uint64_t relayed_ns)
+{
+	// Oldest spans get overwritten, a dump always shows the most recent ones
+	struct job_span *span = &m_trace.spans[m_trace.next];
+	m_trace.next = (m_trace.next + 1) % CLID_MAX_TRACE_SPANS;
+	m_trace.count = MIN_OF(m_trace.count + 1, CLID_MAX_TRACE_SPANS);
+
+	span->job_id = client->current_job_id;
+	span->fd = client->fd;
+	memcpy(span->cmd_name, client->job_cmd_name, MAX_CMD_NAME_LENGTH);
+	span->result = reply->result;
+	span->received_ns = client->job_received_ns;
+	span->forwarded_ns = client->job_forwarded_ns;
+	span->replied_ns = replied_ns;
+	span->relayed_ns = relayed_ns;
+	span->cmdif_queue_ns = reply->startedNs > reply->receivedNs ? reply->startedNs - reply->receivedNs : 0;
+	span->handler_ns = reply->doneNs > reply->startedNs ? reply->doneNs - reply->startedNs : 0;
+}
 
+static void dump_trace(void)
+{
+	if(m_trace.spans == NULL)
+	{
+		return;
+	}
 
+	FILE *file = fopen(m_trace.path, "w");
+	if(file == NULL)
+	{
+		TPT_TRACE(TRACE_ERROR, "Failed to open trace file %s, errno = %d!", m_trace.path, errno);
+		return;
+	}
 
+	// One row (tid) per shell connection, each job is a span with its hops nested below it
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"clid\"}}", (int)getpid());
+
+	size_t first = (m_trace.next + CLID_MAX_TRACE_SPANS - m_trace.count) % CLID_MAX_TRACE_SPANS;
+	for(size_t i = 0; i < m_trace.count; i++)
+	{
+		const struct job_span *span = &m_trace.spans[(first + i) % CLID_MAX_TRACE_SPANS];
+
+		// cmdif ran on the handler's clock, place it in the middle of the ITC round trip, as if both ways took equally long
+		uint64_t round_trip_ns = span->replied_ns - span->forwarded_ns;
+		uint64_t cmdif_ns = MIN_OF(span->cmdif_queue_ns + span->handler_ns, round_trip_ns);
+		uint64_t cmdif_queue_ns = MIN_OF(span->cmdif_queue_ns, cmdif_ns);
+		uint64_t cmdif_received_ns = span->forwarded_ns + (round_trip_ns - cmdif_ns) / 2;
+		uint64_t handler_started_ns = cmdif_received_ns + cmdif_queue_ns;
+		uint64_t handler_done_ns = cmdif_received_ns + cmdif_ns;
+
+		char name[MAX_CMD_NAME_LENGTH + 64];
+		snprintf(name, sizeof(name), "%s (job %llu, result %u)", span->cmd_name, span->job_id, span->result);
+		write_trace_event(file, name, span->fd, span->received_ns, span->relayed_ns);
+		write_trace_event(file, "clid queue", span->fd, span->received_ns, span->forwarded_ns);
+		write_trace_event(file, "itc to handler", span->fd, span->forwarded_ns, cmdif_received_ns);
+		write_trace_event(file, "cmdif queue", span->fd, cmdif_received_ns, handler_started_ns);
+		write_trace_event(file, "handler", span->fd, handler_started_ns, handler_done_ns);
+		write_trace_event(file, "itc to clid", span->fd, handler_done_ns, span->replied_ns);
+		write_trace_event(file, "clid relay", span->fd, span->replied_ns, span->relayed_ns);
+	}
 
+	fprintf(file, "\n]}\n");
+	fclose(file);
 
+	TPT_TRACE(TRACE_INFO, "Wrote %zu job spans to %s!", m_trace.count, m_trace.path);
+}
 
+static void write_trace_event(FILE *file, const char *name, int tid, uint64_t begin_ns, uint64_t end_ns)
+{
+	// Always preceded by the process_name metadata event
+	fprintf(file, ",\n{\"name\":\"");
 
+	// Command names come from the handlers, keep the JSON valid whatever they contain
+	for(const char *c = name; *c != '\0'; c++)
+	{
+		if(*c == '"' || *c == '\\')
+		{
+			fprintf(file, "\\%c", *c);
+		} else if((unsigned char)*c < 0x20)
+		{
+			fprintf(file, "\\u%04x", *c);
+		} else
+		{
+			fputc(*c, file);
+		}
+	}
 
+	fprintf(file, "\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+		(int)getpid(), tid, (double)begin_ns / NSEC_PER_USEC, (double)(end_ns > begin_ns ? end_ns - begin_ns : 0) / NSEC_PER_USEC);
+}
@@ -0,0 +1,140 @@
+#include <iostream>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+
+#include <itc.h>
+#include <itcPubSubIf.h>
+#include <eventLoopIf.h>
+#include <traceIf.h>
+#include <stringUtils.h>
+
+#include "cli-daemon-tpt-provider.h"
+#include "cmdJobIf.h"
+#include "cmdRegisterIf.h"
+#include "cmdTableIf.h"
+#include "cmdTypesIf.h"
+
+using namespace CmdIf::V1;
+using namespace CommonUtils::V1::StringUtils;
+
+/* Synthetic command handler for clidbench: "bench <outputSize> [ <workUs> ]" answers with outputSize bytes
+after spinning workUs microseconds, to emulate a handler of known cost without any real work behind it. */
+
+CmdTypesIf::CmdResultCode handleBench(const std::vector<std::string>& arguments, std::ostringstream& outputStream);
+CmdTypesIf::CmdResultCode handleBenchHelp(const std::vector<std::string>& arguments, std::ostringstream& outputStream);
+void benchCmdHandler(const std::shared_ptr<CmdIf::V1::CmdJobIf>& job);
+void atexit_handler();
+
+itc_mbox_id_t m_benchHandlerMboxId { ITC_NO_MBOX_ID };
+
+const std::string BENCH_CMD { "bench" };
+const std::string m_cmdDesc { "Synthetic command for clidbench, replies with a given output size after a given busy time" };
+constexpr uint32_t MAX_OUTPUT_SIZE { 16 * 1024 * 1024 };
+std::vector<CmdTypesIf::CmdDefinition> m_benchCmdDefinitions {
+	{
+		"bench <outputSize> [ <workUs> ]",
+		{
+			std::bind(&handleBench, std::placeholders::_1, std::placeholders::_2),
+			"handleBench"
+		},
+		"Reply with <outputSize> bytes of output after spinning <workUs> microseconds (default 0)"
+	},
+	{
+		"bench { help | --help | -h }",
+		{
+			std::bind(&handleBenchHelp, std::placeholders::_1, std::placeholders::_2),
+			"handleBenchHelp"
+		},
+		"Print this help!"
+	}
+};
+
+int main()
+{
+	if(itc_init(3, ITC_MALLOC, 0) == false)
+	{
+		TPT_TRACE(TRACE_ERROR, SSTR("Failed to itc_init() by benchHandler!"));
+		return false;
+	}
+
+	m_benchHandlerMboxId = itc_create_mailbox("benchHandlerMailbox", ITC_NO_NAMESPACE);
+	if(m_benchHandlerMboxId == ITC_NO_MBOX_ID)
+	{
+		TPT_TRACE(TRACE_ERROR, SSTR("Failed to create mailbox \"benchHandlerMailbox\"!"));
+		return false;
+	}
+
+	std::atexit(atexit_handler);
+
+	UtilsFramework::ItcPubSub::V1::IItcPubSub::getThreadLocalInstance().addItcFd(itc_get_fd());
+	CmdTableIf::getInstance().registerCmdTable(BENCH_CMD, m_benchCmdDefinitions);
+	CmdRegisterIf::getInstance().registerCmdHandler(BENCH_CMD, m_cmdDesc, std::bind(&benchCmdHandler, std::placeholders::_1));
+
+	UtilsFramework::EventLoop::V1::IEventLoop::getThreadLocalInstance().run();
+
+	return 0;
+}
+
+CmdTypesIf::CmdResultCode handleBench(const std::vector<std::string>& arguments, std::ostringstream& outputStream)
+{
+	if(arguments.size() != 2 && arguments.size() != 3)
+	{
+		return handleBenchHelp(arguments, outputStream);
+	}
+
+	auto outputSize = stringToIntegralType<uint32_t>(arguments[1]);
+	if(!outputSize.has_value() || outputSize.value() > MAX_OUTPUT_SIZE)
+	{
+		outputStream << "Invalid \"<outputSize>\" parameter: " << arguments[1] << "\n";
+		return CmdTypesIf::CmdResultCode::CMD_RET_FAIL;
+	}
+
+	uint32_t workUs = 0;
+	if(arguments.size() == 3)
+	{
+		auto work = stringToIntegralType<uint32_t>(arguments[2]);
+		if(!work.has_value())
+		{
+			outputStream << "Invalid \"<workUs>\" parameter: " << arguments[2] << "\n";
+			return CmdTypesIf::CmdResultCode::CMD_RET_FAIL;
+		}
+		workUs = work.value();
+	}
+
+	// Busy-wait rather than sleep, a real handler occupies this thread for the whole time as well
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(workUs);
+	while(std::chrono::steady_clock::now() < deadline)
+	{
+	}
+
+	outputStream << std::string(outputSize.value(), 'x');
+
+	return CmdTypesIf::CmdResultCode::CMD_RET_SUCCESS;
+}
+
+CmdTypesIf::CmdResultCode handleBenchHelp(const std::vector<std::string>& arguments, std::ostringstream& outputStream)
+{
+	(void)arguments;
+	CmdTableIf::getInstance().printCmdHelp(m_benchCmdDefinitions, outputStream);
+
+	return CmdTypesIf::CmdResultCode::CMD_RET_INVALID_ARGS;
+}
+
+void benchCmdHandler(const std::shared_ptr<CmdIf::V1::CmdJobIf>& job)
+{
+	CmdTypesIf::CmdResultCode res = CmdTableIf::getInstance().executeCmd(job->getArguments(), job->getOutputStream());
+	job->done(res);
+}
+
+void atexit_handler()
+{
+	UtilsFramework::EventLoop::V1::IEventLoop::getThreadLocalInstance().stop();
+
+	itc_delete_mailbox(m_benchHandlerMboxId);
+	itc_exit();
+}
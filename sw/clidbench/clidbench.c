@@ -0,0 +1,1049 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "tcp_proto.h"
+#include "tcp_proto_v2.h"
+
+
+/*
+*  clidbench opens N concurrent shell-like connections to a running clid, then drives a weighted mix of
+*  commands against it, either as fast as possible (closed loop, one outstanding request per connection)
+*  or at a fixed arrival rate (open loop). In open loop, latency is measured from the moment a request
+*  was supposed to be sent, so a stalled clid is not hidden by the generator backing off.
+*  Use it together with benchHandler (see README.md) or any other application registering commands.
+*/
+
+
+/*****************************************************************************\/
+*****                           INTERNAL TYPES                             *****
+*******************************************************************************/
+#define TCP_CLID_PORT		33333
+#define MAX_NUM_CONNECTIONS	4096
+#define MAX_NUM_CMD_MIX		32
+#define MAX_NUM_ARGS		32
+#define MAX_READLINE_LENGTH	1024
+#define CMD_EXECUTION_TIMEOUT	30 // seconds
+#define RX_CHUNK		4096
+#define MAX_PENDING_ARRIVALS	(1 << 20)
+#define MAX_EPOLL_EVENTS	256
+#define NSEC_PER_SEC		1000000000ULL
+#define NSEC_PER_MSEC		1000000ULL
+#define NSEC_PER_USEC		1000ULL
+
+/* Log-linear latency histogram: exact below 2^HIST_SUB_BITS ns, then 2^(HIST_SUB_BITS-1) buckets per power of two (< 1% error) */
+#define HIST_SUB_BITS		7
+#define HIST_NUM_BUCKETS	((1 << HIST_SUB_BITS) + (64 - HIST_SUB_BITS) * (1 << (HIST_SUB_BITS - 1)))
+
+struct latency_histogram {
+	uint64_t	counts[HIST_NUM_BUCKETS];
+	uint64_t	total;
+	uint64_t	min;
+	uint64_t	max;
+	long double	sum;
+};
+
+struct cmd_mix_entry {
+	char		line[MAX_READLINE_LENGTH];
+	uint32_t	weight;
+	bool		is_bulk; // Sent with CLID_V2_FLAG_BULK, v2 connections only
+	uint8_t		*v1_frame; // Whole request, sent as is
+	size_t		v1_len;
+	uint8_t		*v2_payload; // Payload only, header depends on request_id
+	size_t		v2_len;
+	uint64_t	completed;
+	uint64_t	failed;
+	struct latency_histogram histogram; // Per command, to compare interactive and bulk latency
+};
+
+struct bench_conn {
+	int		fd;
+	uint8_t		proto;
+	bool		busy;
+	uint32_t	request_id;
+	int		cmd_idx;
+	uint64_t	intended_ns; // When this request should have been sent
+	uint64_t	sent_ns;
+	bool		is_first_fragment;
+	uint32_t	errorcode;
+	uint32_t	result;
+	uint8_t		*rx_buff;
+	size_t		rx_len;
+	size_t		rx_cap;
+};
+
+struct bench_config {
+	char		ip[INET_ADDRSTRLEN];
+	uint16_t	port;
+	int		nr_conns;
+	double		rate; // req/s over all connections, 0 means closed loop
+	bool		is_poisson;
+	uint64_t	duration_ns;
+	uint64_t	warmup_ns;
+	uint64_t	timeout_ns;
+	uint8_t		proto; // Highest version to offer
+	uint64_t	seed;
+};
+
+
+/*****************************************************************************\/
+*****                         INTERNAL VARIABLES                           *****
+*******************************************************************************/
+static volatile bool m_is_sigint = false;
+static struct bench_config m_config = {
+	.ip		= "127.0.0.1",
+	.port		= TCP_CLID_PORT,
+	.nr_conns	= 16,
+	.rate		= 0,
+	.is_poisson	= true,
+	.duration_ns	= 10 * NSEC_PER_SEC,
+	.warmup_ns	= 1 * NSEC_PER_SEC,
+	.timeout_ns	= CMD_EXECUTION_TIMEOUT * NSEC_PER_SEC,
+	.proto		= CLID_PROTO_V2,
+	.seed		= 0
+};
+static struct cmd_mix_entry m_cmd_mix[MAX_NUM_CMD_MIX];
+static int m_nr_cmd_mix = 0;
+static uint32_t m_total_weight = 0;
+static struct bench_conn m_conns[MAX_NUM_CONNECTIONS];
+static int m_idle_conns[MAX_NUM_CONNECTIONS];
+static int m_nr_idle_conns = 0;
+static int m_nr_alive_conns = 0;
+static uint64_t *m_pending_arrivals = NULL; // Ring of intended send times waiting for an idle connection
+static size_t m_pending_head = 0;
+static size_t m_pending_count = 0;
+static struct latency_histogram m_histogram;
+static uint64_t m_rng_state;
+static uint64_t m_measure_start_ns = 0;
+static uint64_t m_nr_sent = 0;
+static uint64_t m_nr_completed = 0;
+static uint64_t m_nr_failed = 0;
+static uint64_t m_nr_timeouts = 0;
+static uint64_t m_nr_dropped_arrivals = 0;
+static uint64_t m_nr_lost_conns = 0;
+
+
+/*****************************************************************************\/
+*****                    INTERNAL FUNCTIONS PROTOTYPES                     *****
+*******************************************************************************/
+static void sigint_handler(int sig_no);
+static void print_usage(const char *prog);
+static bool parse_arguments(int argc, char **argv);
+static bool add_cmd_mix_entry(const char *spec, bool is_bulk);
+static bool encode_cmd_mix_entry(struct cmd_mix_entry *entry);
+static uint64_t get_time_ns(void);
+static uint64_t next_random(void);
+static uint64_t next_interarrival_ns(void);
+static int pick_cmd_idx(void);
+static bool connect_bench_conn(struct bench_conn *conn, int epfd);
+static uint8_t negotiate_protocol_version(int sockfd);
+static int send_data(int sockfd, const void *tx_buff, size_t nr_bytes_to_send);
+static int recv_data(int sockfd, void *rx_buff, size_t nr_bytes_to_read, int timeout_ms);
+static void close_bench_conn(struct bench_conn *conn);
+static bool send_request(struct bench_conn *conn, uint64_t intended_ns);
+static bool handle_readable(struct bench_conn *conn, uint64_t now);
+static int decode_v1_reply(struct bench_conn *conn, const uint8_t *buff, size_t len, bool *is_done);
+static int decode_v2_reply(struct bench_conn *conn, const uint8_t *buff, size_t len, bool *is_done);
+static void complete_request(struct bench_conn *conn, uint64_t now);
+static void check_timeouts(uint64_t now);
+static bool push_pending_arrival(uint64_t intended_ns);
+static void dispatch_pending_arrivals(void);
+static void histogram_record(struct latency_histogram *hist, uint64_t value);
+static uint64_t histogram_percentile(const struct latency_histogram *hist, double percentile);
+static void print_report(uint64_t elapsed_ns);
+
+
+/*****************************************************************************\/
+*****                       PUBLIC FUNCTIONS IMPLEMENTATION                *****
+*******************************************************************************/
+int main(int argc, char **argv)
+{
+	if(!parse_arguments(argc, argv))
+	{
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGINT, sigint_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	m_rng_state = m_config.seed ? m_config.seed : (get_time_ns() | 1);
+
+	m_pending_arrivals = malloc(MAX_PENDING_ARRIVALS * sizeof(uint64_t));
+	if(m_pending_arrivals == NULL)
+	{
+		printf("Failed to malloc pending arrivals queue!\n");
+		return EXIT_FAILURE;
+	}
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0)
+	{
+		printf("Failed to epoll_create1(), errno = %d!\n", errno);
+		return EXIT_FAILURE;
+	}
+
+	for(int i = 0; i < m_config.nr_conns; i++)
+	{
+		if(!connect_bench_conn(&m_conns[i], epfd))
+		{
+			printf("Failed to open connection %d to tcp://%s:%hu!\n", i, m_config.ip, m_config.port);
+			return EXIT_FAILURE;
+		}
+
+		m_idle_conns[m_nr_idle_conns++] = i;
+		m_nr_alive_conns++;
+	}
+
+	printf("clidbench: %d connections to tcp://%s:%hu, protocol v%hhu, ", m_config.nr_conns, m_config.ip, m_config.port, m_conns[0].proto);
+	if(m_config.rate > 0)
+	{
+		printf("open loop at %.1f req/s (%s)", m_config.rate, m_config.is_poisson ? "poisson" : "fixed");
+	} else
+	{
+		printf("closed loop");
+	}
+	printf(", %.1f s (+%.1f s warmup)\n", (double)m_config.duration_ns / NSEC_PER_SEC, (double)m_config.warmup_ns / NSEC_PER_SEC);
+
+	uint64_t start_ns = get_time_ns();
+	uint64_t end_ns = start_ns + m_config.warmup_ns + m_config.duration_ns;
+	uint64_t next_arrival_ns = start_ns;
+	uint64_t next_timeout_check_ns = start_ns;
+	m_measure_start_ns = start_ns + m_config.warmup_ns;
+	m_histogram.min = UINT64_MAX;
+
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	uint64_t now = start_ns;
+	while(!m_is_sigint && now < end_ns && m_nr_alive_conns > 0)
+	{
+		if(m_config.rate > 0)
+		{
+			while(next_arrival_ns <= now)
+			{
+				push_pending_arrival(next_arrival_ns);
+				next_arrival_ns += next_interarrival_ns();
+			}
+		} else
+		{
+			// Closed loop, every idle connection immediately gets its next request
+			while(m_nr_idle_conns > 0 && m_pending_count < (size_t)m_nr_idle_conns)
+			{
+				push_pending_arrival(now);
+			}
+		}
+
+		dispatch_pending_arrivals();
+
+		int timeout_ms = 1;
+		if(m_config.rate > 0 && next_arrival_ns > now)
+		{
+			timeout_ms = (int)((next_arrival_ns - now) / NSEC_PER_MSEC);
+		}
+
+		int nr_events = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, timeout_ms);
+		if(nr_events < 0 && errno != EINTR)
+		{
+			printf("Failed to epoll_wait(), errno = %d!\n", errno);
+			break;
+		}
+
+		now = get_time_ns();
+		for(int i = 0; i < nr_events; i++)
+		{
+			struct bench_conn *conn = &m_conns[events[i].data.u32];
+			if(!handle_readable(conn, now))
+			{
+				close_bench_conn(conn);
+			}
+		}
+
+		if(now >= next_timeout_check_ns)
+		{
+			check_timeouts(now);
+			next_timeout_check_ns = now + 10 * NSEC_PER_MSEC;
+		}
+	}
+
+	print_report(now > m_measure_start_ns ? now - m_measure_start_ns : 0);
+
+	for(int i = 0; i < m_config.nr_conns; i++)
+	{
+		close_bench_conn(&m_conns[i]);
+	}
+
+	for(int i = 0; i < m_nr_cmd_mix; i++)
+	{
+		free(m_cmd_mix[i].v1_frame);
+		free(m_cmd_mix[i].v2_payload);
+	}
+
+	free(m_pending_arrivals);
+	close(epfd);
+
+	return EXIT_SUCCESS;
+}
+
+
+/*****************************************************************************\/
+*****                      INTERNAL FUNCTIONS IMPLEMENTATION               *****
+*******************************************************************************/
+static void sigint_handler(int sig_no)
+{
+	(void)sig_no;
+	m_is_sigint = true;
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [options] -m \"<weight>:<cmd> [args]\" [-m ...]\n", prog);
+	printf("\t-i <ip>\t\tclid address (default 127.0.0.1)\n");
+	printf("\t-p <port>\tclid port (default %d)\n", TCP_CLID_PORT);
+	printf("\t-c <conns>\tnumber of concurrent connections (default 16, max %d)\n", MAX_NUM_CONNECTIONS);
+	printf("\t-r <rate>\ttotal arrival rate in req/s, 0 runs closed loop as fast as possible (default 0)\n");
+	printf("\t-f\t\tfixed inter-arrival time instead of poisson arrivals\n");
+	printf("\t-d <seconds>\tmeasured duration (default 10)\n");
+	printf("\t-w <seconds>\twarmup, not included in the results (default 1)\n");
+	printf("\t-t <ms>\t\tper request timeout (default %d000)\n", CMD_EXECUTION_TIMEOUT);
+	printf("\t-P <1|2>\thighest protocol version to offer (default %d)\n", CLID_PROTO_V2);
+	printf("\t-s <seed>\trandom seed for command mix and arrivals\n");
+	printf("\t-m <spec>\tadd a command with a relative weight, e.g. -m \"80:bench 16\" -m \"20:bench 65536 100\"\n");
+	printf("\t-B <spec>\tsame as -m, but ask clid to run it in the bulk priority class (protocol v2 only)\n");
+}
+
+static bool parse_arguments(int argc, char **argv)
+{
+	int opt;
+	while((opt = getopt(argc, argv, "i:p:c:r:fd:w:t:P:s:m:B:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			if(inet_pton(AF_INET, optarg, &(struct in_addr){0}) != 1)
+			{
+				printf("Invalid IPv4 address \"%s\"!\n", optarg);
+				return false;
+			}
+			snprintf(m_config.ip, sizeof(m_config.ip), "%s", optarg);
+			break;
+
+		case 'p':
+			m_config.port = (uint16_t)strtoul(optarg, NULL, 10);
+			break;
+
+		case 'c':
+			m_config.nr_conns = atoi(optarg);
+			if(m_config.nr_conns <= 0 || m_config.nr_conns > MAX_NUM_CONNECTIONS)
+			{
+				printf("Number of connections must be in 1..%d!\n", MAX_NUM_CONNECTIONS);
+				return false;
+			}
+			break;
+
+		case 'r':
+			m_config.rate = strtod(optarg, NULL);
+			break;
+
+		case 'f':
+			m_config.is_poisson = false;
+			break;
+
+		case 'd':
+			m_config.duration_ns = (uint64_t)(strtod(optarg, NULL) * NSEC_PER_SEC);
+			break;
+
+		case 'w':
+			m_config.warmup_ns = (uint64_t)(strtod(optarg, NULL) * NSEC_PER_SEC);
+			break;
+
+		case 't':
+			m_config.timeout_ns = strtoull(optarg, NULL, 10) * NSEC_PER_MSEC;
+			break;
+
+		case 'P':
+			m_config.proto = (uint8_t)atoi(optarg);
+			if(m_config.proto != CLID_PROTO_V1 && m_config.proto != CLID_PROTO_V2)
+			{
+				printf("Unsupported protocol version %hhu!\n", m_config.proto);
+				return false;
+			}
+			break;
+
+		case 's':
+			m_config.seed = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'm':
+		case 'B':
+			if(!add_cmd_mix_entry(optarg, opt == 'B'))
+			{
+				return false;
+			}
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	if(m_nr_cmd_mix == 0)
+	{
+		printf("At least one command must be given with -m!\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool add_cmd_mix_entry(const char *spec, bool is_bulk)
+{
+	if(m_nr_cmd_mix == MAX_NUM_CMD_MIX)
+	{
+		printf("No more than %d commands can be mixed!\n", MAX_NUM_CMD_MIX);
+		return false;
+	}
+
+	struct cmd_mix_entry *entry = &m_cmd_mix[m_nr_cmd_mix];
+	const char *line = spec;
+	char *colon = strchr(spec, ':');
+	entry->weight = 1;
+	if(colon != NULL)
+	{
+		char *end;
+		unsigned long weight = strtoul(spec, &end, 10);
+		if(end == colon)
+		{
+			entry->weight = (uint32_t)weight;
+			line = colon + 1;
+		}
+	}
+
+	if(entry->weight == 0)
+	{
+		printf("Command \"%s\" has zero weight, skip it!\n", line);
+		return true;
+	}
+
+	snprintf(entry->line, sizeof(entry->line), "%s", line);
+	entry->is_bulk = is_bulk;
+	memset(&entry->histogram, 0, sizeof(entry->histogram));
+	entry->histogram.min = UINT64_MAX;
+	if(!encode_cmd_mix_entry(entry))
+	{
+		return false;
+	}
+
+	m_total_weight += entry->weight;
+	m_nr_cmd_mix++;
+	return true;
+}
+
+/* Encode the request once for both protocol versions, so that the hot path only copies bytes */
+static bool encode_cmd_mix_entry(struct cmd_mix_entry *entry)
+{
+	char tokens[MAX_READLINE_LENGTH];
+	char *args[MAX_NUM_ARGS];
+	int nr_args = 0;
+	char *saveptr = NULL;
+
+	snprintf(tokens, sizeof(tokens), "%s", entry->line);
+	for(char *tok = strtok_r(tokens, " \t", &saveptr); tok != NULL; tok = strtok_r(NULL, " \t", &saveptr))
+	{
+		if(nr_args == MAX_NUM_ARGS)
+		{
+			printf("Command \"%s\" has more than %d arguments!\n", entry->line, MAX_NUM_ARGS);
+			return false;
+		}
+		args[nr_args++] = tok;
+	}
+
+	if(nr_args == 0)
+	{
+		printf("Empty command in command mix!\n");
+		return false;
+	}
+
+	/* v1: cmd_name + num_args + series of NUL-terminated args, see struct clid_exe_cmd_request */
+	size_t total_len = strlen(args[0]) + 1 + sizeof(uint16_t);
+	for(int i = 0; i < nr_args; i++)
+	{
+		total_len += strlen(args[i]) + 1;
+	}
+
+	entry->v1_len = offsetof(struct ethtcp_msg, payload) + offsetof(struct clid_exe_cmd_request, payload) + total_len;
+	struct ethtcp_msg *req = malloc(entry->v1_len);
+	if(req == NULL)
+	{
+		printf("Failed to malloc v1 request!\n");
+		return false;
+	}
+
+	req->header.sender 					= htonl((uint32_t)getpid());
+	req->header.receiver 					= htonl(CLID_V1_RECEIVER);
+	req->header.protRev 					= htonl(CLID_V1_PROT_REV);
+	req->header.msgno 					= htonl(CLID_EXE_CMD_REQUEST);
+	req->header.payloadLen 					= htonl(offsetof(struct clid_exe_cmd_request, payload) + total_len);
+
+	req->payload.clid_exe_cmd_request.errorcode		= htonl(CLID_STATUS_OK);
+	req->payload.clid_exe_cmd_request.timeout		= htonl(CMD_EXECUTION_TIMEOUT);
+	req->payload.clid_exe_cmd_request.payload_length	= htonl(total_len);
+
+	char *pos = req->payload.clid_exe_cmd_request.payload;
+	strcpy(pos, args[0]);
+	pos += strlen(args[0]) + 1;
+	uint16_t num_args = (uint16_t)nr_args;
+	memcpy(pos, &num_args, sizeof(uint16_t));
+	pos += sizeof(uint16_t);
+	for(int i = 0; i < nr_args; i++)
+	{
+		strcpy(pos, args[i]);
+		pos += strlen(args[i]) + 1;
+	}
+	entry->v1_frame = (uint8_t *)req;
+
+	/* v2: timeout + num_args + length-prefixed args, see tcp_proto_v2.h */
+	size_t cap = 2 * CLID_VARINT_MAX_SIZE;
+	for(int i = 0; i < nr_args; i++)
+	{
+		cap += CLID_VARINT_MAX_SIZE + strlen(args[i]);
+	}
+
+	entry->v2_payload = malloc(cap);
+	if(entry->v2_payload == NULL)
+	{
+		printf("Failed to malloc v2 request!\n");
+		return false;
+	}
+
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, entry->v2_payload, cap);
+	clid_v2_write_varint(&writer, CMD_EXECUTION_TIMEOUT);
+	clid_v2_write_varint(&writer, nr_args);
+	for(int i = 0; i < nr_args; i++)
+	{
+		clid_v2_write_string(&writer, args[i], strlen(args[i]));
+	}
+	entry->v2_len = writer.len;
+
+	return true;
+}
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* xorshift64*, good enough for picking commands and arrival times */
+static uint64_t next_random(void)
+{
+	m_rng_state ^= m_rng_state >> 12;
+	m_rng_state ^= m_rng_state << 25;
+	m_rng_state ^= m_rng_state >> 27;
+	return m_rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t next_interarrival_ns(void)
+{
+	double mean_ns = NSEC_PER_SEC / m_config.rate;
+	if(!m_config.is_poisson)
+	{
+		return mean_ns < 1 ? 1 : (uint64_t)mean_ns;
+	}
+
+	// Uniform in (0, 1], then exponentially distributed gap
+	double u = ((next_random() >> 11) + 1) * (1.0 / 9007199254740992.0);
+	uint64_t gap = (uint64_t)(-log(u) * mean_ns);
+	return gap ? gap : 1;
+}
+
+static int pick_cmd_idx(void)
+{
+	uint32_t pick = (uint32_t)(next_random() % m_total_weight);
+	for(int i = 0; i < m_nr_cmd_mix; i++)
+	{
+		if(pick < m_cmd_mix[i].weight)
+		{
+			return i;
+		}
+		pick -= m_cmd_mix[i].weight;
+	}
+
+	return m_nr_cmd_mix - 1;
+}
+
+static bool connect_bench_conn(struct bench_conn *conn, int epfd)
+{
+	memset(conn, 0, sizeof(struct bench_conn));
+	conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(conn->fd < 0)
+	{
+		printf("Failed to create socket, errno = %d!\n", errno);
+		return false;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(m_config.port);
+	inet_pton(AF_INET, m_config.ip, &addr.sin_addr);
+
+	if(connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		printf("Failed to connect, errno = %d!\n", errno);
+		close(conn->fd);
+		conn->fd = -1;
+		return false;
+	}
+
+	int one = 1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	conn->proto = m_config.proto == CLID_PROTO_V2 ? negotiate_protocol_version(conn->fd) : CLID_PROTO_V1;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u32 = (uint32_t)(conn - m_conns);
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0)
+	{
+		printf("Failed to add fd %d to epoll, errno = %d!\n", conn->fd, errno);
+		close(conn->fd);
+		conn->fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+static uint8_t negotiate_protocol_version(int sockfd)
+{
+	struct ethtcp_header req;
+	req.sender 						= htonl((uint32_t)getpid());
+	req.receiver 						= htonl(CLID_V1_RECEIVER);
+	req.protRev 						= htonl(CLID_PROTO_V2);
+	req.msgno 						= htonl(CLID_HELLO_REQUEST);
+	req.payloadLen 						= htonl(0);
+
+	if(send_data(sockfd, &req, sizeof(struct ethtcp_header)) < 0)
+	{
+		return CLID_PROTO_V1;
+	}
+
+	// An old clid silently drops CLID_HELLO_REQUEST, so never wait for its reply forever
+	struct ethtcp_header rep;
+	if(recv_data(sockfd, &rep, sizeof(struct ethtcp_header), CLID_HELLO_TIMEOUT_MS) != sizeof(struct ethtcp_header) || ntohl(rep.msgno) != CLID_HELLO_REPLY)
+	{
+		return CLID_PROTO_V1;
+	}
+
+	return ntohl(rep.protRev) == CLID_PROTO_V2 ? CLID_PROTO_V2 : CLID_PROTO_V1;
+}
+
+static int send_data(int sockfd, const void *tx_buff, size_t nr_bytes_to_send)
+{
+	size_t sent_count = 0;
+
+	while(sent_count < nr_bytes_to_send)
+	{
+		ssize_t length = send(sockfd, (const char *)tx_buff + sent_count, nr_bytes_to_send - sent_count, 0);
+		if(length < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			return -1;
+		}
+
+		sent_count += length;
+	}
+
+	return (int)sent_count;
+}
+
+static int recv_data(int sockfd, void *rx_buff, size_t nr_bytes_to_read, int timeout_ms)
+{
+	size_t read_count = 0;
+
+	while(read_count < nr_bytes_to_read)
+	{
+		struct pollfd pfd = { .fd = sockfd, .events = POLLIN, .revents = 0 };
+		if(poll(&pfd, 1, timeout_ms) <= 0)
+		{
+			return -1;
+		}
+
+		ssize_t length = recv(sockfd, (char *)rx_buff + read_count, nr_bytes_to_read - read_count, 0);
+		if(length <= 0)
+		{
+			return (int)length;
+		}
+
+		read_count += length;
+	}
+
+	return (int)read_count;
+}
+
+static void close_bench_conn(struct bench_conn *conn)
+{
+	if(conn->fd < 0)
+	{
+		return;
+	}
+
+	close(conn->fd);
+	conn->fd = -1;
+	free(conn->rx_buff);
+	conn->rx_buff = NULL;
+	conn->rx_len = 0;
+	conn->rx_cap = 0;
+
+	// An idle connection is still in m_idle_conns, take it out
+	int idx = (int)(conn - m_conns);
+	for(int i = 0; i < m_nr_idle_conns; i++)
+	{
+		if(m_idle_conns[i] == idx)
+		{
+			m_idle_conns[i] = m_idle_conns[--m_nr_idle_conns];
+			break;
+		}
+	}
+
+	conn->busy = false;
+	m_nr_alive_conns--;
+	m_nr_lost_conns++;
+}
+
+static bool send_request(struct bench_conn *conn, uint64_t intended_ns)
+{
+	struct cmd_mix_entry *entry;
+	int res;
+
+	conn->cmd_idx = pick_cmd_idx();
+	conn->intended_ns = intended_ns;
+	conn->is_first_fragment = true;
+	entry = &m_cmd_mix[conn->cmd_idx];
+
+	if(conn->proto == CLID_PROTO_V2)
+	{
+		uint8_t frame[CLID_V2_MAX_HEADER_SIZE + MAX_READLINE_LENGTH + MAX_NUM_ARGS * CLID_VARINT_MAX_SIZE];
+		size_t header_len = clid_v2_encode_header(frame, CLID_V2_TYPE(CLID_EXE_CMD_REQUEST), entry->is_bulk ? CLID_V2_FLAG_BULK : 0, ++conn->request_id, entry->v2_len);
+		memcpy(frame + header_len, entry->v2_payload, entry->v2_len);
+		conn->sent_ns = get_time_ns();
+		res = send_data(conn->fd, frame, header_len + entry->v2_len);
+	} else
+	{
+		conn->sent_ns = get_time_ns();
+		res = send_data(conn->fd, entry->v1_frame, entry->v1_len);
+	}
+
+	if(res < 0)
+	{
+		printf("Failed to send request on fd %d, errno = %d!\n", conn->fd, errno);
+		return false;
+	}
+
+	conn->busy = true;
+	m_nr_sent++;
+	return true;
+}
+
+static bool handle_readable(struct bench_conn *conn, uint64_t now)
+{
+	if(conn->rx_cap - conn->rx_len < RX_CHUNK)
+	{
+		size_t new_cap = conn->rx_cap ? conn->rx_cap * 2 : RX_CHUNK * 2;
+		uint8_t *new_buff = realloc(conn->rx_buff, new_cap);
+		if(new_buff == NULL)
+		{
+			printf("Failed to realloc rx buffer!\n");
+			return false;
+		}
+
+		conn->rx_buff = new_buff;
+		conn->rx_cap = new_cap;
+	}
+
+	ssize_t size = recv(conn->fd, conn->rx_buff + conn->rx_len, conn->rx_cap - conn->rx_len, MSG_DONTWAIT);
+	if(size < 0 && (errno == EINTR || errno == EAGAIN))
+	{
+		return true;
+	} else if(size <= 0)
+	{
+		printf("Connection fd %d closed by clid!\n", conn->fd);
+		return false;
+	}
+	conn->rx_len += size;
+
+	size_t offset = 0;
+	while(offset < conn->rx_len)
+	{
+		bool is_done = false;
+		int consumed = conn->proto == CLID_PROTO_V2 ? decode_v2_reply(conn, conn->rx_buff + offset, conn->rx_len - offset, &is_done)
+							    : decode_v1_reply(conn, conn->rx_buff + offset, conn->rx_len - offset, &is_done);
+		if(consumed < 0)
+		{
+			printf("Received malformed reply on fd %d!\n", conn->fd);
+			return false;
+		} else if(consumed == 0)
+		{
+			break;
+		}
+
+		offset += consumed;
+
+		if(is_done && conn->busy)
+		{
+			complete_request(conn, now);
+		}
+	}
+
+	memmove(conn->rx_buff, conn->rx_buff + offset, conn->rx_len - offset);
+	conn->rx_len -= offset;
+
+	return true;
+}
+
+/* Return consumed bytes, 0 if more bytes are needed, -1 if malformed */
+static int decode_v1_reply(struct bench_conn *conn, const uint8_t *buff, size_t len, bool *is_done)
+{
+	struct ethtcp_header header;
+	if(len < sizeof(struct ethtcp_header))
+	{
+		return 0;
+	}
+
+	memcpy(&header, buff, sizeof(struct ethtcp_header));
+	uint32_t payload_len = ntohl(header.payloadLen);
+	if(len - sizeof(struct ethtcp_header) < payload_len)
+	{
+		return 0;
+	}
+
+	if(ntohl(header.msgno) == CLID_EXE_CMD_REPLY && payload_len >= offsetof(struct clid_exe_cmd_reply, payload))
+	{
+		struct clid_exe_cmd_reply rep;
+		memcpy(&rep, buff + sizeof(struct ethtcp_header), offsetof(struct clid_exe_cmd_reply, payload));
+		conn->errorcode = ntohl(rep.errorcode);
+		conn->result = ntohl(rep.result);
+		*is_done = true;
+	}
+
+	return (int)(sizeof(struct ethtcp_header) + payload_len);
+}
+
+static int decode_v2_reply(struct bench_conn *conn, const uint8_t *buff, size_t len, bool *is_done)
+{
+	struct clid_v2_frame frame;
+	long frame_size = clid_v2_decode_frame(buff, len, &frame);
+	if(frame_size <= 0)
+	{
+		return (int)frame_size;
+	}
+
+	if(frame.type != CLID_V2_TYPE(CLID_EXE_CMD_REPLY) || frame.request_id != conn->request_id)
+	{
+		// Unsolicited, just skip it
+		return (int)frame_size;
+	}
+
+	if(conn->is_first_fragment)
+	{
+		struct clid_v2_reader reader;
+		clid_v2_reader_init(&reader, frame.payload, frame.payload_length);
+		conn->errorcode = clid_v2_read_varint(&reader);
+		conn->result = clid_v2_read_varint(&reader);
+		conn->is_first_fragment = false;
+	}
+
+	// Large outputs arrive in fragments, the request is only done with the last one
+	*is_done = (frame.flags & CLID_V2_FLAG_MORE) == 0;
+	return (int)frame_size;
+}
+
+static void complete_request(struct bench_conn *conn, uint64_t now)
+{
+	struct cmd_mix_entry *entry = &m_cmd_mix[conn->cmd_idx];
+	bool is_failed = conn->errorcode != CLID_STATUS_OK || conn->result != CLID_EXE_CMD_RESULT_SUCCESS;
+
+	conn->busy = false;
+	m_idle_conns[m_nr_idle_conns++] = (int)(conn - m_conns);
+
+	// Requests that should have been sent during warmup are not measured
+	if(conn->intended_ns < m_measure_start_ns)
+	{
+		return;
+	}
+
+	m_nr_completed++;
+	entry->completed++;
+	if(is_failed)
+	{
+		m_nr_failed++;
+		entry->failed++;
+	}
+
+	histogram_record(&m_histogram, now - conn->intended_ns);
+	histogram_record(&entry->histogram, now - conn->intended_ns);
+}
+
+static void check_timeouts(uint64_t now)
+{
+	for(int i = 0; i < m_config.nr_conns; i++)
+	{
+		struct bench_conn *conn = &m_conns[i];
+		if(conn->fd < 0 || !conn->busy || now - conn->sent_ns < m_config.timeout_ns)
+		{
+			continue;
+		}
+
+		// clid runs one job per client at a time, so a connection with a stuck job is of no use anymore
+		printf("Request \"%s\" on fd %d timed out, drop this connection!\n", m_cmd_mix[conn->cmd_idx].line, conn->fd);
+		if(conn->intended_ns >= m_measure_start_ns)
+		{
+			m_nr_timeouts++;
+		}
+		close_bench_conn(conn);
+	}
+}
+
+static bool push_pending_arrival(uint64_t intended_ns)
+{
+	if(m_pending_count == MAX_PENDING_ARRIVALS)
+	{
+		if(intended_ns >= m_measure_start_ns)
+		{
+			m_nr_dropped_arrivals++;
+		}
+		return false;
+	}
+
+	m_pending_arrivals[(m_pending_head + m_pending_count) % MAX_PENDING_ARRIVALS] = intended_ns;
+	m_pending_count++;
+	return true;
+}
+
+static void dispatch_pending_arrivals(void)
+{
+	while(m_pending_count > 0 && m_nr_idle_conns > 0)
+	{
+		int idx = m_idle_conns[--m_nr_idle_conns];
+		uint64_t intended_ns = m_pending_arrivals[m_pending_head];
+		m_pending_head = (m_pending_head + 1) % MAX_PENDING_ARRIVALS;
+		m_pending_count--;
+
+		if(!send_request(&m_conns[idx], intended_ns))
+		{
+			close_bench_conn(&m_conns[idx]);
+		}
+	}
+}
+
+static void histogram_record(struct latency_histogram *hist, uint64_t value)
+{
+	size_t idx;
+	if(value < (1ULL << HIST_SUB_BITS))
+	{
+		idx = value;
+	} else
+	{
+		int msb = 63 - __builtin_clzll(value);
+		int shift = msb - HIST_SUB_BITS + 1;
+		uint64_t mantissa = value >> shift; // In [2^(HIST_SUB_BITS-1), 2^HIST_SUB_BITS)
+		idx = (1 << HIST_SUB_BITS) + (shift - 1) * (1 << (HIST_SUB_BITS - 1)) + (mantissa - (1 << (HIST_SUB_BITS - 1)));
+	}
+
+	hist->counts[idx]++;
+	hist->total++;
+	hist->sum += value;
+	hist->min = value < hist->min ? value : hist->min;
+	hist->max = value > hist->max ? value : hist->max;
+}
+
+/* Return the middle of the bucket holding the given percentile, clamped by the exact min/max */
+static uint64_t histogram_percentile(const struct latency_histogram *hist, double percentile)
+{
+	if(hist->total == 0)
+	{
+		return 0;
+	}
+
+	uint64_t rank = (uint64_t)ceil(percentile / 100.0 * hist->total);
+	rank = rank ? rank : 1;
+
+	uint64_t seen = 0;
+	for(size_t idx = 0; idx < HIST_NUM_BUCKETS; idx++)
+	{
+		seen += hist->counts[idx];
+		if(seen < rank)
+		{
+			continue;
+		}
+
+		uint64_t value;
+		if(idx < (1 << HIST_SUB_BITS))
+		{
+			value = idx;
+		} else
+		{
+			size_t rel = idx - (1 << HIST_SUB_BITS);
+			int shift = (int)(rel / (1 << (HIST_SUB_BITS - 1))) + 1;
+			uint64_t mantissa = (rel % (1 << (HIST_SUB_BITS - 1))) + (1 << (HIST_SUB_BITS - 1));
+			value = (mantissa << shift) + (1ULL << (shift - 1));
+		}
+
+		value = value < hist->min ? hist->min : value;
+		return value > hist->max ? hist->max : value;
+	}
+
+	return hist->max;
+}
+
+static void print_report(uint64_t elapsed_ns)
+{
+	double elapsed_s = (double)elapsed_ns / NSEC_PER_SEC;
+
+	printf("\n");
+	printf("Requests:   sent %" PRIu64 ", completed %" PRIu64 ", failed %" PRIu64 ", timed out %" PRIu64 ", dropped arrivals %" PRIu64 ", lost connections %" PRIu64 "\n",
+		m_nr_sent, m_nr_completed, m_nr_failed, m_nr_timeouts, m_nr_dropped_arrivals, m_nr_lost_conns);
+	printf("Throughput: %.1f req/s over %.3f s\n", elapsed_s > 0 ? m_nr_completed / elapsed_s : 0.0, elapsed_s);
+
+	if(m_histogram.total > 0)
+	{
+		printf("Latency:    min %.1f us, mean %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+			(double)m_histogram.min / NSEC_PER_USEC,
+			(double)(m_histogram.sum / m_histogram.total) / NSEC_PER_USEC,
+			(double)histogram_percentile(&m_histogram, 50.0) / NSEC_PER_USEC,
+			(double)histogram_percentile(&m_histogram, 90.0) / NSEC_PER_USEC,
+			(double)histogram_percentile(&m_histogram, 99.0) / NSEC_PER_USEC,
+			(double)histogram_percentile(&m_histogram, 99.9) / NSEC_PER_USEC,
+			(double)m_histogram.max / NSEC_PER_USEC);
+	}
+
+	printf("Per command:\n");
+	for(int i = 0; i < m_nr_cmd_mix; i++)
+	{
+		const struct latency_histogram *hist = &m_cmd_mix[i].histogram;
+		printf("\t[%u]%s %-32s completed %" PRIu64 ", failed %" PRIu64 ", p50 %.1f us, p99 %.1f us\n", m_cmd_mix[i].weight, m_cmd_mix[i].is_bulk ? " bulk" : "", m_cmd_mix[i].line,
+			m_cmd_mix[i].completed, m_cmd_mix[i].failed,
+			(double)histogram_percentile(hist, 50.0) / NSEC_PER_USEC, (double)histogram_percentile(hist, 99.0) / NSEC_PER_USEC);
+	}
+}
@@ -0,0 +1,161 @@
+/*
+* ______________________   ________                                     
+* __  ____/__  /____  _/   ___  __ \_____ ____________ ________________ 
+* _  /    __  /  __  /     __  / / /  __ `/  _ \_  __ `__ \  __ \_  __ \
+* / /___  _  /____/ /      _  /_/ // /_/ //  __/  / / / / / /_/ /  / / /
+* \____/  /_____/___/      /_____/ \__,_/ \___//_/ /_/ /_/\____//_/ /_/ 
+*                                                                       
+*/
+
+#ifndef __CLID_CLIENT_H__
+#define __CLID_CLIENT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "tcp_proto_v2.h"
+
+/*
+	libclidclient: asynchronous client of clid, for programs that talk to many devices at once from a single thread.
+
+	+ Nothing ever blocks. A client owns an epoll fd, see clid_client_get_fd(), which goes into the caller's own poll()/epoll loop.
+	  Whenever it is readable, or clid_client_get_timeout() ran out, clid_client_process() handles whatever is due.
+	+ clid_connect() returns at once, requests may be issued right away and are sent once the connection is up.
+	  Requests go out from the next clid_client_process(), all those issued meanwhile on a connection in as few send() as possible.
+	  CLID_HELLO_REQUEST is sent first, a clid that drops it is talked to in protocol v1.
+	+ Requests are pipelined on v2 connections, each reply finds its request by request_id. Jobs are not: clid runs one job
+	  per connection and a new one supersedes it, so an exec or a CLID_EXE_BATCH_REQUEST waits in the library until the one
+	  before it is done, while other requests go ahead of it. A v1 connection has one request in flight at a time, the others
+	  wait in the library. A request waiting in the library counts against its timeout. Run jobs at once on separate connections.
+	+ Every request has its own timeout, a late reply to a request that timed out or was cancelled is dropped.
+	+ Released connections stay open in a pool, see max_idle_conns, the next clid_connect() to the same clid takes one over.
+
+	Results come through callbacks, always from within clid_client_process(). A callback may issue new requests, cancel
+	requests and release or close connections, its own included, but must not destroy the client.
+	A connection or request handle is valid until the library said it is done with it, or the caller released, closed or cancelled it.
+*/
+#define CLID_CLIENT_DEFAULT_PORT		33333
+#define CLID_CLIENT_DEFAULT_CONNECT_TIMEOUT_MS	10000
+#define CLID_CLIENT_DEFAULT_EXEC_TIMEOUT_MS	30000
+#define CLID_CLIENT_REPLY_GRACE_MS		5000 // Waited for on top of the timeout clid got, clid answers "Expired!" by then
+
+/* status of the callbacks */
+#define CLID_CLIENT_OK				0
+#define CLID_CLIENT_ERR_CONNECT			-1 // connect() failed or did not complete within connect_timeout_ms
+#define CLID_CLIENT_ERR_CLOSED			-2 // clid closed the connection, or it broke
+#define CLID_CLIENT_ERR_TIMEOUT			-3 // No complete reply within the timeout of the request
+#define CLID_CLIENT_ERR_PROTOCOL		-4 // The reply could not be decoded, the connection is closed too if it was no valid frame
+#define CLID_CLIENT_ERR_UNSUPPORTED		-5 // The request needs protocol v2, that clid only speaks v1
+#define CLID_CLIENT_ERR_NOMEM			-6
+
+struct clid_client;
+struct clid_conn;
+struct clid_request;
+
+struct clid_client_config {
+	uint16_t	port; // Of every clid, 0 for CLID_CLIENT_DEFAULT_PORT
+	uint32_t	connect_timeout_ms; // Of connect(), 0 for CLID_CLIENT_DEFAULT_CONNECT_TIMEOUT_MS. CLID_HELLO_REQUEST has CLID_HELLO_TIMEOUT_MS on top
+	uint32_t	max_idle_conns; // Released connections kept open for later, the least recently released one goes first
+	uint32_t	keepalive_idle_s; // TCP keepalive of every connection, 0 leaves it off
+	uint32_t	keepalive_intvl_s;
+	uint32_t	keepalive_cnt;
+};
+
+/* One command of a list, pointing into the reply, not NUL-terminated */
+struct clid_cmd_info {
+	const char	*name;
+	uint32_t	name_len;
+	const char	*desc;
+	uint32_t	desc_len;
+};
+
+struct clid_list_reply {
+	int				status; // CLID_CLIENT_*, nothing else is valid unless CLID_CLIENT_OK
+	uint32_t			errorcode; // clid's, CLID_STATUS_LIST_UNCHANGED if the list of the given registry version is still current
+	uint32_t			registry_epoch; // 0 from a v1 or an older clid, the list must not be cached then
+	uint32_t			registry_version;
+	uint32_t			num_cmds;
+	const struct clid_cmd_info	*cmds;
+};
+
+/* Where the time of a job went, as clid reported it in CLID_EXE_CMD_TIMING, see tcp_proto_v2.h */
+struct clid_exec_timing {
+	uint32_t	clid_queue_us;
+	uint32_t	itc_us;
+	uint32_t	cmdif_queue_us;
+	uint32_t	handler_us;
+	uint32_t	relay_us;
+};
+
+/* One piece of the output of a command, as it arrived. The callback gets every piece, is_last tells which one ends it */
+struct clid_exec_reply {
+	int				status; // CLID_CLIENT_*, nothing else is valid unless CLID_CLIENT_OK, is_last is true then
+	uint32_t			errorcode; // clid's and the handler's, the same in every piece
+	uint32_t			result;
+	bool				is_first;
+	bool				is_last;
+	const char			*output; // Not NUL-terminated
+	size_t				output_len;
+	const struct clid_exec_timing	*timing; // First piece only, if CLID_V2_FLAG_TIMING was asked for and clid measured it, NULL otherwise
+};
+
+/* CLID_CLIENT_OK once the connection is up, or why it failed or broke later on. The connection is closed after the callback then,
+every request still on it got its own callback with the same status before */
+typedef void (*clid_conn_cb)(struct clid_conn *conn, int status, void *user_data);
+/* Frames clid pushes on its own (request_id CLID_V2_PUSH_REQUEST_ID), e.g. CLID_CMD_LIST_CHANGED. Never called on a released connection */
+typedef void (*clid_push_cb)(struct clid_conn *conn, const struct clid_v2_frame *frame, void *user_data);
+typedef void (*clid_list_cb)(struct clid_request *request, const struct clid_list_reply *reply, void *user_data);
+typedef void (*clid_exec_cb)(struct clid_request *request, const struct clid_exec_reply *reply, void *user_data);
+/* Every frame of the reply, the last one has no CLID_V2_FLAG_MORE. frame is NULL unless status is CLID_CLIENT_OK, that call is the last one */
+typedef void (*clid_frame_cb)(struct clid_request *request, int status, const struct clid_v2_frame *frame, void *user_data);
+
+/* config NULL takes the defaults. Return NULL on failure, with errno set */
+struct clid_client *clid_client_create(const struct clid_client_config *config);
+/* Close every connection, pooled ones included, and drop every request without any callback */
+void clid_client_destroy(struct clid_client *client);
+/* Readable whenever clid_client_process() has something to do, may be added to an epoll set of the caller */
+int clid_client_get_fd(const struct clid_client *client);
+/* Milliseconds until clid_client_process() has to run even if nothing is readable, -1 if never */
+int clid_client_get_timeout(const struct clid_client *client);
+/* Handle every connection that is ready and every timeout that ran out, never blocks */
+void clid_client_process(struct clid_client *client);
+/* Wait up to timeout_ms (-1 for ever) for something to do, or at most until the next timeout, and do it. Return -1 if waiting failed */
+int clid_client_run(struct clid_client *client, int timeout_ms);
+
+/* A pooled connection to ip is taken over if there is one, conn_cb then tells it is up from the next clid_client_process().
+Return NULL on failure, with errno set */
+struct clid_conn *clid_connect(struct clid_client *client, const char *ip, clid_conn_cb conn_cb, clid_push_cb push_cb, void *user_data);
+/* Done with it: requests still on it are dropped without any callback, the connection goes to the pool if it is healthy and there is room */
+void clid_conn_release(struct clid_conn *conn);
+/* Done with it, and close it right away. Requests still on it are dropped without any callback */
+void clid_conn_close(struct clid_conn *conn);
+/* CLID_PROTO_V1 or CLID_PROTO_V2, 0 until the connection is up */
+uint8_t clid_conn_get_proto(const struct clid_conn *conn);
+const char *clid_conn_get_ip(const struct clid_conn *conn);
+
+/* registry_epoch 0 asks for the whole list, otherwise clid answers CLID_STATUS_LIST_UNCHANGED if the list of that version is still current.
+timeout_ms 0 waits for ever. Return NULL on failure, with errno set */
+struct clid_request *clid_list(struct clid_conn *conn, uint32_t registry_epoch, uint32_t registry_version, uint32_t timeout_ms, clid_list_cb cb, void *user_data);
+/* args[0] is the command name. clid gives up on the job after timeout_ms (rounded up to seconds, 0 for CLID_CLIENT_DEFAULT_EXEC_TIMEOUT_MS) and answers so,
+the request fails with CLID_CLIENT_ERR_TIMEOUT only if not even that comes within CLID_CLIENT_REPLY_GRACE_MS more.
+flags are CLID_V2_FLAG_TIMING and CLID_V2_FLAG_BULK, ignored by a v1 clid. Return NULL on failure, with errno set */
+struct clid_request *clid_exec(struct clid_conn *conn, uint8_t flags, int nr_args, const char *const *args, uint32_t timeout_ms, clid_exec_cb cb, void *user_data);
+/* Any other v2 request, msgno as in tcp_proto.h, its payload encoded as in tcp_proto_v2.h. A v1 clid fails it with CLID_CLIENT_ERR_UNSUPPORTED,
+or right away with errno EPROTONOSUPPORT if the connection is already up. timeout_ms 0 waits for ever. Return NULL on failure, with errno set */
+struct clid_request *clid_send_request(struct clid_conn *conn, uint32_t msgno, uint8_t flags, const void *payload, size_t payload_len, uint32_t timeout_ms,
+	clid_frame_cb cb, void *user_data);
+/* No callback for it any more, whatever clid still sends for it is dropped */
+void clid_request_cancel(struct clid_request *request);
+/* Short text of a CLID_CLIENT_* status, e.g. for logs */
+const char *clid_client_strerror(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __CLID_CLIENT_H__
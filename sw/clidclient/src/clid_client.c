@@ -0,0 +1,1857 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "clid_client.h"
+#include "tcp_proto.h"
+#include "tcp_proto_v2.h"
+
+
+/*****************************************************************************\/
+*****                           INTERNAL TYPES                             *****
+*******************************************************************************/
+#define CLIENT_MAX_EVENTS		64 // Connections handled per epoll_wait()
+#define CLIENT_RX_CHUNK			(64 * 1024) // Room made for each recv(), a whole v2 fragment fits
+#define CLIENT_TX_CHUNK			4096
+#define CLIENT_MIN_ID_BUCKETS		8 // Of a connection, grown as more requests are on it at once
+#define CLIENT_NO_TIMER			UINT32_MAX
+
+#define CONN_CONNECTING			0
+#define CONN_HELLO			1
+#define CONN_READY			2
+#define CONN_IDLE			3 // Released into the pool, nobody's
+#define CONN_CLOSED			4 // fd closed, freed once clid_client_process() is over
+
+#define REQUEST_LIST			0
+#define REQUEST_EXEC			1
+#define REQUEST_FRAME			2
+
+#define CONTAINER_OF(ptr, type, member)	((type *)((void *)((char *)(ptr) - offsetof(type, member))))
+
+/* Deadline of a connection or a request, in the min-heap of its client */
+struct clid_timer {
+	uint64_t		deadline_ns;
+	uint32_t		index; // In client->timers, CLIENT_NO_TIMER while not armed
+	bool			is_request;
+};
+
+struct clid_request {
+	struct clid_conn	*conn;
+	uint8_t			kind; // REQUEST_*
+	uint8_t			type; // CLID_V2_TYPE() of the request
+	uint8_t			flags;
+	uint32_t		id;
+	bool			is_sent;
+	bool			is_done; // Finished or cancelled, freed once clid_client_process() is over
+	bool			is_orphan; // v1 only, given up on while in flight, its reply is still waited for and dropped
+	bool			is_first; // exec: the next CLID_EXE_CMD_REPLY is the first one
+	bool			has_timing;
+	struct clid_exec_timing	timing;
+	union {
+		clid_list_cb	list;
+		clid_exec_cb	exec;
+		clid_frame_cb	frame;
+	} cb;
+	void			*user_data;
+	struct clid_timer	timer;
+	uint8_t			*rx_payload; // list only, the fragments of its reply gathered
+	size_t			rx_len;
+	struct clid_request	*prev; // In conn->first_request, send order
+	struct clid_request	*next;
+	struct clid_request	*next_by_id; // In conn->buckets, in client->zombie_requests once done
+	size_t			payload_len;
+	uint8_t			payload[]; // v2 payload, turned into a v1 frame if need be, see queue_v1_request()
+};
+
+struct clid_conn {
+	struct clid_client	*client;
+	int			fd;
+	char			ip[INET_ADDRSTRLEN];
+	uint8_t			state; // CONN_*
+	uint8_t			proto;
+	uint32_t		events; // As registered with epoll
+	bool			is_user_done; // Released or closed, or failed and told so, no more callbacks
+	bool			is_pending; // In client->pending
+	bool			is_announced; // Taken over from the pool, conn_cb has to tell it is up
+	int			fail_status; // Failure to report from clid_client_process()
+	clid_conn_cb		conn_cb;
+	clid_push_cb		push_cb;
+	void			*user_data;
+	struct clid_timer	timer; // connect() or CLID_HELLO_REQUEST
+	uint32_t		next_request_id;
+	struct clid_request	*first_request;
+	struct clid_request	*last_request;
+	struct clid_request	**buckets; // Requests by id, chained
+	uint32_t		num_buckets;
+	uint32_t		num_requests;
+	uint8_t			*tx_buff;
+	size_t			tx_len;
+	size_t			tx_cap;
+	size_t			tx_sent;
+	uint8_t			*rx_buff;
+	size_t			rx_len;
+	size_t			rx_cap;
+	struct clid_conn	*prev; // In client->first_conn, every open connection
+	struct clid_conn	*next;
+	struct clid_conn	*prev_idle; // In client->first_idle, the one released first is first
+	struct clid_conn	*next_idle;
+	struct clid_conn	*next_in_bucket; // In client->idle_buckets
+	struct clid_conn	*next_pending; // In client->pending
+	struct clid_conn	*next_zombie; // In client->zombie_conns
+};
+
+struct clid_client {
+	int				epoll_fd;
+	struct clid_client_config	config;
+	bool				is_processing;
+	struct clid_timer		**timers; // Min-heap by deadline
+	uint32_t			num_timers;
+	uint32_t			timers_cap;
+	struct clid_conn		*first_conn;
+	struct clid_conn		*pending; // Requests to send, a takeover to announce or a failure to report
+	struct clid_conn		*zombie_conns;
+	struct clid_request		*zombie_requests;
+	struct clid_conn		*first_idle;
+	struct clid_conn		*last_idle;
+	uint32_t			num_idle;
+	struct clid_conn		**idle_buckets; // Pooled connections by ip, chained
+	uint32_t			num_idle_buckets;
+};
+
+
+/*****************************************************************************\/
+*****                    INTERNAL FUNCTIONS PROTOTYPES                     *****
+*******************************************************************************/
+static struct clid_conn *open_conn(struct clid_client *client, const char *ip);
+static void add_pending(struct clid_conn *conn);
+static void run_pending(struct clid_client *client);
+static void run_timers(struct clid_client *client);
+static void free_zombies(struct clid_client *client);
+static void handle_conn_event(struct clid_conn *conn, uint32_t events);
+static void finish_connect(struct clid_conn *conn);
+static void start_conn(struct clid_conn *conn, uint8_t proto);
+static void fail_conn(struct clid_conn *conn, int status);
+static void shut_conn(struct clid_conn *conn);
+static void drop_requests(struct clid_conn *conn);
+static bool has_requests_in_flight(const struct clid_conn *conn);
+static bool is_job_request(const struct clid_request *request);
+static void update_events(struct clid_conn *conn);
+static uint8_t *reserve_tx(struct clid_conn *conn, size_t len);
+static void queue_tx(struct clid_conn *conn, const void *data, size_t len);
+static void queue_v1_header(uint8_t *buff, uint32_t protrev, uint32_t msgno, uint32_t payload_len);
+static void flush_tx(struct clid_conn *conn);
+static void read_conn(struct clid_conn *conn);
+static void decode_rx(struct clid_conn *conn);
+static long decode_hello_reply(struct clid_conn *conn, const uint8_t *buff, size_t len);
+static long decode_v1_frame(struct clid_conn *conn, const uint8_t *buff, size_t len);
+static void handle_v2_frame(struct clid_conn *conn, const struct clid_v2_frame *frame);
+static struct clid_request *new_request(struct clid_conn *conn, uint8_t kind, uint32_t msgno, uint8_t flags, size_t payload_len, uint32_t timeout_ms);
+static void add_request(struct clid_request *request);
+static void send_requests(struct clid_conn *conn);
+static void queue_v1_request(struct clid_conn *conn, struct clid_request *request);
+static struct clid_request *find_request(const struct clid_conn *conn, uint32_t id);
+static void finish_request(struct clid_request *request);
+static void fail_request(struct clid_request *request, int status);
+static void give_up_request(struct clid_request *request);
+static void deliver_list(struct clid_request *request, const uint8_t *payload, size_t len);
+static void deliver_v1_list(struct clid_request *request, const uint8_t *payload, size_t len);
+static void deliver_exec(struct clid_request *request, const struct clid_v2_frame *frame);
+static void deliver_v1_exec(struct clid_request *request, const uint8_t *payload, size_t len);
+static bool gather_payload(struct clid_request *request, const struct clid_v2_frame *frame);
+static void pool_conn(struct clid_conn *conn);
+static void unpool_conn(struct clid_conn *conn);
+static struct clid_conn *take_pooled_conn(struct clid_client *client, const char *ip);
+static uint32_t hash_ip(const char *ip);
+static bool arm_timer(struct clid_client *client, struct clid_timer *timer, uint64_t deadline_ns);
+static void disarm_timer(struct clid_client *client, struct clid_timer *timer);
+static void sift_timer(struct clid_client *client, uint32_t index);
+static void swap_timers(struct clid_client *client, uint32_t a, uint32_t b);
+static uint64_t get_time_ns(void);
+
+
+/*****************************************************************************\/
+*****                       PUBLIC FUNCTIONS IMPLEMENTATION                *****
+*******************************************************************************/
+struct clid_client *clid_client_create(const struct clid_client_config *config)
+{
+	struct clid_client *client = calloc(1, sizeof(struct clid_client));
+	if(client == NULL)
+	{
+		return NULL;
+	}
+
+	if(config != NULL)
+	{
+		client->config = *config;
+	}
+
+	if(client->config.port == 0)
+	{
+		client->config.port = CLID_CLIENT_DEFAULT_PORT;
+	}
+
+	if(client->config.connect_timeout_ms == 0)
+	{
+		client->config.connect_timeout_ms = CLID_CLIENT_DEFAULT_CONNECT_TIMEOUT_MS;
+	}
+
+	// A pool of n connections gets n buckets, one lookup per clid_connect() whatever its size
+	client->num_idle_buckets = 1;
+	while(client->num_idle_buckets < client->config.max_idle_conns)
+	{
+		client->num_idle_buckets <<= 1;
+	}
+
+	client->idle_buckets = calloc(client->num_idle_buckets, sizeof(struct clid_conn *));
+	client->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(client->idle_buckets == NULL || client->epoll_fd < 0)
+	{
+		int saved_errno = errno;
+		if(client->epoll_fd >= 0)
+		{
+			close(client->epoll_fd);
+		}
+		free(client->idle_buckets);
+		free(client);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	return client;
+}
+
+void clid_client_destroy(struct clid_client *client)
+{
+	if(client == NULL)
+	{
+		return;
+	}
+
+	while(client->first_conn != NULL)
+	{
+		struct clid_conn *conn = client->first_conn;
+		conn->is_user_done = true;
+		drop_requests(conn);
+		shut_conn(conn);
+	}
+
+	free_zombies(client);
+	close(client->epoll_fd);
+	free(client->timers);
+	free(client->idle_buckets);
+	free(client);
+}
+
+int clid_client_get_fd(const struct clid_client *client)
+{
+	return client->epoll_fd;
+}
+
+int clid_client_get_timeout(const struct clid_client *client)
+{
+	if(client->pending != NULL)
+	{
+		return 0;
+	} else if(client->num_timers == 0)
+	{
+		return -1;
+	}
+
+	uint64_t now = get_time_ns();
+	uint64_t deadline_ns = client->timers[0]->deadline_ns;
+	return deadline_ns > now ? (int)((deadline_ns - now + 999999) / 1000000) : 0;
+}
+
+void clid_client_process(struct clid_client *client)
+{
+	// Not from within a callback, the caller's own loop comes back here soon enough
+	if(client->is_processing)
+	{
+		return;
+	}
+	client->is_processing = true;
+
+	run_pending(client);
+
+	struct epoll_event events[CLIENT_MAX_EVENTS];
+	int count = epoll_wait(client->epoll_fd, events, CLIENT_MAX_EVENTS, 0);
+	for(int i = 0; i < count; i++)
+	{
+		// Closed by an earlier callback of this round, but not freed before its end
+		struct clid_conn *conn = events[i].data.ptr;
+		if(conn->state != CONN_CLOSED)
+		{
+			handle_conn_event(conn, events[i].events);
+		}
+	}
+
+	run_timers(client);
+	run_pending(client);
+	free_zombies(client);
+
+	client->is_processing = false;
+}
+
+int clid_client_run(struct clid_client *client, int timeout_ms)
+{
+	int client_timeout_ms = clid_client_get_timeout(client);
+	if(client_timeout_ms >= 0 && (timeout_ms < 0 || client_timeout_ms < timeout_ms))
+	{
+		timeout_ms = client_timeout_ms;
+	}
+
+	// Nothing is taken off epoll here, clid_client_process() gets every event
+	struct epoll_event event;
+	if(epoll_wait(client->epoll_fd, &event, 1, timeout_ms) < 0 && errno != EINTR)
+	{
+		return -1;
+	}
+
+	clid_client_process(client);
+	return 0;
+}
+
+struct clid_conn *clid_connect(struct clid_client *client, const char *ip, clid_conn_cb conn_cb, clid_push_cb push_cb, void *user_data)
+{
+	struct in_addr addr;
+	if(ip == NULL || conn_cb == NULL || inet_pton(AF_INET, ip, &addr) != 1)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct clid_conn *conn = take_pooled_conn(client, ip);
+	if(conn != NULL)
+	{
+		conn->is_announced = true;
+		add_pending(conn);
+	} else if((conn = open_conn(client, ip)) == NULL)
+	{
+		return NULL;
+	}
+
+	conn->conn_cb = conn_cb;
+	conn->push_cb = push_cb;
+	conn->user_data = user_data;
+	return conn;
+}
+
+void clid_conn_release(struct clid_conn *conn)
+{
+	if(conn->is_user_done)
+	{
+		return;
+	}
+
+	// A reply still on its way would be taken for the one of the next user, on v1 at least
+	bool is_poolable = conn->state == CONN_READY && !has_requests_in_flight(conn) && conn->client->config.max_idle_conns > 0;
+	conn->is_user_done = true;
+	conn->is_announced = false;
+	drop_requests(conn);
+
+	if(is_poolable)
+	{
+		pool_conn(conn);
+	} else
+	{
+		shut_conn(conn);
+	}
+}
+
+void clid_conn_close(struct clid_conn *conn)
+{
+	if(conn->is_user_done)
+	{
+		// From within the callbacks of its failure, it is already closed
+		drop_requests(conn);
+		return;
+	}
+
+	conn->is_user_done = true;
+	drop_requests(conn);
+	shut_conn(conn);
+}
+
+uint8_t clid_conn_get_proto(const struct clid_conn *conn)
+{
+	return conn->state == CONN_READY || conn->state == CONN_IDLE ? conn->proto : 0;
+}
+
+const char *clid_conn_get_ip(const struct clid_conn *conn)
+{
+	return conn->ip;
+}
+
+struct clid_request *clid_list(struct clid_conn *conn, uint32_t registry_epoch, uint32_t registry_version, uint32_t timeout_ms, clid_list_cb cb, void *user_data)
+{
+	struct clid_request *request = new_request(conn, REQUEST_LIST, CLID_GET_LIST_CMD_REQUEST, 0, registry_epoch != 0 ? 2 * CLID_VARINT_MAX_SIZE : 0, timeout_ms);
+	if(request == NULL)
+	{
+		return NULL;
+	}
+
+	if(registry_epoch != 0)
+	{
+		struct clid_v2_writer writer;
+		clid_v2_writer_init(&writer, request->payload, request->payload_len);
+		clid_v2_write_varint(&writer, registry_epoch);
+		clid_v2_write_varint(&writer, registry_version);
+		request->payload_len = writer.len;
+	}
+
+	request->cb.list = cb;
+	request->user_data = user_data;
+	add_request(request);
+	return request;
+}
+
+struct clid_request *clid_exec(struct clid_conn *conn, uint8_t flags, int nr_args, const char *const *args, uint32_t timeout_ms, clid_exec_cb cb, void *user_data)
+{
+	// v1 counts the arguments in 16 bits
+	if(nr_args < 1 || nr_args > UINT16_MAX || (flags & ~(CLID_V2_FLAG_TIMING | CLID_V2_FLAG_BULK)) != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size_t payload_cap = 2 * CLID_VARINT_MAX_SIZE;
+	for(int i = 0; i < nr_args; i++)
+	{
+		payload_cap += CLID_VARINT_MAX_SIZE + strlen(args[i]);
+	}
+
+	if(timeout_ms == 0)
+	{
+		timeout_ms = CLID_CLIENT_DEFAULT_EXEC_TIMEOUT_MS;
+	}
+
+	// clid answers on its own once the job expired, only a reply that does not even come then is given up on here
+	uint32_t grace_ms = timeout_ms <= UINT32_MAX - CLID_CLIENT_REPLY_GRACE_MS - 999 ? CLID_CLIENT_REPLY_GRACE_MS + 999 : 0;
+	struct clid_request *request = new_request(conn, REQUEST_EXEC, CLID_EXE_CMD_REQUEST, flags, payload_cap, timeout_ms + grace_ms);
+	if(request == NULL)
+	{
+		return NULL;
+	}
+
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, request->payload, request->payload_len);
+	clid_v2_write_varint(&writer, timeout_ms / 1000 + (timeout_ms % 1000 != 0));
+	clid_v2_write_varint(&writer, (uint32_t)nr_args);
+	for(int i = 0; i < nr_args; i++)
+	{
+		clid_v2_write_string(&writer, args[i], strlen(args[i]));
+	}
+	request->payload_len = writer.len;
+
+	request->is_first = true;
+	request->cb.exec = cb;
+	request->user_data = user_data;
+	add_request(request);
+	return request;
+}
+
+struct clid_request *clid_send_request(struct clid_conn *conn, uint32_t msgno, uint8_t flags, const void *payload, size_t payload_len, uint32_t timeout_ms,
+	clid_frame_cb cb, void *user_data)
+{
+	if(msgno <= CLID_PAYLOAD_TYPE_BASE || msgno > CLID_PAYLOAD_TYPE_BASE + UINT8_MAX || payload_len > CLID_V2_MAX_PAYLOAD_LENGTH)
+	{
+		errno = EINVAL;
+		return NULL;
+	} else if(clid_conn_get_proto(conn) == CLID_PROTO_V1)
+	{
+		errno = EPROTONOSUPPORT;
+		return NULL;
+	}
+
+	struct clid_request *request = new_request(conn, REQUEST_FRAME, msgno, flags, payload_len, timeout_ms);
+	if(request == NULL)
+	{
+		return NULL;
+	}
+
+	if(payload_len > 0)
+	{
+		memcpy(request->payload, payload, payload_len);
+	}
+
+	request->cb.frame = cb;
+	request->user_data = user_data;
+	add_request(request);
+	return request;
+}
+
+void clid_request_cancel(struct clid_request *request)
+{
+	if(!request->is_done && !request->is_orphan)
+	{
+		give_up_request(request);
+	}
+}
+
+const char *clid_client_strerror(int status)
+{
+	switch (status)
+	{
+	case CLID_CLIENT_OK:
+		return "OK";
+	case CLID_CLIENT_ERR_CONNECT:
+		return "connect failed";
+	case CLID_CLIENT_ERR_CLOSED:
+		return "disconnected";
+	case CLID_CLIENT_ERR_TIMEOUT:
+		return "no reply in time";
+	case CLID_CLIENT_ERR_PROTOCOL:
+		return "malformed reply";
+	case CLID_CLIENT_ERR_UNSUPPORTED:
+		return "not supported by this clid";
+	case CLID_CLIENT_ERR_NOMEM:
+		return "out of memory";
+	default:
+		return "unknown status";
+	}
+}
+
+
+
+/*****************************************************************************\/
+*****                      INTERNAL FUNCTIONS IMPLEMENTATION               *****
+*******************************************************************************/
+/* Non-blocking connect(), finish_connect() takes it on once the socket is writable */
+static struct clid_conn *open_conn(struct clid_client *client, const char *ip)
+{
+	struct clid_conn *conn = calloc(1, sizeof(struct clid_conn));
+	if(conn == NULL)
+	{
+		return NULL;
+	}
+
+	conn->client = client;
+	conn->state = CONN_CONNECTING;
+	conn->timer.index = CLIENT_NO_TIMER;
+	snprintf(conn->ip, sizeof(conn->ip), "%s", ip);
+
+	conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(conn->fd < 0)
+	{
+		free(conn);
+		return NULL;
+	}
+
+	// An idle connection costs no traffic of ours, the kernel alone notices a clid that went away without closing it
+	int enable = 1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+	if(client->config.keepalive_idle_s > 0)
+	{
+		int idle = (int)client->config.keepalive_idle_s;
+		int interval = (int)client->config.keepalive_intvl_s;
+		int count = (int)client->config.keepalive_cnt;
+		setsockopt(conn->fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+		if(interval > 0)
+		{
+			setsockopt(conn->fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+		}
+		if(count > 0)
+		{
+			setsockopt(conn->fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+		}
+	}
+
+	struct sockaddr_in serveraddr;
+	memset(&serveraddr, 0, sizeof(struct sockaddr_in));
+	serveraddr.sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &serveraddr.sin_addr);
+	serveraddr.sin_port = htons(client->config.port);
+
+	struct epoll_event event = { .events = EPOLLOUT, .data.ptr = conn };
+	if(!arm_timer(client, &conn->timer, get_time_ns() + (uint64_t)client->config.connect_timeout_ms * 1000000)
+		|| epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) < 0)
+	{
+		int saved_errno = errno;
+		disarm_timer(client, &conn->timer);
+		close(conn->fd);
+		free(conn);
+		errno = saved_errno;
+		return NULL;
+	}
+	conn->events = EPOLLOUT;
+
+	// Refused right away on a local address, told from clid_client_process() all the same
+	if(connect(conn->fd, (struct sockaddr *)((void *)&serveraddr), sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS)
+	{
+		conn->fail_status = CLID_CLIENT_ERR_CONNECT;
+		add_pending(conn);
+	}
+
+	conn->next = client->first_conn;
+	if(client->first_conn != NULL)
+	{
+		client->first_conn->prev = conn;
+	}
+	client->first_conn = conn;
+
+	return conn;
+}
+
+static void add_pending(struct clid_conn *conn)
+{
+	if(!conn->is_pending)
+	{
+		conn->is_pending = true;
+		conn->next_pending = conn->client->pending;
+		conn->client->pending = conn;
+	}
+}
+
+/* Callbacks in here may make more connections pending, they are taken care of in the same round */
+static void run_pending(struct clid_client *client)
+{
+	while(client->pending != NULL)
+	{
+		struct clid_conn *conn = client->pending;
+		client->pending = conn->next_pending;
+		conn->is_pending = false;
+
+		if(conn->state == CONN_CLOSED)
+		{
+			continue;
+		} else if(conn->fail_status != CLID_CLIENT_OK)
+		{
+			fail_conn(conn, conn->fail_status);
+			continue;
+		}
+
+		if(conn->is_announced)
+		{
+			conn->is_announced = false;
+			conn->conn_cb(conn, CLID_CLIENT_OK, conn->user_data);
+		}
+
+		if(conn->state != CONN_CLOSED && conn->state != CONN_CONNECTING)
+		{
+			flush_tx(conn);
+		}
+	}
+}
+
+static void run_timers(struct clid_client *client)
+{
+	uint64_t now = get_time_ns();
+	while(client->num_timers > 0 && client->timers[0]->deadline_ns <= now)
+	{
+		struct clid_timer *timer = client->timers[0];
+		disarm_timer(client, timer);
+
+		if(timer->is_request)
+		{
+			struct clid_request *request = CONTAINER_OF(timer, struct clid_request, timer);
+			fail_request(request, CLID_CLIENT_ERR_TIMEOUT);
+			continue;
+		}
+
+		// An old clid silently drops CLID_HELLO_REQUEST, it speaks v1 then
+		struct clid_conn *conn = CONTAINER_OF(timer, struct clid_conn, timer);
+		if(conn->state == CONN_CONNECTING)
+		{
+			fail_conn(conn, CLID_CLIENT_ERR_CONNECT);
+		} else if(conn->state == CONN_HELLO)
+		{
+			start_conn(conn, CLID_PROTO_V1);
+		}
+	}
+}
+
+static void free_zombies(struct clid_client *client)
+{
+	while(client->zombie_requests != NULL)
+	{
+		struct clid_request *request = client->zombie_requests;
+		client->zombie_requests = request->next_by_id;
+		free(request->rx_payload);
+		free(request);
+	}
+
+	while(client->zombie_conns != NULL)
+	{
+		struct clid_conn *conn = client->zombie_conns;
+		client->zombie_conns = conn->next_zombie;
+		free(conn->buckets);
+		free(conn->tx_buff);
+		free(conn->rx_buff);
+		free(conn);
+	}
+}
+
+static void handle_conn_event(struct clid_conn *conn, uint32_t events)
+{
+	if(conn->state == CONN_CONNECTING)
+	{
+		finish_connect(conn);
+		return;
+	}
+
+	if(events & EPOLLOUT)
+	{
+		flush_tx(conn);
+	}
+
+	if(conn->state != CONN_CLOSED && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+	{
+		read_conn(conn);
+	}
+}
+
+static void finish_connect(struct clid_conn *conn)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+	{
+		fail_conn(conn, CLID_CLIENT_ERR_CONNECT);
+		return;
+	}
+
+	// Always v1 framed, see tcp_proto.h
+	uint8_t *hello = reserve_tx(conn, sizeof(struct ethtcp_header));
+	if(hello == NULL || !arm_timer(conn->client, &conn->timer, get_time_ns() + (uint64_t)CLID_HELLO_TIMEOUT_MS * 1000000))
+	{
+		fail_conn(conn, CLID_CLIENT_ERR_NOMEM);
+		return;
+	}
+
+	queue_v1_header(hello, CLID_PROTO_V2, CLID_HELLO_REQUEST, 0);
+	conn->tx_len += sizeof(struct ethtcp_header);
+	conn->state = CONN_HELLO;
+	flush_tx(conn);
+}
+
+/* Tell the user, then send whatever was issued meanwhile */
+static void start_conn(struct clid_conn *conn, uint8_t proto)
+{
+	disarm_timer(conn->client, &conn->timer);
+	conn->state = CONN_READY;
+	conn->proto = proto;
+
+	conn->conn_cb(conn, CLID_CLIENT_OK, conn->user_data);
+	if(conn->state != CONN_READY)
+	{
+		return;
+	}
+
+	if(proto == CLID_PROTO_V1)
+	{
+		// A callback may cancel any other request, the walk starts over after each one
+		struct clid_request *request = conn->first_request;
+		while(request != NULL && conn->state == CONN_READY)
+		{
+			if(request->kind == REQUEST_FRAME)
+			{
+				fail_request(request, CLID_CLIENT_ERR_UNSUPPORTED);
+				request = conn->first_request;
+			} else
+			{
+				request = request->next;
+			}
+		}
+	}
+
+	if(conn->state == CONN_READY)
+	{
+		send_requests(conn);
+	}
+}
+
+/* Every request on it gets status, then conn_cb, unless the user is done with it */
+static void fail_conn(struct clid_conn *conn, int status)
+{
+	if(conn->state == CONN_IDLE)
+	{
+		conn->is_user_done = true;
+	}
+	shut_conn(conn);
+
+	// A callback may close the connection, the rest of its requests are just dropped then
+	while(!conn->is_user_done && conn->first_request != NULL)
+	{
+		fail_request(conn->first_request, status);
+	}
+	drop_requests(conn);
+
+	if(!conn->is_user_done)
+	{
+		conn->is_user_done = true;
+		conn->conn_cb(conn, status, conn->user_data);
+	}
+}
+
+/* Close the socket, the connection itself is freed once clid_client_process() is over, its requests stay until dropped */
+static void shut_conn(struct clid_conn *conn)
+{
+	struct clid_client *client = conn->client;
+	if(conn->state == CONN_CLOSED)
+	{
+		return;
+	} else if(conn->state == CONN_IDLE)
+	{
+		unpool_conn(conn);
+	}
+
+	disarm_timer(client, &conn->timer);
+	epoll_ctl(client->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	conn->fd = -1;
+	conn->state = CONN_CLOSED;
+
+	if(conn->prev != NULL)
+	{
+		conn->prev->next = conn->next;
+	} else
+	{
+		client->first_conn = conn->next;
+	}
+	if(conn->next != NULL)
+	{
+		conn->next->prev = conn->prev;
+	}
+
+	conn->next_zombie = client->zombie_conns;
+	client->zombie_conns = conn;
+	if(!client->is_processing)
+	{
+		// Nothing of this round can still point at it
+		free_zombies(client);
+	}
+}
+
+/* Without any callback */
+static void drop_requests(struct clid_conn *conn)
+{
+	while(conn->first_request != NULL)
+	{
+		finish_request(conn->first_request);
+	}
+}
+
+static bool has_requests_in_flight(const struct clid_conn *conn)
+{
+	for(const struct clid_request *request = conn->first_request; request != NULL; request = request->next)
+	{
+		if(request->is_sent)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* clid runs one job per connection, a CLID_EXE_CMD_REQUEST or CLID_EXE_BATCH_REQUEST supersedes the one still running there */
+static bool is_job_request(const struct clid_request *request)
+{
+	return request->type == CLID_V2_TYPE(CLID_EXE_CMD_REQUEST) || request->type == CLID_V2_TYPE(CLID_EXE_BATCH_REQUEST);
+}
+
+static void update_events(struct clid_conn *conn)
+{
+	uint32_t events = EPOLLIN | (conn->tx_sent < conn->tx_len ? EPOLLOUT : 0);
+	if(events != conn->events)
+	{
+		struct epoll_event event = { .events = events, .data.ptr = conn };
+		if(epoll_ctl(conn->client->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == 0)
+		{
+			conn->events = events;
+		}
+	}
+}
+
+/* Room for len more bytes at the end of the tx buffer, the caller adds them to tx_len once written */
+static uint8_t *reserve_tx(struct clid_conn *conn, size_t len)
+{
+	if(conn->tx_sent > 0 && conn->tx_cap - conn->tx_len < len)
+	{
+		memmove(conn->tx_buff, conn->tx_buff + conn->tx_sent, conn->tx_len - conn->tx_sent);
+		conn->tx_len -= conn->tx_sent;
+		conn->tx_sent = 0;
+	}
+
+	if(conn->tx_cap - conn->tx_len < len)
+	{
+		size_t new_cap = conn->tx_cap ? conn->tx_cap : CLIENT_TX_CHUNK;
+		while(new_cap - conn->tx_len < len)
+		{
+			new_cap *= 2;
+		}
+
+		uint8_t *new_buff = realloc(conn->tx_buff, new_cap);
+		if(new_buff == NULL)
+		{
+			return NULL;
+		}
+		conn->tx_buff = new_buff;
+		conn->tx_cap = new_cap;
+	}
+
+	return conn->tx_buff + conn->tx_len;
+}
+
+static void queue_tx(struct clid_conn *conn, const void *data, size_t len)
+{
+	uint8_t *buff = reserve_tx(conn, len);
+	if(buff == NULL)
+	{
+		// Half a frame cannot be taken back, the stream is lost
+		conn->fail_status = CLID_CLIENT_ERR_NOMEM;
+		add_pending(conn);
+		return;
+	}
+
+	memcpy(buff, data, len);
+	conn->tx_len += len;
+	add_pending(conn);
+}
+
+static void queue_v1_header(uint8_t *buff, uint32_t protrev, uint32_t msgno, uint32_t payload_len)
+{
+	struct ethtcp_header header;
+	header.sender 						= htonl((uint32_t)getpid());
+	header.receiver 					= htonl(CLID_V1_RECEIVER);
+	header.protRev 						= htonl(protrev);
+	header.msgno 						= htonl(msgno);
+	header.payloadLen 					= htonl(payload_len);
+	memcpy(buff, &header, sizeof(struct ethtcp_header));
+}
+
+static void flush_tx(struct clid_conn *conn)
+{
+	if(conn->fail_status != CLID_CLIENT_OK)
+	{
+		fail_conn(conn, conn->fail_status);
+		return;
+	}
+
+	while(conn->tx_sent < conn->tx_len)
+	{
+		ssize_t size = send(conn->fd, conn->tx_buff + conn->tx_sent, conn->tx_len - conn->tx_sent, MSG_NOSIGNAL);
+		if(size < 0 && errno == EINTR)
+		{
+			continue;
+		} else if(size < 0 && errno == EAGAIN)
+		{
+			break;
+		} else if(size < 0)
+		{
+			fail_conn(conn, CLID_CLIENT_ERR_CLOSED);
+			return;
+		}
+
+		conn->tx_sent += size;
+	}
+
+	if(conn->tx_sent == conn->tx_len)
+	{
+		conn->tx_sent = 0;
+		conn->tx_len = 0;
+	}
+
+	// EPOLLOUT only while clid does not take all of it
+	update_events(conn);
+}
+
+static void read_conn(struct clid_conn *conn)
+{
+	if(conn->rx_cap - conn->rx_len < CLIENT_RX_CHUNK)
+	{
+		size_t new_cap = conn->rx_cap ? conn->rx_cap * 2 : 2 * CLIENT_RX_CHUNK;
+		uint8_t *new_buff = realloc(conn->rx_buff, new_cap);
+		if(new_buff == NULL)
+		{
+			fail_conn(conn, CLID_CLIENT_ERR_NOMEM);
+			return;
+		}
+		conn->rx_buff = new_buff;
+		conn->rx_cap = new_cap;
+	}
+
+	ssize_t size = recv(conn->fd, conn->rx_buff + conn->rx_len, conn->rx_cap - conn->rx_len, 0);
+	if(size < 0 && (errno == EINTR || errno == EAGAIN))
+	{
+		return;
+	} else if(size <= 0)
+	{
+		fail_conn(conn, conn->state == CONN_HELLO ? CLID_CLIENT_ERR_CONNECT : CLID_CLIENT_ERR_CLOSED);
+		return;
+	}
+
+	conn->rx_len += size;
+	decode_rx(conn);
+}
+
+/* Handle every complete frame in the rx buffer, a partial one waits there for the rest of it */
+static void decode_rx(struct clid_conn *conn)
+{
+	size_t offset = 0;
+	long frame_size = 0;
+	while(conn->state != CONN_CLOSED && offset < conn->rx_len)
+	{
+		if(conn->state == CONN_HELLO)
+		{
+			frame_size = decode_hello_reply(conn, conn->rx_buff + offset, conn->rx_len - offset);
+		} else if(conn->proto == CLID_PROTO_V2)
+		{
+			struct clid_v2_frame frame;
+			frame_size = clid_v2_decode_frame(conn->rx_buff + offset, conn->rx_len - offset, &frame);
+			if(frame_size > 0)
+			{
+				handle_v2_frame(conn, &frame);
+			}
+		} else
+		{
+			frame_size = decode_v1_frame(conn, conn->rx_buff + offset, conn->rx_len - offset);
+		}
+
+		if(frame_size <= 0)
+		{
+			break;
+		}
+
+		offset += frame_size;
+	}
+
+	// Buffers of a closed connection are only freed after this round, the callbacks above may have closed it
+	if(conn->state == CONN_CLOSED)
+	{
+		return;
+	} else if(frame_size < 0)
+	{
+		fail_conn(conn, CLID_CLIENT_ERR_PROTOCOL);
+		return;
+	}
+
+	memmove(conn->rx_buff, conn->rx_buff + offset, conn->rx_len - offset);
+	conn->rx_len -= offset;
+}
+
+static long decode_hello_reply(struct clid_conn *conn, const uint8_t *buff, size_t len)
+{
+	struct ethtcp_header header;
+	if(len < sizeof(struct ethtcp_header))
+	{
+		return 0;
+	}
+
+	memcpy(&header, buff, sizeof(struct ethtcp_header));
+	if(ntohl(header.msgno) != CLID_HELLO_REPLY || ntohl(header.payloadLen) != 0)
+	{
+		return -1;
+	}
+
+	start_conn(conn, ntohl(header.protRev) == CLID_PROTO_V2 ? CLID_PROTO_V2 : CLID_PROTO_V1);
+	return (long)sizeof(struct ethtcp_header);
+}
+
+/* Return the size of the complete v1 frame at buff, 0 if more bytes are needed, -1 if malformed.
+v1 has no request_id, a reply is for the one request in flight */
+static long decode_v1_frame(struct clid_conn *conn, const uint8_t *buff, size_t len)
+{
+	struct ethtcp_header header;
+	if(len < sizeof(struct ethtcp_header))
+	{
+		return 0;
+	}
+
+	memcpy(&header, buff, sizeof(struct ethtcp_header));
+	uint32_t payload_len = ntohl(header.payloadLen);
+	if(payload_len > CLID_V2_MAX_PAYLOAD_LENGTH)
+	{
+		return -1;
+	} else if(len - sizeof(struct ethtcp_header) < payload_len)
+	{
+		return 0;
+	}
+
+	const uint8_t *payload = buff + sizeof(struct ethtcp_header);
+	uint32_t msgno = ntohl(header.msgno);
+	struct clid_request *request = conn->first_request;
+	if(request == NULL || !request->is_sent || (msgno != CLID_EXE_CMD_REPLY && msgno != CLID_GET_LIST_CMD_REPLY))
+	{
+		return (long)(sizeof(struct ethtcp_header) + payload_len);
+	}
+
+	if(request->is_orphan)
+	{
+		finish_request(request);
+	} else if(msgno == CLID_EXE_CMD_REPLY && request->kind == REQUEST_EXEC)
+	{
+		deliver_v1_exec(request, payload, payload_len);
+	} else if(msgno == CLID_GET_LIST_CMD_REPLY && request->kind == REQUEST_LIST)
+	{
+		deliver_v1_list(request, payload, payload_len);
+	} else
+	{
+		fail_request(request, CLID_CLIENT_ERR_PROTOCOL);
+	}
+
+	if(conn->state == CONN_READY)
+	{
+		send_requests(conn);
+	}
+
+	return (long)(sizeof(struct ethtcp_header) + payload_len);
+}
+
+static void handle_v2_frame(struct clid_conn *conn, const struct clid_v2_frame *frame)
+{
+	if(frame->request_id == CLID_V2_PUSH_REQUEST_ID)
+	{
+		if(!conn->is_user_done && conn->push_cb != NULL)
+		{
+			conn->push_cb(conn, frame, conn->user_data);
+		}
+		return;
+	}
+
+	// Late frames of a request given up on are dropped
+	struct clid_request *request = find_request(conn, frame->request_id);
+	if(request == NULL)
+	{
+		return;
+	}
+
+	if(request->kind == REQUEST_FRAME)
+	{
+		if((frame->flags & CLID_V2_FLAG_MORE) == 0)
+		{
+			finish_request(request);
+		}
+		request->cb.frame(request, CLID_CLIENT_OK, frame, request->user_data);
+	} else if(request->kind == REQUEST_EXEC)
+	{
+		deliver_exec(request, frame);
+	} else if(frame->type == CLID_V2_TYPE(CLID_GET_LIST_CMD_REPLY))
+	{
+		if(!gather_payload(request, frame))
+		{
+			fail_request(request, CLID_CLIENT_ERR_NOMEM);
+		} else if((frame->flags & CLID_V2_FLAG_MORE) == 0 && request->rx_payload != NULL)
+		{
+			deliver_list(request, request->rx_payload, request->rx_len);
+		} else if((frame->flags & CLID_V2_FLAG_MORE) == 0)
+		{
+			deliver_list(request, frame->payload, frame->payload_length);
+		}
+	}
+}
+
+static struct clid_request *new_request(struct clid_conn *conn, uint8_t kind, uint32_t msgno, uint8_t flags, size_t payload_len, uint32_t timeout_ms)
+{
+	if(conn->is_user_done || conn->state == CONN_CLOSED)
+	{
+		errno = ENOTCONN;
+		return NULL;
+	}
+
+	// Its id hashes into the connection's buckets, grown before there are more requests than buckets
+	if(conn->num_requests >= conn->num_buckets)
+	{
+		uint32_t num_buckets = conn->num_buckets ? conn->num_buckets * 2 : CLIENT_MIN_ID_BUCKETS;
+		struct clid_request **buckets = calloc(num_buckets, sizeof(struct clid_request *));
+		if(buckets == NULL)
+		{
+			return NULL;
+		}
+
+		for(uint32_t i = 0; i < conn->num_buckets; i++)
+		{
+			while(conn->buckets[i] != NULL)
+			{
+				struct clid_request *request = conn->buckets[i];
+				conn->buckets[i] = request->next_by_id;
+				request->next_by_id = buckets[request->id & (num_buckets - 1)];
+				buckets[request->id & (num_buckets - 1)] = request;
+			}
+		}
+
+		free(conn->buckets);
+		conn->buckets = buckets;
+		conn->num_buckets = num_buckets;
+	}
+
+	struct clid_request *request = calloc(1, sizeof(struct clid_request) + payload_len);
+	if(request == NULL)
+	{
+		return NULL;
+	}
+
+	request->conn = conn;
+	request->kind = kind;
+	request->type = CLID_V2_TYPE(msgno);
+	request->flags = flags;
+	request->payload_len = payload_len;
+	request->timer.index = CLIENT_NO_TIMER;
+	request->timer.is_request = true;
+
+	if(timeout_ms > 0 && !arm_timer(conn->client, &request->timer, get_time_ns() + (uint64_t)timeout_ms * 1000000))
+	{
+		free(request);
+		return NULL;
+	}
+
+	// Never CLID_V2_PUSH_REQUEST_ID, not even once it wrapped
+	if(++conn->next_request_id == CLID_V2_PUSH_REQUEST_ID)
+	{
+		conn->next_request_id++;
+	}
+	request->id = conn->next_request_id;
+
+	return request;
+}
+
+/* Last step of issuing a request, nothing can fail any more */
+static void add_request(struct clid_request *request)
+{
+	struct clid_conn *conn = request->conn;
+	request->prev = conn->last_request;
+	if(conn->last_request != NULL)
+	{
+		conn->last_request->next = request;
+	} else
+	{
+		conn->first_request = request;
+	}
+	conn->last_request = request;
+
+	uint32_t bucket = request->id & (conn->num_buckets - 1);
+	request->next_by_id = conn->buckets[bucket];
+	conn->buckets[bucket] = request;
+	conn->num_requests++;
+
+	if(conn->state == CONN_READY)
+	{
+		send_requests(conn);
+	}
+}
+
+/* Every request not sent yet on v2 but jobs, one at a time. The next one once nothing is in flight on v1 */
+static void send_requests(struct clid_conn *conn)
+{
+	if(conn->proto == CLID_PROTO_V1)
+	{
+		struct clid_request *request = conn->first_request;
+		if(request != NULL && !request->is_sent)
+		{
+			queue_v1_request(conn, request);
+			request->is_sent = true;
+		}
+		return;
+	}
+
+	// A job waits for the one before it to finish, whatever comes after it goes ahead
+	bool is_job_in_flight = false;
+	for(struct clid_request *request = conn->first_request; request != NULL; request = request->next)
+	{
+		bool is_waiting = is_job_in_flight && is_job_request(request);
+		is_job_in_flight = is_job_in_flight || is_job_request(request);
+		if(request->is_sent || is_waiting)
+		{
+			continue;
+		}
+
+		uint8_t header[CLID_V2_MAX_HEADER_SIZE];
+		size_t header_len = clid_v2_encode_header(header, request->type, request->flags, request->id, (uint32_t)request->payload_len);
+		queue_tx(conn, header, header_len);
+		queue_tx(conn, request->payload, request->payload_len);
+		request->is_sent = true;
+	}
+}
+
+/* The v1 frame of a list or exec request, from its v2 payload */
+static void queue_v1_request(struct clid_conn *conn, struct clid_request *request)
+{
+	struct clid_v2_reader reader;
+	clid_v2_reader_init(&reader, request->payload, (uint32_t)request->payload_len);
+
+	if(request->kind == REQUEST_LIST)
+	{
+		uint8_t frame[sizeof(struct ethtcp_header) + sizeof(struct clid_get_list_cmd_request)];
+		uint32_t errorcode = htonl(CLID_STATUS_OK);
+		queue_v1_header(frame, CLID_V1_PROT_REV, CLID_GET_LIST_CMD_REQUEST, sizeof(struct clid_get_list_cmd_request));
+		memcpy(frame + sizeof(struct ethtcp_header), &errorcode, sizeof(errorcode));
+		queue_tx(conn, frame, sizeof(frame));
+		return;
+	}
+
+	// cmd_name, num_args, then every argument including cmd_name again, all strings with their '\0', see tcp_proto.h
+	uint32_t timeout = clid_v2_read_varint(&reader);
+	uint32_t num_args = clid_v2_read_varint(&reader);
+	const uint8_t *args = reader.pos;
+	uint32_t name_len = 0;
+	size_t args_len = 0;
+	for(uint32_t i = 0; i < num_args; i++)
+	{
+		uint32_t arg_len = 0;
+		clid_v2_read_string(&reader, &arg_len);
+		name_len = i == 0 ? arg_len : name_len;
+		args_len += arg_len + 1;
+	}
+
+	size_t output_len = name_len + 1 + sizeof(uint16_t) + args_len;
+	size_t payload_len = offsetof(struct clid_exe_cmd_request, payload) + output_len;
+	uint8_t *frame = reserve_tx(conn, sizeof(struct ethtcp_header) + payload_len);
+	if(frame == NULL)
+	{
+		conn->fail_status = CLID_CLIENT_ERR_NOMEM;
+		add_pending(conn);
+		return;
+	}
+
+	struct clid_exe_cmd_request fields;
+	fields.errorcode = htonl(CLID_STATUS_OK);
+	fields.timeout = htonl(timeout);
+	fields.payload_length = htonl((uint32_t)output_len);
+	queue_v1_header(frame, CLID_V1_PROT_REV, CLID_EXE_CMD_REQUEST, (uint32_t)payload_len);
+	memcpy(frame + sizeof(struct ethtcp_header), &fields, offsetof(struct clid_exe_cmd_request, payload));
+
+	uint8_t *pos = frame + sizeof(struct ethtcp_header) + offsetof(struct clid_exe_cmd_request, payload);
+	clid_v2_reader_init(&reader, args, (uint32_t)(request->payload + request->payload_len - args));
+	for(uint32_t i = 0; i < num_args; i++)
+	{
+		uint32_t arg_len = 0;
+		const char *arg = clid_v2_read_string(&reader, &arg_len);
+		if(i == 0)
+		{
+			memcpy(pos, arg, arg_len);
+			pos[arg_len] = '\0';
+			pos += arg_len + 1;
+
+			uint16_t nr_args = (uint16_t)num_args;
+			memcpy(pos, &nr_args, sizeof(uint16_t));
+			pos += sizeof(uint16_t);
+		}
+
+		memcpy(pos, arg, arg_len);
+		pos[arg_len] = '\0';
+		pos += arg_len + 1;
+	}
+
+	conn->tx_len += sizeof(struct ethtcp_header) + payload_len;
+	add_pending(conn);
+}
+
+static struct clid_request *find_request(const struct clid_conn *conn, uint32_t id)
+{
+	if(conn->num_buckets == 0)
+	{
+		return NULL;
+	}
+
+	struct clid_request *request = conn->buckets[id & (conn->num_buckets - 1)];
+	while(request != NULL && request->id != id)
+	{
+		request = request->next_by_id;
+	}
+
+	return request;
+}
+
+/* Take it off its connection and its timer, without any callback. Freed once clid_client_process() is over */
+static void finish_request(struct clid_request *request)
+{
+	struct clid_conn *conn = request->conn;
+	struct clid_client *client = conn->client;
+	if(request->is_done)
+	{
+		return;
+	}
+	request->is_done = true;
+
+	disarm_timer(client, &request->timer);
+
+	if(request->prev != NULL)
+	{
+		request->prev->next = request->next;
+	} else
+	{
+		conn->first_request = request->next;
+	}
+	if(request->next != NULL)
+	{
+		request->next->prev = request->prev;
+	} else
+	{
+		conn->last_request = request->prev;
+	}
+
+	struct clid_request **iter = &conn->buckets[request->id & (conn->num_buckets - 1)];
+	while(*iter != request)
+	{
+		iter = &(*iter)->next_by_id;
+	}
+	*iter = request->next_by_id;
+	conn->num_requests--;
+
+	// The next job waited for this one
+	if(request->is_sent && is_job_request(request) && conn->proto == CLID_PROTO_V2 && conn->state == CONN_READY && !conn->is_user_done)
+	{
+		send_requests(conn);
+	}
+
+	if(client->is_processing)
+	{
+		request->next_by_id = client->zombie_requests;
+		client->zombie_requests = request;
+	} else
+	{
+		free(request->rx_payload);
+		free(request);
+	}
+}
+
+/* The last callback of the request tells status. Finished before it, as before any last callback, so that the connection may go back to the pool from within */
+static void fail_request(struct clid_request *request, int status)
+{
+	if(request->is_orphan)
+	{
+		finish_request(request);
+		return;
+	}
+
+	if(request->conn->proto == CLID_PROTO_V1 && request->is_sent && request->conn->state == CONN_READY)
+	{
+		// Its reply may still come, it must not be taken for the one of the next request
+		request->is_orphan = true;
+		disarm_timer(request->conn->client, &request->timer);
+	} else
+	{
+		finish_request(request);
+	}
+
+	if(request->kind == REQUEST_LIST)
+	{
+		struct clid_list_reply reply = { .status = status };
+		request->cb.list(request, &reply, request->user_data);
+	} else if(request->kind == REQUEST_EXEC)
+	{
+		struct clid_exec_reply reply = { .status = status, .is_first = request->is_first, .is_last = true };
+		request->cb.exec(request, &reply, request->user_data);
+	} else
+	{
+		request->cb.frame(request, status, NULL, request->user_data);
+	}
+}
+
+/* Cancelled by the user, without any callback */
+static void give_up_request(struct clid_request *request)
+{
+	struct clid_conn *conn = request->conn;
+	if(conn->proto == CLID_PROTO_V1 && request->is_sent && conn->state == CONN_READY)
+	{
+		request->is_orphan = true;
+		disarm_timer(conn->client, &request->timer);
+		return;
+	}
+
+	finish_request(request);
+}
+
+/* Whole v2 CLID_GET_LIST_CMD_REPLY payload */
+static void deliver_list(struct clid_request *request, const uint8_t *payload, size_t len)
+{
+	struct clid_v2_reader reader;
+	clid_v2_reader_init(&reader, payload, (uint32_t)len);
+	struct clid_list_reply reply = { .status = CLID_CLIENT_OK };
+	reply.errorcode = clid_v2_read_varint(&reader);
+	reply.num_cmds = clid_v2_read_varint(&reader);
+
+	// Every command takes two bytes at least, a bigger count is a lie
+	struct clid_cmd_info *cmds = NULL;
+	if(!reader.error && reply.num_cmds > 0)
+	{
+		cmds = reply.num_cmds <= len / 2 ? malloc(reply.num_cmds * sizeof(struct clid_cmd_info)) : NULL;
+		if(cmds == NULL)
+		{
+			fail_request(request, reply.num_cmds <= len / 2 ? CLID_CLIENT_ERR_NOMEM : CLID_CLIENT_ERR_PROTOCOL);
+			return;
+		}
+	}
+
+	for(uint32_t i = 0; i < reply.num_cmds && !reader.error; i++)
+	{
+		cmds[i].name = clid_v2_read_string(&reader, &cmds[i].name_len);
+		cmds[i].desc = clid_v2_read_string(&reader, &cmds[i].desc_len);
+	}
+
+	// Absent from the reply of an older clid
+	if(clid_v2_reader_remaining(&reader) > 0)
+	{
+		reply.registry_epoch = clid_v2_read_varint(&reader);
+		reply.registry_version = clid_v2_read_varint(&reader);
+	}
+
+	if(reader.error)
+	{
+		free(cmds);
+		fail_request(request, CLID_CLIENT_ERR_PROTOCOL);
+		return;
+	}
+
+	reply.cmds = cmds;
+	finish_request(request);
+	request->cb.list(request, &reply, request->user_data);
+	free(cmds);
+}
+
+/* v1 CLID_GET_LIST_CMD_REPLY: errorcode and payload_length in network order, then the commands in host order, see tcp_proto.h */
+static void deliver_v1_list(struct clid_request *request, const uint8_t *payload, size_t len)
+{
+	struct clid_list_reply reply = { .status = CLID_CLIENT_OK };
+	uint32_t payload_length = 0;
+	uint16_t num_cmds = 0;
+	size_t offset = offsetof(struct clid_get_list_cmd_reply, payload);
+	if(len < offset + sizeof(uint16_t))
+	{
+		fail_request(request, CLID_CLIENT_ERR_PROTOCOL);
+		return;
+	}
+
+	memcpy(&reply.errorcode, payload, sizeof(uint32_t));
+	memcpy(&payload_length, payload + sizeof(uint32_t), sizeof(uint32_t));
+	reply.errorcode = ntohl(reply.errorcode);
+	len = ntohl(payload_length) < len - offset ? offset + ntohl(payload_length) : len;
+
+	memcpy(&num_cmds, payload + offset, sizeof(uint16_t));
+	offset += sizeof(uint16_t);
+
+	struct clid_cmd_info *cmds = num_cmds > 0 ? malloc(num_cmds * sizeof(struct clid_cmd_info)) : NULL;
+	if(num_cmds > 0 && cmds == NULL)
+	{
+		fail_request(request, CLID_CLIENT_ERR_NOMEM);
+		return;
+	}
+
+	bool is_valid = true;
+	for(uint16_t i = 0; i < num_cmds && is_valid; i++)
+	{
+		uint16_t name_len = 0;
+		uint16_t desc_len = 0;
+		is_valid = len - offset >= sizeof(uint16_t);
+		if(is_valid)
+		{
+			memcpy(&name_len, payload + offset, sizeof(uint16_t));
+			offset += sizeof(uint16_t);
+			is_valid = len - offset >= (size_t)name_len + sizeof(uint16_t);
+		}
+
+		if(is_valid)
+		{
+			cmds[i].name = (const char *)payload + offset;
+			cmds[i].name_len = name_len;
+			offset += name_len;
+			memcpy(&desc_len, payload + offset, sizeof(uint16_t));
+			offset += sizeof(uint16_t);
+			is_valid = len - offset >= desc_len;
+		}
+
+		if(is_valid)
+		{
+			cmds[i].desc = (const char *)payload + offset;
+			cmds[i].desc_len = desc_len;
+			offset += desc_len;
+		}
+	}
+
+	if(!is_valid)
+	{
+		free(cmds);
+		fail_request(request, CLID_CLIENT_ERR_PROTOCOL);
+		return;
+	}
+
+	reply.num_cmds = num_cmds;
+	reply.cmds = cmds;
+	finish_request(request);
+	request->cb.list(request, &reply, request->user_data);
+	free(cmds);
+}
+
+/* Each fragment goes to the callback as it arrives, the output is never held in full */
+static void deliver_exec(struct clid_request *request, const struct clid_v2_frame *frame)
+{
+	struct clid_v2_reader reader;
+	clid_v2_reader_init(&reader, frame->payload, frame->payload_length);
+	if(frame->type == CLID_V2_TYPE(CLID_EXE_CMD_TIMING))
+	{
+		// Comes right before the reply, always with CLID_V2_FLAG_MORE
+		request->timing.clid_queue_us = clid_v2_read_varint(&reader);
+		request->timing.itc_us = clid_v2_read_varint(&reader);
+		request->timing.cmdif_queue_us = clid_v2_read_varint(&reader);
+		request->timing.handler_us = clid_v2_read_varint(&reader);
+		request->timing.relay_us = clid_v2_read_varint(&reader);
+		request->has_timing = !reader.error;
+		return;
+	} else if(frame->type != CLID_V2_TYPE(CLID_EXE_CMD_REPLY))
+	{
+		return;
+	}
+
+	struct clid_exec_reply reply = { .status = CLID_CLIENT_OK, .is_first = request->is_first };
+	if(request->is_first)
+	{
+		reply.errorcode = clid_v2_read_varint(&reader);
+		reply.result = clid_v2_read_varint(&reader);
+		reply.timing = request->has_timing ? &request->timing : NULL;
+		request->is_first = false;
+		if(reader.error)
+		{
+			fail_request(request, CLID_CLIENT_ERR_PROTOCOL);
+			return;
+		}
+	}
+
+	reply.is_last = (frame->flags & CLID_V2_FLAG_MORE) == 0;
+	reply.output = (const char *)reader.pos;
+	reply.output_len = clid_v2_reader_remaining(&reader);
+	if(reply.is_last)
+	{
+		finish_request(request);
+	}
+	request->cb.exec(request, &reply, request->user_data);
+}
+
+/* v1 CLID_EXE_CMD_REPLY, the whole output in one piece */
+static void deliver_v1_exec(struct clid_request *request, const uint8_t *payload, size_t len)
+{
+	struct clid_exe_cmd_reply rep;
+	size_t offset = offsetof(struct clid_exe_cmd_reply, payload);
+	if(len < offset)
+	{
+		fail_request(request, CLID_CLIENT_ERR_PROTOCOL);
+		return;
+	}
+
+	memcpy(&rep, payload, offset);
+	size_t output_len = ntohl(rep.payload_length) < len - offset ? ntohl(rep.payload_length) : len - offset;
+
+	// v1 outputs carry their '\0', nobody wants it in theirs
+	struct clid_exec_reply reply = { .status = CLID_CLIENT_OK, .is_first = true, .is_last = true };
+	reply.errorcode = ntohl(rep.errorcode);
+	reply.result = ntohl(rep.result);
+	reply.output = (const char *)payload + offset;
+	reply.output_len = strnlen(reply.output, output_len);
+	finish_request(request);
+	request->cb.exec(request, &reply, request->user_data);
+}
+
+/* Only once a reply comes in several fragments, a single one is decoded right where it is */
+static bool gather_payload(struct clid_request *request, const struct clid_v2_frame *frame)
+{
+	if(request->rx_payload == NULL && (frame->flags & CLID_V2_FLAG_MORE) == 0)
+	{
+		return true;
+	} else if(request->rx_len + frame->payload_length > CLID_V2_MAX_PAYLOAD_LENGTH)
+	{
+		return false;
+	}
+
+	uint8_t *new_payload = realloc(request->rx_payload, request->rx_len + frame->payload_length + 1);
+	if(new_payload == NULL)
+	{
+		return false;
+	}
+
+	memcpy(new_payload + request->rx_len, frame->payload, frame->payload_length);
+	request->rx_payload = new_payload;
+	request->rx_len += frame->payload_length;
+	return true;
+}
+
+/* Kept open for the next clid_connect() to its ip, the one released first goes if the pool is full */
+static void pool_conn(struct clid_conn *conn)
+{
+	struct clid_client *client = conn->client;
+	if(client->num_idle >= client->config.max_idle_conns)
+	{
+		shut_conn(client->first_idle);
+	}
+
+	conn->state = CONN_IDLE;
+	conn->conn_cb = NULL;
+	conn->push_cb = NULL;
+	conn->user_data = NULL;
+
+	conn->prev_idle = client->last_idle;
+	conn->next_idle = NULL;
+	if(client->last_idle != NULL)
+	{
+		client->last_idle->next_idle = conn;
+	} else
+	{
+		client->first_idle = conn;
+	}
+	client->last_idle = conn;
+
+	uint32_t bucket = hash_ip(conn->ip) & (client->num_idle_buckets - 1);
+	conn->next_in_bucket = client->idle_buckets[bucket];
+	client->idle_buckets[bucket] = conn;
+	client->num_idle++;
+}
+
+static void unpool_conn(struct clid_conn *conn)
+{
+	struct clid_client *client = conn->client;
+	if(conn->prev_idle != NULL)
+	{
+		conn->prev_idle->next_idle = conn->next_idle;
+	} else
+	{
+		client->first_idle = conn->next_idle;
+	}
+	if(conn->next_idle != NULL)
+	{
+		conn->next_idle->prev_idle = conn->prev_idle;
+	} else
+	{
+		client->last_idle = conn->prev_idle;
+	}
+
+	struct clid_conn **iter = &client->idle_buckets[hash_ip(conn->ip) & (client->num_idle_buckets - 1)];
+	while(*iter != conn)
+	{
+		iter = &(*iter)->next_in_bucket;
+	}
+	*iter = conn->next_in_bucket;
+	client->num_idle--;
+}
+
+static struct clid_conn *take_pooled_conn(struct clid_client *client, const char *ip)
+{
+	struct clid_conn *conn = client->idle_buckets[hash_ip(ip) & (client->num_idle_buckets - 1)];
+	while(conn != NULL && strcmp(conn->ip, ip) != 0)
+	{
+		conn = conn->next_in_bucket;
+	}
+
+	if(conn != NULL)
+	{
+		unpool_conn(conn);
+		conn->state = CONN_READY;
+		conn->is_user_done = false;
+	}
+
+	return conn;
+}
+
+/* FNV-1a */
+static uint32_t hash_ip(const char *ip)
+{
+	uint32_t hash = 2166136261u;
+	for(const char *c = ip; *c != '\0'; c++)
+	{
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	}
+
+	return hash;
+}
+
+/* Move the timer to deadline_ns, armed or not */
+static bool arm_timer(struct clid_client *client, struct clid_timer *timer, uint64_t deadline_ns)
+{
+	if(timer->index == CLIENT_NO_TIMER)
+	{
+		if(client->num_timers == client->timers_cap)
+		{
+			uint32_t new_cap = client->timers_cap ? client->timers_cap * 2 : 64;
+			struct clid_timer **new_timers = realloc(client->timers, new_cap * sizeof(struct clid_timer *));
+			if(new_timers == NULL)
+			{
+				return false;
+			}
+			client->timers = new_timers;
+			client->timers_cap = new_cap;
+		}
+
+		timer->index = client->num_timers++;
+		client->timers[timer->index] = timer;
+	}
+
+	timer->deadline_ns = deadline_ns;
+	sift_timer(client, timer->index);
+	return true;
+}
+
+static void disarm_timer(struct clid_client *client, struct clid_timer *timer)
+{
+	uint32_t index = timer->index;
+	if(index == CLIENT_NO_TIMER)
+	{
+		return;
+	}
+
+	timer->index = CLIENT_NO_TIMER;
+	if(index != --client->num_timers)
+	{
+		client->timers[index] = client->timers[client->num_timers];
+		client->timers[index]->index = index;
+		sift_timer(client, index);
+	}
+}
+
+/* Restore the heap order around index, up or down whichever is needed */
+static void sift_timer(struct clid_client *client, uint32_t index)
+{
+	while(index > 0 && client->timers[index]->deadline_ns < client->timers[(index - 1) / 2]->deadline_ns)
+	{
+		swap_timers(client, index, (index - 1) / 2);
+		index = (index - 1) / 2;
+	}
+
+	while(1)
+	{
+		uint32_t smallest = index;
+		uint32_t left = 2 * index + 1;
+		uint32_t right = left + 1;
+		if(left < client->num_timers && client->timers[left]->deadline_ns < client->timers[smallest]->deadline_ns)
+		{
+			smallest = left;
+		}
+		if(right < client->num_timers && client->timers[right]->deadline_ns < client->timers[smallest]->deadline_ns)
+		{
+			smallest = right;
+		}
+
+		if(smallest == index)
+		{
+			break;
+		}
+
+		swap_timers(client, index, smallest);
+		index = smallest;
+	}
+}
+
+static void swap_timers(struct clid_client *client, uint32_t a, uint32_t b)
+{
+	struct clid_timer *timer = client->timers[a];
+	client->timers[a] = client->timers[b];
+	client->timers[b] = timer;
+	client->timers[a]->index = a;
+	client->timers[b]->index = b;
+}
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
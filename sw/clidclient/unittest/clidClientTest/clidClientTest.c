@@ -0,0 +1,526 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "clid_client.h"
+#include "tcp_proto.h"
+#include "tcp_proto_v2.h"
+
+#define TEST_IP			"127.0.0.1"
+#define TEST_PORT_V2		34401
+#define TEST_PORT_V1		34402
+#define TEST_PORT_CLOSED	34403
+#define TEST_EPOCH		7
+#define TEST_VERSION		3
+#define TEST_WAIT_MS		5000
+
+/* Fake clid, one thread per connection. Like clid it runs one job per connection, a new exec or batch supersedes the one
+still running and that one is never answered. A "defer" command runs until the next list request was answered, a batch for ever */
+struct fake_clid {
+	uint16_t	port;
+	bool		is_v1; // Drops CLID_HELLO_REQUEST, like a clid older than v2
+	int		listen_fd;
+	int		num_accepted;
+};
+
+struct fake_conn {
+	struct fake_clid	*clid;
+	int			fd;
+};
+
+struct test_state {
+	int		conn_status;
+	bool		is_conn_done;
+	int		num_replies;
+	int		order[4];
+	char		outputs[4][64];
+	int		statuses[4];
+	uint32_t	num_cmds;
+	uint32_t	registry_epoch;
+	char		first_cmd[16];
+};
+
+static struct fake_clid m_clid_v2 = { .port = TEST_PORT_V2 };
+static struct fake_clid m_clid_v1 = { .port = TEST_PORT_V1, .is_v1 = true };
+
+static bool recv_all(int fd, void *buff, size_t len)
+{
+	size_t offset = 0;
+	while(offset < len)
+	{
+		ssize_t res = recv(fd, (uint8_t *)buff + offset, len - offset, 0);
+		if(res <= 0)
+		{
+			return false;
+		}
+		offset += res;
+	}
+
+	return true;
+}
+
+static void send_v1_frame(int fd, uint32_t protrev, uint32_t msgno, const void *payload, uint32_t payload_len)
+{
+	struct ethtcp_header header = { htonl(1), htonl(CLID_V1_RECEIVER), htonl(protrev), htonl(msgno), htonl(payload_len) };
+	uint8_t frame[sizeof(header) + 256];
+	memcpy(frame, &header, sizeof(header));
+	if(payload_len > 0)
+	{
+		memcpy(frame + sizeof(header), payload, payload_len);
+	}
+	send(fd, frame, sizeof(header) + payload_len, MSG_NOSIGNAL);
+}
+
+static void send_v2_frame(int fd, uint32_t msgno, uint8_t flags, uint32_t request_id, const uint8_t *payload, uint32_t payload_len)
+{
+	uint8_t frame[CLID_V2_MAX_HEADER_SIZE + 256];
+	size_t header_len = clid_v2_encode_header(frame, CLID_V2_TYPE(msgno), flags, request_id, payload_len);
+	memcpy(frame + header_len, payload, payload_len);
+	send(fd, frame, header_len + payload_len, MSG_NOSIGNAL);
+}
+
+static void send_v2_exec_reply(int fd, uint32_t request_id, const char *name, uint32_t name_len, const char *arg, uint32_t arg_len)
+{
+	uint8_t payload[128];
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, payload, sizeof(payload));
+	clid_v2_write_varint(&writer, CLID_STATUS_OK);
+	clid_v2_write_varint(&writer, CLID_EXE_CMD_RESULT_SUCCESS);
+	clid_v2_write_bytes(&writer, name, name_len);
+	clid_v2_write_bytes(&writer, ":", 1);
+	clid_v2_write_bytes(&writer, arg, arg_len);
+	send_v2_frame(fd, CLID_EXE_CMD_REPLY, 0, request_id, payload, writer.len);
+}
+
+/* The list in two fragments, so that the client has to gather them */
+static void send_v2_list_reply(int fd, uint32_t request_id)
+{
+	uint8_t payload[64];
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, payload, sizeof(payload));
+	clid_v2_write_varint(&writer, CLID_STATUS_OK);
+	clid_v2_write_varint(&writer, 2);
+	clid_v2_write_string(&writer, "abc", 3);
+	clid_v2_write_string(&writer, "Test abc", 8);
+	clid_v2_write_string(&writer, "def", 3);
+	clid_v2_write_string(&writer, "Test def", 8);
+	clid_v2_write_varint(&writer, TEST_EPOCH);
+	clid_v2_write_varint(&writer, TEST_VERSION);
+
+	send_v2_frame(fd, CLID_GET_LIST_CMD_REPLY, CLID_V2_FLAG_MORE, request_id, payload, 5);
+	send_v2_frame(fd, CLID_GET_LIST_CMD_REPLY, 0, request_id, payload + 5, writer.len - 5);
+}
+
+static void serve_v2(int fd)
+{
+	uint32_t deferred_id = 0;
+	char deferred_arg[16];
+	uint32_t deferred_len = 0;
+	uint8_t buff[4096];
+	size_t len = 0;
+	while(1)
+	{
+		struct clid_v2_frame frame;
+		long frame_size = clid_v2_decode_frame(buff, len, &frame);
+		if(frame_size < 0)
+		{
+			return;
+		} else if(frame_size == 0)
+		{
+			ssize_t res = recv(fd, buff + len, sizeof(buff) - len, 0);
+			if(res <= 0)
+			{
+				return;
+			}
+			len += res;
+			continue;
+		}
+
+		struct clid_v2_reader reader;
+		clid_v2_reader_init(&reader, frame.payload, frame.payload_length);
+		if(frame.type == CLID_V2_TYPE(CLID_GET_LIST_CMD_REQUEST))
+		{
+			send_v2_list_reply(fd, frame.request_id);
+			if(deferred_id != 0)
+			{
+				send_v2_exec_reply(fd, deferred_id, "defer", 5, deferred_arg, deferred_len);
+				deferred_id = 0;
+			}
+		} else if(frame.type == CLID_V2_TYPE(CLID_EXE_CMD_REQUEST))
+		{
+			uint32_t name_len = 0;
+			uint32_t arg_len = 0;
+			clid_v2_read_varint(&reader);
+			clid_v2_read_varint(&reader);
+			const char *name = clid_v2_read_string(&reader, &name_len);
+			const char *arg = clid_v2_read_string(&reader, &arg_len);
+			deferred_id = 0;
+			if(name_len == 5 && memcmp(name, "defer", 5) == 0 && arg_len < sizeof(deferred_arg))
+			{
+				deferred_id = frame.request_id;
+				memcpy(deferred_arg, arg, arg_len);
+				deferred_len = arg_len;
+			} else
+			{
+				send_v2_exec_reply(fd, frame.request_id, name, name_len, arg, arg_len);
+			}
+		} else if(frame.type == CLID_V2_TYPE(CLID_EXE_BATCH_REQUEST))
+		{
+			deferred_id = 0;
+		}
+
+		memmove(buff, buff + frame_size, len - frame_size);
+		len -= frame_size;
+	}
+}
+
+static void serve_v1(int fd)
+{
+	struct ethtcp_header header;
+	uint8_t payload[1024];
+	while(recv_all(fd, &header, sizeof(header)) && ntohl(header.payloadLen) <= sizeof(payload)
+		&& recv_all(fd, payload, ntohl(header.payloadLen)))
+	{
+		if(ntohl(header.msgno) == CLID_GET_LIST_CMD_REQUEST)
+		{
+			uint8_t reply[64];
+			uint32_t fields[2] = { htonl(CLID_STATUS_OK), htonl(2 + 2 + 3 + 2 + 8) };
+			uint16_t num_cmds = 1;
+			uint16_t name_len = 3;
+			uint16_t desc_len = 8;
+			memcpy(reply, fields, 8);
+			memcpy(reply + 8, &num_cmds, 2);
+			memcpy(reply + 10, &name_len, 2);
+			memcpy(reply + 12, "abc", 3);
+			memcpy(reply + 15, &desc_len, 2);
+			memcpy(reply + 17, "Test abc", 8);
+			send_v1_frame(fd, CLID_V1_PROT_REV, CLID_GET_LIST_CMD_REPLY, reply, 25);
+		} else if(ntohl(header.msgno) == CLID_EXE_CMD_REQUEST)
+		{
+			// cmd_name, num_args, then the arguments again with cmd_name first, see tcp_proto.h
+			const char *name = (const char *)payload + 12;
+			const char *arg = name + strlen(name) + 1 + 2 + strlen(name) + 1;
+			uint8_t reply[128];
+			int output_len = snprintf((char *)reply + 12, sizeof(reply) - 12, "%s:%s", name, arg) + 1;
+			uint32_t fields[3] = { htonl(CLID_STATUS_OK), htonl(CLID_EXE_CMD_RESULT_SUCCESS), htonl(output_len) };
+			memcpy(reply, fields, 12);
+			send_v1_frame(fd, CLID_V1_PROT_REV, CLID_EXE_CMD_REPLY, reply, 12 + output_len);
+		}
+	}
+}
+
+static void *fake_conn_thread(void *arg)
+{
+	struct fake_conn *conn = arg;
+	struct ethtcp_header hello;
+	if(recv_all(conn->fd, &hello, sizeof(hello)) && ntohl(hello.msgno) == CLID_HELLO_REQUEST)
+	{
+		if(conn->clid->is_v1)
+		{
+			serve_v1(conn->fd);
+		} else
+		{
+			send_v1_frame(conn->fd, CLID_PROTO_V2, CLID_HELLO_REPLY, NULL, 0);
+			serve_v2(conn->fd);
+		}
+	}
+
+	close(conn->fd);
+	free(conn);
+	return NULL;
+}
+
+static void *fake_clid_thread(void *arg)
+{
+	struct fake_clid *clid = arg;
+	while(1)
+	{
+		int fd = accept(clid->listen_fd, NULL, NULL);
+		if(fd < 0)
+		{
+			return NULL;
+		}
+
+		__atomic_add_fetch(&clid->num_accepted, 1, __ATOMIC_SEQ_CST);
+		struct fake_conn *conn = malloc(sizeof(struct fake_conn));
+		conn->clid = clid;
+		conn->fd = fd;
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, fake_conn_thread, conn);
+		pthread_detach(thread);
+	}
+}
+
+static bool start_fake_clid(struct fake_clid *clid)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(clid->port) };
+	inet_pton(AF_INET, TEST_IP, &addr.sin_addr);
+	int enable = 1;
+	clid->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(clid->listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+	if(bind(clid->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(clid->listen_fd, 16) < 0)
+	{
+		printf("Failed to listen on port %u, errno = %d!\n", clid->port, errno);
+		return false;
+	}
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, fake_clid_thread, clid);
+	pthread_detach(thread);
+	return true;
+}
+
+static uint64_t get_time_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Drive the client like an event loop would, until *counter reaches target */
+static bool run_until(struct clid_client *client, const int *counter, int target)
+{
+	uint64_t deadline = get_time_ms() + TEST_WAIT_MS;
+	while(*counter < target && get_time_ms() < deadline)
+	{
+		clid_client_run(client, 100);
+	}
+
+	return *counter >= target;
+}
+
+static void handle_conn(struct clid_conn *conn, int status, void *user_data)
+{
+	(void)conn;
+	struct test_state *state = user_data;
+	state->conn_status = status;
+	state->is_conn_done = true;
+}
+
+static void handle_list(struct clid_request *request, const struct clid_list_reply *reply, void *user_data)
+{
+	(void)request;
+	struct test_state *state = user_data;
+	state->statuses[state->num_replies] = reply->status;
+	if(reply->status == CLID_CLIENT_OK)
+	{
+		state->num_cmds = reply->num_cmds;
+		state->registry_epoch = reply->registry_epoch;
+		snprintf(state->first_cmd, sizeof(state->first_cmd), "%.*s", (int)reply->cmds[0].name_len, reply->cmds[0].name);
+	}
+	state->num_replies++;
+}
+
+/* user_data of each exec is its index, the state is global to keep it simple */
+static struct test_state m_state;
+
+static void handle_exec(struct clid_request *request, const struct clid_exec_reply *reply, void *user_data)
+{
+	(void)request;
+	int index = (int)(intptr_t)user_data;
+	m_state.statuses[index] = reply->status;
+	if(reply->status == CLID_CLIENT_OK)
+	{
+		snprintf(m_state.outputs[index], sizeof(m_state.outputs[index]), "%.*s", (int)reply->output_len, reply->output);
+	}
+	m_state.order[m_state.num_replies++] = index;
+}
+
+static void handle_frame(struct clid_request *request, int status, const struct clid_v2_frame *frame, void *user_data)
+{
+	(void)request;
+	(void)frame;
+	int index = (int)(intptr_t)user_data;
+	m_state.statuses[index] = status;
+	m_state.order[m_state.num_replies++] = index;
+}
+
+/* Releases the connection right from within the last callback, as a fan-out does */
+static void handle_exec_release(struct clid_request *request, const struct clid_exec_reply *reply, void *user_data)
+{
+	handle_exec(request, reply, (void *)(intptr_t)2);
+	if(reply->is_last)
+	{
+		clid_conn_release(user_data);
+	}
+}
+
+static struct clid_request *exec_cmd(struct clid_conn *conn, const char *name, const char *arg, int index)
+{
+	const char *args[] = { name, arg };
+	return clid_exec(conn, 0, 2, args, 0, handle_exec, (void *)(intptr_t)index);
+}
+
+static bool test_list(struct clid_client *client)
+{
+	struct test_state state = {0};
+	struct clid_conn *conn = clid_connect(client, TEST_IP, handle_conn, NULL, &state);
+	bool is_passed = conn != NULL && clid_list(conn, 0, 0, 0, handle_list, &state) != NULL
+		&& run_until(client, &state.num_replies, 1)
+		&& state.conn_status == CLID_CLIENT_OK && clid_conn_get_proto(conn) == CLID_PROTO_V2
+		&& state.statuses[0] == CLID_CLIENT_OK && state.num_cmds == 2 && strcmp(state.first_cmd, "abc") == 0
+		&& state.registry_epoch == TEST_EPOCH;
+
+	if(conn != NULL)
+	{
+		clid_conn_close(conn);
+	}
+	printf("test_list -> %s\n", is_passed ? "PASS" : "FAIL");
+	return is_passed;
+}
+
+/* Issued before the connection is up. The execs wait for each other, none is superseded, the list goes ahead of them */
+static bool test_pipelined_execs(struct clid_client *client)
+{
+	struct test_state state = {0};
+	struct test_state list_state = {0};
+	memset(&m_state, 0, sizeof(m_state));
+	struct clid_conn *conn = clid_connect(client, TEST_IP, handle_conn, NULL, &state);
+	bool is_passed = conn != NULL && exec_cmd(conn, "defer", "a", 0) != NULL && exec_cmd(conn, "echo", "b", 1) != NULL
+		&& clid_list(conn, 0, 0, 0, handle_list, &list_state) != NULL && exec_cmd(conn, "echo", "c", 2) != NULL
+		&& run_until(client, &m_state.num_replies, 3) && list_state.num_replies == 1 && list_state.statuses[0] == CLID_CLIENT_OK
+		&& m_state.order[0] == 0 && m_state.order[1] == 1 && m_state.order[2] == 2
+		&& strcmp(m_state.outputs[0], "defer:a") == 0 && strcmp(m_state.outputs[1], "echo:b") == 0
+		&& strcmp(m_state.outputs[2], "echo:c") == 0;
+
+	if(conn != NULL)
+	{
+		clid_conn_close(conn);
+	}
+	printf("test_pipelined_execs -> %s\n", is_passed ? "PASS" : "FAIL");
+	return is_passed;
+}
+
+/* A request with no reply times out alone, the connection goes on */
+static bool test_timeout(struct clid_client *client)
+{
+	struct test_state state = {0};
+	memset(&m_state, 0, sizeof(m_state));
+	struct clid_conn *conn = clid_connect(client, TEST_IP, handle_conn, NULL, &state);
+	uint64_t start = get_time_ms();
+	bool is_passed = conn != NULL
+		&& clid_send_request(conn, CLID_EXE_BATCH_REQUEST, 0, NULL, 0, 200, handle_frame, (void *)(intptr_t)0) != NULL
+		&& run_until(client, &m_state.num_replies, 1) && m_state.statuses[0] == CLID_CLIENT_ERR_TIMEOUT
+		&& get_time_ms() - start >= 200 && exec_cmd(conn, "echo", "d", 1) != NULL
+		&& run_until(client, &m_state.num_replies, 2) && strcmp(m_state.outputs[1], "echo:d") == 0;
+
+	if(conn != NULL)
+	{
+		clid_conn_close(conn);
+	}
+	printf("test_timeout -> %s\n", is_passed ? "PASS" : "FAIL");
+	return is_passed;
+}
+
+/* A released connection is taken over by the next clid_connect(), nothing new is accepted. Also when released from a callback */
+static bool test_pool_reuse(struct clid_client *client)
+{
+	struct test_state state = {0};
+	memset(&m_state, 0, sizeof(m_state));
+	struct clid_conn *conn = clid_connect(client, TEST_IP, handle_conn, NULL, &state);
+	bool is_passed = conn != NULL && exec_cmd(conn, "echo", "e", 0) != NULL && run_until(client, &m_state.num_replies, 1);
+	if(conn != NULL)
+	{
+		clid_conn_release(conn);
+	}
+
+	int num_accepted = __atomic_load_n(&m_clid_v2.num_accepted, __ATOMIC_SEQ_CST);
+	struct test_state state2 = {0};
+	conn = is_passed ? clid_connect(client, TEST_IP, handle_conn, NULL, &state2) : NULL;
+	is_passed = conn != NULL && exec_cmd(conn, "echo", "f", 1) != NULL && run_until(client, &m_state.num_replies, 2)
+		&& state2.is_conn_done && state2.conn_status == CLID_CLIENT_OK && strcmp(m_state.outputs[1], "echo:f") == 0
+		&& __atomic_load_n(&m_clid_v2.num_accepted, __ATOMIC_SEQ_CST) == num_accepted;
+
+	const char *args[] = { "echo", "g" };
+	is_passed = is_passed && clid_exec(conn, 0, 2, args, 0, handle_exec_release, conn) != NULL && run_until(client, &m_state.num_replies, 3);
+	conn = is_passed ? NULL : conn;
+
+	struct test_state state3 = {0};
+	conn = is_passed ? clid_connect(client, TEST_IP, handle_conn, NULL, &state3) : conn;
+	is_passed = is_passed && conn != NULL && exec_cmd(conn, "echo", "h", 3) != NULL && run_until(client, &m_state.num_replies, 4)
+		&& strcmp(m_state.outputs[3], "echo:h") == 0 && __atomic_load_n(&m_clid_v2.num_accepted, __ATOMIC_SEQ_CST) == num_accepted;
+
+	if(conn != NULL)
+	{
+		clid_conn_close(conn);
+	}
+	printf("test_pool_reuse -> %s\n", is_passed ? "PASS" : "FAIL");
+	return is_passed;
+}
+
+/* HELLO is dropped, the connection goes on in v1 after CLID_HELLO_TIMEOUT_MS, one request in flight at a time */
+static bool test_v1_fallback(void)
+{
+	struct clid_client_config config = { .port = TEST_PORT_V1 };
+	struct clid_client *client = clid_client_create(&config);
+	struct test_state state = {0};
+	memset(&m_state, 0, sizeof(m_state));
+	struct clid_conn *conn = clid_connect(client, TEST_IP, handle_conn, NULL, &state);
+	bool is_passed = conn != NULL && exec_cmd(conn, "echo", "g", 0) != NULL && exec_cmd(conn, "echo", "h", 1) != NULL
+		&& run_until(client, &m_state.num_replies, 2) && clid_conn_get_proto(conn) == CLID_PROTO_V1
+		&& strcmp(m_state.outputs[0], "echo:g") == 0 && strcmp(m_state.outputs[1], "echo:h") == 0
+		&& clid_send_request(conn, CLID_EXE_BATCH_REQUEST, 0, NULL, 0, 0, handle_frame, NULL) == NULL && errno == EPROTONOSUPPORT;
+
+	struct test_state list_state = {0};
+	is_passed = is_passed && clid_list(conn, 0, 0, 0, handle_list, &list_state) != NULL
+		&& run_until(client, &list_state.num_replies, 1) && list_state.statuses[0] == CLID_CLIENT_OK
+		&& list_state.num_cmds == 1 && strcmp(list_state.first_cmd, "abc") == 0 && list_state.registry_epoch == 0;
+
+	clid_client_destroy(client);
+	printf("test_v1_fallback -> %s\n", is_passed ? "PASS" : "FAIL");
+	return is_passed;
+}
+
+static bool test_connect_refused(void)
+{
+	struct clid_client_config config = { .port = TEST_PORT_CLOSED };
+	struct clid_client *client = clid_client_create(&config);
+	struct test_state state = {0};
+	memset(&m_state, 0, sizeof(m_state));
+	struct clid_conn *conn = clid_connect(client, TEST_IP, handle_conn, NULL, &state);
+	bool is_passed = conn != NULL && exec_cmd(conn, "echo", "i", 0) != NULL && run_until(client, &m_state.num_replies, 1)
+		&& m_state.statuses[0] == CLID_CLIENT_ERR_CONNECT && state.is_conn_done && state.conn_status == CLID_CLIENT_ERR_CONNECT;
+
+	clid_client_destroy(client);
+	printf("test_connect_refused -> %s\n", is_passed ? "PASS" : "FAIL");
+	return is_passed;
+}
+
+int main()
+{
+	if(!start_fake_clid(&m_clid_v2) || !start_fake_clid(&m_clid_v1))
+	{
+		return 1;
+	}
+
+	struct clid_client_config config = { .port = TEST_PORT_V2, .max_idle_conns = 4 };
+	struct clid_client *client = clid_client_create(&config);
+	if(client == NULL)
+	{
+		printf("Failed to create clid client, errno = %d!\n", errno);
+		return 1;
+	}
+
+	bool is_passed = true;
+	is_passed &= test_list(client);
+	is_passed &= test_pipelined_execs(client);
+	is_passed &= test_timeout(client);
+	is_passed &= test_pool_reuse(client);
+	is_passed &= test_v1_fallback();
+	is_passed &= test_connect_refused();
+	clid_client_destroy(client);
+
+	printf("%s\n", is_passed ? "All tests PASSED" : "Some tests FAILED");
+	return is_passed ? 0 : 1;
+}
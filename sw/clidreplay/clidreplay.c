@@ -0,0 +1,995 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "tcp_proto.h"
+#include "tcp_proto_v2.h"
+#include "clid_capture.h"
+
+
+/*
+*  clidreplay re-drives a capture written by "clid -r <file>" against a running clid.
+*  Every recorded shell connection gets its own connection again and sends exactly the frames it recorded,
+*  at their original pace, at a scaled pace or as fast as possible. Like a real shell, a connection never
+*  sends its next frame before the reply to the previous one arrived, so a slower clid shows up as lag
+*  instead of piling up requests. Use it together with replayHandler (see README.md), which answers
+*  with the outputs recorded in the same capture.
+*/
+
+
+/*****************************************************************************\/
+*****                           INTERNAL TYPES                             *****
+*******************************************************************************/
+#define TCP_CLID_PORT		33333
+#define CMD_EXECUTION_TIMEOUT	30 // seconds
+#define RX_CHUNK		4096
+#define MAX_EPOLL_EVENTS	256
+#define NSEC_PER_SEC		1000000000ULL
+#define NSEC_PER_MSEC		1000000ULL
+#define NSEC_PER_USEC		1000ULL
+
+enum replay_event_kind {
+	REPLAY_CONNECT,
+	REPLAY_SEND,
+	REPLAY_CLOSE
+};
+
+struct replay_event {
+	enum replay_event_kind	kind;
+	uint64_t		time_us;	// Relative to the first record of the replayed session
+	const uint8_t		*frame;		// Points into the mapped capture file
+	uint32_t		frame_len;
+};
+
+struct replay_conn {
+	int			fd;
+	struct replay_event	*events;
+	size_t			nr_events;
+	size_t			cap_events;
+	size_t			next_event;
+	uint8_t			proto;
+	bool			is_awaiting_reply;
+	bool			is_awaiting_hello;
+	uint32_t		request_id;	// v2 only, of the awaited reply
+	uint64_t		sent_ns;
+	uint64_t		deadline_ns;
+	uint8_t			*rx_buff;
+	size_t			rx_len;
+	size_t			rx_cap;
+	int			heap_idx;	// Position in m_heap, -1 if not scheduled
+	bool			is_finished;
+};
+
+struct replay_config {
+	char			ip[INET_ADDRSTRLEN];
+	uint16_t		port;
+	double			speed;		// 0 means as fast as possible
+	uint32_t		session;	// 1-based
+	uint64_t		timeout_ns;
+	const char		*path;
+};
+
+
+/*****************************************************************************\/
+*****                          INTERNAL VARIABLES                          *****
+*******************************************************************************/
+static volatile bool m_is_sigint = false;
+static struct replay_config m_config = {
+	.ip = "127.0.0.1",
+	.port = TCP_CLID_PORT,
+	.speed = 1.0,
+	.session = 1,
+	.timeout_ns = CMD_EXECUTION_TIMEOUT * NSEC_PER_SEC,
+	.path = NULL
+};
+static struct replay_conn *m_conns = NULL;
+static size_t m_nr_conns = 0;
+static size_t m_cap_conns = 0;
+static int *m_heap = NULL; // Min-heap of conns by due time of their next event, awaiting conns are not in it
+static size_t m_heap_len = 0;
+static size_t m_nr_finished = 0;
+static uint64_t m_start_ns = 0;
+static uint64_t *m_latencies = NULL;
+static size_t m_nr_latencies = 0;
+static size_t m_cap_latencies = 0;
+static uint64_t m_nr_sessions = 0;
+static uint64_t m_nr_records = 0;
+static uint64_t m_nr_jobs = 0;
+static uint64_t m_capture_duration_us = 0;
+static uint64_t m_nr_sent = 0;
+static uint64_t m_nr_replies = 0;
+static uint64_t m_nr_timeouts = 0;
+static uint64_t m_nr_skipped = 0;
+static uint64_t m_nr_failed_conns = 0;
+static uint64_t m_total_lag_ns = 0;
+static uint64_t m_max_lag_ns = 0;
+
+
+/*****************************************************************************\/
+*****                     INTERNAL FUNCTIONS PROTOTYPES                    *****
+*******************************************************************************/
+static void sigint_handler(int sig_no);
+static void print_usage(const char *prog);
+static bool parse_arguments(int argc, char **argv);
+static uint64_t get_time_ns(void);
+static bool load_capture(const uint8_t *buff, size_t len);
+static struct replay_conn *new_replay_conn(void);
+static bool add_replay_event(struct replay_conn *conn, enum replay_event_kind kind, uint64_t time_us, const uint8_t *frame, uint32_t frame_len);
+static uint64_t due_time_ns(const struct replay_conn *conn);
+static void heap_push(int conn_idx);
+static int heap_pop(void);
+static void heap_swap(size_t a, size_t b);
+static void run_next_event(struct replay_conn *conn, int epfd, uint64_t now);
+static void reschedule(struct replay_conn *conn);
+static bool connect_replay_conn(struct replay_conn *conn, int epfd);
+static void close_replay_conn(struct replay_conn *conn);
+static bool send_frame(struct replay_conn *conn, const uint8_t *frame, uint32_t frame_len, uint64_t now);
+static int send_data(int sockfd, const void *tx_buff, size_t nr_bytes_to_send);
+static bool handle_readable(struct replay_conn *conn, uint64_t now);
+static int decode_v1_reply(struct replay_conn *conn, const uint8_t *buff, size_t len, bool *is_done);
+static int decode_v2_reply(struct replay_conn *conn, const uint8_t *buff, size_t len, bool *is_done);
+static void complete_reply(struct replay_conn *conn, uint64_t now, bool is_timeout);
+static void check_timeouts(uint64_t now);
+static int compare_u64(const void *pa, const void *pb);
+static void print_report(uint64_t elapsed_ns);
+
+
+
+
+/*****************************************************************************\/
+*****                             MAIN FUNCTION                            *****
+*******************************************************************************/
+int main(int argc, char **argv)
+{
+	if(!parse_arguments(argc, argv))
+	{
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGINT, sigint_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	int capfd = open(m_config.path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if(capfd < 0 || fstat(capfd, &st) < 0)
+	{
+		printf("Failed to open capture file %s, errno = %d!\n", m_config.path, errno);
+		return EXIT_FAILURE;
+	}
+
+	if(st.st_size < CLID_CAPTURE_MAGIC_SIZE)
+	{
+		printf("Capture file %s is too short!\n", m_config.path);
+		return EXIT_FAILURE;
+	}
+
+	// Frames are sent straight out of the mapping, nothing is copied
+	uint8_t *capture = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, capfd, 0);
+	close(capfd);
+	if(capture == MAP_FAILED)
+	{
+		printf("Failed to mmap capture file %s, errno = %d!\n", m_config.path, errno);
+		return EXIT_FAILURE;
+	}
+
+	if(!load_capture(capture, st.st_size))
+	{
+		munmap(capture, st.st_size);
+		return EXIT_FAILURE;
+	}
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0)
+	{
+		printf("Failed to epoll_create1(), errno = %d!\n", errno);
+		return EXIT_FAILURE;
+	}
+
+	printf("clidreplay: session %u of %" PRIu64 " in %s, %" PRIu64 " records, %zu connections, %" PRIu64 " jobs, %.3f s recorded\n",
+		m_config.session, m_nr_sessions, m_config.path, m_nr_records, m_nr_conns, m_nr_jobs, (double)m_capture_duration_us / 1000000);
+	if(m_config.speed > 0)
+	{
+		printf("clidreplay: replaying to tcp://%s:%hu at %.2fx speed\n", m_config.ip, m_config.port, m_config.speed);
+	} else
+	{
+		printf("clidreplay: replaying to tcp://%s:%hu as fast as possible\n", m_config.ip, m_config.port);
+	}
+
+	m_start_ns = get_time_ns();
+	for(size_t i = 0; i < m_nr_conns; i++)
+	{
+		reschedule(&m_conns[i]);
+	}
+
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	uint64_t now = m_start_ns;
+	uint64_t next_timeout_check_ns = m_start_ns;
+	while(!m_is_sigint && m_nr_finished < m_nr_conns)
+	{
+		while(m_heap_len > 0 && due_time_ns(&m_conns[m_heap[0]]) <= now)
+		{
+			struct replay_conn *conn = &m_conns[heap_pop()];
+			run_next_event(conn, epfd, now);
+			reschedule(conn);
+		}
+
+		int timeout_ms = 10;
+		if(m_heap_len > 0)
+		{
+			uint64_t due = due_time_ns(&m_conns[m_heap[0]]);
+			timeout_ms = due > now ? (int)((due - now) / NSEC_PER_MSEC) : 0;
+			timeout_ms = timeout_ms > 10 ? 10 : timeout_ms;
+		}
+
+		int nr_events = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, timeout_ms);
+		if(nr_events < 0 && errno != EINTR)
+		{
+			printf("Failed to epoll_wait(), errno = %d!\n", errno);
+			break;
+		}
+
+		now = get_time_ns();
+		for(int i = 0; i < nr_events; i++)
+		{
+			struct replay_conn *conn = &m_conns[events[i].data.u32];
+			if(!handle_readable(conn, now))
+			{
+				// The rest of this connection's frames are skipped, as a shell would have lost them as well
+				close_replay_conn(conn);
+				m_nr_failed_conns++;
+				if(conn->is_awaiting_reply)
+				{
+					conn->is_awaiting_reply = false;
+					reschedule(conn);
+				}
+			}
+		}
+
+		if(now >= next_timeout_check_ns)
+		{
+			check_timeouts(now);
+			next_timeout_check_ns = now + 10 * NSEC_PER_MSEC;
+		}
+	}
+
+	print_report(get_time_ns() - m_start_ns);
+
+	for(size_t i = 0; i < m_nr_conns; i++)
+	{
+		close_replay_conn(&m_conns[i]);
+		free(m_conns[i].events);
+		free(m_conns[i].rx_buff);
+	}
+
+	free(m_conns);
+	free(m_heap);
+	free(m_latencies);
+	munmap(capture, st.st_size);
+	close(epfd);
+
+	return EXIT_SUCCESS;
+}
+
+
+/*****************************************************************************\/
+*****                      INTERNAL FUNCTIONS IMPLEMENTATION               *****
+*******************************************************************************/
+static void sigint_handler(int sig_no)
+{
+	(void)sig_no;
+	m_is_sigint = true;
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [options] <capture_file>\n", prog);
+	printf("\t-i <ip>\t\tclid address (default 127.0.0.1)\n");
+	printf("\t-p <port>\tclid port (default %d)\n", TCP_CLID_PORT);
+	printf("\t-x <factor>\tspeed factor, 1 replays at the recorded pace, 2 twice as fast, 0.5 half as fast (default 1)\n");
+	printf("\t-m\t\tas fast as possible, same as -x 0\n");
+	printf("\t-S <session>\tsession of the capture to replay, each clid start begins a new one (default 1)\n");
+	printf("\t-t <ms>\t\tper request timeout (default %d000)\n", CMD_EXECUTION_TIMEOUT);
+}
+
+static bool parse_arguments(int argc, char **argv)
+{
+	int opt;
+	while((opt = getopt(argc, argv, "i:p:x:mS:t:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			if(inet_pton(AF_INET, optarg, &(struct in_addr){0}) != 1)
+			{
+				printf("Invalid IPv4 address \"%s\"!\n", optarg);
+				return false;
+			}
+			snprintf(m_config.ip, sizeof(m_config.ip), "%s", optarg);
+			break;
+
+		case 'p':
+			m_config.port = (uint16_t)strtoul(optarg, NULL, 10);
+			break;
+
+		case 'x':
+			m_config.speed = strtod(optarg, NULL);
+			if(m_config.speed < 0)
+			{
+				printf("Speed factor must not be negative!\n");
+				return false;
+			}
+			break;
+
+		case 'm':
+			m_config.speed = 0;
+			break;
+
+		case 'S':
+			m_config.session = (uint32_t)strtoul(optarg, NULL, 10);
+			if(m_config.session == 0)
+			{
+				printf("Sessions are numbered from 1!\n");
+				return false;
+			}
+			break;
+
+		case 't':
+			m_config.timeout_ns = strtoull(optarg, NULL, 10) * NSEC_PER_MSEC;
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	if(optind != argc - 1)
+	{
+		printf("Exactly one capture file must be given!\n");
+		return false;
+	}
+
+	m_config.path = argv[optind];
+	return true;
+}
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static bool load_capture(const uint8_t *buff, size_t len)
+{
+	if(memcmp(buff, CLID_CAPTURE_MAGIC, CLID_CAPTURE_MAGIC_SIZE) != 0)
+	{
+		printf("%s is not a clid capture file!\n", m_config.path);
+		return false;
+	}
+
+	// Recorded conn ids are clid's fds, map each of them to the replay connection currently using it
+	size_t nr_conn_ids = 0;
+	long *conn_of_id = NULL;
+	uint64_t first_us = UINT64_MAX;
+
+	size_t offset = CLID_CAPTURE_MAGIC_SIZE;
+	struct clid_cap_record record;
+	long record_size = 0;
+	while((record_size = clid_cap_decode_record(buff + offset, len - offset, &record)) > 0)
+	{
+		offset += record_size;
+
+		if(record.kind == CLID_CAP_SESSION)
+		{
+			m_nr_sessions++;
+			continue;
+		}
+
+		if(m_nr_sessions != m_config.session)
+		{
+			continue;
+		}
+
+		m_nr_records++;
+		first_us = first_us == UINT64_MAX ? record.time_us : first_us;
+		uint64_t time_us = record.time_us - first_us;
+		m_capture_duration_us = time_us;
+
+		if(record.conn >= nr_conn_ids)
+		{
+			size_t new_nr = (record.conn + 1) * 2;
+			long *new_map = realloc(conn_of_id, new_nr * sizeof(long));
+			if(new_map == NULL)
+			{
+				printf("Failed to realloc connection map!\n");
+				free(conn_of_id);
+				return false;
+			}
+
+			for(size_t i = nr_conn_ids; i < new_nr; i++)
+			{
+				new_map[i] = -1;
+			}
+			conn_of_id = new_map;
+			nr_conn_ids = new_nr;
+		}
+
+		long conn_idx = conn_of_id[record.conn];
+		bool is_ok = true;
+		switch (record.kind)
+		{
+		case CLID_CAP_CONNECT:
+			if(new_replay_conn() == NULL)
+			{
+				is_ok = false;
+				break;
+			}
+			conn_of_id[record.conn] = (long)(m_nr_conns - 1);
+			is_ok = add_replay_event(&m_conns[m_nr_conns - 1], REPLAY_CONNECT, time_us, NULL, 0);
+			break;
+
+		case CLID_CAP_INBOUND:
+			if(conn_idx < 0)
+			{
+				// Capture started while this connection was already open
+				if(new_replay_conn() == NULL)
+				{
+					is_ok = false;
+					break;
+				}
+				conn_idx = (long)(m_nr_conns - 1);
+				conn_of_id[record.conn] = conn_idx;
+				is_ok = add_replay_event(&m_conns[conn_idx], REPLAY_CONNECT, time_us, NULL, 0);
+			}
+			is_ok = is_ok && add_replay_event(&m_conns[conn_idx], REPLAY_SEND, time_us, record.body, record.body_length);
+			break;
+
+		case CLID_CAP_DISCONNECT:
+			if(conn_idx >= 0)
+			{
+				is_ok = add_replay_event(&m_conns[conn_idx], REPLAY_CLOSE, time_us, NULL, 0);
+				conn_of_id[record.conn] = -1;
+			}
+			break;
+
+		case CLID_CAP_JOB:
+			m_nr_jobs++;
+			break;
+
+		default:
+			// Handler replies and expiries are what clid is expected to produce, replayHandler uses them
+			break;
+		}
+
+		if(!is_ok)
+		{
+			free(conn_of_id);
+			return false;
+		}
+	}
+
+	free(conn_of_id);
+
+	if(record_size < 0)
+	{
+		// A capture cut short by a crash still replays up to the last complete record
+		printf("Warning: malformed record at offset %zu in %s, ignoring the rest!\n", offset, m_config.path);
+	}
+
+	if(m_nr_sessions < m_config.session)
+	{
+		printf("%s only has %" PRIu64 " sessions!\n", m_config.path, m_nr_sessions);
+		return false;
+	}
+
+	if(m_nr_conns > 0)
+	{
+		m_heap = malloc(m_nr_conns * sizeof(int));
+		if(m_heap == NULL)
+		{
+			printf("Failed to malloc schedule!\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static struct replay_conn *new_replay_conn(void)
+{
+	if(m_nr_conns == m_cap_conns)
+	{
+		size_t new_cap = m_cap_conns ? m_cap_conns * 2 : 64;
+		struct replay_conn *new_conns = realloc(m_conns, new_cap * sizeof(struct replay_conn));
+		if(new_conns == NULL)
+		{
+			printf("Failed to realloc connections!\n");
+			return NULL;
+		}
+
+		m_conns = new_conns;
+		m_cap_conns = new_cap;
+	}
+
+	struct replay_conn *conn = &m_conns[m_nr_conns++];
+	memset(conn, 0, sizeof(struct replay_conn));
+	conn->fd = -1;
+	conn->proto = CLID_PROTO_V1;
+	conn->heap_idx = -1;
+
+	return conn;
+}
+
+static bool add_replay_event(struct replay_conn *conn, enum replay_event_kind kind, uint64_t time_us, const uint8_t *frame, uint32_t frame_len)
+{
+	if(conn->nr_events == conn->cap_events)
+	{
+		size_t new_cap = conn->cap_events ? conn->cap_events * 2 : 16;
+		struct replay_event *new_events = realloc(conn->events, new_cap * sizeof(struct replay_event));
+		if(new_events == NULL)
+		{
+			printf("Failed to realloc replay events!\n");
+			return false;
+		}
+
+		conn->events = new_events;
+		conn->cap_events = new_cap;
+	}
+
+	conn->events[conn->nr_events++] = (struct replay_event){ .kind = kind, .time_us = time_us, .frame = frame, .frame_len = frame_len };
+	return true;
+}
+
+static uint64_t due_time_ns(const struct replay_conn *conn)
+{
+	if(m_config.speed == 0)
+	{
+		return m_start_ns;
+	}
+
+	return m_start_ns + (uint64_t)(conn->events[conn->next_event].time_us * NSEC_PER_USEC / m_config.speed);
+}
+
+static void heap_push(int conn_idx)
+{
+	size_t i = m_heap_len++;
+	m_heap[i] = conn_idx;
+	m_conns[conn_idx].heap_idx = (int)i;
+
+	uint64_t due = due_time_ns(&m_conns[conn_idx]);
+	while(i > 0 && due_time_ns(&m_conns[m_heap[(i - 1) / 2]]) > due)
+	{
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static int heap_pop(void)
+{
+	int top = m_heap[0];
+	heap_swap(0, --m_heap_len);
+	m_conns[top].heap_idx = -1;
+
+	size_t i = 0;
+	while(1)
+	{
+		size_t smallest = i;
+		size_t left = 2 * i + 1;
+		size_t right = 2 * i + 2;
+		if(left < m_heap_len && due_time_ns(&m_conns[m_heap[left]]) < due_time_ns(&m_conns[m_heap[smallest]]))
+		{
+			smallest = left;
+		}
+		if(right < m_heap_len && due_time_ns(&m_conns[m_heap[right]]) < due_time_ns(&m_conns[m_heap[smallest]]))
+		{
+			smallest = right;
+		}
+		if(smallest == i)
+		{
+			break;
+		}
+
+		heap_swap(i, smallest);
+		i = smallest;
+	}
+
+	return top;
+}
+
+static void heap_swap(size_t a, size_t b)
+{
+	int tmp = m_heap[a];
+	m_heap[a] = m_heap[b];
+	m_heap[b] = tmp;
+	m_conns[m_heap[a]].heap_idx = (int)a;
+	m_conns[m_heap[b]].heap_idx = (int)b;
+}
+
+static void run_next_event(struct replay_conn *conn, int epfd, uint64_t now)
+{
+	uint64_t due = due_time_ns(conn);
+	uint64_t lag = now > due ? now - due : 0;
+	struct replay_event *event = &conn->events[conn->next_event++];
+
+	switch (event->kind)
+	{
+	case REPLAY_CONNECT:
+		if(!connect_replay_conn(conn, epfd))
+		{
+			m_nr_failed_conns++;
+		}
+		break;
+
+	case REPLAY_SEND:
+		if(conn->fd < 0)
+		{
+			m_nr_skipped++;
+			break;
+		}
+
+		if(m_config.speed > 0)
+		{
+			m_total_lag_ns += lag;
+			m_max_lag_ns = lag > m_max_lag_ns ? lag : m_max_lag_ns;
+		}
+
+		if(!send_frame(conn, event->frame, event->frame_len, now))
+		{
+			close_replay_conn(conn);
+			m_nr_failed_conns++;
+		}
+		break;
+
+	case REPLAY_CLOSE:
+		close_replay_conn(conn);
+		break;
+	}
+}
+
+static void reschedule(struct replay_conn *conn)
+{
+	if(conn->is_awaiting_reply || conn->is_finished)
+	{
+		return;
+	}
+
+	if(conn->next_event < conn->nr_events)
+	{
+		heap_push((int)(conn - m_conns));
+		return;
+	}
+
+	close_replay_conn(conn);
+	conn->is_finished = true;
+	m_nr_finished++;
+}
+
+static bool connect_replay_conn(struct replay_conn *conn, int epfd)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(m_config.port);
+	inet_pton(AF_INET, m_config.ip, &addr.sin_addr);
+
+	conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(conn->fd < 0)
+	{
+		printf("Failed to get socket(), errno = %d!\n", errno);
+		return false;
+	}
+
+	if(connect(conn->fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0)
+	{
+		printf("Failed to connect to tcp://%s:%hu, errno = %d!\n", m_config.ip, m_config.port, errno);
+		close(conn->fd);
+		conn->fd = -1;
+		return false;
+	}
+
+	int nodelay = 1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int));
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)(conn - m_conns) };
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0)
+	{
+		printf("Failed to epoll_ctl(), errno = %d!\n", errno);
+		close(conn->fd);
+		conn->fd = -1;
+		return false;
+	}
+
+	conn->proto = CLID_PROTO_V1;
+	conn->rx_len = 0;
+	return true;
+}
+
+static void close_replay_conn(struct replay_conn *conn)
+{
+	if(conn->fd >= 0)
+	{
+		close(conn->fd); // Also removes it from epoll
+		conn->fd = -1;
+	}
+}
+
+static bool send_frame(struct replay_conn *conn, const uint8_t *frame, uint32_t frame_len, uint64_t now)
+{
+	bool is_v2_frame = frame_len > 0 && frame[0] == CLID_V2_MAGIC;
+	if(is_v2_frame != (conn->proto == CLID_PROTO_V2))
+	{
+		// This clid agreed on another protocol version than the recorded one, the frame would not be understood
+		m_nr_skipped++;
+		return true;
+	}
+
+	bool expects_reply = false;
+	if(is_v2_frame)
+	{
+		struct clid_v2_frame decoded;
+		if(clid_v2_decode_frame(frame, frame_len, &decoded) <= 0)
+		{
+			m_nr_skipped++;
+			return true;
+		}
+
+		expects_reply = decoded.type == CLID_V2_TYPE(CLID_GET_LIST_CMD_REQUEST) || decoded.type == CLID_V2_TYPE(CLID_EXE_CMD_REQUEST) || decoded.type == CLID_V2_TYPE(CLID_EXE_BATCH_REQUEST);
+		conn->request_id = decoded.request_id;
+	} else if(frame_len >= sizeof(struct ethtcp_header))
+	{
+		struct ethtcp_header header;
+		memcpy(&header, frame, sizeof(struct ethtcp_header));
+		uint32_t msgno = ntohl(header.msgno);
+		expects_reply = msgno == CLID_HELLO_REQUEST || msgno == CLID_GET_LIST_CMD_REQUEST || msgno == CLID_EXE_CMD_REQUEST;
+		conn->is_awaiting_hello = msgno == CLID_HELLO_REQUEST;
+	}
+
+	if(send_data(conn->fd, frame, frame_len) < 0)
+	{
+		printf("Failed to send to fd %d, errno = %d!\n", conn->fd, errno);
+		return false;
+	}
+
+	m_nr_sent++;
+	if(expects_reply)
+	{
+		conn->is_awaiting_reply = true;
+		conn->sent_ns = now;
+		// An old clid never answers CLID_HELLO_REQUEST, as a shell we just go on in v1 after a short while
+		conn->deadline_ns = now + (conn->is_awaiting_hello ? CLID_HELLO_TIMEOUT_MS * NSEC_PER_MSEC : m_config.timeout_ns);
+	}
+
+	return true;
+}
+
+static int send_data(int sockfd, const void *tx_buff, size_t nr_bytes_to_send)
+{
+	size_t sent_count = 0;
+
+	while(sent_count < nr_bytes_to_send)
+	{
+		ssize_t length = send(sockfd, (const char *)tx_buff + sent_count, nr_bytes_to_send - sent_count, 0);
+		if(length < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			return -1;
+		}
+
+		sent_count += length;
+	}
+
+	return (int)sent_count;
+}
+
+static bool handle_readable(struct replay_conn *conn, uint64_t now)
+{
+	if(conn->fd < 0)
+	{
+		return true;
+	}
+
+	if(conn->rx_cap - conn->rx_len < RX_CHUNK)
+	{
+		size_t new_cap = conn->rx_cap ? conn->rx_cap * 2 : RX_CHUNK * 2;
+		uint8_t *new_buff = realloc(conn->rx_buff, new_cap);
+		if(new_buff == NULL)
+		{
+			printf("Failed to realloc rx buffer!\n");
+			return false;
+		}
+
+		conn->rx_buff = new_buff;
+		conn->rx_cap = new_cap;
+	}
+
+	ssize_t size = recv(conn->fd, conn->rx_buff + conn->rx_len, conn->rx_cap - conn->rx_len, MSG_DONTWAIT);
+	if(size < 0 && (errno == EINTR || errno == EAGAIN))
+	{
+		return true;
+	} else if(size <= 0)
+	{
+		printf("Connection fd %d closed by clid!\n", conn->fd);
+		return false;
+	}
+	conn->rx_len += size;
+
+	size_t offset = 0;
+	while(offset < conn->rx_len)
+	{
+		bool is_done = false;
+		int consumed = conn->proto == CLID_PROTO_V2 ? decode_v2_reply(conn, conn->rx_buff + offset, conn->rx_len - offset, &is_done)
+							    : decode_v1_reply(conn, conn->rx_buff + offset, conn->rx_len - offset, &is_done);
+		if(consumed < 0)
+		{
+			printf("Received malformed reply on fd %d!\n", conn->fd);
+			return false;
+		} else if(consumed == 0)
+		{
+			break;
+		}
+
+		offset += consumed;
+
+		if(is_done && conn->is_awaiting_reply)
+		{
+			complete_reply(conn, now, false);
+		}
+	}
+
+	memmove(conn->rx_buff, conn->rx_buff + offset, conn->rx_len - offset);
+	conn->rx_len -= offset;
+
+	return true;
+}
+
+/* Return consumed bytes, 0 if more bytes are needed, -1 if malformed */
+static int decode_v1_reply(struct replay_conn *conn, const uint8_t *buff, size_t len, bool *is_done)
+{
+	struct ethtcp_header header;
+	if(len < sizeof(struct ethtcp_header))
+	{
+		return 0;
+	}
+
+	memcpy(&header, buff, sizeof(struct ethtcp_header));
+	uint32_t payload_len = ntohl(header.payloadLen);
+	if(len - sizeof(struct ethtcp_header) < payload_len)
+	{
+		return 0;
+	}
+
+	if(ntohl(header.msgno) == CLID_HELLO_REPLY)
+	{
+		// Every following frame on this connection uses the agreed version, the rest of the buffer included
+		conn->proto = ntohl(header.protRev) >= CLID_PROTO_V2 ? CLID_PROTO_V2 : CLID_PROTO_V1;
+		conn->is_awaiting_hello = false;
+	}
+
+	*is_done = true;
+	return (int)(sizeof(struct ethtcp_header) + payload_len);
+}
+
+static int decode_v2_reply(struct replay_conn *conn, const uint8_t *buff, size_t len, bool *is_done)
+{
+	struct clid_v2_frame frame;
+	long frame_size = clid_v2_decode_frame(buff, len, &frame);
+	if(frame_size <= 0)
+	{
+		return (int)frame_size;
+	}
+
+	// Large outputs arrive in fragments, the request is only done with the last one
+	*is_done = frame.request_id == conn->request_id && (frame.flags & CLID_V2_FLAG_MORE) == 0;
+	return (int)frame_size;
+}
+
+static void complete_reply(struct replay_conn *conn, uint64_t now, bool is_timeout)
+{
+	conn->is_awaiting_reply = false;
+
+	if(conn->is_awaiting_hello)
+	{
+		// Unanswered hello, not a timeout: the recorded shell would have fallen back to v1 the same way
+		conn->is_awaiting_hello = false;
+	} else if(is_timeout)
+	{
+		m_nr_timeouts++;
+	} else
+	{
+		m_nr_replies++;
+		if(m_nr_latencies == m_cap_latencies)
+		{
+			size_t new_cap = m_cap_latencies ? m_cap_latencies * 2 : 4096;
+			uint64_t *new_latencies = realloc(m_latencies, new_cap * sizeof(uint64_t));
+			if(new_latencies != NULL)
+			{
+				m_latencies = new_latencies;
+				m_cap_latencies = new_cap;
+			}
+		}
+
+		if(m_nr_latencies < m_cap_latencies)
+		{
+			m_latencies[m_nr_latencies++] = now - conn->sent_ns;
+		}
+	}
+
+	reschedule(conn);
+}
+
+static void check_timeouts(uint64_t now)
+{
+	for(size_t i = 0; i < m_nr_conns; i++)
+	{
+		struct replay_conn *conn = &m_conns[i];
+		if(conn->is_awaiting_reply && now >= conn->deadline_ns)
+		{
+			if(!conn->is_awaiting_hello)
+			{
+				printf("Request on fd %d timed out!\n", conn->fd);
+			}
+
+			complete_reply(conn, now, true);
+		}
+	}
+}
+
+static int compare_u64(const void *pa, const void *pb)
+{
+	uint64_t a = *(const uint64_t *)pa;
+	uint64_t b = *(const uint64_t *)pb;
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static void print_report(uint64_t elapsed_ns)
+{
+	double elapsed_s = (double)elapsed_ns / NSEC_PER_SEC;
+
+	printf("\n");
+	printf("Replayed %.3f s of capture in %.3f s\n", (double)m_capture_duration_us / 1000000, elapsed_s);
+	printf("Frames sent: %" PRIu64 ", replies: %" PRIu64 ", timeouts: %" PRIu64 ", skipped: %" PRIu64 ", failed connections: %" PRIu64 "\n",
+		m_nr_sent, m_nr_replies, m_nr_timeouts, m_nr_skipped, m_nr_failed_conns);
+	if(elapsed_s > 0)
+	{
+		printf("Throughput: %.1f req/s\n", m_nr_replies / elapsed_s);
+	}
+
+	if(m_config.speed > 0 && m_nr_sent > 0)
+	{
+		// How far behind the recorded schedule frames went out, mostly because clid was still busy with the previous one
+		printf("Send lag behind schedule (us): avg %.1f, max %.1f\n", (double)m_total_lag_ns / m_nr_sent / NSEC_PER_USEC, (double)m_max_lag_ns / NSEC_PER_USEC);
+	}
+
+	if(m_nr_latencies > 0)
+	{
+		qsort(m_latencies, m_nr_latencies, sizeof(uint64_t), compare_u64);
+		printf("Reply latency (us): p50 %.1f, p90 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+			(double)m_latencies[m_nr_latencies * 50 / 100] / NSEC_PER_USEC,
+			(double)m_latencies[m_nr_latencies * 90 / 100] / NSEC_PER_USEC,
+			(double)m_latencies[m_nr_latencies * 99 / 100] / NSEC_PER_USEC,
+			(double)m_latencies[m_nr_latencies * 999 / 1000] / NSEC_PER_USEC,
+			(double)m_latencies[m_nr_latencies - 1] / NSEC_PER_USEC);
+	}
+}
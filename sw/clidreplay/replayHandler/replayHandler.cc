@@ -0,0 +1,301 @@
+#include <iostream>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include <itc.h>
+#include <itcPubSubIf.h>
+#include <eventLoopIf.h>
+#include <traceIf.h>
+#include <stringUtils.h>
+
+#include "cli-daemon-tpt-provider.h"
+#include "cmdJobIf.h"
+#include "cmdRegisterIf.h"
+#include "cmdTypesIf.h"
+#include "cmdProto.h"
+#include "clid_capture.h"
+
+using namespace CmdIf::V1;
+using namespace CommonUtils::V1::StringUtils;
+
+/* Stand-in for the real command handlers while clidreplay replays a capture: every command name seen in the capture is registered,
+and each job is answered with the result and output that the real handler gave for the very same arguments, in recorded order. */
+
+struct RecordedReply
+{
+	uint32_t result;
+	std::string output;
+	uint64_t latencyUs; // From forwarding the job to receiving its CMDIF_EXE_CMD_REPLY, as clid saw it
+};
+
+struct RecordedReplies
+{
+	std::vector<RecordedReply> replies;
+	size_t next;
+};
+
+bool loadCapture(const std::string& path, uint64_t session);
+std::string makeArgumentsKey(const std::vector<std::string>& arguments);
+CmdTypesIf::CmdResultCode toCmdResultCode(uint32_t result);
+void replayCmdHandler(const std::shared_ptr<CmdIf::V1::CmdJobIf>& job);
+void atexit_handler();
+
+itc_mbox_id_t m_replayHandlerMboxId { ITC_NO_MBOX_ID };
+
+const std::string m_cmdDesc { "Replays the replies recorded in a clid capture" };
+std::unordered_map<std::string, RecordedReplies> m_repliesByArguments;
+std::set<std::string> m_cmdNames;
+bool m_isLatencyEmulated { false };
+double m_speed { 1.0 };
+
+int main(int argc, char* argv[])
+{
+	uint64_t session = 1;
+	int opt;
+	while((opt = getopt(argc, argv, "S:lx:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'S':
+			session = std::strtoull(optarg, nullptr, 0);
+			break;
+		case 'l':
+			m_isLatencyEmulated = true;
+			break;
+		case 'x':
+			m_speed = std::strtod(optarg, nullptr);
+			break;
+		default:
+			std::cout << "Usage: " << argv[0] << " [ -S <session> ] [ -l ] [ -x <speed> ] <capture_file>" << std::endl;
+			std::cout << "\t-S <session>\tSession of the capture to serve, 1 by default" << std::endl;
+			std::cout << "\t-l\t\tHold each reply for the recorded handler latency" << std::endl;
+			std::cout << "\t-x <speed>\tDivide the held latency by <speed>, as clidreplay -x does, 1 by default" << std::endl;
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if(optind >= argc || session == 0 || m_speed <= 0)
+	{
+		std::cout << "Usage: " << argv[0] << " [ -S <session> ] [ -l ] [ -x <speed> ] <capture_file>" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if(!loadCapture(argv[optind], session))
+	{
+		return EXIT_FAILURE;
+	}
+
+	if(itc_init(3, ITC_MALLOC, 0) == false)
+	{
+		TPT_TRACE(TRACE_ERROR, SSTR("Failed to itc_init() by replayHandler!"));
+		return EXIT_FAILURE;
+	}
+
+	m_replayHandlerMboxId = itc_create_mailbox("replayHandlerMailbox", ITC_NO_NAMESPACE);
+	if(m_replayHandlerMboxId == ITC_NO_MBOX_ID)
+	{
+		TPT_TRACE(TRACE_ERROR, SSTR("Failed to create mailbox \"replayHandlerMailbox\"!"));
+		return EXIT_FAILURE;
+	}
+
+	std::atexit(atexit_handler);
+
+	UtilsFramework::ItcPubSub::V1::IItcPubSub::getThreadLocalInstance().addItcFd(itc_get_fd());
+	for(const auto& cmdName : m_cmdNames)
+	{
+		CmdRegisterIf::getInstance().registerCmdHandler(cmdName, m_cmdDesc, std::bind(&replayCmdHandler, std::placeholders::_1));
+	}
+
+	std::cout << "replayHandler: serving " << m_repliesByArguments.size() << " distinct argument lists of " << m_cmdNames.size() << " commands" << std::endl;
+
+	UtilsFramework::EventLoop::V1::IEventLoop::getThreadLocalInstance().run();
+
+	return 0;
+}
+
+bool loadCapture(const std::string& path, uint64_t session)
+{
+	std::ifstream file(path, std::ios::binary);
+	if(!file)
+	{
+		std::cout << "Failed to open " << path << "!" << std::endl;
+		return false;
+	}
+
+	std::vector<uint8_t> buff { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+	if(buff.size() < CLID_CAPTURE_MAGIC_SIZE || std::string(buff.begin(), buff.begin() + CLID_CAPTURE_MAGIC_SIZE) != CLID_CAPTURE_MAGIC)
+	{
+		std::cout << path << " is not a clid capture file!" << std::endl;
+		return false;
+	}
+
+	// job_ids restart with every clid start, so they only identify a job within one session
+	struct PendingJob
+	{
+		std::string key;
+		uint64_t forwardedUs;
+	};
+	std::map<uint64_t, PendingJob> pendingJobs;
+	uint64_t currentSession = 0;
+
+	size_t offset = CLID_CAPTURE_MAGIC_SIZE;
+	struct clid_cap_record record;
+	long recordSize = 0;
+	while((recordSize = clid_cap_decode_record(buff.data() + offset, buff.size() - offset, &record)) > 0)
+	{
+		offset += recordSize;
+
+		if(record.kind == CLID_CAP_SESSION)
+		{
+			currentSession++;
+			continue;
+		}
+
+		if(currentSession != session)
+		{
+			continue;
+		}
+
+		if(record.kind == CLID_CAP_JOB)
+		{
+			std::vector<std::string> arguments;
+			uint32_t pos = 0;
+			while(pos + sizeof(uint16_t) <= record.body_length)
+			{
+				uint16_t len;
+				std::memcpy(&len, record.body + pos, sizeof(uint16_t));
+				pos += sizeof(uint16_t);
+				if(pos + len > record.body_length)
+				{
+					break;
+				}
+
+				arguments.emplace_back(reinterpret_cast<const char*>(record.body + pos), len);
+				pos += len;
+			}
+
+			if(arguments.empty())
+			{
+				continue;
+			}
+
+			m_cmdNames.insert(arguments[0]);
+			pendingJobs[record.job_id] = { makeArgumentsKey(arguments), record.time_us };
+		} else if(record.kind == CLID_CAP_ITC_REPLY)
+		{
+			auto job = pendingJobs.find(record.job_id);
+			if(job == pendingJobs.end())
+			{
+				continue;
+			}
+
+			uint64_t result = 0;
+			int resultSize = clid_cap_varint64_decode(record.body, record.body_length, &result);
+			if(resultSize <= 0)
+			{
+				continue;
+			}
+
+			RecordedReply reply { static_cast<uint32_t>(result),
+					      std::string(reinterpret_cast<const char*>(record.body + resultSize), record.body_length - resultSize),
+					      record.time_us - job->second.forwardedUs };
+			m_repliesByArguments[job->second.key].replies.push_back(std::move(reply));
+			pendingJobs.erase(job);
+		} else if(record.kind == CLID_CAP_JOB_EXPIRED)
+		{
+			// clid already gave up on it, a late reply for this job_id would be ignored
+			pendingJobs.erase(record.job_id);
+		}
+	}
+
+	if(recordSize < 0)
+	{
+		std::cout << "Warning: malformed record at offset " << offset << " in " << path << ", ignoring the rest!" << std::endl;
+	}
+
+	if(currentSession < session)
+	{
+		std::cout << path << " only has " << currentSession << " sessions!" << std::endl;
+		return false;
+	}
+
+	if(m_cmdNames.empty())
+	{
+		std::cout << "No job found in session " << session << " of " << path << "!" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+std::string makeArgumentsKey(const std::vector<std::string>& arguments)
+{
+	// Arguments cannot contain '\0', they are C strings on the shell side
+	std::string key;
+	for(const auto& argument : arguments)
+	{
+		key += argument;
+		key += '\0';
+	}
+
+	return key;
+}
+
+CmdTypesIf::CmdResultCode toCmdResultCode(uint32_t result)
+{
+	switch (result)
+	{
+	case CMDIF_RET_SUCCESS:
+		return CmdTypesIf::CmdResultCode::CMD_RET_SUCCESS;
+	case CMDIF_RET_INVALID_ARGS:
+		return CmdTypesIf::CmdResultCode::CMD_RET_INVALID_ARGS;
+	default:
+		return CmdTypesIf::CmdResultCode::CMD_RET_FAIL;
+	}
+}
+
+void replayCmdHandler(const std::shared_ptr<CmdIf::V1::CmdJobIf>& job)
+{
+	auto entry = m_repliesByArguments.find(makeArgumentsKey(job->getArguments()));
+	if(entry == m_repliesByArguments.end() || entry->second.replies.empty())
+	{
+		job->getOutputStream() << "replayHandler: no reply recorded for these arguments\n";
+		job->done(CmdTypesIf::CmdResultCode::CMD_RET_FAIL);
+		return;
+	}
+
+	// Same arguments may have been answered differently over time, hand the recorded replies out in turn
+	RecordedReplies& recorded = entry->second;
+	const RecordedReply& reply = recorded.replies[recorded.next];
+	recorded.next = (recorded.next + 1) % recorded.replies.size();
+
+	if(m_isLatencyEmulated)
+	{
+		// A real handler occupies this thread for the whole time as well
+		std::this_thread::sleep_for(std::chrono::microseconds(static_cast<uint64_t>(reply.latencyUs / m_speed)));
+	}
+
+	job->getOutputStream() << reply.output;
+	job->done(toCmdResultCode(reply.result));
+}
+
+void atexit_handler()
+{
+	UtilsFramework::EventLoop::V1::IEventLoop::getThreadLocalInstance().stop();
+
+	itc_delete_mailbox(m_replayHandlerMboxId);
+	itc_exit();
+}
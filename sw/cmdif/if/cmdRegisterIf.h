@@ -38,7 +38,10 @@ public:
 
 	using CmdInvoker = std::function<void(const std::shared_ptr<CmdIf::V1::CmdJobIf>& job)>;
 
-	virtual ReturnCode registerCmdHandler(const std::string& cmdName, const std::string& cmdDesc, const CmdInvoker& cmdHandler) = 0;
+	virtual ReturnCode registerCmdHandler(const std::string& cmdName, const std::string& cmdDesc, const CmdInvoker& cmdHandler, CmdTypesIf::CmdPriority priority = CmdTypesIf::CmdPriority::INTERACTIVE) = 0;
+	// Several processes may join the same group, a job for groupName is then run by all of them at once and
+	// their outputs come back to the shell as one reply, headed by each memberName. deregisterCmdHandler() leaves the group.
+	virtual ReturnCode joinCmdGroup(const std::string& groupName, const std::string& memberName, const std::string& groupDesc, const CmdInvoker& cmdHandler) = 0;
 	virtual ReturnCode deregisterCmdHandler(const std::string& cmdName) = 0;
 	
 	// Avoid copy/move constructors, assigments
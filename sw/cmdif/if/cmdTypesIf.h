@@ -28,6 +28,13 @@ public:
 		CMD_RET_FAIL
 	};
 
+	// How clid schedules the jobs of a command against the other commands of the same mailbox
+	enum class CmdPriority
+	{
+		INTERACTIVE, // Typed by an operator, dispatched first
+		BULK // Automated collection, dumps, only gets the share interactive jobs leave
+	};
+
 	using CmdFunction = std::function<CmdResultCode(const std::vector<std::string>& arguments, std::ostringstream& outputStream)>;
 
 	struct CmdFunctionWrapper
@@ -11,6 +11,7 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
 #include <itc.h>
 
 #include "cmdJobIf.h"
@@ -24,7 +25,7 @@ namespace V1
 class CmdJobImpl : public CmdJobIf
 {
 public:
-	CmdJobImpl(const std::string& cmdName, const unsigned long long jobId, const std::vector<std::string>& args, itc_mbox_id_t clidMboxId);
+	CmdJobImpl(const std::string& cmdName, const unsigned long long jobId, const std::vector<std::string>& args, itc_mbox_id_t clidMboxId, uint64_t receivedNs);
 	virtual ~CmdJobImpl();
 
 	const std::string& getCmdName() const override
@@ -44,6 +45,12 @@ public:
 
 	void done(const CmdIf::V1::CmdTypesIf::CmdResultCode& rc) override;
 
+	// Right before the job is passed to its cmdHandler, the time until done() is what the handler took
+	void markStarted();
+
+	// Timestamps reported to clid in CmdIfExeCmdTimedReplyS, steady_clock is CLOCK_MONOTONIC on Linux
+	static uint64_t getSteadyClockNs();
+
 	// Avoid copy/move constructors, assigments
 	CmdJobImpl(const CmdJobImpl&) 			= delete;
 	CmdJobImpl(CmdJobImpl&&) 			= delete;
@@ -56,6 +63,8 @@ private:
 	std::vector<std::string> m_args;
 	itc_mbox_id_t m_clidMboxId;
 	std::ostringstream m_output;
+	uint64_t m_receivedNs;
+	uint64_t m_startedNs;
 
 }; // class CmdJobImpl
 
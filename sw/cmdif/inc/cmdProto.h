@@ -18,11 +18,24 @@
 #define CMDIF_RET_INVALID_ARGS				20
 #define CMDIF_RET_FAIL					30
 
+/* Priority class of a command, clid forwards queued jobs of interactive commands to a mailbox ahead of bulk ones */
+#define CMDIF_PRIO_INTERACTIVE				0
+#define CMDIF_PRIO_BULK					1
+
+/* CMDIF_REG_CMD_REQUEST flags */
+#define CMDIF_REG_FLAG_GROUP				0x1 // Join the group cmd_name as member_name, clid fans each job out to all members
+#define CMDIF_REG_FLAG_SYNTAX				0x2 // A CMDIF_REG_SYNTAX_REQUEST follows, clid announces the command to shells once it has it
+
 #define CMDIF_MSGBASE					0x17700000
 #define CMDIF_REG_CMD_REQUEST				(CMDIF_MSGBASE + 1)
 #define CMDIF_DEREG_CMD_REQUEST				(CMDIF_MSGBASE + 2)
 #define CMDIF_EXE_CMD_REQUEST				(CMDIF_MSGBASE + 3)
 #define CMDIF_EXE_CMD_REPLY				(CMDIF_MSGBASE + 4)
+#define CMDIF_REG_SYNTAX_REQUEST			(CMDIF_MSGBASE + 5)
+#define CMDIF_EXE_CMD_TIMED_REPLY			(CMDIF_MSGBASE + 6)
+
+/* Larger syntax graphs are not handed to clid, the command is then only checked by its handler */
+#define CMDIF_MAX_SYNTAX_LENGTH				(16 * 1024)
 
 
 struct CmdIfRegCmdRequestS
@@ -31,6 +44,17 @@ struct CmdIfRegCmdRequestS
 	itc_mbox_id_t mbox_id;
 	char cmd_name[MAX_CMD_NAME_LENGTH];
 	char cmd_desc[1];
+	// Followed by a CmdIfRegCmdExtS
+};
+
+/* Appended to CMDIF_REG_CMD_REQUEST right after the '\0' of cmd_desc, unaligned, so that the message still starts as it always did.
+   Registrants built before it send none, clid tells by the size of the message and takes their commands as interactive, without flags.
+   Fields are only ever added at its end, clid takes those that fit in the message */
+struct CmdIfRegCmdExtS
+{
+	uint32_t priority; // CMDIF_PRIO_*
+	uint32_t flags; // CMDIF_REG_FLAG_*
+	char member_name[MAX_CMD_NAME_LENGTH]; // CMDIF_REG_FLAG_GROUP only, shown in the merged reply
 };
 
 struct CmdIfDeregCmdRequestS
@@ -39,6 +63,15 @@ struct CmdIfDeregCmdRequestS
 	char cmd_name[1];
 };
 
+/* Sent right after CMDIF_REG_CMD_REQUEST if a CmdTableIf was registered for cmd_name, clid serves it to shells as is */
+struct CmdIfRegSyntaxRequestS
+{
+	uint32_t msgno;
+	char cmd_name[MAX_CMD_NAME_LENGTH];
+	uint32_t syntaxLen;
+	uint8_t syntax[1]; // See "syntax" in tcp_proto_v2.h
+};
+
 struct CmdIfExeCmdRequestS
 {
 	uint32_t msgno;
@@ -73,12 +106,30 @@ struct CmdIfExeCmdReplyS
 	char output[1];
 };
 
+/* CMDIF_EXE_CMD_REPLY with the spans of the job in cmdif and the length of its output, sent by cmdif instead of it.
+   clid takes both, the plain one from handlers built before it */
+struct CmdIfExeCmdTimedReplyS
+{
+	uint32_t msgno;
+	unsigned long long job_id;
+	uint32_t result;
+	/* When this job went through cmdif, in nanoseconds of the handler's CLOCK_MONOTONIC (steady_clock).
+	   The handler may run on another host, only the differences between them mean anything to clid. */
+	uint64_t receivedNs; // handleExeCmdRequest() got the CMDIF_EXE_CMD_REQUEST
+	uint64_t startedNs; // The registered cmdHandler was invoked
+	uint64_t doneNs; // CmdJobImpl::done() was called
+	uint32_t outputLen; // Not including the '\0' which still terminates output
+	char output[1];
+};
+
 
 union itc_msg
 {
 	uint32_t					msgno;
 	struct CmdIfRegCmdRequestS			cmdIfRegCmdRequest;
 	struct CmdIfDeregCmdRequestS			cmdIfDeregCmdRequest;
+	struct CmdIfRegSyntaxRequestS			cmdIfRegSyntaxRequest;
 	struct CmdIfExeCmdRequestS			cmdIfExeCmdRequest;
 	struct CmdIfExeCmdReplyS			cmdIfExeCmdReply;
+	struct CmdIfExeCmdTimedReplyS			cmdIfExeCmdTimedReply;
 };
\ No newline at end of file
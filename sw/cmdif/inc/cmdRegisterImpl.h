@@ -13,6 +13,7 @@
 #include <memory>
 #include <unordered_map>
 #include <string>
+#include <vector>
 #include <mutex>
 
 #include <itc.h>
@@ -43,12 +44,17 @@ public:
 	CmdRegisterImpl& operator=(const CmdRegisterImpl&) 	= delete;
 	CmdRegisterImpl& operator=(CmdRegisterImpl&&) 		= delete;
 
-	ReturnCode registerCmdHandler(const std::string& cmdName, const std::string& cmdDesc, const CmdInvoker& cmdHandler) override;
+	ReturnCode registerCmdHandler(const std::string& cmdName, const std::string& cmdDesc, const CmdInvoker& cmdHandler, CmdTypesIf::CmdPriority priority = CmdTypesIf::CmdPriority::INTERACTIVE) override;
+	ReturnCode joinCmdGroup(const std::string& groupName, const std::string& memberName, const std::string& groupDesc, const CmdInvoker& cmdHandler) override;
 	ReturnCode deregisterCmdHandler(const std::string& cmdName) override;
 
 private:
 	void init();
 
+	ReturnCode addInvoker(const std::string& cmdName, const std::string& cmdDesc, const CmdInvoker& cmdHandler, uint32_t priority, uint32_t flags, const std::string& memberName);
+	bool getSyntaxGraph(const std::string& cmdName, std::vector<uint8_t>& syntax);
+	void sendSyntaxGraph(const std::string& cmdName, const std::vector<uint8_t>& syntax);
+
 	void invokeCmd(const std::shared_ptr<CmdIf::V1::CmdJobIf>& job, const CmdInvoker& cmdHandler);
 	void handleExeCmdRequest(const std::shared_ptr<union itc_msg>& msg);
 
@@ -58,6 +58,7 @@ class CmdSyntaxGraph
 public:
 	void addCommand(const std::string& cmdName, const std::vector<std::pair<std::string, CmdTypesIf::CmdFunctionWrapper>>& syntaxHandler);
 	const std::shared_ptr<CmdTypesIf::CmdFunctionWrapper> findCmdHandler(size_t numArgs, std::vector<std::string>::const_iterator args, std::ostringstream& output) const;
+	bool serializeCommand(const std::string& cmdName, std::vector<uint8_t>& syntax) const;
 
 	CmdSyntaxGraph() = default;
 	virtual ~CmdSyntaxGraph() = default;
@@ -78,6 +79,7 @@ private:
 	std::shared_ptr<GraphNode> evaluateCommandArguments(std::shared_ptr<GraphNode> currentNode, std::shared_ptr<std::ostringstream> validArgs, size_t numArgs, std::vector<std::string>::const_iterator args) const;
 	static void printNextPossibleArguments(std::shared_ptr<GraphNode> currentNode, std::ostringstream& output);
 	static void printGraphNodeList(const GraphNodeList& list);
+	static void appendVarint(std::vector<uint8_t>& buff, uint32_t value);
 
 private:
 	std::map<std::string, std::shared_ptr<GraphNode>> m_cmdMap; // Contain a list of graph trees with respective cmdNames
@@ -85,6 +87,7 @@ private:
 
 public:
 	friend class CmdSyntaxGraphTest;
+	friend class CmdSyntaxGraphBench;
 
 }; // class CmdSyntaxGraph
 
@@ -27,6 +27,8 @@ public:
 	CmdIf::V1::CmdTypesIf::CmdResultCode executeCmd(const std::vector<std::string>& args, std::ostringstream& output) override;
 	void printCmdHelp(const std::vector<CmdTypesIf::CmdDefinition>& cmdDefinitions, std::ostringstream& output) override;
 
+	bool getSyntaxGraph(const std::string& cmdName, std::vector<uint8_t>& syntax) const;
+
 	CmdTableImpl() = default;
 	virtual ~CmdTableImpl() = default;
 
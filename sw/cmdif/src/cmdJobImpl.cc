@@ -1,6 +1,7 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <chrono>
 
 #include <itc.h>
 #include <traceIf.h>
@@ -19,11 +20,13 @@ namespace CmdIf
 namespace V1
 {
 
-CmdJobImpl::CmdJobImpl(const std::string& cmdName, const unsigned long long jobId, const std::vector<std::string>& args, itc_mbox_id_t clidMboxId)
+CmdJobImpl::CmdJobImpl(const std::string& cmdName, const unsigned long long jobId, const std::vector<std::string>& args, itc_mbox_id_t clidMboxId, uint64_t receivedNs)
 	: m_cmdName(cmdName),
 	  m_jobId(jobId),
 	  m_args(args),
-	  m_clidMboxId(clidMboxId)
+	  m_clidMboxId(clidMboxId),
+	  m_receivedNs(receivedNs),
+	  m_startedNs(receivedNs)
 {
 }
 
@@ -31,8 +34,20 @@ CmdJobImpl::~CmdJobImpl()
 {
 }
 
+void CmdJobImpl::markStarted()
+{
+	m_startedNs = getSteadyClockNs();
+}
+
+uint64_t CmdJobImpl::getSteadyClockNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 void CmdJobImpl::done(const CmdIf::V1::CmdTypesIf::CmdResultCode& rc)
 {
+	uint64_t doneNs = getSteadyClockNs();
+
 	uint32_t result;
 	if(rc == CmdIf::V1::CmdTypesIf::CmdResultCode::CMD_RET_SUCCESS)
 	{
@@ -49,24 +64,30 @@ void CmdJobImpl::done(const CmdIf::V1::CmdTypesIf::CmdResultCode& rc)
 		return;
 	}
 
-	uint32_t len = m_output.str().length();
-	union itc_msg* rep = itc_alloc(offsetof(struct CmdIfExeCmdReplyS, output) + len + 1, CMDIF_EXE_CMD_REPLY);
-	rep->cmdIfExeCmdReply.job_id = m_jobId;
-	rep->cmdIfExeCmdReply.result = result;
-	std::strcpy(rep->cmdIfExeCmdReply.output, m_output.str().c_str());
+	const std::string output = m_output.str();
+	uint32_t len = output.length();
+	union itc_msg* rep = itc_alloc(offsetof(struct CmdIfExeCmdTimedReplyS, output) + len + 1, CMDIF_EXE_CMD_TIMED_REPLY);
+	rep->cmdIfExeCmdTimedReply.job_id = m_jobId;
+	rep->cmdIfExeCmdTimedReply.result = result;
+	rep->cmdIfExeCmdTimedReply.receivedNs = m_receivedNs;
+	rep->cmdIfExeCmdTimedReply.startedNs = m_startedNs;
+	rep->cmdIfExeCmdTimedReply.doneNs = doneNs;
+	rep->cmdIfExeCmdTimedReply.outputLen = len;
+	std::memcpy(rep->cmdIfExeCmdTimedReply.output, output.data(), len);
+	rep->cmdIfExeCmdTimedReply.output[len] = '\0';
 
 	// TPT_TRACE(TRACE_DEBUG, SSTR("rep = 0x", std::hex, rep));
-	// TPT_TRACE(TRACE_DEBUG, SSTR("job_id = 0x", std::hex, &(rep->cmdIfExeCmdReply.job_id)));
-	// TPT_TRACE(TRACE_DEBUG, SSTR("result = 0x", std::hex, &(rep->cmdIfExeCmdReply.result)));
-	// TPT_TRACE(TRACE_DEBUG, SSTR("output = 0x", std::hex, (unsigned long long)(rep->cmdIfExeCmdReply.output)));
+	// TPT_TRACE(TRACE_DEBUG, SSTR("job_id = 0x", std::hex, &(rep->cmdIfExeCmdTimedReply.job_id)));
+	// TPT_TRACE(TRACE_DEBUG, SSTR("result = 0x", std::hex, &(rep->cmdIfExeCmdTimedReply.result)));
+	// TPT_TRACE(TRACE_DEBUG, SSTR("output = 0x", std::hex, (unsigned long long)(rep->cmdIfExeCmdTimedReply.output)));
 
 	if(!itc_send(&rep, m_clidMboxId, ITC_MY_MBOX_ID, NULL))
 	{
-		TPT_TRACE(TRACE_ERROR, SSTR("Failed to send CMDIF_EXE_CMD_REPLY to clid for cmdName = \"", m_cmdName, "\""));
+		TPT_TRACE(TRACE_ERROR, SSTR("Failed to send CMDIF_EXE_CMD_TIMED_REPLY to clid for cmdName = \"", m_cmdName, "\""));
 		return;
 	}
 
-	TPT_TRACE(TRACE_INFO, SSTR("Send CMDIF_EXE_CMD_REPLY to clid successfully!"));
+	TPT_TRACE(TRACE_INFO, SSTR("Send CMDIF_EXE_CMD_TIMED_REPLY to clid successfully!"));
 }
 
 } // V1
@@ -6,6 +6,7 @@
 #include <memory>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 
 #include <itc.h>
 #include <itcPubSubIf.h>
@@ -15,6 +16,7 @@
 #include "cli-daemon-tpt-provider.h"
 #include "cmdRegisterImpl.h"
 #include "cmdJobImpl.h"
+#include "cmdTableImpl.h"
 #include "cmdTypesIf.h"
 #include "cmdProto.h"
 
@@ -49,7 +51,17 @@ void CmdRegisterImpl::reset()
 	m_registeredInvokers.clear();
 }
 
-CmdRegisterIf::ReturnCode CmdRegisterImpl::registerCmdHandler(const std::string& cmdName, const std::string& cmdDesc, const CmdInvoker& cmdHandler)
+CmdRegisterIf::ReturnCode CmdRegisterImpl::registerCmdHandler(const std::string& cmdName, const std::string& cmdDesc, const CmdInvoker& cmdHandler, CmdTypesIf::CmdPriority priority)
+{
+	return addInvoker(cmdName, cmdDesc, cmdHandler, priority == CmdTypesIf::CmdPriority::BULK ? CMDIF_PRIO_BULK : CMDIF_PRIO_INTERACTIVE, 0, std::string());
+}
+
+CmdRegisterIf::ReturnCode CmdRegisterImpl::joinCmdGroup(const std::string& groupName, const std::string& memberName, const std::string& groupDesc, const CmdInvoker& cmdHandler)
+{
+	return addInvoker(groupName, groupDesc, cmdHandler, CMDIF_PRIO_INTERACTIVE, CMDIF_REG_FLAG_GROUP, memberName);
+}
+
+CmdRegisterIf::ReturnCode CmdRegisterImpl::addInvoker(const std::string& cmdName, const std::string& cmdDesc, const CmdInvoker& cmdHandler, uint32_t priority, uint32_t flags, const std::string& memberName)
 {
 	CmdRegisterIf::ReturnCode rc = CmdRegisterIf::ReturnCode::ALREADY_EXISTS;
 	std::unique_lock<std::mutex> lock(m_mutex);
@@ -60,7 +72,20 @@ CmdRegisterIf::ReturnCode CmdRegisterImpl::registerCmdHandler(const std::string&
 		m_registeredInvokers.emplace(cmdName, std::bind(&CmdRegisterImpl::invokeCmd, this, std::placeholders::_1, cmdHandler));
 		lock.unlock();
 
-		union itc_msg* req = itc_alloc(offsetof(struct CmdIfRegCmdRequestS, cmd_desc) + cmdDesc.length() + 1, CMDIF_REG_CMD_REQUEST);
+		// Members of a group may each parse their arguments differently, only a single handler's syntax is handed out
+		std::vector<uint8_t> syntax;
+		if((flags & CMDIF_REG_FLAG_GROUP) == 0 && getSyntaxGraph(cmdName, syntax))
+		{
+			flags |= CMDIF_REG_FLAG_SYNTAX;
+		}
+
+		struct CmdIfRegCmdExtS ext;
+		std::memset(&ext, 0, sizeof(ext));
+		ext.priority = priority;
+		ext.flags = flags;
+		std::memcpy(ext.member_name, memberName.c_str(), std::min(memberName.length(), static_cast<size_t>(MAX_CMD_NAME_LENGTH - 1)));
+
+		union itc_msg* req = itc_alloc(offsetof(struct CmdIfRegCmdRequestS, cmd_desc) + cmdDesc.length() + 1 + sizeof(ext), CMDIF_REG_CMD_REQUEST);
 
 		req->cmdIfRegCmdRequest.mbox_id = itc_current_mbox();
 		std::memset(req->cmdIfRegCmdRequest.cmd_name, 0, MAX_CMD_NAME_LENGTH);
@@ -74,6 +99,7 @@ CmdRegisterIf::ReturnCode CmdRegisterImpl::registerCmdHandler(const std::string&
 		}
 
 		std::strcpy(req->cmdIfRegCmdRequest.cmd_desc, cmdDesc.c_str());
+		std::memcpy(req->cmdIfRegCmdRequest.cmd_desc + cmdDesc.length() + 1, &ext, sizeof(ext));
 
 		if(m_clidMboxId == ITC_NO_MBOX_ID)
 		{
@@ -88,6 +114,11 @@ CmdRegisterIf::ReturnCode CmdRegisterImpl::registerCmdHandler(const std::string&
 
 		TPT_TRACE(TRACE_INFO, SSTR("Send CMDIF_REG_CMD_REQUEST to clid successfully!"));
 
+		if((flags & CMDIF_REG_FLAG_SYNTAX) != 0)
+		{
+			sendSyntaxGraph(cmdName, syntax);
+		}
+
 		return CmdRegisterIf::ReturnCode::NORMAL;
 	}
 
@@ -95,6 +126,40 @@ CmdRegisterIf::ReturnCode CmdRegisterImpl::registerCmdHandler(const std::string&
 	return rc;
 }
 
+bool CmdRegisterImpl::getSyntaxGraph(const std::string& cmdName, std::vector<uint8_t>& syntax)
+{
+	// Only known if the application registered its CmdTableIf for cmdName before the handler, as it normally does
+	if(!CmdTableImpl::getInstance().getSyntaxGraph(cmdName, syntax))
+	{
+		return false;
+	}
+
+	if(syntax.size() > CMDIF_MAX_SYNTAX_LENGTH || cmdName.length() >= MAX_CMD_NAME_LENGTH)
+	{
+		TPT_TRACE(TRACE_ABN, SSTR("Syntax graph of cmdName \"", cmdName, "\" is not handed to clid, ", syntax.size(), " bytes!"));
+		return false;
+	}
+
+	return true;
+}
+
+void CmdRegisterImpl::sendSyntaxGraph(const std::string& cmdName, const std::vector<uint8_t>& syntax)
+{
+	union itc_msg* req = itc_alloc(offsetof(struct CmdIfRegSyntaxRequestS, syntax) + syntax.size(), CMDIF_REG_SYNTAX_REQUEST);
+	std::memset(req->cmdIfRegSyntaxRequest.cmd_name, 0, MAX_CMD_NAME_LENGTH);
+	std::strcpy(req->cmdIfRegSyntaxRequest.cmd_name, cmdName.c_str());
+	req->cmdIfRegSyntaxRequest.syntaxLen = static_cast<uint32_t>(syntax.size());
+	std::memcpy(req->cmdIfRegSyntaxRequest.syntax, syntax.data(), syntax.size());
+
+	if(!itc_send(&req, m_clidMboxId, ITC_MY_MBOX_ID, NULL))
+	{
+		TPT_TRACE(TRACE_ERROR, SSTR("Failed to send CMDIF_REG_SYNTAX_REQUEST to clid for cmdName = \"", cmdName, "\""));
+		return;
+	}
+
+	TPT_TRACE(TRACE_INFO, SSTR("Send CMDIF_REG_SYNTAX_REQUEST to clid successfully, ", syntax.size(), " bytes!"));
+}
+
 CmdRegisterIf::ReturnCode CmdRegisterImpl::deregisterCmdHandler(const std::string& cmdName)
 {
 	CmdRegisterIf::ReturnCode rc = CmdRegisterIf::ReturnCode::NOT_FOUND;
@@ -160,6 +225,8 @@ void CmdRegisterImpl::init()
 
 void CmdRegisterImpl::handleExeCmdRequest(const std::shared_ptr<union itc_msg>& msg)
 {
+	uint64_t receivedNs = CmdJobImpl::getSteadyClockNs();
+
 	// TODO: Create a Job, save job_id and pass it to the class who registered the cmdHandler.
 	// Reinterpret cmd arguments sent from clid daemon and pass to cmdTableIf for decoding the syntax and executing the actual cmd
 
@@ -167,31 +234,48 @@ void CmdRegisterImpl::handleExeCmdRequest(const std::shared_ptr<union itc_msg>&
 	printArgs << "\"";
 	std::vector<std::string> argsList;
 	uint32_t numArgs = msg->cmdIfExeCmdRequest.num_args;
-	char* args = msg->cmdIfExeCmdRequest.payload;
+	const char* args = msg->cmdIfExeCmdRequest.payload;
+	const char* argsEnd = args + msg->cmdIfExeCmdRequest.payloadLen;
+	argsList.reserve(numArgs);
 
+	// Arguments are length-prefixed, see CmdIfExeCmdRequestS
 	for(uint32_t i = 0; i < numArgs; i++)
 	{
-		std::string str(args);
-		printArgs << str;
+		uint16_t argLen = 0;
+		if(argsEnd - args < (long)sizeof(uint16_t))
+		{
+			TPT_TRACE(TRACE_ERROR, SSTR("Truncated argument ", i, " in execute command request from clid!"));
+			return;
+		}
+		std::memcpy(&argLen, args, sizeof(uint16_t));
+		args += sizeof(uint16_t);
+
+		if(argsEnd - args < argLen)
+		{
+			TPT_TRACE(TRACE_ERROR, SSTR("Truncated argument ", i, " in execute command request from clid!"));
+			return;
+		}
+
+		argsList.emplace_back(args, argLen);
+		args += argLen;
+
+		printArgs << argsList.back();
 		if(i < numArgs - 1)
 		{
 			printArgs << " ";
 		}
-
-		argsList.push_back(str);
-		args += (str.length() + 1);
-		
 	}
 
 	printArgs << "\"";
 	TPT_TRACE(TRACE_INFO, SSTR("Received execute command request from clid for cmdName \"", std::string(msg->cmdIfExeCmdRequest.cmd_name), "\", with args \"",  printArgs.str(), "\""));
 
-	auto job = std::make_shared<CmdIf::V1::CmdJobImpl>(msg->cmdIfExeCmdRequest.cmd_name, msg->cmdIfExeCmdRequest.job_id, argsList, m_clidMboxId);
+	auto job = std::make_shared<CmdIf::V1::CmdJobImpl>(msg->cmdIfExeCmdRequest.cmd_name, msg->cmdIfExeCmdRequest.job_id, argsList, m_clidMboxId, receivedNs);
 
 	auto iter = m_registeredInvokers.find(job->getCmdName());
 	if(iter != m_registeredInvokers.cend())
 	{
 		// Pass the job to registered cmdHandler which previously added by registerCmdHandler()
+		job->markStarted();
 		iter->second(job);
 	} else
 	{
@@ -3,6 +3,7 @@
 #include <memory>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <functional>
 #include <sstream>
 #include <cstdio>
@@ -12,6 +13,7 @@
 
 #include "cli-daemon-tpt-provider.h"
 #include "cmdSyntaxGraph.h"
+#include "tcp_proto_v2.h"
 
 using namespace CommonUtils::V1::StringUtils;
 
@@ -417,6 +419,66 @@ const std::shared_ptr<CmdTypesIf::CmdFunctionWrapper> CmdSyntaxGraph::findCmdHan
 
 }
 
+bool CmdSyntaxGraph::serializeCommand(const std::string& cmdName, std::vector<uint8_t>& syntax) const
+{
+	std::scoped_lock<std::mutex> lock(m_mutex);
+
+	const auto& firstNodeIter = m_cmdMap.find(cmdName);
+	if(firstNodeIter == m_cmdMap.cend())
+	{
+		return false;
+	}
+
+	/* Nodes are shared between syntax paths, so number each of them once, in breadth-first order from the cmdName node,
+	   children then refer to each other by these indices (see "syntax" in tcp_proto_v2.h) */
+	std::vector<GraphNode*> nodes { firstNodeIter->second.get() };
+	std::unordered_map<const GraphNode*, uint32_t> indices { { nodes[0], 0 } };
+	uint32_t numEdges = 0;
+	for(size_t i = 0; i < nodes.size(); ++i)
+	{
+		for(const auto& subnode : nodes[i]->m_subNodeList)
+		{
+			if(indices.emplace(subnode.get(), static_cast<uint32_t>(nodes.size())).second)
+			{
+				nodes.push_back(subnode.get());
+			}
+		}
+
+		numEdges += nodes[i]->m_subNodeList.size();
+	}
+
+	if(nodes.size() > CLID_MAX_SYNTAX_NODES)
+	{
+		TPT_TRACE(TRACE_ABN, SSTR("Syntax graph of cmdName \"", cmdName, "\" has too many nodes (", nodes.size(), "), cannot serialize it!"));
+		return false;
+	}
+
+	syntax.clear();
+	appendVarint(syntax, CLID_SYNTAX_VERSION);
+	appendVarint(syntax, static_cast<uint32_t>(nodes.size()));
+	appendVarint(syntax, numEdges);
+	for(const auto node : nodes)
+	{
+		appendVarint(syntax, (node->m_anyValue ? CLID_SYNTAX_NODE_ANY_VALUE : 0) | (node->m_handler.func ? CLID_SYNTAX_NODE_HANDLER : 0));
+		appendVarint(syntax, static_cast<uint32_t>(node->m_name.length()));
+		syntax.insert(syntax.end(), node->m_name.cbegin(), node->m_name.cend());
+		appendVarint(syntax, static_cast<uint32_t>(node->m_subNodeList.size()));
+		for(const auto& subnode : node->m_subNodeList)
+		{
+			appendVarint(syntax, indices[subnode.get()]);
+		}
+	}
+
+	return true;
+}
+
+void CmdSyntaxGraph::appendVarint(std::vector<uint8_t>& buff, uint32_t value)
+{
+	uint8_t encoded[CLID_VARINT_MAX_SIZE];
+	size_t len = clid_varint_encode(encoded, value);
+	buff.insert(buff.end(), encoded, encoded + len);
+}
+
 void CmdSyntaxGraph::printNextPossibleArguments(std::shared_ptr<GraphNode> currentNode, std::ostringstream& output)
 {
 	while(currentNode)
@@ -44,6 +44,11 @@ CmdIf::V1::CmdTypesIf::CmdResultCode CmdTableImpl::executeCmd(const std::vector<
 	return res;
 }
 
+bool CmdTableImpl::getSyntaxGraph(const std::string& cmdName, std::vector<uint8_t>& syntax) const
+{
+	return m_syntaxGraph.serializeCommand(cmdName, syntax);
+}
+
 void CmdTableImpl::printCmdHelp(const std::vector<CmdTypesIf::CmdDefinition>& cmdDefinitions, std::ostringstream& output)
 {
 	static const std::string INDENT { "\n     " };
@@ -0,0 +1,288 @@
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <string>
+#include <set>
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <cstdlib>
+#include <malloc.h>
+
+#include "cmdSyntaxGraphBench.h"
+#include "cmdTypesIf.h"
+
+/* Replace the global allocation functions so that every heap operation done by CmdSyntaxGraph is counted.
+   Sizes come from malloc_usable_size() to account for what the allocator really hands out, not what was asked for.
+   The benchmark is single-threaded, plain counters are enough. */
+static uint64_t m_numAllocs { 0 };
+static uint64_t m_allocatedBytes { 0 };
+static uint64_t m_freedBytes { 0 };
+
+void* operator new(std::size_t size)
+{
+	void* ptr = std::malloc(size ? size : 1);
+	if(ptr == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	m_numAllocs++;
+	m_allocatedBytes += malloc_usable_size(ptr);
+	return ptr;
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	if(ptr)
+	{
+		m_freedBytes += malloc_usable_size(ptr);
+		std::free(ptr);
+	}
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+	(void)size;
+	operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t size) noexcept
+{
+	(void)size;
+	operator delete(ptr);
+}
+
+namespace CmdIf
+{
+
+namespace V1
+{
+
+constexpr size_t NUM_INPUTS_PER_KIND { 1024 };
+
+HeapCounters getHeapCounters()
+{
+	return { m_numAllocs, m_allocatedBytes, m_freedBytes };
+}
+
+CmdSyntaxGraphBench::CmdSyntaxGraphBench(const SyntaxGraphBenchConfig& config, uint32_t seed)
+	: m_config(config), m_rng(seed)
+{
+	if(m_config.numOptionals > m_config.depth)
+	{
+		m_config.numOptionals = m_config.depth;
+	}
+
+	generateTable();
+}
+
+CmdTypesIf::CmdResultCode CmdSyntaxGraphBench::mockCmdHandler(const std::vector<std::string>& arguments, std::ostringstream& outputStream)
+{
+	(void)arguments;
+	(void)outputStream;
+	return CmdTypesIf::CmdResultCode::CMD_RET_SUCCESS;
+}
+
+void CmdSyntaxGraphBench::generateTable()
+{
+	enum class PositionKind { LITERAL, ANY, OPTIONAL };
+
+	CmdTypesIf::CmdFunctionWrapper handler { std::bind(&CmdSyntaxGraphBench::mockCmdHandler, std::placeholders::_1, std::placeholders::_2), "mockCmdHandler" };
+	std::uniform_int_distribution<uint32_t> percent(0, 99);
+
+	for(uint32_t i = 0; i < m_config.numCmds; ++i)
+	{
+		std::string cmdName = "c" + std::to_string(i);
+		std::vector<std::pair<std::string, CmdTypesIf::CmdFunctionWrapper>> syntaxes;
+
+		for(uint32_t j = 0; j < m_config.syntaxesPerCmd; ++j)
+		{
+			/* Pick which positions are optional branches, then draw <any> among the remaining ones */
+			std::vector<PositionKind> kinds(m_config.depth, PositionKind::LITERAL);
+			for(uint32_t k = 0; k < m_config.numOptionals; ++k)
+			{
+				kinds[k] = PositionKind::OPTIONAL;
+			}
+			std::shuffle(kinds.begin(), kinds.end(), m_rng);
+			for(auto& kind : kinds)
+			{
+				if(kind == PositionKind::LITERAL && percent(m_rng) < m_config.anyPercent)
+				{
+					kind = PositionKind::ANY;
+				}
+			}
+
+			std::string selector = "s" + std::to_string(j);
+			std::string syntax = cmdName + " " + selector;
+			std::vector<std::string> args { cmdName, selector };
+			size_t lastLiteral = 0;
+
+			for(uint32_t k = 0; k < m_config.depth; ++k)
+			{
+				std::string pos = std::to_string(k);
+				switch(kinds[k])
+				{
+				case PositionKind::LITERAL:
+					syntax += " l" + pos;
+					lastLiteral = args.size();
+					args.push_back("l" + pos);
+					break;
+
+				case PositionKind::ANY:
+					syntax += " <a" + pos + ">";
+					args.push_back(std::to_string(m_rng()));
+					break;
+
+				case PositionKind::OPTIONAL:
+					syntax += " [ o" + pos + "a | o" + pos + "b ]";
+					switch(m_rng() % 3)
+					{
+					case 0:
+						args.push_back("o" + pos + "a");
+						break;
+					case 1:
+						args.push_back("o" + pos + "b");
+						break;
+					default:
+						break; // Leave the optional branch out
+					}
+					break;
+				}
+			}
+
+			syntaxes.emplace_back(syntax, handler);
+
+			/* Only keep a bounded set of inputs, spread over the whole table */
+			if(m_matchingInputs.size() < NUM_INPUTS_PER_KIND || m_rng() % (m_config.numCmds * m_config.syntaxesPerCmd) < NUM_INPUTS_PER_KIND)
+			{
+				/* A miss as it typically happens: right command, mistyped deepest literal, or an unknown sub-command if there is no literal */
+				std::vector<std::string> wrongArgs = args;
+				wrongArgs[lastLiteral ? lastLiteral : 1] = "zz";
+
+				if(m_matchingInputs.size() < NUM_INPUTS_PER_KIND)
+				{
+					m_matchingInputs.push_back(args);
+					m_nonMatchingInputs.push_back(wrongArgs);
+				}
+				else
+				{
+					size_t victim = m_rng() % NUM_INPUTS_PER_KIND;
+					m_matchingInputs[victim] = args;
+					m_nonMatchingInputs[victim] = wrongArgs;
+				}
+			}
+		}
+
+		m_table.emplace_back(cmdName, syntaxes);
+	}
+}
+
+size_t CmdSyntaxGraphBench::countNodes() const
+{
+	/* Alternatives of an optional branch join again on the next node, so the graph is a DAG, visit each node once */
+	std::set<const GraphNode*> visited;
+	std::vector<const GraphNode*> stack;
+
+	for(const auto& cmd : m_syntaxGraph.m_cmdMap)
+	{
+		stack.push_back(cmd.second.get());
+	}
+
+	while(!stack.empty())
+	{
+		const GraphNode* node = stack.back();
+		stack.pop_back();
+
+		if(!visited.insert(node).second)
+		{
+			continue;
+		}
+
+		for(const auto& subnode : node->m_subNodeList)
+		{
+			stack.push_back(subnode.get());
+		}
+	}
+
+	return visited.size();
+}
+
+SyntaxGraphLookupResult CmdSyntaxGraphBench::measureLookups(const std::vector<std::vector<std::string>>& inputs, uint32_t numLookups) const
+{
+	SyntaxGraphLookupResult result {};
+	std::ostringstream output;
+	uint32_t numHits = 0;
+
+	if(inputs.empty() || numLookups == 0)
+	{
+		return result;
+	}
+
+	HeapCounters before = getHeapCounters();
+	auto start = std::chrono::steady_clock::now();
+
+	for(uint32_t i = 0; i < numLookups; ++i)
+	{
+		const std::vector<std::string>& args = inputs[i % inputs.size()];
+		if(m_syntaxGraph.findCmdHandler(args.size(), args.cbegin(), output))
+		{
+			numHits++;
+		}
+		output.str(std::string()); // Misses print their usage into the output, do not let it grow across iterations
+	}
+
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	HeapCounters after = getHeapCounters();
+
+	result.lookupsPerSec = numLookups / elapsed;
+	result.allocsPerLookup = static_cast<double>(after.numAllocs - before.numAllocs) / numLookups;
+	result.bytesPerLookup = static_cast<double>(after.allocatedBytes - before.allocatedBytes) / numLookups;
+	result.hitPercent = 100.0 * numHits / numLookups;
+
+	return result;
+}
+
+SyntaxGraphBenchResult CmdSyntaxGraphBench::run(uint32_t numLookups)
+{
+	SyntaxGraphBenchResult result {};
+
+	HeapCounters before = getHeapCounters();
+	auto start = std::chrono::steady_clock::now();
+
+	for(const auto& cmd : m_table)
+	{
+		m_syntaxGraph.addCommand(cmd.first, cmd.second);
+	}
+
+	auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	HeapCounters after = getHeapCounters();
+
+	result.numNodes = countNodes();
+	result.numSyntaxes = static_cast<size_t>(m_config.numCmds) * m_config.syntaxesPerCmd;
+	result.buildMs = elapsed;
+
+	/* What addCommand() leaves behind on the heap: the nodes themselves plus their names, handler copies and subnode vectors */
+	uint64_t retainedBytes = (after.allocatedBytes - before.allocatedBytes) - (after.freedBytes - before.freedBytes);
+	result.bytesPerNode = result.numNodes ? static_cast<double>(retainedBytes) / result.numNodes : 0;
+
+	result.matching = measureLookups(m_matchingInputs, numLookups);
+	result.nonMatching = measureLookups(m_nonMatchingInputs, numLookups);
+
+	return result;
+}
+
+} // namespace V1
+
+} // namespace CmdIf
@@ -0,0 +1,100 @@
+/*
+* ______________________   ________                                     
+* __  ____/__  /____  _/   ___  __ \_____ ____________ ________________ 
+* _  /    __  /  __  /     __  / / /  __ `/  _ \_  __ `__ \  __ \_  __ \
+* / /___  _  /____/ /      _  /_/ // /_/ //  __/  / / / / / /_/ /  / / /
+* \____/  /_____/___/      /_____/ \__,_/ \___//_/ /_/ /_/\____//_/ /_/ 
+*                                                                       
+*/
+
+#pragma once
+
+#include <sstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <cstdint>
+
+#include "cmdSyntaxGraph.h"
+
+
+namespace CmdIf
+{
+
+namespace V1
+{
+
+/* Shape of a synthetic command table.
+   Every command "c<i>" gets syntaxesPerCmd syntaxes "c<i> s<j> ...", each followed by depth positions. Of those positions,
+   numOptionals are "[ o<k>a | o<k>b ]" branches, anyPercent percent of the rest are "<a<k>>" and the others are literals "l<k>". */
+struct SyntaxGraphBenchConfig
+{
+	uint32_t numCmds;
+	uint32_t syntaxesPerCmd;
+	uint32_t depth;
+	uint32_t numOptionals;
+	uint32_t anyPercent;
+};
+
+struct SyntaxGraphLookupResult
+{
+	double lookupsPerSec;
+	double allocsPerLookup;
+	double bytesPerLookup;
+	double hitPercent;
+};
+
+struct SyntaxGraphBenchResult
+{
+	size_t numNodes;
+	size_t numSyntaxes;
+	double buildMs;
+	double bytesPerNode;
+	SyntaxGraphLookupResult matching;
+	SyntaxGraphLookupResult nonMatching;
+};
+
+class CmdSyntaxGraphBench
+{
+public:
+	CmdSyntaxGraphBench(const SyntaxGraphBenchConfig& config, uint32_t seed);
+	virtual ~CmdSyntaxGraphBench() = default;
+
+	SyntaxGraphBenchResult run(uint32_t numLookups);
+
+	CmdSyntaxGraphBench(const CmdSyntaxGraphBench&) = delete;
+	CmdSyntaxGraphBench(CmdSyntaxGraphBench&&) = delete;
+	CmdSyntaxGraphBench& operator=(const CmdSyntaxGraphBench&) = delete;
+	CmdSyntaxGraphBench& operator=(CmdSyntaxGraphBench&&) = delete;
+
+	static CmdTypesIf::CmdResultCode mockCmdHandler(const std::vector<std::string>& arguments, std::ostringstream& outputStream);
+
+private:
+	void generateTable();
+	size_t countNodes() const;
+	SyntaxGraphLookupResult measureLookups(const std::vector<std::vector<std::string>>& inputs, uint32_t numLookups) const;
+
+private:
+	SyntaxGraphBenchConfig m_config;
+	std::mt19937 m_rng;
+	CmdSyntaxGraph m_syntaxGraph;
+
+	std::vector<std::pair<std::string, std::vector<std::pair<std::string, CmdTypesIf::CmdFunctionWrapper>>>> m_table;
+	std::vector<std::vector<std::string>> m_matchingInputs;
+	std::vector<std::vector<std::string>> m_nonMatchingInputs;
+
+}; // class CmdSyntaxGraphBench
+
+/* Heap counters fed by the global operator new/delete replacements in cmdSyntaxGraphBench.cc */
+struct HeapCounters
+{
+	uint64_t numAllocs;
+	uint64_t allocatedBytes;
+	uint64_t freedBytes;
+};
+
+HeapCounters getHeapCounters();
+
+} // namespace V1
+
+} // namespace CmdIf
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "cmdSyntaxGraphBench.h"
+
+
+using namespace CmdIf::V1;
+
+/* Usage: cmdSyntaxGraphBench [ <numLookups> [ <seed> ] ]
+   Each row builds a fresh CmdSyntaxGraph from a synthetic table, then runs numLookups findCmdHandler() calls
+   with inputs that match a syntax and again with inputs that do not. One parameter is varied at a time. */
+
+int main(int argc, char* argv[])
+{
+	uint32_t numLookups = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 200000;
+	uint32_t seed = argc > 2 ? std::strtoul(argv[2], nullptr, 0) : 1;
+
+	const std::vector<std::pair<std::string, SyntaxGraphBenchConfig>> configs {
+		// sweep             numCmds  syntaxes  depth  optionals  any%
+		{ "size",          {   10,     4,        4,     1,         25 } },
+		{ "size",          {  100,     4,        4,     1,         25 } },
+		{ "size",          { 1000,     4,        4,     1,         25 } },
+		{ "depth",         {  100,     4,        2,     1,         25 } },
+		{ "depth",         {  100,     4,        8,     1,         25 } },
+		{ "depth",         {  100,     4,       16,     1,         25 } },
+		{ "optionals",     {  100,     4,        8,     0,         25 } },
+		{ "optionals",     {  100,     4,        8,     2,         25 } },
+		{ "optionals",     {  100,     4,        8,     4,         25 } },
+		{ "any",           {  100,     4,        8,     1,          0 } },
+		{ "any",           {  100,     4,        8,     1,         50 } },
+		{ "any",           {  100,     4,        8,     1,        100 } }
+	};
+
+	std::cout << "numLookups " << numLookups << ", seed " << seed << std::endl;
+	std::cout << std::endl;
+	std::cout << std::left
+		<< std::setw(10) << "sweep" << std::right
+		<< std::setw(6) << "cmds" << std::setw(6) << "depth" << std::setw(5) << "opt" << std::setw(5) << "any%"
+		<< std::setw(8) << "nodes" << std::setw(10) << "build ms" << std::setw(9) << "B/node"
+		<< " |" << std::setw(11) << "hit/s" << std::setw(9) << "alloc/op" << std::setw(8) << "B/op" << std::setw(6) << "hit%"
+		<< " |" << std::setw(11) << "miss/s" << std::setw(9) << "alloc/op" << std::setw(8) << "B/op" << std::setw(6) << "hit%"
+		<< std::endl;
+
+	for(const auto& config : configs)
+	{
+		CmdSyntaxGraphBench bench(config.second, seed);
+		SyntaxGraphBenchResult result = bench.run(numLookups);
+
+		std::cout << std::fixed << std::left
+			<< std::setw(10) << config.first << std::right
+			<< std::setw(6) << config.second.numCmds << std::setw(6) << config.second.depth
+			<< std::setw(5) << config.second.numOptionals << std::setw(5) << config.second.anyPercent
+			<< std::setw(8) << result.numNodes << std::setprecision(2) << std::setw(10) << result.buildMs
+			<< std::setprecision(0) << std::setw(9) << result.bytesPerNode
+			<< " |" << std::setw(11) << result.matching.lookupsPerSec << std::setprecision(1) << std::setw(9) << result.matching.allocsPerLookup
+			<< std::setprecision(0) << std::setw(8) << result.matching.bytesPerLookup << std::setw(6) << result.matching.hitPercent
+			<< " |" << std::setw(11) << result.nonMatching.lookupsPerSec << std::setprecision(1) << std::setw(9) << result.nonMatching.allocsPerLookup
+			<< std::setprecision(0) << std::setw(8) << result.nonMatching.bytesPerLookup << std::setw(6) << result.nonMatching.hitPercent
+			<< std::endl;
+	}
+
+	return 0;
+}
@@ -116,6 +116,44 @@ void CmdSyntaxGraphTest::printNextPossibleArgumentsTest(std::shared_ptr<GraphNod
 	std::cout << std::endl;
 }
 
+void CmdSyntaxGraphTest::serializeCommandTest(const std::string& cmdName, const std::vector<std::pair<std::string, CmdTypesIf::CmdFunctionWrapper>>& syntaxHandler)
+{
+	std::cout << "Input: " << cmdName << std::endl;
+	for(const auto& sh : syntaxHandler)
+	{
+		std::cout << "       Syntax: " << sh.first << std::endl;
+	}
+	std::cout << std::endl;
+
+	std::cout << "Output:" << std::endl;
+	m_syntaxGraph.addCommand(cmdName, syntaxHandler);
+
+	std::vector<uint8_t> syntax;
+	if(!m_syntaxGraph.serializeCommand(cmdName, syntax))
+	{
+		std::cout << "       Failed to serializeCommand()!" << std::endl;
+		return;
+	}
+
+	std::cout << "[OK]:       " << std::dec << syntax.size() << " bytes:";
+	for(const auto& byte : syntax)
+	{
+		std::cout << " " << std::hex << static_cast<int>(byte);
+	}
+	std::cout << std::dec << std::endl;
+
+	std::vector<uint8_t> unknown;
+	if(!m_syntaxGraph.serializeCommand(cmdName + "_unknown", unknown))
+	{
+		std::cout << "[OK]:       Unknown cmdName has no syntax!" << std::endl;
+	}
+
+	std::cout << std::endl;
+	
+	std::cout << "================================================" << std::endl;
+	std::cout << std::endl;
+}
+
 CmdTypesIf::CmdResultCode CmdSyntaxGraphTest::mockCmdHandler(const std::vector<std::string>& arguments, std::ostringstream& outputStream)
 {
 	(void)arguments;
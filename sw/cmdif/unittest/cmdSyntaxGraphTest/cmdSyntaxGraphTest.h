@@ -31,6 +31,7 @@ public:
 	std::shared_ptr<GraphNode> addSyntax(std::shared_ptr<GraphNode> firstNode, const char* syntax, const CmdTypesIf::CmdFunctionWrapper& cmdHandler);
 	void evaluateCommandArguments(std::shared_ptr<GraphNode> firstNode, const std::vector<std::string>& args);
 	void printNextPossibleArgumentsTest(std::shared_ptr<GraphNode> currentNode);
+	void serializeCommandTest(const std::string& cmdName, const std::vector<std::pair<std::string, CmdTypesIf::CmdFunctionWrapper>>& syntaxHandler);
 
 	CmdTypesIf::CmdResultCode mockCmdHandler(const std::vector<std::string>& arguments, std::ostringstream& outputStream);
 	CmdTypesIf::CmdResultCode mockCmdHandler2(const std::vector<std::string>& arguments, std::ostringstream& outputStream);
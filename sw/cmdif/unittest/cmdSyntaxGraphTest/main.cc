@@ -56,5 +56,7 @@ int main()
 
 	syntaxGraphTest.printNextPossibleArgumentsTest(firstNode);
 
+	syntaxGraphTest.serializeCommandTest("abc", { { syntax2, cmdHandler1 }, { syntax4, cmdHandler2 } });
+
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,163 @@
+/*
+* ______________________   ________                                     
+* __  ____/__  /____  _/   ___  __ \_____ ____________ ________________ 
+* _  /    __  /  __  /     __  / / /  __ `/  _ \_  __ `__ \  __ \_  __ \
+* / /___  _  /____/ /      _  /_/ // /_/ //  __/  / / / / / /_/ /  / / /
+* \____/  /_____/___/      /_____/ \__,_/ \___//_/ /_/ /_/\____//_/ /_/ 
+*                                                                       
+*/
+
+#ifndef __CLID_BEACON_H__
+#define __CLID_BEACON_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+	Discovery beacon, broadcast by clid every few seconds to CLID_BEACON_PORT, where shells listen for the ITCGW text broadcast too.
+
+	One UDP datagram, all integers big-endian at fixed offsets, so that it is read without any string scanning:
+	+ magic: 4 bytes, CLID_BEACON_MAGIC.
+	+ version: 1 byte, CLID_BEACON_VERSION. A receiver ignores versions it does not know.
+	+ hostname_len: 1 byte, 1 to CLID_BEACON_MAX_HOSTNAME.
+	+ tcp_port: 2 bytes, where clid accepts shells.
+	+ tcp_ip: 4 bytes, IPv4 address clid listens on (the datagram may leave through another one).
+	+ registry_epoch: 4 bytes, registry_version: 4 bytes, as in the v2 CLID_GET_LIST_CMD_REPLY. A shell holding the command list
+	of that epoch and version knows it is still current without asking.
+	+ active_clients: 2 bytes, shells connected right now.
+	+ jobs_in_flight: 2 bytes, shells whose command (or batch) clid has not replied to yet.
+	+ reserved: 4 bytes, zeros.
+	+ hostname: "hostname_len" bytes (not include '\0').
+
+	A shell does not have to wait for the next one: it broadcasts a probe to CLID_PROBE_PORT and every clid that beacons and hears it
+	answers right away with its beacon, sent to where the probe came from. Only probes from clid's own network are answered, and only
+	a few a second per source. The probe is CLID_PROBE_SIZE bytes, as large as the largest beacon so that the answer is never larger:
+	+ magic: 4 bytes, CLID_PROBE_MAGIC.
+	+ version: 1 byte, CLID_BEACON_VERSION, the beacon version the shell understands.
+	+ reserved: 3 bytes, zeros.
+	+ padding: up to CLID_PROBE_SIZE, zeros. A shorter probe is not answered.
+*/
+#define CLID_BEACON_PORT		11111
+#define CLID_BEACON_MAGIC		0x434C4442 // "CLDB"
+#define CLID_BEACON_VERSION		1
+#define CLID_BEACON_HEADER_SIZE		28
+#define CLID_BEACON_MAX_HOSTNAME	64
+#define CLID_BEACON_MAX_SIZE		(CLID_BEACON_HEADER_SIZE + CLID_BEACON_MAX_HOSTNAME)
+#define CLID_PROBE_PORT			11112
+#define CLID_PROBE_MAGIC		0x434C4450 // "CLDP"
+#define CLID_PROBE_SIZE			CLID_BEACON_MAX_SIZE
+
+struct clid_beacon {
+	uint16_t	tcp_port;
+	uint32_t	tcp_ip; // Network order, as in struct in_addr
+	uint32_t	registry_epoch;
+	uint32_t	registry_version;
+	uint16_t	active_clients;
+	uint16_t	jobs_in_flight;
+	char		hostname[CLID_BEACON_MAX_HOSTNAME + 1];
+};
+
+
+static inline void clid_beacon_put_u16(uint8_t *buff, uint16_t value)
+{
+	buff[0] = (uint8_t)(value >> 8);
+	buff[1] = (uint8_t)value;
+}
+
+static inline void clid_beacon_put_u32(uint8_t *buff, uint32_t value)
+{
+	buff[0] = (uint8_t)(value >> 24);
+	buff[1] = (uint8_t)(value >> 16);
+	buff[2] = (uint8_t)(value >> 8);
+	buff[3] = (uint8_t)value;
+}
+
+static inline uint16_t clid_beacon_get_u16(const uint8_t *buff)
+{
+	return (uint16_t)((buff[0] << 8) | buff[1]);
+}
+
+static inline uint32_t clid_beacon_get_u32(const uint8_t *buff)
+{
+	return ((uint32_t)buff[0] << 24) | ((uint32_t)buff[1] << 16) | ((uint32_t)buff[2] << 8) | buff[3];
+}
+
+/* buff must have room for CLID_BEACON_MAX_SIZE bytes, a longer hostname is cut, return beacon size */
+static inline size_t clid_beacon_encode(uint8_t *buff, const struct clid_beacon *beacon)
+{
+	size_t hostname_len = strnlen(beacon->hostname, CLID_BEACON_MAX_HOSTNAME);
+
+	clid_beacon_put_u32(buff, CLID_BEACON_MAGIC);
+	buff[4] = CLID_BEACON_VERSION;
+	buff[5] = (uint8_t)hostname_len;
+	clid_beacon_put_u16(buff + 6, beacon->tcp_port);
+	memcpy(buff + 8, &beacon->tcp_ip, 4); // Already in network order
+	clid_beacon_put_u32(buff + 12, beacon->registry_epoch);
+	clid_beacon_put_u32(buff + 16, beacon->registry_version);
+	clid_beacon_put_u16(buff + 20, beacon->active_clients);
+	clid_beacon_put_u16(buff + 22, beacon->jobs_in_flight);
+	memset(buff + 24, 0, 4); // Reserved
+	memcpy(buff + CLID_BEACON_HEADER_SIZE, beacon->hostname, hostname_len);
+
+	return CLID_BEACON_HEADER_SIZE + hostname_len;
+}
+
+static inline bool clid_is_beacon(const uint8_t *buff, size_t len)
+{
+	return len >= 4 && clid_beacon_get_u32(buff) == CLID_BEACON_MAGIC;
+}
+
+/* Return false if buff is not a complete beacon of a known version */
+static inline bool clid_beacon_decode(const uint8_t *buff, size_t len, struct clid_beacon *beacon)
+{
+	if(len < CLID_BEACON_HEADER_SIZE || !clid_is_beacon(buff, len) || buff[4] != CLID_BEACON_VERSION)
+	{
+		return false;
+	}
+
+	size_t hostname_len = buff[5];
+	if(hostname_len == 0 || hostname_len > CLID_BEACON_MAX_HOSTNAME || len < CLID_BEACON_HEADER_SIZE + hostname_len
+		|| memchr(buff + CLID_BEACON_HEADER_SIZE, '\0', hostname_len) != NULL)
+	{
+		return false;
+	}
+
+	beacon->tcp_port = clid_beacon_get_u16(buff + 6);
+	memcpy(&beacon->tcp_ip, buff + 8, 4);
+	beacon->registry_epoch = clid_beacon_get_u32(buff + 12);
+	beacon->registry_version = clid_beacon_get_u32(buff + 16);
+	beacon->active_clients = clid_beacon_get_u16(buff + 20);
+	beacon->jobs_in_flight = clid_beacon_get_u16(buff + 22);
+	memcpy(beacon->hostname, buff + CLID_BEACON_HEADER_SIZE, hostname_len);
+	beacon->hostname[hostname_len] = '\0';
+
+	return true;
+}
+
+/* buff must have room for CLID_PROBE_SIZE bytes */
+static inline size_t clid_probe_encode(uint8_t *buff)
+{
+	clid_beacon_put_u32(buff, CLID_PROBE_MAGIC);
+	buff[4] = CLID_BEACON_VERSION;
+	memset(buff + 5, 0, CLID_PROBE_SIZE - 5); // Reserved and padding
+
+	return CLID_PROBE_SIZE;
+}
+
+/* A probe of a later version is still answered, with the beacon this side knows */
+static inline bool clid_is_probe(const uint8_t *buff, size_t len)
+{
+	return len >= CLID_PROBE_SIZE && clid_beacon_get_u32(buff) == CLID_PROBE_MAGIC;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __CLID_BEACON_H__
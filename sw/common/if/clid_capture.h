@@ -0,0 +1,173 @@
+/*
+* ______________________   ________                                     
+* __  ____/__  /____  _/   ___  __ \_____ ____________ ________________ 
+* _  /    __  /  __  /     __  / / /  __ `/  _ \_  __ `__ \  __ \_  __ \
+* / /___  _  /____/ /      _  /_/ // /_/ //  __/  / / / / / /_/ /  / / /
+* \____/  /_____/___/      /_____/ \__,_/ \___//_/ /_/ /_/\____//_/ /_/ 
+*                                                                       
+*/
+
+#ifndef __CLID_CAPTURE_H__
+#define __CLID_CAPTURE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+	Capture file written by "clid -r <file>" and read back by clidreplay and replayHandler.
+
+	The file starts with the 8 bytes CLID_CAPTURE_MAGIC, then is a plain sequence of records, appended to as they happen.
+	Every clid start appends a CLID_CAP_SESSION record first, all timestamps of the following records are relative to it.
+
+	Record format (integers are LEB128 varints, as in tcp_proto_v2.h but up to 64 bits):
+	+ kind: one byte, CLID_CAP_*.
+	+ time_us: varint, microseconds since the start of the session (CLOCK_MONOTONIC).
+	+ conn: varint, connection the record belongs to (clid's fd for it, reused after a CLID_CAP_DISCONNECT), 0 if none.
+	+ job_id: varint, clid's job_id the record belongs to, 0 if none.
+	+ body_length: varint, number of bytes that body has.
+	+ body: "body_length" bytes, format depends on kind (see below).
+*/
+#define CLID_CAPTURE_MAGIC		"CLIDCAP1"
+#define CLID_CAPTURE_MAGIC_SIZE		8
+#define CLID_CAP_VARINT64_MAX_SIZE	10
+#define CLID_CAP_MAX_HEADER_SIZE	(1 + 3 * CLID_CAP_VARINT64_MAX_SIZE + 5)
+
+/*
+	Record kinds and their body:
+
+	CLID_CAP_SESSION: wall clock at the start of the session, varint, microseconds since the epoch.
+	CLID_CAP_CONNECT: empty, a shell client connected.
+	CLID_CAP_DISCONNECT: empty, a shell client disconnected or was dropped.
+	CLID_CAP_INBOUND: one complete inbound frame, exactly as received (v1 header + payload, or one v2 frame).
+	CLID_CAP_JOB: a job was forwarded to its handler, the frame it came from is the last exe cmd or batch CLID_CAP_INBOUND on the same conn.
+		It may have waited in clid behind other jobs of the same handler mailbox in between. Each command of a batch is a job of its own.
+		Body is the arguments as in CmdIfExeCmdRequestS payload: for each argument, length (uint16_t, host order) then bytes.
+	CLID_CAP_ITC_REPLY: CMDIF_EXE_CMD_REPLY from the handler, result (varint) then the output bytes.
+	CLID_CAP_JOB_EXPIRED: empty, the job timer expired before the handler replied.
+*/
+#define CLID_CAP_SESSION		1
+#define CLID_CAP_CONNECT		2
+#define CLID_CAP_DISCONNECT		3
+#define CLID_CAP_INBOUND		4
+#define CLID_CAP_JOB			5
+#define CLID_CAP_ITC_REPLY		6
+#define CLID_CAP_JOB_EXPIRED		7
+
+struct clid_cap_record {
+	uint8_t		kind;
+	uint64_t	time_us;
+	uint32_t	conn;
+	uint64_t	job_id;
+	uint32_t	body_length;
+	const uint8_t	*body;		// Points into the decoded buffer, no copy
+};
+
+
+static inline size_t clid_cap_varint64_encode(uint8_t *buff, uint64_t value)
+{
+	size_t i = 0;
+	while(value >= 0x80)
+	{
+		buff[i++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buff[i++] = (uint8_t)value;
+
+	return i;
+}
+
+/* Return number of consumed bytes, 0 if more bytes are needed, -1 if malformed */
+static inline int clid_cap_varint64_decode(const uint8_t *buff, size_t len, uint64_t *value)
+{
+	uint64_t result = 0;
+	for(size_t i = 0; i < CLID_CAP_VARINT64_MAX_SIZE; i++)
+	{
+		if(i >= len)
+		{
+			return 0;
+		}
+
+		result |= (uint64_t)(buff[i] & 0x7F) << (7 * i);
+		if((buff[i] & 0x80) == 0)
+		{
+			if(i == CLID_CAP_VARINT64_MAX_SIZE - 1 && buff[i] > 0x01)
+			{
+				return -1; // More than 64 bits
+			}
+
+			*value = result;
+			return (int)(i + 1);
+		}
+	}
+
+	return -1;
+}
+
+/* buff must have room for at least CLID_CAP_MAX_HEADER_SIZE bytes, return header size */
+static inline size_t clid_cap_encode_header(uint8_t *buff, uint8_t kind, uint64_t time_us, uint32_t conn, uint64_t job_id, uint32_t body_length)
+{
+	size_t len = 0;
+	buff[len++] = kind;
+	len += clid_cap_varint64_encode(buff + len, time_us);
+	len += clid_cap_varint64_encode(buff + len, conn);
+	len += clid_cap_varint64_encode(buff + len, job_id);
+	len += clid_cap_varint64_encode(buff + len, body_length);
+
+	return len;
+}
+
+/* Return total record size (header + body) if a complete record is in buff, 0 if more bytes are needed, -1 if malformed */
+static inline long clid_cap_decode_record(const uint8_t *buff, size_t len, struct clid_cap_record *record)
+{
+	if(len < 1)
+	{
+		return 0;
+	}
+
+	record->kind = buff[0];
+	if(record->kind < CLID_CAP_SESSION || record->kind > CLID_CAP_JOB_EXPIRED)
+	{
+		return -1;
+	}
+
+	uint64_t fields[4];
+	size_t offset = 1;
+	for(int i = 0; i < 4; i++)
+	{
+		int res = clid_cap_varint64_decode(buff + offset, len - offset, &fields[i]);
+		if(res <= 0)
+		{
+			return res;
+		}
+		offset += res;
+	}
+
+	if(fields[1] > UINT32_MAX || fields[3] > UINT32_MAX)
+	{
+		return -1;
+	}
+
+	record->time_us = fields[0];
+	record->conn = (uint32_t)fields[1];
+	record->job_id = fields[2];
+	record->body_length = (uint32_t)fields[3];
+
+	if(len - offset < record->body_length)
+	{
+		return 0;
+	}
+
+	record->body = buff + offset;
+	return (long)(offset + record->body_length);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __CLID_CAPTURE_H__
@@ -20,6 +20,15 @@ extern "C" {
 
 #define CLID_PAYLOAD_TYPE_BASE		0x10000
 
+/* Legacy values carried in every v1 ethtcp_header */
+#define CLID_V1_RECEIVER		111
+#define CLID_V1_PROT_REV		15
+
+/* Protocol versions, see CLID_HELLO_REQUEST below for how they are negotiated */
+#define CLID_PROTO_V1			1
+#define CLID_PROTO_V2			2
+#define CLID_HELLO_TIMEOUT_MS		1000
+
 #define CLID_GET_LIST_CMD_REQUEST	(CLID_PAYLOAD_TYPE_BASE + 0x1)
 struct clid_get_list_cmd_request {
 	// uint32_t	payload_startpoint;
@@ -86,15 +95,57 @@ struct clid_exe_cmd_request {
 struct clid_exe_cmd_reply {
 	// uint32_t	payload_startpoint;
 	uint32_t	errorcode;
-	uint32_t	result;
+	uint32_t	result; // Handler's CMDIF_RET_* as is, see CLID_EXE_CMD_RESULT_SUCCESS
 	uint32_t	payload_length;
 	char		payload[1]; // String that shell client will print out for the user about results of the requested command
 };
 
+/* Same value as CMDIF_RET_SUCCESS in cmdProto.h, which shell clients do not include */
+#define CLID_EXE_CMD_RESULT_SUCCESS	10
+
+
+#define CLID_HELLO_REQUEST		(CLID_PAYLOAD_TYPE_BASE + 0x5)
+#define CLID_HELLO_REPLY		(CLID_PAYLOAD_TYPE_BASE + 0x6)
+/*
+	Version negotiation, always v1 framed and without any payload (payloadLen = 0):
+	+ Right after connect(), shell sends CLID_HELLO_REQUEST with header.protRev = highest version it speaks.
+	+ clid answers CLID_HELLO_REPLY with header.protRev = agreed version, and switches this connection to it.
+	+ An old clid just drops the unknown CLID_HELLO_REQUEST (it has no payload to desync the stream),
+	  so shell falls back to CLID_PROTO_V1 if no reply arrives within CLID_HELLO_TIMEOUT_MS.
+	+ From then on, every frame on this connection uses the agreed framing (see tcp_proto_v2.h for v2).
+*/
+
+#define CLID_EXE_CMD_TIMING		(CLID_PAYLOAD_TYPE_BASE + 0x7)
+/* v2 only, per-hop breakdown of a job, see tcp_proto_v2.h */
+
+#define CLID_EXE_BATCH_REQUEST		(CLID_PAYLOAD_TYPE_BASE + 0x8)
+#define CLID_EXE_BATCH_REPLY		(CLID_PAYLOAD_TYPE_BASE + 0x9)
+/* v2 only, an ordered list of commands executed in a single round trip, see tcp_proto_v2.h */
+
+/* How clid runs the commands of a CLID_EXE_BATCH_REQUEST */
+#define CLID_BATCH_SEQUENTIAL		0 // One after the other in order, whatever their results
+#define CLID_BATCH_STOP_ON_ERROR	1 // One after the other in order, the first one that does not succeed skips all the following ones
+#define CLID_BATCH_PARALLEL		2 // Several at once, they may complete in any order
+#define CLID_MAX_BATCH_CMDS		4096
+
+/* Result of a command in CLID_EXE_BATCH_REPLY that was never executed */
+#define CLID_BATCH_RESULT_SKIPPED	0
+
+#define CLID_CMD_LIST_CHANGED		(CLID_PAYLOAD_TYPE_BASE + 0xA)
+/* v2 only, pushed by clid on its own when a command comes or goes, see tcp_proto_v2.h */
+
+/* What happened to the command of a CLID_CMD_LIST_CHANGED */
+#define CLID_CMD_ADDED			1
+#define CLID_CMD_REMOVED		2
+
+#define CLID_GET_SYNTAX_REQUEST		(CLID_PAYLOAD_TYPE_BASE + 0xB)
+#define CLID_GET_SYNTAX_REPLY		(CLID_PAYLOAD_TYPE_BASE + 0xC)
+/* v2 only, compiled syntax graphs of commands, so that shells validate and complete arguments locally, see tcp_proto_v2.h */
 
 typedef enum {
 	CLID_STATUS_OK = 0,
 	CLID_INVALID_TYPE,
+	CLID_STATUS_LIST_UNCHANGED, // v2 CLID_GET_LIST_CMD_REPLY only, the list the requester already has is still valid
 	CLID_NUM_OF_STATUS
 } status_e;
 
@@ -0,0 +1,363 @@
+/*
+* ______________________   ________                                     
+* __  ____/__  /____  _/   ___  __ \_____ ____________ ________________ 
+* _  /    __  /  __  /     __  / / /  __ `/  _ \_  __ `__ \  __ \_  __ \
+* / /___  _  /____/ /      _  /_/ // /_/ //  __/  / / / / / /_/ /  / / /
+* \____/  /_____/___/      /_____/ \__,_/ \___//_/ /_/ /_/\____//_/ /_/ 
+*                                                                       
+*/
+
+#ifndef __TCP_PROTO_V2_H__
+#define __TCP_PROTO_V2_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "tcp_proto.h"
+
+/*
+	v2 frame format (all multi-byte integers are LEB128 varints, little groups of 7 bits first):
+	+ magic: one byte, always CLID_V2_MAGIC. A v1 frame always starts with 0x00 (high byte of sender pid), so both can be told apart.
+	+ type: one byte, CLID_V2_TYPE() of the respective v1 msgno.
+	+ flags: one byte, CLID_V2_FLAG_*.
+	+ request_id: varint, chosen by the requester and echoed back in the reply. Requesters never use 0,
+	  it marks the frames clid pushes on its own, which a client may receive at any time between two replies.
+	+ payload_length: varint, number of bytes that payload has.
+	+ payload: "payload_length" bytes, format depends on type (see below).
+
+	A frame can be decoded in a single bounded pass, no string scanning is needed anywhere,
+	all strings are length-prefixed and NOT NUL-terminated.
+*/
+#define CLID_V2_MAGIC			0xC2
+#define CLID_VARINT_MAX_SIZE		5
+#define CLID_V2_FIXED_HEADER_SIZE	3
+#define CLID_V2_MAX_HEADER_SIZE		(CLID_V2_FIXED_HEADER_SIZE + 2 * CLID_VARINT_MAX_SIZE)
+#define CLID_V2_MAX_PAYLOAD_LENGTH	(16 * 1024 * 1024)
+#define CLID_V2_MAX_FRAGMENT_LENGTH	(64 * 1024)
+
+#define CLID_V2_TYPE(msgno)		((uint8_t)((msgno) - CLID_PAYLOAD_TYPE_BASE))
+
+/* request_id of the frames clid pushes on its own, see CLID_CMD_LIST_CHANGED */
+#define CLID_V2_PUSH_REQUEST_ID		0
+
+/* This frame is a fragment of a reply, more fragments with the same request_id will follow */
+#define CLID_V2_FLAG_MORE		0x01
+
+/* CLID_EXE_CMD_REQUEST only: also report where the time of this job went, in a CLID_EXE_CMD_TIMING frame */
+#define CLID_V2_FLAG_TIMING		0x02
+
+/* CLID_EXE_CMD_REQUEST and CLID_EXE_BATCH_REQUEST only: run this job in the bulk priority class, whatever class its command was registered with.
+   Automated clients set it so that their jobs never delay the ones typed by an operator, the opposite is not possible */
+#define CLID_V2_FLAG_BULK		0x04
+
+/*
+	v2 payload formats:
+
+	CLID_GET_LIST_CMD_REQUEST: empty, or the registry version of a list the requester has cached from an earlier connection:
+		+ registry_epoch: varint, never 0
+		+ registry_version: varint
+
+	CLID_GET_LIST_CMD_REPLY:
+		+ errorcode: varint, CLID_STATUS_LIST_UNCHANGED if the version in the request is the current one
+		+ num_cmds: varint, 0 for CLID_STATUS_LIST_UNCHANGED
+		+ for each cmd: cmd_len (varint), cmd, cmd_desc_len (varint), cmd_desc
+		+ registry_epoch: varint, picked by clid at startup, so that versions of two clid runs are never mistaken for each other.
+		  Absent from the reply of an older clid, that list must not be cached then.
+		+ registry_version: varint, bumped on every CLID_CMD_LIST_CHANGED
+
+	CLID_EXE_CMD_REQUEST:
+		+ timeout: varint, in seconds
+		+ num_args: varint, number of arguments, the first one is the cmd_name itself
+		+ for each argument: arg_len (varint), arg
+
+	CLID_EXE_CMD_REPLY:
+		+ errorcode: varint (only present in the first fragment)
+		+ result: varint (only present in the first fragment)
+		+ output: the rest of the payload. Large outputs are split into CLID_V2_MAX_FRAGMENT_LENGTH
+		  fragments, all but the last one carry CLID_V2_FLAG_MORE.
+
+	CLID_EXE_CMD_TIMING: answer to CLID_V2_FLAG_TIMING, sent right before the CLID_EXE_CMD_REPLY of the same request_id,
+	so it always carries CLID_V2_FLAG_MORE. Each duration (varint, microseconds) is taken on a single clock,
+	no clock needs to be in sync with another one:
+		+ clid_queue_us: clid received the request -> clid forwarded it to the handler over ITC
+		+ itc_us: time spent in ITC, to the handler and back (forward -> handler reply minus the time spent in cmdif)
+		+ cmdif_queue_us: cmdif handleExeCmdRequest() received the request -> the handler was invoked
+		+ handler_us: the handler was invoked -> CmdJobImpl::done()
+		+ relay_us: clid received the handler reply -> clid started relaying it to the shell
+	What the shell measures on top of their sum is spent on the network and in the shell itself.
+
+	CLID_EXE_BATCH_REQUEST:
+		+ timeout: varint, in seconds, applies to each command on its own
+		+ policy: varint, CLID_BATCH_*
+		+ num_cmds: varint, 1 to CLID_MAX_BATCH_CMDS
+		+ for each cmd: num_args (varint), then for each argument: arg_len (varint), arg. As in CLID_EXE_CMD_REQUEST,
+		  the first argument is the cmd_name itself.
+
+	CLID_EXE_BATCH_REPLY: sent once every command of the batch is done or skipped. The payload below is cut into
+	CLID_V2_MAX_FRAGMENT_LENGTH fragments, all but the last one carry CLID_V2_FLAG_MORE, an entry may span two fragments:
+		+ errorcode: varint
+		+ num_cmds: varint, same as in the request
+		+ for each cmd, in request order: result (varint, CLID_BATCH_RESULT_SKIPPED if it never ran), output_len (varint), output
+
+	CLID_CMD_LIST_CHANGED: pushed with request_id 0 to every v2 client, so that it never has to fetch the whole list again
+		+ change: varint, CLID_CMD_ADDED or CLID_CMD_REMOVED
+		+ cmd_name: varint length, then bytes
+		+ cmd_desc: varint length, then bytes, empty for CLID_CMD_REMOVED
+
+	CLID_GET_SYNTAX_REQUEST: answered right away, even while a job of the requester runs
+		+ num_cmds: varint, 0 for all commands
+		+ for each cmd: cmd_len (varint), cmd
+
+	CLID_GET_SYNTAX_REPLY:
+		+ errorcode: varint
+		+ num_cmds: varint
+		+ for each cmd: cmd_len (varint), cmd, syntax_len (varint), syntax. syntax is empty if the command is unknown,
+		  a group, or its application has no CmdTableIf for it, such a command can only be checked by its handler.
+		  For a request of all commands, only the ones with a syntax are listed.
+
+	syntax: the CmdSyntaxGraph of a command as cmdif compiled it from the CmdTableIf syntaxes, a DAG of nodes:
+		+ version: varint, CLID_SYNTAX_VERSION, a shell ignores a syntax of another version
+		+ num_nodes: varint, 1 to CLID_MAX_SYNTAX_NODES, node 0 is the cmd_name itself
+		+ num_edges: varint, sum of num_children of all nodes
+		+ for each node: flags (varint, CLID_SYNTAX_NODE_*), name_len (varint), name,
+		  num_children (varint), then the index of each child (varint, below num_nodes), in the order cmdif tries them
+*/
+#define CLID_SYNTAX_VERSION		1
+#define CLID_MAX_SYNTAX_NODES		4096
+#define CLID_SYNTAX_NODE_ANY_VALUE	0x01 // Name is a <placeholder>, any argument matches it
+#define CLID_SYNTAX_NODE_HANDLER	0x02 // The arguments may end here, a command handler is attached
+
+struct clid_v2_frame {
+	uint8_t		type;
+	uint8_t		flags;
+	uint32_t	request_id;
+	uint32_t	payload_length;
+	const uint8_t	*payload;	// Points into the decoded buffer, no copy
+};
+
+/* Sequential reader over a payload, any overrun sets error and all further reads return zero/NULL */
+struct clid_v2_reader {
+	const uint8_t	*pos;
+	const uint8_t	*end;
+	bool		error;
+};
+
+/* Sequential writer into a caller-provided buffer, overflow sets error and stops writing */
+struct clid_v2_writer {
+	uint8_t		*buff;
+	size_t		len;
+	size_t		cap;
+	bool		error;
+};
+
+
+static inline size_t clid_varint_size(uint32_t value)
+{
+	size_t size = 1;
+	while(value >= 0x80)
+	{
+		value >>= 7;
+		size++;
+	}
+
+	return size;
+}
+
+static inline size_t clid_varint_encode(uint8_t *buff, uint32_t value)
+{
+	size_t i = 0;
+	while(value >= 0x80)
+	{
+		buff[i++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buff[i++] = (uint8_t)value;
+
+	return i;
+}
+
+/* Return number of consumed bytes, 0 if more bytes are needed, -1 if malformed */
+static inline int clid_varint_decode(const uint8_t *buff, size_t len, uint32_t *value)
+{
+	uint32_t result = 0;
+	for(size_t i = 0; i < CLID_VARINT_MAX_SIZE; i++)
+	{
+		if(i >= len)
+		{
+			return 0;
+		}
+
+		result |= (uint32_t)(buff[i] & 0x7F) << (7 * i);
+		if((buff[i] & 0x80) == 0)
+		{
+			if(i == CLID_VARINT_MAX_SIZE - 1 && buff[i] > 0x0F)
+			{
+				return -1; // More than 32 bits
+			}
+
+			*value = result;
+			return (int)(i + 1);
+		}
+	}
+
+	return -1;
+}
+
+static inline size_t clid_v2_header_size(uint32_t request_id, uint32_t payload_length)
+{
+	return CLID_V2_FIXED_HEADER_SIZE + clid_varint_size(request_id) + clid_varint_size(payload_length);
+}
+
+/* buff must have room for at least CLID_V2_MAX_HEADER_SIZE bytes, return header size */
+static inline size_t clid_v2_encode_header(uint8_t *buff, uint8_t type, uint8_t flags, uint32_t request_id, uint32_t payload_length)
+{
+	size_t len = 0;
+	buff[len++] = CLID_V2_MAGIC;
+	buff[len++] = type;
+	buff[len++] = flags;
+	len += clid_varint_encode(buff + len, request_id);
+	len += clid_varint_encode(buff + len, payload_length);
+
+	return len;
+}
+
+/* Return total frame size (header + payload) if a complete frame is in buff, 0 if more bytes are needed, -1 if malformed */
+static inline long clid_v2_decode_frame(const uint8_t *buff, size_t len, struct clid_v2_frame *frame)
+{
+	if(len < CLID_V2_FIXED_HEADER_SIZE)
+	{
+		return 0;
+	}
+
+	if(buff[0] != CLID_V2_MAGIC)
+	{
+		return -1;
+	}
+
+	size_t offset = CLID_V2_FIXED_HEADER_SIZE;
+	int res = clid_varint_decode(buff + offset, len - offset, &frame->request_id);
+	if(res <= 0)
+	{
+		return res;
+	}
+	offset += res;
+
+	res = clid_varint_decode(buff + offset, len - offset, &frame->payload_length);
+	if(res <= 0)
+	{
+		return res;
+	}
+	offset += res;
+
+	if(frame->payload_length > CLID_V2_MAX_PAYLOAD_LENGTH)
+	{
+		return -1;
+	}
+
+	if(len - offset < frame->payload_length)
+	{
+		return 0;
+	}
+
+	frame->type	= buff[1];
+	frame->flags	= buff[2];
+	frame->payload	= buff + offset;
+
+	return (long)(offset + frame->payload_length);
+}
+
+static inline void clid_v2_reader_init(struct clid_v2_reader *reader, const uint8_t *payload, uint32_t payload_length)
+{
+	reader->pos	= payload;
+	reader->end	= payload + payload_length;
+	reader->error	= false;
+}
+
+static inline uint32_t clid_v2_read_varint(struct clid_v2_reader *reader)
+{
+	uint32_t value = 0;
+	if(reader->error)
+	{
+		return 0;
+	}
+
+	int res = clid_varint_decode(reader->pos, (size_t)(reader->end - reader->pos), &value);
+	if(res <= 0)
+	{
+		reader->error = true;
+		return 0;
+	}
+
+	reader->pos += res;
+	return value;
+}
+
+/* Read a length-prefixed string, return a pointer into the payload (not NUL-terminated) */
+static inline const char *clid_v2_read_string(struct clid_v2_reader *reader, uint32_t *len)
+{
+	*len = clid_v2_read_varint(reader);
+	if(reader->error || (size_t)(reader->end - reader->pos) < *len)
+	{
+		reader->error = true;
+		*len = 0;
+		return NULL;
+	}
+
+	const char *str = (const char *)reader->pos;
+	reader->pos += *len;
+	return str;
+}
+
+static inline size_t clid_v2_reader_remaining(const struct clid_v2_reader *reader)
+{
+	return reader->error ? 0 : (size_t)(reader->end - reader->pos);
+}
+
+static inline void clid_v2_writer_init(struct clid_v2_writer *writer, uint8_t *buff, size_t cap)
+{
+	writer->buff	= buff;
+	writer->len	= 0;
+	writer->cap	= cap;
+	writer->error	= false;
+}
+
+static inline void clid_v2_write_varint(struct clid_v2_writer *writer, uint32_t value)
+{
+	if(writer->error || writer->cap - writer->len < clid_varint_size(value))
+	{
+		writer->error = true;
+		return;
+	}
+
+	writer->len += clid_varint_encode(writer->buff + writer->len, value);
+}
+
+static inline void clid_v2_write_bytes(struct clid_v2_writer *writer, const void *data, size_t len)
+{
+	if(writer->error || writer->cap - writer->len < len)
+	{
+		writer->error = true;
+		return;
+	}
+
+	memcpy(writer->buff + writer->len, data, len);
+	writer->len += len;
+}
+
+static inline void clid_v2_write_string(struct clid_v2_writer *writer, const char *str, uint32_t len)
+{
+	clid_v2_write_varint(writer, len);
+	clid_v2_write_bytes(writer, str, len);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __TCP_PROTO_V2_H__
@@ -0,0 +1,73 @@
+/*
+* ______________________   ________                                     
+* __  ____/__  /____  _/   ___  __ \_____ ____________ ________________ 
+* _  /    __  /  __  /     __  / / /  __ `/  _ \_  __ `__ \  __ \_  __ \
+* / /___  _  /____/ /      _  /_/ // /_/ //  __/  / / / / / /_/ /  / / /
+* \____/  /_____/___/      /_____/ \__,_/ \___//_/ /_/ /_/\____//_/ /_/ 
+*                                                                       
+*/
+
+#ifndef __ITC_H__
+#define __ITC_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+	itclite: drop-in stand-in for the subset of the SDK's libitc used by clid and cmdif.
+	No itccoord or itcgws is needed, selected at link time with ITC_IMPL=lite (see sw/make/Makefile.config).
+
+	+ One mailbox per thread, itc_receive() and itc_get_fd() always refer to the calling thread's mailbox.
+	+ Within a process, messages go through a lock-free MPSC queue, the sender never blocks nor takes a lock.
+	+ Across processes on the same machine, messages go through an abstract unix datagram socket per mailbox.
+	+ Mailbox names are published in a small lock-free shared memory registry, for itc_locate_sync().
+	+ Namespaces and external (gateway) mailboxes are not supported, namespace arguments are ignored.
+
+	User must define "union itc_msg" with "uint32_t msgno" as first member, as with the real libitc.
+*/
+
+typedef uint32_t itc_mbox_id_t;
+
+#define ITC_NO_MBOX_ID		0
+#define ITC_MY_MBOX_ID		0xFFFFFFFF
+#define ITC_NO_NAMESPACE	0
+
+/* itc_receive() and itc_locate_sync() timeouts, in milliseconds otherwise */
+#define ITC_NO_WAIT		0
+#define ITC_WAIT_FOREVER	-1
+
+typedef enum {
+	ITC_MALLOC = 0
+} itc_alloc_scheme;
+
+union itc_msg;
+
+bool itc_init(int32_t nr_mboxes, itc_alloc_scheme alloc_scheme, uint32_t flags);
+bool itc_exit(void);
+
+union itc_msg *itc_alloc(size_t size, uint32_t msgno);
+bool itc_free(union itc_msg **msg);
+itc_mbox_id_t itc_sender(union itc_msg *msg);
+size_t itc_size(union itc_msg *msg); // As given to itc_alloc(), also on the receiving side
+
+itc_mbox_id_t itc_create_mailbox(const char *name, uint32_t flags);
+bool itc_delete_mailbox(itc_mbox_id_t mbox_id);
+itc_mbox_id_t itc_current_mbox(void);
+int itc_get_fd(void);
+
+/* On success, *msg is consumed and set to NULL. On failure, the caller still owns *msg */
+bool itc_send(union itc_msg **msg, itc_mbox_id_t to, itc_mbox_id_t from, char *namespace_);
+union itc_msg *itc_receive(int32_t tmo);
+
+itc_mbox_id_t itc_locate_sync(int32_t timeout, const char *name, bool find_only_internal, bool *is_external, char *namespace_);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __ITC_H__
@@ -0,0 +1,847 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "itc.h"
+
+
+/*****************************************************************************\/
+*****                           INTERNAL TYPES                             *****
+*******************************************************************************/
+/* mbox_id = pid << ITCLITE_SLOT_BITS | slot, so any process can tell where a mailbox lives from its id alone */
+#define ITCLITE_SLOT_BITS		10
+#define ITCLITE_MAX_MAILBOXES		(1 << ITCLITE_SLOT_BITS) // Slot 0 is never used, so no id is ever ITC_NO_MBOX_ID
+#define ITCLITE_MAX_PID			(UINT32_MAX >> ITCLITE_SLOT_BITS)
+#define ITCLITE_MAX_NAME_LENGTH		64
+#define ITCLITE_REGISTRY_SHM_NAME	"/itclite_registry"
+#define ITCLITE_REGISTRY_ENTRIES	4096
+#define ITCLITE_SOCKET_PREFIX		"itclite."
+#define ITCLITE_INLINE_MAX		(32 * 1024) // Bigger messages are passed as a memfd instead
+#define ITCLITE_LOCATE_POLL_MS		10
+#define ITCLITE_MSG_MAGIC		0x17C11733
+
+#define ITCLITE_MBOX_ID(pid, slot)	(((uint32_t)(pid) << ITCLITE_SLOT_BITS) | (uint32_t)(slot))
+#define ITCLITE_MBOX_PID(id)		((pid_t)((id) >> ITCLITE_SLOT_BITS))
+#define ITCLITE_MBOX_SLOT(id)		((id) & (ITCLITE_MAX_MAILBOXES - 1))
+
+/* Hidden in front of every union itc_msg, doubles as the node of the MPSC queue */
+struct itclite_msg_hdr {
+	_Atomic(struct itclite_msg_hdr *)	next;
+	itc_mbox_id_t				sender;
+	itc_mbox_id_t				receiver;
+	uint32_t				size; // Of the union itc_msg part
+	uint32_t				magic;
+} __attribute__((aligned(16)));
+
+/* Vyukov's intrusive MPSC queue: producers only do one atomic exchange, the single consumer is the owner thread */
+struct itclite_queue {
+	_Atomic(struct itclite_msg_hdr *)	head; // Producers push here
+	struct itclite_msg_hdr			*tail; // Consumer pops here
+	struct itclite_msg_hdr			stub;
+};
+
+typedef enum {
+	MBOX_FREE = 0,
+	MBOX_RESERVED,
+	MBOX_ACTIVE
+} mbox_state_e;
+
+struct itclite_mailbox {
+	_Atomic int		state;
+	_Atomic int		nr_senders; // Local senders currently pushing, delete waits for them
+	itc_mbox_id_t		id;
+	char			name[ITCLITE_MAX_NAME_LENGTH];
+	struct itclite_queue	queue;
+	int			event_fd; // EFD_SEMAPHORE, counts messages in queue
+	int			sock_fd; // Receives from other processes
+	int			epoll_fd; // Returned by itc_get_fd(), readable on either of above
+	int			registry_idx;
+};
+
+typedef enum {
+	ENTRY_FREE = 0,
+	ENTRY_BUSY,
+	ENTRY_READY
+} registry_entry_state_e;
+
+struct itclite_registry_entry {
+	_Atomic uint32_t	state;
+	itc_mbox_id_t		id;
+	char			name[ITCLITE_MAX_NAME_LENGTH];
+};
+
+/* Prepended to each datagram sent to another process */
+#define ITCLITE_WIRE_FLAG_MEMFD		0x1
+struct itclite_wire_hdr {
+	itc_mbox_id_t	sender;
+	uint32_t	size;
+	uint32_t	flags;
+};
+
+
+/*****************************************************************************\/
+*****                         INTERNAL VARIABLES                           *****
+*******************************************************************************/
+static struct itclite_mailbox m_mailboxes[ITCLITE_MAX_MAILBOXES];
+static struct itclite_registry_entry *m_registry = NULL;
+static int m_send_fd = -1; // Unbound socket used to send to other processes
+static pid_t m_pid = 0;
+static _Atomic int m_nr_inits = 0;
+static __thread struct itclite_mailbox *m_my_mbox = NULL;
+
+
+/*****************************************************************************\/
+*****                    INTERNAL FUNCTIONS PROTOTYPES                     *****
+*******************************************************************************/
+static inline struct itclite_msg_hdr *msg_to_hdr(union itc_msg *msg);
+static inline union itc_msg *hdr_to_msg(struct itclite_msg_hdr *hdr);
+static void queue_init(struct itclite_queue *q);
+static void queue_push(struct itclite_queue *q, struct itclite_msg_hdr *node);
+static struct itclite_msg_hdr *queue_pop(struct itclite_queue *q);
+static socklen_t make_sock_addr(itc_mbox_id_t id, struct sockaddr_un *addr);
+static bool map_registry(void);
+static int register_name(const char *name, itc_mbox_id_t id);
+static void unregister_name(int idx, itc_mbox_id_t id);
+static itc_mbox_id_t lookup_name(const char *name);
+static bool is_mbox_alive(itc_mbox_id_t id);
+static bool send_local(struct itclite_msg_hdr *hdr, itc_mbox_id_t to);
+static bool send_remote(struct itclite_msg_hdr *hdr, itc_mbox_id_t to);
+static union itc_msg *receive_local(struct itclite_mailbox *mbox);
+static union itc_msg *receive_remote(struct itclite_mailbox *mbox);
+static int64_t get_time_ms(void);
+static void register_atfork_handler(void);
+static void reset_after_fork(void);
+
+
+/*****************************************************************************\/
+*****                       PUBLIC FUNCTIONS IMPLEMENTATION                *****
+*******************************************************************************/
+bool itc_init(int32_t nr_mboxes, itc_alloc_scheme alloc_scheme, uint32_t flags)
+{
+	(void)nr_mboxes;
+	(void)alloc_scheme;
+	(void)flags;
+
+	// Several users (e.g. clid and cmdif linked into one test process) may init, only the first one counts
+	if(atomic_fetch_add(&m_nr_inits, 1) > 0)
+	{
+		return true;
+	}
+
+	static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+	pthread_once(&atfork_once, register_atfork_handler);
+
+	m_pid = getpid();
+	if((uint32_t)m_pid > ITCLITE_MAX_PID)
+	{
+		fprintf(stderr, "itclite: pid %d does not fit into a mailbox id!\n", m_pid);
+		return false;
+	}
+
+	if(!map_registry())
+	{
+		return false;
+	}
+
+	m_send_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if(m_send_fd < 0)
+	{
+		fprintf(stderr, "itclite: failed to create send socket, errno = %d!\n", errno);
+		return false;
+	}
+
+	return true;
+}
+
+bool itc_exit(void)
+{
+	if(atomic_fetch_sub(&m_nr_inits, 1) != 1)
+	{
+		return true;
+	}
+
+	if(m_send_fd != -1)
+	{
+		close(m_send_fd);
+		m_send_fd = -1;
+	}
+
+	if(m_registry != NULL)
+	{
+		munmap(m_registry, ITCLITE_REGISTRY_ENTRIES * sizeof(struct itclite_registry_entry));
+		m_registry = NULL;
+	}
+
+	return true;
+}
+
+union itc_msg *itc_alloc(size_t size, uint32_t msgno)
+{
+	if(size < sizeof(uint32_t))
+	{
+		size = sizeof(uint32_t);
+	}
+
+	struct itclite_msg_hdr *hdr = malloc(sizeof(struct itclite_msg_hdr) + size);
+	if(hdr == NULL)
+	{
+		return NULL;
+	}
+
+	atomic_init(&hdr->next, NULL);
+	hdr->sender	= ITC_NO_MBOX_ID;
+	hdr->receiver	= ITC_NO_MBOX_ID;
+	hdr->size	= (uint32_t)size;
+	hdr->magic	= ITCLITE_MSG_MAGIC;
+
+	union itc_msg *msg = hdr_to_msg(hdr);
+	memcpy(msg, &msgno, sizeof(uint32_t));
+	return msg;
+}
+
+bool itc_free(union itc_msg **msg)
+{
+	if(msg == NULL || *msg == NULL)
+	{
+		return false;
+	}
+
+	struct itclite_msg_hdr *hdr = msg_to_hdr(*msg);
+	if(hdr->magic != ITCLITE_MSG_MAGIC)
+	{
+		return false;
+	}
+
+	hdr->magic = 0;
+	free(hdr);
+	*msg = NULL;
+	return true;
+}
+
+itc_mbox_id_t itc_sender(union itc_msg *msg)
+{
+	return msg_to_hdr(msg)->sender;
+}
+
+size_t itc_size(union itc_msg *msg)
+{
+	return msg_to_hdr(msg)->size;
+}
+
+itc_mbox_id_t itc_create_mailbox(const char *name, uint32_t flags)
+{
+	(void)flags;
+
+	if(m_my_mbox != NULL || name == NULL || strlen(name) >= ITCLITE_MAX_NAME_LENGTH || atomic_load(&m_nr_inits) == 0)
+	{
+		return ITC_NO_MBOX_ID;
+	}
+
+	struct itclite_mailbox *mbox = NULL;
+	int slot = 1;
+	for(; slot < ITCLITE_MAX_MAILBOXES; slot++)
+	{
+		int expected = MBOX_FREE;
+		if(atomic_compare_exchange_strong(&m_mailboxes[slot].state, &expected, MBOX_RESERVED))
+		{
+			mbox = &m_mailboxes[slot];
+			break;
+		}
+	}
+
+	if(mbox == NULL)
+	{
+		return ITC_NO_MBOX_ID;
+	}
+
+	mbox->id = ITCLITE_MBOX_ID(m_pid, slot);
+	strcpy(mbox->name, name);
+	queue_init(&mbox->queue);
+	atomic_store(&mbox->nr_senders, 0);
+	mbox->event_fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+	mbox->sock_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	mbox->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	mbox->registry_idx = -1;
+
+	struct sockaddr_un addr;
+	socklen_t addr_len = make_sock_addr(mbox->id, &addr);
+	struct epoll_event ev = { .events = EPOLLIN };
+	if(mbox->event_fd < 0 || mbox->sock_fd < 0 || mbox->epoll_fd < 0
+		|| bind(mbox->sock_fd, (struct sockaddr *)&addr, addr_len) < 0
+		|| epoll_ctl(mbox->epoll_fd, EPOLL_CTL_ADD, mbox->event_fd, &ev) < 0
+		|| epoll_ctl(mbox->epoll_fd, EPOLL_CTL_ADD, mbox->sock_fd, &ev) < 0
+		|| (mbox->registry_idx = register_name(name, mbox->id)) < 0)
+	{
+		fprintf(stderr, "itclite: failed to create mailbox \"%s\", errno = %d!\n", name, errno);
+		close(mbox->event_fd);
+		close(mbox->sock_fd);
+		close(mbox->epoll_fd);
+		atomic_store(&mbox->state, MBOX_FREE);
+		return ITC_NO_MBOX_ID;
+	}
+
+	m_my_mbox = mbox;
+	atomic_store_explicit(&mbox->state, MBOX_ACTIVE, memory_order_release);
+	return mbox->id;
+}
+
+bool itc_delete_mailbox(itc_mbox_id_t mbox_id)
+{
+	if(ITCLITE_MBOX_PID(mbox_id) != m_pid)
+	{
+		return false;
+	}
+
+	struct itclite_mailbox *mbox = &m_mailboxes[ITCLITE_MBOX_SLOT(mbox_id)];
+	int expected = MBOX_ACTIVE;
+	if(mbox->id != mbox_id || !atomic_compare_exchange_strong(&mbox->state, &expected, MBOX_RESERVED))
+	{
+		return false;
+	}
+
+	unregister_name(mbox->registry_idx, mbox->id);
+
+	// New senders see the state change and back off, wait for the ones already pushing
+	while(atomic_load(&mbox->nr_senders) > 0)
+	{
+		sched_yield();
+	}
+
+	struct itclite_msg_hdr *hdr;
+	while((hdr = queue_pop(&mbox->queue)) != NULL)
+	{
+		free(hdr);
+	}
+
+	close(mbox->epoll_fd);
+	close(mbox->sock_fd);
+	close(mbox->event_fd);
+
+	if(m_my_mbox == mbox)
+	{
+		m_my_mbox = NULL;
+	}
+
+	atomic_store(&mbox->state, MBOX_FREE);
+	return true;
+}
+
+itc_mbox_id_t itc_current_mbox(void)
+{
+	return m_my_mbox != NULL ? m_my_mbox->id : ITC_NO_MBOX_ID;
+}
+
+int itc_get_fd(void)
+{
+	return m_my_mbox != NULL ? m_my_mbox->epoll_fd : -1;
+}
+
+bool itc_send(union itc_msg **msg, itc_mbox_id_t to, itc_mbox_id_t from, char *namespace_)
+{
+	(void)namespace_;
+
+	if(msg == NULL || *msg == NULL || to == ITC_NO_MBOX_ID)
+	{
+		return false;
+	}
+
+	struct itclite_msg_hdr *hdr = msg_to_hdr(*msg);
+	hdr->sender = (from == ITC_MY_MBOX_ID) ? itc_current_mbox() : from;
+	hdr->receiver = to;
+
+	bool res = (ITCLITE_MBOX_PID(to) == m_pid) ? send_local(hdr, to) : send_remote(hdr, to);
+	if(res)
+	{
+		*msg = NULL;
+	}
+
+	return res;
+}
+
+union itc_msg *itc_receive(int32_t tmo)
+{
+	struct itclite_mailbox *mbox = m_my_mbox;
+	if(mbox == NULL)
+	{
+		return NULL;
+	}
+
+	int64_t deadline = (tmo > 0) ? get_time_ms() + tmo : 0;
+	while(1)
+	{
+		union itc_msg *msg = receive_local(mbox);
+		if(msg == NULL)
+		{
+			msg = receive_remote(mbox);
+		}
+
+		if(msg != NULL || tmo == ITC_NO_WAIT)
+		{
+			return msg;
+		}
+
+		int wait_ms = -1;
+		if(tmo > 0)
+		{
+			int64_t remaining = deadline - get_time_ms();
+			if(remaining <= 0)
+			{
+				return NULL;
+			}
+			wait_ms = (int)remaining;
+		}
+
+		struct pollfd pfd = { .fd = mbox->epoll_fd, .events = POLLIN, .revents = 0 };
+		if(poll(&pfd, 1, wait_ms) < 0 && errno != EINTR)
+		{
+			return NULL;
+		}
+	}
+}
+
+itc_mbox_id_t itc_locate_sync(int32_t timeout, const char *name, bool find_only_internal, bool *is_external, char *namespace_)
+{
+	(void)find_only_internal;
+	(void)namespace_;
+
+	if(is_external != NULL)
+	{
+		*is_external = false;
+	}
+
+	if(m_registry == NULL || name == NULL)
+	{
+		return ITC_NO_MBOX_ID;
+	}
+
+	int64_t deadline = get_time_ms() + timeout;
+	while(1)
+	{
+		itc_mbox_id_t id = lookup_name(name);
+		if(id != ITC_NO_MBOX_ID)
+		{
+			return id;
+		}
+
+		if(timeout != ITC_WAIT_FOREVER && get_time_ms() >= deadline)
+		{
+			return ITC_NO_MBOX_ID;
+		}
+
+		usleep(ITCLITE_LOCATE_POLL_MS * 1000);
+	}
+}
+
+
+/*****************************************************************************\/
+*****                      INTERNAL FUNCTIONS IMPLEMENTATION               *****
+*******************************************************************************/
+static inline struct itclite_msg_hdr *msg_to_hdr(union itc_msg *msg)
+{
+	return (struct itclite_msg_hdr *)((char *)msg - sizeof(struct itclite_msg_hdr));
+}
+
+static inline union itc_msg *hdr_to_msg(struct itclite_msg_hdr *hdr)
+{
+	return (union itc_msg *)((char *)hdr + sizeof(struct itclite_msg_hdr));
+}
+
+static void queue_init(struct itclite_queue *q)
+{
+	atomic_init(&q->stub.next, NULL);
+	atomic_init(&q->head, &q->stub);
+	q->tail = &q->stub;
+}
+
+static void queue_push(struct itclite_queue *q, struct itclite_msg_hdr *node)
+{
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	struct itclite_msg_hdr *prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/* Return NULL when empty, or when a producer is between its exchange and its link store (retry shortly then) */
+static struct itclite_msg_hdr *queue_pop(struct itclite_queue *q)
+{
+	struct itclite_msg_hdr *tail = q->tail;
+	struct itclite_msg_hdr *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	if(tail == &q->stub)
+	{
+		if(next == NULL)
+		{
+			return NULL;
+		}
+
+		q->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+
+	if(next != NULL)
+	{
+		q->tail = next;
+		return tail;
+	}
+
+	if(tail != atomic_load_explicit(&q->head, memory_order_acquire))
+	{
+		return NULL;
+	}
+
+	queue_push(q, &q->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if(next != NULL)
+	{
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+static socklen_t make_sock_addr(itc_mbox_id_t id, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	// Abstract namespace (leading '\0'), nothing is left behind on the filesystem
+	int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, ITCLITE_SOCKET_PREFIX "%08x", id);
+	return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+static bool map_registry(void)
+{
+	size_t size = ITCLITE_REGISTRY_ENTRIES * sizeof(struct itclite_registry_entry);
+	// Owner only, whoever may write the registry decides where every mailbox's messages go
+	int fd = shm_open(ITCLITE_REGISTRY_SHM_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd < 0)
+	{
+		fprintf(stderr, "itclite: failed to shm_open() registry, errno = %d!\n", errno);
+		return false;
+	}
+
+	// Growing to the same size is a no-op, new pages read as zero i.e. ENTRY_FREE
+	if(ftruncate(fd, size) < 0)
+	{
+		fprintf(stderr, "itclite: failed to ftruncate() registry, errno = %d!\n", errno);
+		close(fd);
+		return false;
+	}
+
+	m_registry = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(m_registry == MAP_FAILED)
+	{
+		fprintf(stderr, "itclite: failed to mmap() registry, errno = %d!\n", errno);
+		m_registry = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+static int register_name(const char *name, itc_mbox_id_t id)
+{
+	if(lookup_name(name) != ITC_NO_MBOX_ID)
+	{
+		errno = EEXIST;
+		return -1;
+	}
+
+	for(int i = 0; i < ITCLITE_REGISTRY_ENTRIES; i++)
+	{
+		uint32_t expected = ENTRY_FREE;
+		if(atomic_compare_exchange_strong(&m_registry[i].state, &expected, ENTRY_BUSY))
+		{
+			m_registry[i].id = id;
+			strcpy(m_registry[i].name, name);
+			atomic_store_explicit(&m_registry[i].state, ENTRY_READY, memory_order_release);
+			return i;
+		}
+	}
+
+	errno = ENOSPC;
+	return -1;
+}
+
+static void unregister_name(int idx, itc_mbox_id_t id)
+{
+	uint32_t expected = ENTRY_READY;
+	if(idx >= 0 && m_registry[idx].id == id && atomic_compare_exchange_strong(&m_registry[idx].state, &expected, ENTRY_BUSY))
+	{
+		m_registry[idx].id = ITC_NO_MBOX_ID;
+		atomic_store_explicit(&m_registry[idx].state, ENTRY_FREE, memory_order_release);
+	}
+}
+
+static itc_mbox_id_t lookup_name(const char *name)
+{
+	for(int i = 0; i < ITCLITE_REGISTRY_ENTRIES; i++)
+	{
+		if(atomic_load_explicit(&m_registry[i].state, memory_order_acquire) != ENTRY_READY || strcmp(m_registry[i].name, name) != 0)
+		{
+			continue;
+		}
+
+		itc_mbox_id_t id = m_registry[i].id;
+		if(is_mbox_alive(id))
+		{
+			return id;
+		}
+
+		// Left behind by a crashed process, reclaim it
+		unregister_name(i, id);
+	}
+
+	return ITC_NO_MBOX_ID;
+}
+
+static bool is_mbox_alive(itc_mbox_id_t id)
+{
+	pid_t pid = ITCLITE_MBOX_PID(id);
+	if(pid == m_pid)
+	{
+		return atomic_load(&m_mailboxes[ITCLITE_MBOX_SLOT(id)].state) == MBOX_ACTIVE;
+	}
+
+	return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static bool send_local(struct itclite_msg_hdr *hdr, itc_mbox_id_t to)
+{
+	struct itclite_mailbox *mbox = &m_mailboxes[ITCLITE_MBOX_SLOT(to)];
+
+	atomic_fetch_add(&mbox->nr_senders, 1);
+	if(atomic_load_explicit(&mbox->state, memory_order_acquire) != MBOX_ACTIVE || mbox->id != to)
+	{
+		atomic_fetch_sub(&mbox->nr_senders, 1);
+		return false;
+	}
+
+	queue_push(&mbox->queue, hdr);
+	uint64_t one = 1;
+	ssize_t res = write(mbox->event_fd, &one, sizeof(uint64_t));
+	(void)res; // Only fails on counter overflow, the message is queued anyway
+	atomic_fetch_sub(&mbox->nr_senders, 1);
+
+	return true;
+}
+
+static bool send_remote(struct itclite_msg_hdr *hdr, itc_mbox_id_t to)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len = make_sock_addr(to, &addr);
+	struct itclite_wire_hdr wire = { .sender = hdr->sender, .size = hdr->size, .flags = 0 };
+	struct iovec iov[2] = {
+		{ .iov_base = &wire, .iov_len = sizeof(wire) },
+		{ .iov_base = hdr_to_msg(hdr), .iov_len = hdr->size }
+	};
+	struct msghdr mh = { .msg_name = &addr, .msg_namelen = addr_len, .msg_iov = iov, .msg_iovlen = 2 };
+	union {
+		char		buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr	align;
+	} ctrl;
+	int memfd = -1;
+
+	if(hdr->size > ITCLITE_INLINE_MAX)
+	{
+		// Too big for a datagram, hand over a memfd holding the message instead
+		memfd = memfd_create("itclite_msg", MFD_CLOEXEC);
+		if(memfd < 0 || write(memfd, hdr_to_msg(hdr), hdr->size) != (ssize_t)hdr->size)
+		{
+			if(memfd >= 0)
+			{
+				close(memfd);
+			}
+			return false;
+		}
+
+		wire.flags = ITCLITE_WIRE_FLAG_MEMFD;
+		mh.msg_iovlen = 1;
+		mh.msg_control = ctrl.buf;
+		mh.msg_controllen = sizeof(ctrl.buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+	}
+
+	ssize_t res;
+	do
+	{
+		res = sendmsg(m_send_fd, &mh, MSG_NOSIGNAL);
+	} while(res < 0 && errno == EINTR);
+
+	if(memfd >= 0)
+	{
+		close(memfd);
+	}
+
+	if(res < 0)
+	{
+		return false;
+	}
+
+	free(hdr);
+	return true;
+}
+
+static union itc_msg *receive_local(struct itclite_mailbox *mbox)
+{
+	uint64_t count;
+	if(read(mbox->event_fd, &count, sizeof(uint64_t)) != sizeof(uint64_t))
+	{
+		return NULL;
+	}
+
+	// The eventfd is only bumped after a push completed, but an earlier push may still be linking itself in
+	struct itclite_msg_hdr *hdr;
+	while((hdr = queue_pop(&mbox->queue)) == NULL)
+	{
+		sched_yield();
+	}
+
+	atomic_store_explicit(&hdr->next, NULL, memory_order_relaxed);
+	return hdr_to_msg(hdr);
+}
+
+static union itc_msg *receive_remote(struct itclite_mailbox *mbox)
+{
+	struct itclite_wire_hdr wire;
+	union {
+		char		buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr	align;
+	} ctrl;
+
+	// Peek at the header first to learn the size, then read the whole datagram straight into the message
+	ssize_t res = recv(mbox->sock_fd, &wire, sizeof(wire), MSG_PEEK | MSG_DONTWAIT);
+	if(res < (ssize_t)sizeof(wire))
+	{
+		if(res >= 0)
+		{
+			recv(mbox->sock_fd, &wire, sizeof(wire), MSG_DONTWAIT); // Runt datagram, drop it
+		}
+		return NULL;
+	}
+
+	union itc_msg *msg = itc_alloc(wire.size, 0);
+	if(msg == NULL)
+	{
+		recv(mbox->sock_fd, &wire, sizeof(wire), MSG_DONTWAIT);
+		return NULL;
+	}
+
+	struct itclite_msg_hdr *hdr = msg_to_hdr(msg);
+	bool is_memfd = wire.flags & ITCLITE_WIRE_FLAG_MEMFD;
+	struct iovec iov[2] = {
+		{ .iov_base = &wire, .iov_len = sizeof(wire) },
+		{ .iov_base = msg, .iov_len = is_memfd ? 0 : wire.size }
+	};
+	struct msghdr mh = { .msg_iov = iov, .msg_iovlen = 2, .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf) };
+
+	res = recvmsg(mbox->sock_fd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if(res < 0)
+	{
+		itc_free(&msg);
+		return NULL;
+	}
+
+	if(is_memfd)
+	{
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+		int memfd = -1;
+		if(cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+		}
+
+		bool is_ok = memfd >= 0 && pread(memfd, msg, wire.size, 0) == (ssize_t)wire.size;
+		if(memfd >= 0)
+		{
+			close(memfd);
+		}
+
+		if(!is_ok)
+		{
+			itc_free(&msg);
+			return NULL;
+		}
+	} else if(res != (ssize_t)(sizeof(wire) + wire.size))
+	{
+		itc_free(&msg);
+		return NULL;
+	}
+
+	hdr->sender = wire.sender;
+	hdr->receiver = mbox->id;
+	return msg;
+}
+
+static void register_atfork_handler(void)
+{
+	pthread_atfork(NULL, NULL, reset_after_fork);
+}
+
+/* A forked child has a new pid, so none of the inherited mailboxes are its own, it has to itc_init() again */
+static void reset_after_fork(void)
+{
+	for(int slot = 1; slot < ITCLITE_MAX_MAILBOXES; slot++)
+	{
+		struct itclite_mailbox *mbox = &m_mailboxes[slot];
+		if(atomic_load(&mbox->state) == MBOX_ACTIVE)
+		{
+			struct itclite_msg_hdr *hdr;
+			while((hdr = queue_pop(&mbox->queue)) != NULL)
+			{
+				free(hdr);
+			}
+
+			close(mbox->epoll_fd);
+			close(mbox->sock_fd);
+			close(mbox->event_fd);
+		}
+
+		atomic_store(&mbox->state, MBOX_FREE);
+	}
+
+	if(m_send_fd != -1)
+	{
+		close(m_send_fd);
+		m_send_fd = -1;
+	}
+
+	if(m_registry != NULL)
+	{
+		munmap(m_registry, ITCLITE_REGISTRY_ENTRIES * sizeof(struct itclite_registry_entry));
+		m_registry = NULL;
+	}
+
+	m_my_mbox = NULL;
+	atomic_store(&m_nr_inits, 0);
+}
+
+static int64_t get_time_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
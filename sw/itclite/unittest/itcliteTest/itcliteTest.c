@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "itc.h"
+
+#define TEST_MSG		0x1001
+#define TEST_STOP		0x1002
+#define NUM_PRODUCERS		4
+#define NUM_MSGS_PER_PRODUCER	100000
+#define NUM_PINGPONGS		100000
+#define BIG_MSG_SIZE		(1024 * 1024)
+
+struct TestMsgS {
+	uint32_t	msgno;
+	uint32_t	producer;
+	uint32_t	seq;
+	uint32_t	len;
+	char		data[1];
+};
+
+union itc_msg {
+	uint32_t		msgno;
+	struct TestMsgS		testMsg;
+};
+
+static itc_mbox_id_t m_consumer_mbox = ITC_NO_MBOX_ID;
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void *producer_thread(void *arg)
+{
+	uint32_t producer = (uint32_t)(uintptr_t)arg;
+	for(uint32_t i = 0; i < NUM_MSGS_PER_PRODUCER; i++)
+	{
+		union itc_msg *msg = itc_alloc(sizeof(struct TestMsgS), TEST_MSG);
+		msg->testMsg.producer = producer;
+		msg->testMsg.seq = i;
+		itc_send(&msg, m_consumer_mbox, ITC_MY_MBOX_ID, NULL);
+	}
+
+	return NULL;
+}
+
+static bool test_multi_producers(void)
+{
+	pthread_t threads[NUM_PRODUCERS];
+	uint32_t next_seq[NUM_PRODUCERS] = {0};
+	bool is_ok = true;
+
+	for(uintptr_t i = 0; i < NUM_PRODUCERS; i++)
+	{
+		pthread_create(&threads[i], NULL, producer_thread, (void *)i);
+	}
+
+	uint64_t start = get_time_ns();
+	for(int i = 0; i < NUM_PRODUCERS * NUM_MSGS_PER_PRODUCER; i++)
+	{
+		union itc_msg *msg = itc_receive(ITC_WAIT_FOREVER);
+		if(msg->testMsg.seq != next_seq[msg->testMsg.producer]++)
+		{
+			is_ok = false; // Messages of the same producer must never be reordered
+		}
+		itc_free(&msg);
+	}
+	uint64_t elapsed = get_time_ns() - start;
+
+	for(int i = 0; i < NUM_PRODUCERS; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	printf("test_multi_producers: %d msgs in %.1f ms (%.1f Mmsg/s) -> %s\n", NUM_PRODUCERS * NUM_MSGS_PER_PRODUCER,
+		elapsed / 1e6, NUM_PRODUCERS * NUM_MSGS_PER_PRODUCER * 1e3 / elapsed, is_ok ? "PASS" : "FAIL");
+	return is_ok;
+}
+
+static void *echo_thread(void *arg)
+{
+	(void)arg;
+	itc_create_mailbox("itcliteTestEcho", ITC_NO_NAMESPACE);
+
+	while(1)
+	{
+		union itc_msg *msg = itc_receive(ITC_WAIT_FOREVER);
+		if(msg->msgno == TEST_STOP)
+		{
+			itc_free(&msg);
+			break;
+		}
+		itc_send(&msg, itc_sender(msg), ITC_MY_MBOX_ID, NULL);
+	}
+
+	itc_delete_mailbox(itc_current_mbox());
+	return NULL;
+}
+
+static bool test_pingpong_latency(void)
+{
+	pthread_t thread;
+	pthread_create(&thread, NULL, echo_thread, NULL);
+
+	itc_mbox_id_t echo = itc_locate_sync(1000, "itcliteTestEcho", true, NULL, NULL);
+	if(echo == ITC_NO_MBOX_ID)
+	{
+		printf("test_pingpong_latency: failed to locate echo mailbox -> FAIL\n");
+		return false;
+	}
+
+	uint64_t *rtts = malloc(NUM_PINGPONGS * sizeof(uint64_t));
+	for(int i = 0; i < NUM_PINGPONGS; i++)
+	{
+		union itc_msg *msg = itc_alloc(sizeof(struct TestMsgS), TEST_MSG);
+		uint64_t start = get_time_ns();
+		itc_send(&msg, echo, ITC_MY_MBOX_ID, NULL);
+		msg = itc_receive(ITC_WAIT_FOREVER);
+		rtts[i] = get_time_ns() - start;
+		itc_free(&msg);
+	}
+
+	union itc_msg *stop = itc_alloc(sizeof(uint32_t), TEST_STOP);
+	itc_send(&stop, echo, ITC_MY_MBOX_ID, NULL);
+	pthread_join(thread, NULL);
+
+	qsort(rtts, NUM_PINGPONGS, sizeof(uint64_t), compare_u64);
+	printf("test_pingpong_latency: round trip p50 %.1f us, p99 %.1f us, p999 %.1f us -> PASS\n",
+		rtts[NUM_PINGPONGS / 2] / 1e3, rtts[NUM_PINGPONGS * 99 / 100] / 1e3, rtts[NUM_PINGPONGS * 999 / 1000] / 1e3);
+	free(rtts);
+	return true;
+}
+
+static bool check_payload(union itc_msg *msg, uint32_t len)
+{
+	if(msg->testMsg.len != len)
+	{
+		return false;
+	}
+
+	for(uint32_t i = 0; i < len; i++)
+	{
+		if(msg->testMsg.data[i] != (char)(i * 7))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool test_cross_process(void)
+{
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		// Child starts from scratch, as a separate application would
+		itc_init(3, ITC_MALLOC, 0);
+		echo_thread(NULL);
+		itc_exit();
+		_exit(0);
+	}
+
+	itc_mbox_id_t echo = itc_locate_sync(2000, "itcliteTestEcho", true, NULL, NULL);
+	bool is_ok = echo != ITC_NO_MBOX_ID;
+
+	uint32_t lens[] = { 16, BIG_MSG_SIZE }; // Inline datagram, then memfd
+	for(size_t n = 0; is_ok && n < sizeof(lens) / sizeof(lens[0]); n++)
+	{
+		union itc_msg *msg = itc_alloc(offsetof(struct TestMsgS, data) + lens[n], TEST_MSG);
+		msg->testMsg.len = lens[n];
+		for(uint32_t i = 0; i < lens[n]; i++)
+		{
+			msg->testMsg.data[i] = (char)(i * 7);
+		}
+
+		is_ok = itc_send(&msg, echo, ITC_MY_MBOX_ID, NULL);
+		msg = is_ok ? itc_receive(2000) : msg;
+		is_ok = is_ok && msg != NULL && itc_sender(msg) == echo && itc_size(msg) == offsetof(struct TestMsgS, data) + lens[n] && check_payload(msg, lens[n]);
+		itc_free(&msg);
+	}
+
+	if(echo != ITC_NO_MBOX_ID)
+	{
+		union itc_msg *stop = itc_alloc(sizeof(uint32_t), TEST_STOP);
+		itc_send(&stop, echo, ITC_MY_MBOX_ID, NULL);
+	}
+	waitpid(pid, NULL, 0);
+
+	printf("test_cross_process: -> %s\n", is_ok ? "PASS" : "FAIL");
+	return is_ok;
+}
+
+int main()
+{
+	if(!itc_init(3, ITC_MALLOC, 0))
+	{
+		printf("Failed to itc_init()!\n");
+		return 1;
+	}
+
+	m_consumer_mbox = itc_create_mailbox("itcliteTestMain", ITC_NO_NAMESPACE);
+	if(m_consumer_mbox == ITC_NO_MBOX_ID)
+	{
+		printf("Failed to create mailbox \"itcliteTestMain\"!\n");
+		return 1;
+	}
+
+	bool is_ok = test_multi_producers();
+	is_ok = test_pingpong_latency() && is_ok;
+	is_ok = test_cross_process() && is_ok;
+
+	itc_delete_mailbox(m_consumer_mbox);
+	itc_exit();
+
+	return is_ok ? 0 : 1;
+}
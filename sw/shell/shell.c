@@ -9,12 +9,25 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <pthread.h>
-#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <search.h>
+#include <limits.h>
 #include <stddef.h>
 #include <termios.h>
+#include <poll.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "tcp_proto.h"
+#include "tcp_proto_v2.h"
+#include "clid_beacon.h"
+#include "clid_client.h"
 
 
 /*
@@ -28,18 +41,51 @@
 /*****************************************************************************\/
 *****                           INTERNAL TYPES                             *****
 *******************************************************************************/
-#define NUM_INTERNAL_CMDS	6
+#define NUM_INTERNAL_CMDS	17
 #define MAX_REMOTE_CMDS		255
-#define MAX_HISTORY_CMDS	50
 #define MAX_ARG_LENGTH		64
 #define MAX_NUM_ARGS		32
 #define MAX_HOST_NAME_LENGTH	255
 #define UDP_BROADCAST_PORT	11111
 #define TCP_CLID_PORT		33333
-#define MAX_NUM_REMOTE_HOSTS	255
+#define MAX_NUM_REMOTE_HOSTS	4096
 #define CHECK_ALIVE_INTERVAL	15
+#define REMOTE_HOST_HASH_SIZE	8192 // Buckets of the scan table by hostname, power of 2
+#define ALIVE_WHEEL_SIZE	32 // One slot per second, power of 2 above CHECK_ALIVE_INTERVAL
+#define NO_REMOTE_HOST		-1
+#define BEACON_BATCH		64 // Broadcast messages taken by one recvmmsg()
+#define MAX_BEACON_SIZE		1500
+#define UDP_RCVBUF_SIZE		(1024 * 1024) // Room for a burst of beacons from a whole lab
+#define PROBE_WAIT_MS		200 // Answers to a probe come in well within this on a lab network
 #define MAX_READLINE_LENGTH	1024
+#define HISTORY_MAGIC		"CLIHIST1"
+#define HISTORY_MAGIC_SIZE	8
+#define HISTORY_HEADER_SIZE	64
+#define HISTORY_DATA_SIZE	(4 * 1024 * 1024) // Some 100000 lines of typical length
+#define HISTORY_PAD		0xFFFFFFFFu
+#define HISTORY_LIST_DEFAULT	50 // Entries listed by history without <n>
 #define CMD_EXECUTION_TIMEOUT	30 // seconds
+#define OUTPUT_BUFF_SIZE	(64 * 1024) // Output of a remote command goes out in writes of up to this size
+#define MAX_BATCH_PAYLOAD	(1024 * 1024) // Longer scripts are sent as several batches
+#define FANOUT_DEFAULT_JOBS	32 // Hosts a fan-out talks to at once, "--jobs" of fanout
+#define FANOUT_MAX_JOBS		128
+#define MAX_QUEUED_LINES	32 // Lines typed while a remote command runs, executed in order once it is done
+#define INPUT_CHUNK		4096 // Read from stdin at once, a whole paste in a single read() most of the time
+#define MAX_SESSIONS		16 // Remote devices the shell stays connected to at once, see local_use()
+#define SESSION_KEEPALIVE_IDLE	60 // seconds of silence before TCP checks that the device of an idle session is still there
+#define SESSION_KEEPALIVE_INTVL	10
+#define SESSION_KEEPALIVE_CNT	3
+#define CLIENT_POOL_SIZE	32 // Connections fan-outs leave open for the next one, see finish_fanout_host()
+#define CMD_CACHE_MAGIC		"CLICMDS1" // Command list cache of a device, see save_cmd_cache()
+#define CMD_CACHE_MAGIC_SIZE	8
+#define MAX_COMPLETIONS		64 // Candidates Tab considers at once, see complete_input_line()
+#define PREFETCH_DEFAULT_BUDGET	4 // Background connections of "prefetch on" without <budget>, see start_prefetches()
+#define PREFETCH_TIMEOUT_MS	3000 // A device that takes longer to connect and list its commands is left alone
+#define PREFETCH_RETRY_PERIOD	60 // seconds before a device whose prefetch failed is tried again
+#define PREFETCH_SCAN_PERIOD_MS	1000 // How often the scan table is looked at for devices to prefetch
+#define PREFETCH_CANDIDATES	64 // Devices looked at for one free background connection
+#define MAX_JOBS		16 // Remote commands run with "&" at once, finished ones count until fg took their output
+#define MAX_CMD_CACHE_SIZE	(CMD_CACHE_MAGIC_SIZE + 3 * CLID_VARINT_MAX_SIZE + MAX_REMOTE_CMDS * (2 * CLID_VARINT_MAX_SIZE + sizeof(struct remote_cmd)))
 
 
 #define MUTEX_LOCK(lock)								\
@@ -61,57 +107,300 @@ struct local_cmd {
 	char	syntax[64];
 };
 
+/* Decoded "syntax" of a remote command (see tcp_proto_v2.h), nodes, children and names all live in one allocation */
+struct syntax_node {
+	const char		*name; // Not NUL-terminated
+	uint32_t		name_len;
+	uint32_t		flags; // CLID_SYNTAX_NODE_*
+	uint32_t		num_children;
+	const uint32_t		*children;
+};
+
+struct syntax_graph {
+	uint32_t		num_nodes;
+	struct syntax_node	*nodes; // nodes[0] is the command name itself
+};
+
 struct remote_cmd {
-	char	cmd[MAX_ARG_LENGTH];
-	char	description[128];
+	char			cmd[MAX_ARG_LENGTH];
+	char			description[128];
+	struct syntax_graph	*syntax; // NULL until clid sent it, the command is then only checked by its handler
+};
+
+/* A word Tab may complete the current one with, or just show */
+struct completion {
+	const char		*name;
+	size_t			len;
+	bool			is_hint; // <placeholder> or <cr>, shown but never inserted
 };
 
+/* Entry of the scan table, its index in m_remote_hosts is what "connect --idx" takes, so it stays put while the device broadcasts */
 struct remote_host_info {
 	char		hostname[MAX_HOST_NAME_LENGTH];
 	char		ip[25];
-	int		alive_timer_fd;
+	uint32_t	hash;
+	int		next_in_bucket; // Next entry with the same hash bucket, next free entry while unused
+	int		next_in_wheel; // Next entry in the same slot of m_alive_wheel
+	uint64_t	expiry_tick; // Only looked at when its slot of m_alive_wheel comes round, a beacon just moves it on
+	bool		has_load; // clid's own beacon was heard, not only the ITCGW broadcast
+	uint16_t	active_clients;
+	uint16_t	jobs_in_flight;
+	uint32_t	registry_epoch;
+	uint32_t	registry_version;
+	uint64_t	prefetch_retry_ns; // Main thread only, not prefetched again before then
+};
+
+/* Start of the history file, its ring of records follows at HISTORY_HEADER_SIZE. The file is mapped shared by all shells of the user,
+a record is: text_len (uint32_t, HISTORY_PAD for the filler in front of a wrap), text, zeros up to 8 bytes alignment, then the size of
+the whole record (uint32_t), so that the ring can be walked backwards from head too. A record never wraps, a filler takes the rest instead */
+struct history_file_header {
+	char		magic[HISTORY_MAGIC_SIZE];
+	uint32_t	data_size;
+	uint32_t	reserved;
+	uint64_t	head; // Logical offset the next record goes to, ever growing, its place in the ring is head % data_size
+};
+
+/* Entries ever seen by this shell, whose text contains a given trigram, oldest first */
+struct history_gram {
+	uint32_t	key; // Three bytes of text + 1, 0 if the slot is free
+	uint32_t	count;
+	uint32_t	cap;
+	uint32_t	*ids;
+};
+
+/* History file mapped, and what this shell knows of it. An id is the index in offsets, the entries below first were overwritten since */
+struct history {
+	int				fd; // -1 if only kept in memory, without a file to map
+	struct history_file_header	*header;
+	uint8_t				*data;
+	uint64_t			known_head; // Up to where offsets are filled in
+	uint64_t			*offsets;
+	uint32_t			count;
+	uint32_t			cap;
+	uint32_t			first;
+	struct history_gram		*grams; // Open addressing, see find_history_gram()
+	uint32_t			num_grams;
+	uint32_t			grams_cap;
+};
+
+/* Per-hop breakdown of a remote command, as reported by clid in CLID_EXE_CMD_TIMING (v2 only) */
+struct exe_cmd_timing {
+	bool		is_valid;
+	uint32_t	clid_queue_us;
+	uint32_t	itc_us;
+	uint32_t	cmdif_queue_us;
+	uint32_t	handler_us;
+	uint32_t	relay_us;
+};
+
+
+#define ESC_NONE		0
+#define ESC_STARTED		1 // '^['
+#define ESC_CSI			2 // '^[' '[' and the digits of its parameter so far, see handle_escape_sequence()
+#define ESC_PASTE_START		200 // '^[' '[' "200~" of bracketed paste, the text in between is taken as is, see paste_input_text()
+#define ESC_PASTE_END		201
+
+#define SESSION_READY		0
+#define SESSION_CONNECTING	1 // Waiting for the connection, see handle_session_conn()
+#define SESSION_LISTING		2
+#define SESSION_FAILED		3 // Closed by whoever waits for the session, connect or the main loop for a prefetch
+
+/* One connection to a clid, with the command list it gave us. Only the active session takes commands, the others
+just stay connected, with their lists kept up to date by clid's pushes, so that switching to them costs nothing */
+struct remote_session {
+	bool			is_used;
+	char			hostname[MAX_HOST_NAME_LENGTH]; // From the scan table, empty if the device did not broadcast yet
+	char			ip[25];
+	char			prompt[MAX_HOST_NAME_LENGTH + 40];
+	struct clid_conn	*conn;
+	uint8_t			proto;
+	struct remote_cmd	*remote_cmds; // MAX_REMOTE_CMDS of them
+	void			*remote_cmd_tree;
+	uint32_t		registry_epoch; // Registry version of remote_cmds as reported by clid, epoch 0 if unknown
+	uint32_t		registry_version;
+	uint8_t			state; // SESSION_*, anything but SESSION_READY is a prefetch on its way and takes nothing else
+	bool			is_prefetched; // Opened in the background and not used yet, given up whenever its slot is needed
+	uint64_t		deadline_ns; // Of a prefetch on its way
+};
+
+struct bg_job;
+
+/* Remote command whose reply the main loop is waiting for, see handle_exec_reply() */
+struct pending_cmd {
+	bool			is_pending;
+	struct remote_session	*session; // NULL for a job brought to the foreground
+	struct clid_request	*request; // NULL once the client is done with it
+	struct bg_job		*job; // Brought to the foreground by fg, its reply still comes to handle_job_reply()
+	bool			is_timed;
+	uint64_t		sent_ns;
+	struct exe_cmd_timing	timing;
+};
+
+/* Output of the pending remote command, written out as it arrives and never held in full, see write_cmd_output().
+With the pager on, what comes while --More-- is shown goes to a spool file meanwhile, clid is never kept from sending */
+struct cmd_output {
+	int		fd; // STDOUT_FILENO, or the file of save
+	char		path[PATH_MAX]; // of the file
+	char		buff[OUTPUT_BUFF_SIZE];
+	size_t		len;
+	uint64_t	total;
+	bool		is_failed; // Writing to fd failed, the rest is dropped
+	bool		is_paged;
+	int		rows; // of the terminal, while paged
+	int		cols;
+	int		line; // Lines shown since the last --More--
+	int		col;
+	bool		is_paused; // --More-- is shown
+	bool		is_quit; // q at --More--, the rest is dropped
+	bool		is_complete; // Whole reply received, the command finishes once the spool is shown too
+	FILE		*spool;
+	uint64_t	spool_len;
+	uint64_t	spool_pos;
+};
+
+#define FANOUT_PENDING		0 // Not started yet, see run_fanout()
+#define FANOUT_RUNNING		1
+#define FANOUT_DONE		2
+
+struct fanout;
+
+/* One host of a fan-out, see local_fanout() */
+struct fanout_host {
+	char		hostname[MAX_HOST_NAME_LENGTH];
+	char		ip[25];
+	struct fanout	*fanout;
+	struct clid_conn *conn;
+	uint8_t		state; // FANOUT_*
+	char		status[64]; // "OK", or why there is no output
+	char		*output;
+	size_t		output_len;
+	int		group; // First host with the same status and output
+};
+
+/* Same command for every host of a fan-out, and how far it got */
+struct fanout {
+	struct fanout_host	*hosts;
+	size_t			count;
+	size_t			next; // First host not started yet
+	size_t			done;
+	int			active;
+	int			nr_args;
+	const char *const	*args;
+};
+
+#define JOB_RUNNING		0
+#define JOB_DONE		1 // Its output stays in the spool until fg shows it
+
+/* Remote command run with a trailing "&", on a connection of its own so that the session takes other commands meanwhile, see start_job() */
+struct bg_job {
+	bool			is_used;
+	int			id; // As shown by jobs, one above the highest one in use
+	char			cmdline[MAX_READLINE_LENGTH];
+	char			ip[25];
+	struct clid_conn	*conn;
+	struct clid_request	*request; // NULL once the client is done with it
+	uint8_t			state; // JOB_*
+	char			status[64]; // "Running", "Done", or why there is no more output
+	bool			has_reply; // First piece is in, errorcode and result are valid
+	bool			is_complete; // Last piece is in too
+	bool			is_notified; // Its end was told above a prompt, see notify_jobs()
+	uint32_t		errorcode;
+	uint32_t		result;
+	FILE			*spool; // Output so far, never held in memory
+	uint64_t		spool_len;
+	uint64_t		started_ns;
+	uint64_t		finished_ns;
 };
 
-struct history_cmd {
-	struct history_cmd	*next;
-	struct history_cmd	*prev;
+/* One argument of a tokenized line, where it starts in the line buffer and how long it is, see get_args() */
+struct arg_slice {
+	uint32_t	offset;
+	uint32_t	len;
+};
 
-	char			cmd[256];
+/* One command line of a script, see run_script() */
+struct script_cmd {
+	unsigned int	line;
+	int		nr_args;
+	size_t		first_arg; // Into script.args
 };
 
-struct history_cmd_queue {
-	struct history_cmd	*head;
-	struct history_cmd	*tail;
+/* Reply of a CLID_EXE_BATCH_REQUEST, gathered from its fragments, see handle_batch_frame() */
+struct batch_reply {
+	bool		is_done;
+	int		status; // CLID_CLIENT_*
+	uint8_t		*payload;
+	size_t		len;
+	size_t		cap;
+};
 
-	struct history_cmd	*search;
+/* Whole script in a single buffer, the arguments of all its lines are slices of it, see load_script() */
+struct script {
+	char			*text;
+	struct arg_slice	*args;
+	size_t			nr_args;
+	struct script_cmd	*cmds;
+	size_t			count;
 };
 
 
 /*****************************************************************************\/
 *****                         INTERNAL VARIABLES                           *****
 *******************************************************************************/
-static volatile bool m_is_sigint = false;
+static int m_sigint_pipe[2] = { -1, -1 }; // Written by shell_sig_handler(), so that no poll() ever misses a Ctrl-C
 static bool m_is_exit = false;
-static bool m_is_connected = false;
 static char m_local_prompt[] = "local$ ";
-static char m_connected_prompt[35];
-static char m_active_remote_ip[20] = "0.0.0.0";
-static int m_active_fd = -1;
+static struct remote_session m_sessions[MAX_SESSIONS];
+static struct remote_session *m_active_session = NULL; // NULL while at the local prompt
 static char m_buffer[MAX_READLINE_LENGTH];
 static size_t m_buff_len = 0;
+static size_t m_cursor = 0; // Position of the cursor in m_buffer
+static uint8_t m_esc_state = ESC_NONE;
+static uint32_t m_esc_param = 0; // Of the CSI sequence being read, e.g. 3 for Del
+static bool m_is_pasting = false; // Between the brackets of a paste
+static char m_shown[MAX_READLINE_LENGTH]; // Input line as the terminal has it after the prompt, see update_input_line()
+static size_t m_shown_len = 0;
+static size_t m_shown_cursor = 0;
+static bool m_is_shown = false; // m_shown is valid, anything printed over the line since takes a whole redraw
+static uint32_t m_hist_browse = 0; // Entry shown by the arrow keys, history count if none
+static bool m_is_searching = false; // Ctrl-R, m_buffer holds the match and m_search_query what it has to contain
+static char m_search_query[MAX_READLINE_LENGTH];
+static size_t m_search_len = 0;
+static uint32_t m_search_match = 0; // Entry in m_buffer, history count if there is none
+static bool m_is_search_failed = false; // Nothing older contains the query, m_buffer still holds the last match
+static char m_search_saved[MAX_READLINE_LENGTH]; // Line as it was before Ctrl-R, back on Ctrl-G
+static struct pending_cmd m_pending = { .is_pending = false };
+static struct cmd_output m_output = { .fd = -1 };
+static bool m_is_pager_on = false;
+static bool m_is_prompt_needed = false; // A remote command just finished, the queued lines and the prompt come next
+static char m_queued_lines[MAX_QUEUED_LINES][MAX_READLINE_LENGTH];
+static size_t m_queued_head = 0;
+static size_t m_num_queued = 0;
+static char m_input[INPUT_CHUNK]; // Read from stdin, not handled yet while the queue is full
+static size_t m_input_len = 0;
+static size_t m_input_pos = 0;
+static bool m_is_stdin_eof = false;
+static char m_args_buff[MAX_READLINE_LENGTH]; // Tokenized line, m_args point into it
 static char *m_args[MAX_NUM_ARGS];
 static int m_nr_args = 0;
 static struct local_cmd m_local_cmds[NUM_INTERNAL_CMDS];
-static struct remote_cmd m_remote_cmds[MAX_REMOTE_CMDS];
-static void *m_remote_cmd_tree;
 static int m_udp_fd;
 static struct remote_host_info m_remote_hosts[MAX_NUM_REMOTE_HOSTS];
 static pthread_mutex_t m_remote_hosts_mtx;
 static pthread_t m_udp_thread_id;
 static pthread_mutex_t m_udp_thread_mtx;
-static void *m_remote_host_tree;
-static struct history_cmd_queue m_hist_cmd_queue;
-static uint16_t m_num_hist_cmd = 0;
+static int m_remote_host_buckets[REMOTE_HOST_HASH_SIZE];
+static int m_alive_wheel[ALIVE_WHEEL_SIZE];
+static uint64_t m_alive_tick; // Last second m_alive_wheel was advanced to
+static int m_free_remote_host;
+static int m_num_remote_hosts = 0;
+static bool m_is_scan_table_full = false;
+static uint64_t m_probe_sent_ns = 0;
+static int m_prefetch_budget = 0; // Background connections prefetch may hold, 0 while it is off
+static uint64_t m_prefetch_scan_ns = 0; // When the scan table is looked at next
+static struct history m_history = { .fd = -1 };
+static struct bg_job m_jobs[MAX_JOBS];
+static struct clid_client *m_client = NULL; // Every connection to a clid, sessions, prefetches and fan-outs alike
 static struct termios old_term_settings, current_term_settings;
 
 
@@ -121,9 +410,33 @@ static struct termios old_term_settings, current_term_settings;
 *******************************************************************************/
 static void shell_init(void);
 static void shell_sig_handler(int signo);
-static bool read_input_cmd(char *line, size_t max_len);
-static int get_token(const char *str, char *token);
-static int get_args(char *cmd, char *args[]);
+static bool consume_sigint(void);
+static void run_event_loop(void);
+static bool wait_client(void);
+static void handle_ctrl_c(void);
+static void handle_stdin_readable(void);
+static void process_input(void);
+static bool handle_input_byte(char c);
+static void handle_escape_sequence(char c);
+static void show_history_cmd(const char *cmd, size_t len);
+static void insert_input_text(const char *text, size_t len);
+static bool paste_input_text(void);
+static void complete_input_line(void);
+static size_t collect_cmd_completions(const char *word, size_t word_len, struct completion *completions);
+static size_t collect_fanout_completions(char **words, int nr_words, const char *word, size_t word_len, struct completion *completions);
+static size_t collect_syntax_completions(const struct syntax_graph *graph, char **words, int nr_words, const char *word, size_t word_len, struct completion *completions);
+static void add_completion(struct completion *completions, size_t *count, const char *name, size_t len, bool is_hint);
+static void submit_input_line(void);
+static void execute_line(const char *line);
+static void run_queued_lines(void);
+static void print_prompt(void);
+static void redraw_input_line(void);
+static void update_input_line(void);
+static size_t encode_cursor_move(char *out, size_t from, size_t to);
+static size_t encode_csi(char *out, size_t n, char final);
+static void begin_notification(void);
+static void end_notification(void);
+static int get_args(char *line, struct arg_slice slices[], const char **reason);
 static int is_local_cmd(char *str);
 static void execute_local_cmd(int index, char **args);
 static bool setup_local_cmds(void);
@@ -131,25 +444,116 @@ static bool setup_udp_server(void);
 static bool setup_udp_thread(void);
 static void* udp_loop(void *data);
 static bool setup_udp_remote_hosts(void);
-static bool setup_alive_timer(int *timer_fd);
-static bool restart_alive_timer(int timer_fd);
-static int compare_hostname_remotehost_tree(const void *pa, const void *pb);
-static int compare_host_remotehost_tree(const void *pa, const void *pb);
+static uint64_t get_alive_tick(void);
+static void advance_alive_wheel(uint64_t tick);
+static bool parse_beacon(const char *msg, size_t len, char *hostname, char *ip);
+static void update_remote_host(const char *hostname, const char *ip, const struct clid_beacon *beacon, uint64_t tick);
+static bool find_least_busy_host(const char *pattern, char *ip);
+static void probe_remote_hosts(void);
+static void wait_probe_replies(void);
+static uint32_t hash_hostname(const char *hostname, size_t len);
+static int find_remote_host(const char *hostname, uint32_t hash);
+static int add_remote_host(const char *hostname, uint32_t hash, const char *ip, uint64_t tick);
+static void remove_remote_host(int index);
 static int compare_cmd_name_in_remotecmd_tree(const void *pa, const void *pb);
 static int compare_remotecmd_in_remotecmd_tree(const void *pa, const void *pb);
 static bool handle_receive_broadcast_msg(int sockfd);
-static void add_new_cmd_to_history_queue(char *cmd);
-static void destroy_history_queue(struct history_cmd_queue *hist_queue);
-static bool connect_to_remote_host_via_ipaddr(char *ip);
-static bool send_get_list_cmd_request(int sockfd);
-static int recv_data(int sockfd, void *rx_buff, int nr_bytes_to_read);
-static bool receive_get_list_cmd_reply(int sockfd);
-static bool handle_receive_get_list_cmd_reply(int sockfd, struct ethtcp_header *header);
-static bool setup_remote_cmds_list(void);
+static bool get_clishell_path(const char *xdg_var, const char *fallback, const char *name, char *path, size_t size);
+static void open_history(void);
+static bool map_history_file(const char *path);
+static bool map_history_memory(void);
+static void close_history(void);
+static void sync_history(void);
+static void reload_history(void);
+static bool read_history_record(uint64_t pos, uint64_t *size, uint32_t *text_len);
+static void add_history_entry(uint64_t offset);
+static const char *get_history_text(uint32_t id, uint32_t *len);
+static void append_history(const char *line, size_t len);
+static void index_history_entry(uint32_t id);
+static struct history_gram *find_history_gram(uint32_t key, bool is_added);
+static uint32_t search_history(const char *query, size_t query_len, uint32_t before);
+static bool is_history_match(uint32_t id, const char *query, size_t query_len);
+static void start_history_search(void);
+static void update_history_search(uint32_t before);
+static void handle_search_byte(char c);
+static void end_history_search(bool is_accepted);
+static struct remote_session *connect_to_remote_host_via_ipaddr(const char *ip);
+static struct remote_session *find_session(const char *host);
+static void close_session(struct remote_session *session);
+static void close_all_sessions(void);
+static struct remote_session *get_free_session(void);
+static void start_prefetches(void);
+static bool pick_prefetch_host(char *ip, char *hostname);
+static bool start_prefetch(const char *ip, const char *hostname);
+static void fail_prefetch(struct remote_session *session);
+static void handle_session_conn(struct clid_conn *conn, int status, void *user_data);
+static void handle_session_push(struct clid_conn *conn, const struct clid_v2_frame *frame, void *user_data);
+static void handle_session_list(struct clid_request *request, const struct clid_list_reply *reply, void *user_data);
+static bool apply_cmd_list(struct remote_session *session, const struct clid_list_reply *reply);
+static void stop_prefetches(void);
+static void handle_cmd_list_changed(struct remote_session *session, const struct clid_v2_frame *frame);
+static void finish_pending_cmd(void);
+static void cancel_pending_cmd(void);
+static bool add_remote_cmd(struct remote_session *session, const char *cmd, uint32_t cmd_len, const char *desc, uint32_t desc_len);
+static bool remove_remote_cmd(struct remote_session *session, const char *cmd, uint32_t cmd_len);
+static bool add_remote_cmd_list(struct remote_session *session, struct clid_v2_reader *reader, uint32_t num_cmds);
+static void clear_remote_cmds(struct remote_session *session);
+static bool get_cmd_cache_path(const char *ip, char *path, size_t size);
+static bool load_cmd_cache(struct remote_session *session);
+static void save_cmd_cache(const struct remote_session *session);
+static void touch_cmd_cache(const char *ip);
 static void do_nothing(void *tree_node_data);
-static bool send_exe_cmd_request(int sockfd);
-static bool receive_exe_cmd_reply(int sockfd);
-static bool handle_receive_exe_cmd_reply(int sockfd, struct ethtcp_header *header);
+static bool send_v2_get_syntax_request(struct remote_session *session, const char *cmd, uint32_t cmd_len);
+static void handle_syntax_frame(struct clid_request *request, int status, const struct clid_v2_frame *frame, void *user_data);
+static void handle_get_syntax_reply(struct remote_session *session, const struct clid_v2_frame *frame);
+static struct syntax_graph *decode_syntax_graph(const uint8_t *syntax, uint32_t syntax_len);
+static bool check_remote_cmd_syntax(const struct syntax_graph *graph);
+static uint32_t evaluate_syntax_args(const struct syntax_graph *graph, uint32_t node, int nr_args, char **args, bool is_printed);
+static void print_next_syntax_args(const struct syntax_graph *graph, uint32_t node);
+static bool is_syntax_node_matched(const struct syntax_node *node, const char *arg, size_t arg_len);
+static void execute_remote_cmd(bool is_timed, int output_fd, const char *output_path);
+static void handle_exec_reply(struct clid_request *request, const struct clid_exec_reply *reply, void *user_data);
+static bool check_remote_cmd(struct remote_session *session);
+static void start_cmd_output(int fd, const char *path);
+static void write_cmd_output(const char *data, size_t len);
+static void complete_cmd_output(void);
+static void end_cmd_output(void);
+static size_t page_cmd_output(const char *data, size_t len);
+static void buffer_cmd_output(const char *data, size_t len);
+static void flush_cmd_output(void);
+static void spool_cmd_output(const char *data, size_t len);
+static void handle_pager_key(char c);
+static void resume_cmd_output(void);
+static void print_exe_cmd_timing(const struct exe_cmd_timing *timing, uint64_t total_ns);
+static void print_usage(const char *prog);
+static bool parse_batch_policy(const char *str, uint32_t *policy);
+static bool run_script(char *ip, const char *path, uint32_t policy);
+static bool load_script(FILE *file, const char *path, struct script *script);
+static bool read_script_text(FILE *file, const char *path, struct script *script);
+static const char *get_script_arg(const struct script *script, const struct script_cmd *cmd, int index);
+static void destroy_script(struct script *script);
+static struct clid_request *send_v2_batch_request(struct remote_session *session, const struct script *script, size_t next, uint32_t policy, size_t *num_sent, struct batch_reply *reply);
+static void handle_batch_frame(struct clid_request *request, int status, const struct clid_v2_frame *frame, void *user_data);
+static bool receive_v2_batch_reply(struct clid_request *request, struct batch_reply *reply);
+static size_t collect_fanout_hosts(const char *pattern, struct fanout_host *hosts);
+static void run_fanout(struct fanout *fanout, int jobs);
+static void start_fanout_host(struct fanout *fanout, struct fanout_host *host);
+static void handle_fanout_conn(struct clid_conn *conn, int status, void *user_data);
+static void handle_fanout_reply(struct clid_request *request, const struct clid_exec_reply *reply, void *user_data);
+static bool append_fanout_output(struct fanout_host *host, const void *data, size_t len);
+static void finish_fanout_host(struct fanout_host *host, const char *status);
+static void print_fanout_results(struct fanout_host *hosts, size_t count);
+static void start_job(void);
+static struct bg_job *get_free_job(void);
+static struct bg_job *find_job(const char *id);
+static void handle_job_conn(struct clid_conn *conn, int status, void *user_data);
+static void handle_job_reply(struct clid_request *request, const struct clid_exec_reply *reply, void *user_data);
+static void spool_job_reply(struct bg_job *job, const struct clid_exec_reply *reply);
+static void finish_job(struct bg_job *job, const char *status);
+static void remove_job(struct bg_job *job);
+static void remove_all_jobs(void);
+static void notify_jobs(void);
+static uint64_t get_time_ns(void);
 
 /* Initialize new terminal i/o settings */
 void initTermios(void);
@@ -163,111 +567,100 @@ static bool local_history(char **args);
 static bool local_scan(char **args);
 static bool local_connect(char **args);
 static bool local_disconnect(char **args);
+static bool local_time(char **args);
+static bool local_fanout(char **args);
+static bool local_sessions(char **args);
+static bool local_use(char **args);
+static bool local_save(char **args);
+static bool local_pager(char **args);
+static bool local_prefetch(char **args);
+static bool local_jobs(char **args);
+static bool local_fg(char **args);
+static bool local_wait(char **args);
+static bool local_kill(char **args);
 
 
 int main(int argc, char* argv[])
 {
-	(void)argc;
-	(void)argv;
-	// int opt = 0;
-	// char tcp_ip[25];
-	// int port = 0;
+	int opt = 0;
+	char *ip = NULL;
+	const char *script_path = NULL;
+	uint32_t policy = CLID_BATCH_STOP_ON_ERROR;
+	while((opt = getopt(argc, argv, "c:f:p:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			ip = optarg;
+			break;
+		case 'f':
+			script_path = optarg;
+			break;
+		case 'p':
+			if(!parse_batch_policy(optarg, &policy))
+			{
+				printf("Unknown batch policy %s!\n", optarg);
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			print_usage(argv[0]);
+			exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
 
 	shell_init();
 
-	if(!setup_local_cmds() || !setup_remote_cmds_list())
+	if(!setup_local_cmds())
 	{
 		printf("Failed to set local shell commands!\n");
 		exit(EXIT_FAILURE);
 	}
 
-	m_hist_cmd_queue.head = NULL;
-	m_hist_cmd_queue.tail = NULL;
-	m_hist_cmd_queue.search = NULL;
-
-	setup_udp_server();
-	setup_udp_thread();
-
-	printf("Starting new shell...\n");
-	printf("\n");
-
-	initTermios();
-
-	int index = 0;
-	while(!m_is_exit)
+	// Script mode never reads the terminal, it runs the script and exits with its outcome
+	if(script_path != NULL)
 	{
-		if(m_is_connected)
-		{
-			printf("%s", m_connected_prompt);
-		} else
-		{
-			printf("%s", m_local_prompt);
-		}
-
-		m_buff_len = 0;
-		bool ret = read_input_cmd(m_buffer, MAX_READLINE_LENGTH);
-		if(!ret)
+		if(ip == NULL)
 		{
+			printf("A script needs the clid to run on, see -c!\n");
 			exit(EXIT_FAILURE);
 		}
-		
-		m_nr_args = 0;
-		if(m_buff_len > 0)
-		{
-			m_nr_args = get_args(m_buffer, m_args);
-		}
 
-		if(m_nr_args >= 1)
-		{
-			if((index = is_local_cmd(m_args[0])) >= 0)
-			{
-				execute_local_cmd(index, m_args);
-			} else
-			{
-				struct remote_cmd **iter;
-				iter = tfind(m_args[0], &m_remote_cmd_tree, compare_cmd_name_in_remotecmd_tree);
-				if(iter == NULL)
-				{
-					printf("Unknown command: %s!\n", m_args[0]);
-				} else
-				{
-					printf("Executing remote command %s...\n", m_args[0]);
-					if(m_active_fd != -1)
-					{
-						send_exe_cmd_request(m_active_fd);
-						receive_exe_cmd_reply(m_active_fd);
-					}
-				}
-			}
-		}
+		bool is_succeeded = run_script(ip, script_path, policy);
+		close_all_sessions();
+		clid_client_destroy(m_client);
 
-		for(int i = 0; i < m_nr_args; i++)
-		{
-			free(m_args[i]);
-			m_args[i] = NULL;
-		}
+		exit(is_succeeded ? EXIT_SUCCESS : EXIT_FAILURE);
 	}
 
-	destroy_history_queue(&m_hist_cmd_queue);
+	open_history();
 
-	if(m_active_fd != -1)
+	if(setup_udp_server() && setup_udp_thread())
 	{
-		close(m_active_fd);
-		m_active_fd = -1;
+		probe_remote_hosts();
 	}
 
-	for(int i = 0; i < MAX_REMOTE_CMDS; i++)
+	printf("Starting new shell...\n");
+	printf("\n");
+
+	initTermios();
+
+	if(ip != NULL)
 	{
-		if(m_remote_cmds[i].cmd[0] != '\0')
+		m_active_session = connect_to_remote_host_via_ipaddr(ip);
+		if(m_active_session != NULL)
 		{
-			tdelete(m_remote_cmds[i].cmd, &m_remote_cmd_tree, compare_cmd_name_in_remotecmd_tree);
-
-			m_remote_cmds[i].cmd[0] = '\0';
-			m_remote_cmds[i].description[0] = '\0';
+			send_v2_get_syntax_request(m_active_session, NULL, 0);
 		}
 	}
 
-	tdestroy(m_remote_cmd_tree, do_nothing);
+	run_event_loop();
+
+	close_history();
+	remove_all_jobs();
+	close_all_sessions();
+	clid_client_destroy(m_client);
 
 	resetTermios();
 
@@ -281,1510 +674,5225 @@ int main(int argc, char* argv[])
 *******************************************************************************/
 static void shell_init(void)
 {
+	if(pipe2(m_sigint_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+	{
+		printf("Failed to pipe2(), errno = %d!\n", errno);
+	}
+
 	// Customize Ctrl-C -> give up and terminate the on-going command -> Return to our shell ready for next commands
 	struct sigaction sa;
 	sa.sa_handler = &shell_sig_handler;
 	sa.sa_flags = 0;
 	sigemptyset(&sa.sa_mask);
 	sigaction(SIGINT, &sa, NULL);
+
+	// An idle session costs no traffic of ours, the kernel alone notices a device that went away without closing the connection
+	struct clid_client_config config = {
+		.port = TCP_CLID_PORT,
+		.max_idle_conns = CLIENT_POOL_SIZE,
+		.keepalive_idle_s = SESSION_KEEPALIVE_IDLE,
+		.keepalive_intvl_s = SESSION_KEEPALIVE_INTVL,
+		.keepalive_cnt = SESSION_KEEPALIVE_CNT,
+	};
+	m_client = clid_client_create(&config);
+	if(m_client == NULL)
+	{
+		printf("Failed to create clid client, errno = %d!\n", errno);
+		exit(EXIT_FAILURE);
+	}
 }
 
 static void shell_sig_handler(int signo)
 {
 	(void)signo;
-	m_is_sigint = true;
 
-	// printf("\nCalling shell_sig_handler...\n");
+	// Whichever thread gets it, the main loop wakes up on the pipe
+	int saved_errno = errno;
+	ssize_t res = write(m_sigint_pipe[1], "", 1);
+	(void)res;
+	errno = saved_errno;
 }
 
-static bool read_input_cmd(char *line, size_t max_len)
+/* Return true if Ctrl-C was pressed since the last call */
+static bool consume_sigint(void)
 {
-	size_t i = 0;
-	line[0] = '\0';
-
-	char c;
-	char arrow_count = 0; // 27 -> 91 -> 65/66/67/68
-	char del_count = 0; // 51 -> 126
-	char home_end_count = 0; // 27 -> 72/70
-	bool is_reached_tail_head = false;
-
-	while((c = getchar()))
+	char buff[16];
+	bool is_pressed = false;
+	while(read(m_sigint_pipe[0], buff, sizeof(buff)) > 0)
 	{
-		if(i > max_len - 1)
-		{
-			printf("\nLine is too long!\n");
-			break;
-		}
-
-		switch (c)
-		{
-		case 27: // Escape sequence character '^['
-			arrow_count = 1;
-			home_end_count = 1;
-			break;
-		case 91:
-			if(arrow_count == 1)
-			{
-				arrow_count = 2;
-			}
-			if(home_end_count == 1)
-			{
-				home_end_count = 2;
-			}
-			break;
-		case 65: // Up Arrow
-			if(arrow_count == 2)
-			{
-				if(m_hist_cmd_queue.search == NULL)
-				{
-					break;
-				}
-
-				// Clear current line
-				printf("\33[2K\r");
-				line[0] = '\0';
-				i = 0;
-
-				if(m_is_connected)
-				{
-					printf("%s", m_connected_prompt);
-				} else
-				{
-					printf("%s", m_local_prompt);
-				}
-
-				if(m_hist_cmd_queue.search == m_hist_cmd_queue.tail && is_reached_tail_head)
-				{
-					m_hist_cmd_queue.search = m_hist_cmd_queue.search->prev;
-				}
-
-				printf("%s", m_hist_cmd_queue.search->cmd);
-				strcat(line, m_hist_cmd_queue.search->cmd);
-				i += strlen(line);
-
-				if(m_hist_cmd_queue.search != m_hist_cmd_queue.head)
-				{
-					m_hist_cmd_queue.search = m_hist_cmd_queue.search->prev;
-					is_reached_tail_head = false;
-				} else
-				{
-					is_reached_tail_head = true;
-				}
-			}
-			break;
-		case 66: // Down Arrow
-			if(arrow_count == 2)
-			{
-				if(m_hist_cmd_queue.search == NULL)
-				{
-					break;
-				}
-
-				// Clear current line
-				printf("\33[2K\r");
-				line[0] = '\0';
-				i = 0;
-
-				if(m_is_connected)
-				{
-					printf("%s", m_connected_prompt);
-				} else
-				{
-					printf("%s", m_local_prompt);
-				}				
-
-				if(m_hist_cmd_queue.search == m_hist_cmd_queue.head && is_reached_tail_head)
-				{
-					m_hist_cmd_queue.search = m_hist_cmd_queue.search->next;
-					printf("%s", m_hist_cmd_queue.search->cmd);
-					strcat(line, m_hist_cmd_queue.search->cmd);
-					i += strlen(line);
-					m_hist_cmd_queue.search = m_hist_cmd_queue.search->next;
-					is_reached_tail_head = false;
-				} else if(m_hist_cmd_queue.search == m_hist_cmd_queue.tail && is_reached_tail_head)
-				{
-				} else
-				{
-					printf("%s", m_hist_cmd_queue.search->cmd);
-					strcat(line, m_hist_cmd_queue.search->cmd);
-					i += strlen(line);
-
-					if(m_hist_cmd_queue.search != m_hist_cmd_queue.tail)
-					{
-						m_hist_cmd_queue.search = m_hist_cmd_queue.search->next;
-						is_reached_tail_head = false;
-					} else
-					{
-						is_reached_tail_head = true;
-					}
-				}				
-			}
-			break;
-		case 67: // Right Arrow
-			if(arrow_count == 2)
-			{
-				// printf("GET RIGHT ARROW!");
-				if(i < strlen(line))
-				{
-					printf("\033[1C");
-					++i;
-				}
-				
-			}
-			break;
-		case 68: // Left Arrow
-			if(arrow_count == 2)
-			{
-				// printf("GET LEFT ARROW!");
-				if(i > 0)
-				{
-					printf("\b");
-					--i;
-				}
-			}
-			break;
-		case 8: // Backspace
-			// printf("GET BACKSPACE!");
-			if(i > 0)
-			{
-				// Handle our line[]
-				--i;
-				line[i] = '\0';
-				strcat(line, line + strlen(line) + 1);
-
-				// Clear current line and printf new line
-				printf("\33[2K\r");
-
-				size_t prompt_len = 0;
-				if(m_is_connected)
-				{
-					printf("%s", m_connected_prompt);
-					prompt_len = strlen(m_connected_prompt);
-				} else
-				{
-					printf("%s", m_local_prompt);
-					prompt_len = strlen(m_local_prompt);
-				}
-
-				printf("%s", line);
-
-				// Move to beginning of the line
-				printf("\r");
-				// Move right i characters
-				for(size_t iter = 0; iter < (prompt_len + i); ++iter)
-				{
-					printf("\033[1C");
-				}
-			}
-			break;
-		case 51:
-			del_count = 1;
-			break;
-		case 126: // Del
-			if(del_count == 1)
-			{
-				if(i < strlen(line))
-				{
-					// Handle our line[]
-					line[i] = '\0';
-					strcat(line, line + strlen(line) + 1);
-
-					// Clear current line and printf new line
-					printf("\33[2K\r");
-
-					size_t prompt_len = 0;
-					if(m_is_connected)
-					{
-						printf("%s", m_connected_prompt);
-						prompt_len = strlen(m_connected_prompt);
-					} else
-					{
-						printf("%s", m_local_prompt);
-						prompt_len = strlen(m_local_prompt);
-					}
-
-					printf("%s", line);
-
-					// Move to beginning of the line
-					printf("\r");
-					// Move right i characters
-					for(size_t iter = 0; iter < (prompt_len + i); ++iter)
-					{
-						printf("\033[1C");
-					}
-				}
-			}
-			break;
-		case 10: // Enter
-			// Receive command and execute it
-			// printf("\nExecuting command above!");
-			m_hist_cmd_queue.search = m_hist_cmd_queue.tail;
-			printf("\n");
-			break;
-		case 32: // Space
-			// Save string from current position to the end of line
-			char latter[MAX_READLINE_LENGTH];
-			strcpy(latter, line + i);
-			line[i] = '\0';
-			strcat(line, " ");
-			strcat(line, latter);
-			++i;
-
-			// Clear current line and printf new line
-			printf("\33[2K\r");
-
-			size_t prompt_len = 0;
-			if(m_is_connected)
-			{
-				printf("%s", m_connected_prompt);
-				prompt_len = strlen(m_connected_prompt);
-			} else
-			{
-				printf("%s", m_local_prompt);
-				prompt_len = strlen(m_local_prompt);
-			}
+		is_pressed = true;
+	}
 
-			printf("%s", line);
+	return is_pressed;
+}
 
-			// Move to beginning of the line
-			printf("\r");
-			// Move right i characters
-			for(size_t iter = 0; iter < (prompt_len + i); ++iter)
-			{
-				printf("\033[1C");
-			}
-			break;
-		case 18: // Ctrl-R	
-			break;
-		case 72: // Home
-			if(home_end_count == 2)
-			{
-				for(size_t iter = 0; iter < i; ++iter)
-				{
-					printf("\b");
-				}
+/* Single-threaded loop over Ctrl-C, the clid client and stdin. Nothing in here blocks on clid, a remote command only
+issues its request and its reply is printed as it comes, so the shell never stops reading keys. Idle sessions are watched
+by the client as well, for the command list changes clid pushes and for their device going down */
+static void run_event_loop(void)
+{
+	print_prompt();
+	m_is_shown = true;
+	fflush(stdout);
 
-				i = 0;
-			}
-			break;
-		case 70: // End
-			if(home_end_count == 2)
-			{
-				for(size_t iter = i; iter < strlen(line); ++iter)
-				{
-					printf("\033[1C");
-				}
+	while(!m_is_exit)
+	{
+		struct pollfd pfds[3];
+		int nfds = 0;
+		int stdin_idx = -1;
 
-				i = strlen(line);
-			}
-			break;
+		pfds[nfds].fd = m_sigint_pipe[0];
+		pfds[nfds].events = POLLIN;
+		pfds[nfds++].revents = 0;
 
-		default:
-			break;
-		}
+		pfds[nfds].fd = clid_client_get_fd(m_client);
+		pfds[nfds].events = POLLIN;
+		pfds[nfds++].revents = 0;
 
-		if(c == 10)
+		// Once the queue is full, whatever is typed ahead waits in the kernel
+		if(!m_is_stdin_eof && m_input_pos == m_input_len && m_num_queued < MAX_QUEUED_LINES)
 		{
-			break;
+			stdin_idx = nfds;
+			pfds[nfds].fd = STDIN_FILENO;
+			pfds[nfds].events = POLLIN;
+			pfds[nfds++].revents = 0;
 		}
 
-		if(c == EOF)
+		// Reply deadlines are the client's, prefetches give up on their own and the scan table is looked at again for devices new since
+		int timeout_ms = clid_client_get_timeout(m_client);
+		uint64_t now = get_time_ns();
+		for(int i = 0; i < MAX_SESSIONS; i++)
 		{
-			if(m_is_sigint)
+			uint64_t deadline_ns = m_sessions[i].is_used && m_sessions[i].state != SESSION_READY ? m_sessions[i].deadline_ns : 0;
+			int prefetch_ms = deadline_ns > now ? (int)((deadline_ns - now) / 1000000 + 1) : 0;
+			if(deadline_ns != 0 && (timeout_ms < 0 || prefetch_ms < timeout_ms))
 			{
-				// printf("Received Ctrl-C!");
-				m_is_sigint = false;
-				m_buff_len = 0;
-				line[0] = '\0';
-				printf ("\n");
+				timeout_ms = prefetch_ms;
 			}
+		}
 
-			return true;
+		if(m_prefetch_budget > 0)
+		{
+			int scan_ms = m_prefetch_scan_ns > now ? (int)((m_prefetch_scan_ns - now) / 1000000 + 1) : 0;
+			timeout_ms = timeout_ms < 0 || scan_ms < timeout_ms ? scan_ms : timeout_ms;
 		}
 
-		if(c == 32 || c == 8)
+		if(poll(pfds, nfds, timeout_ms) < 0 && errno != EINTR)
 		{
-			continue;
+			printf("Failed to poll(), errno = %d!\n", errno);
+			break;
 		}
 
-		if(arrow_count == 0 && del_count == 0 && home_end_count == 0 && c >= 33 && c <= 125)
+		if(pfds[0].revents != 0 && consume_sigint())
 		{
-			// Save string from current position to the end of line
-			char latter[MAX_READLINE_LENGTH];
-			strcpy(latter, line + i);
-			line[i] = c;
-			line[i + 1] = '\0';
-			strcat(line, latter);
-			++i;
+			handle_ctrl_c();
+		}
 
-			// Clear current line and printf new line
-			printf("\33[2K\r");
+		clid_client_process(m_client);
 
-			size_t prompt_len = 0;
-			if(m_is_connected)
-			{
-				printf("%s", m_connected_prompt);
-				prompt_len = strlen(m_connected_prompt);
-			} else
+		now = get_time_ns();
+		for(int i = 0; i < MAX_SESSIONS; i++)
+		{
+			struct remote_session *session = &m_sessions[i];
+			if(session->is_used && session->is_prefetched && session->state != SESSION_READY && (session->state == SESSION_FAILED || now >= session->deadline_ns))
 			{
-				printf("%s", m_local_prompt);
-				prompt_len = strlen(m_local_prompt);
+				fail_prefetch(session);
 			}
+		}
+		start_prefetches();
 
-			printf("%s", line);
-
-			// Move to beginning of the line
-			printf("\r");
-			// Move right i characters
-			for(size_t iter = 0; iter < (prompt_len + i); ++iter)
-			{
-				printf("\033[1C");
-			}
+		// Not from within the callbacks above, a queued "connect" waits for the client itself
+		if(m_is_prompt_needed && !m_pending.is_pending)
+		{
+			m_is_prompt_needed = false;
+			run_queued_lines();
 		}
-		
-		if(c != 27 && c != 91)
+
+		if(stdin_idx >= 0 && pfds[stdin_idx].revents != 0)
 		{
-			arrow_count = 0;
-			home_end_count = 0;
+			handle_stdin_readable();
 		}
 
-		if(c != 51)
+		// Piped input ran out, everything it queued has run
+		if(m_is_stdin_eof && !m_pending.is_pending && m_num_queued == 0 && m_input_pos == m_input_len)
 		{
-			del_count = 0;
+			printf("\n");
+			m_is_exit = true;
 		}
+
+		fflush(stdout);
+	}
+}
+
+/* One round of the client for those that wait for it in the foreground, connect, scripts and fan-outs. Return false on Ctrl-C */
+static bool wait_client(void)
+{
+	struct pollfd pfds[2];
+	pfds[0].fd = m_sigint_pipe[0];
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	pfds[1].fd = clid_client_get_fd(m_client);
+	pfds[1].events = POLLIN;
+	pfds[1].revents = 0;
+
+	if(poll(pfds, 2, clid_client_get_timeout(m_client)) < 0 && errno != EINTR)
+	{
+		printf("Failed to poll(), errno = %d!\n", errno);
+		return false;
 	}
 
-	m_buff_len = strlen(line);
-	if(m_buff_len > 0) 
+	if(pfds[0].revents != 0 && consume_sigint())
 	{
-		add_new_cmd_to_history_queue(line);
+		return false;
 	}
 
+	clid_client_process(m_client);
 	return true;
 }
 
-static int get_token(const char *str, char *token)
+static void handle_ctrl_c(void)
 {
-	int nr_chars = 0;
-	// printf("get_token - Input str: \"%s\"\n", str);
-	// If str has not reached NULL-terminated character '\0' yet and skip white spaces or tabs
-	while(*str && strchr(" \t", *str))
+	if(m_pending.is_pending)
 	{
-		str++;
-		nr_chars++;
+		printf(m_pending.job != NULL ? "\n" : "\nCancelled, a late reply of this command will be dropped!\n\n");
+		cancel_pending_cmd();
+		return;
 	}
 
-	// Found new token
-	bool start_with_one_minus = false;
-	bool start_with_two_minus = false;
-	bool start_with_int = false;
-	bool is_single_flag = false;
-	int i = 0;
-	while(*str && !strchr(" \t", *str))
+	// Give up the line being typed, as a terminal does
+	m_buff_len = 0;
+	m_cursor = 0;
+	m_buffer[0] = '\0';
+	m_esc_state = ESC_NONE;
+	printf("\n");
+	m_is_prompt_needed = true;
+}
+
+static void handle_stdin_readable(void)
+{
+	ssize_t size = read(STDIN_FILENO, m_input, sizeof(m_input));
+	if(size == 0)
 	{
-		if(*str == '-')
+		m_is_stdin_eof = true;
+		return;
+	} else if(size < 0)
+	{
+		if(errno != EINTR && errno != EAGAIN)
 		{
-			/* Token as a single flag or negative interger, for example, -D, -a, -f, -99, -22,... */
-			if(i == 0)
-			{
-				start_with_one_minus = true;
-				token[i] = *str++;
-				i++;
-				nr_chars++;
-				continue;
-			}
+			printf("Failed to read() stdin, errno = %d!\n", errno);
+			m_is_stdin_eof = true;
+		}
+		return;
+	}
 
-			/* Token as a complete flag, for example, --daemon, --unittest,... */
-			if(start_with_one_minus && i == 1)
-			{
-				start_with_one_minus = false;
-				start_with_two_minus = true;
-				token[i] = *str++;
-				i++;
-				nr_chars++;
-				continue;
-			}		
+	m_input_len = size;
+	m_input_pos = 0;
+	process_input();
+}
 
-			/* Token as a complete word-concatenated flag, for example, --add-missing, --frequency-overlap,... */
-			/* If there were a token starting with two minus, not allowed to have the 3rd minus right then */
-			if(start_with_two_minus && i != 2)
+static void process_input(void)
+{
+	while(m_input_pos < m_input_len && m_num_queued < MAX_QUEUED_LINES && !m_is_exit)
+	{
+		if(m_output.is_paused)
+		{
+			handle_pager_key(m_input[m_input_pos++]);
+		} else if(m_is_pasting && m_esc_state == ESC_NONE && !m_is_searching)
+		{
+			if(paste_input_text())
+			{
+				submit_input_line();
+			}
+		} else if(handle_input_byte(m_input[m_input_pos++]))
+		{
+			submit_input_line();
+		}
+	}
+}
+
+/* Line editing, one key at a time as it comes. Return true once Enter completes the line in m_buffer */
+static bool handle_input_byte(char c)
+{
+	if(m_is_searching)
+	{
+		if(c != 10)
+		{
+			handle_search_byte(c);
+			return false;
+		}
+
+		end_history_search(true);
+	}
+
+	if(m_esc_state != ESC_NONE)
+	{
+		handle_escape_sequence(c);
+		return false;
+	}
+
+	switch (c)
+	{
+	case 27: // Escape sequence character '^['
+		m_esc_state = ESC_STARTED;
+		break;
+	case 10: // Enter
+		return true;
+	case 8: // Backspace
+	case 127:
+		if(m_cursor > 0)
+		{
+			memmove(&m_buffer[m_cursor - 1], &m_buffer[m_cursor], m_buff_len - m_cursor + 1);
+			m_cursor--;
+			m_buff_len--;
+			update_input_line();
+		}
+		break;
+	case 9: // Tab
+		complete_input_line();
+		break;
+	case 18: // Ctrl-R
+		start_history_search();
+		break;
+	default:
+		if(c >= 32 && c <= 126 && m_buff_len < MAX_READLINE_LENGTH - 1)
+		{
+			memmove(&m_buffer[m_cursor + 1], &m_buffer[m_cursor], m_buff_len - m_cursor + 1);
+			m_buffer[m_cursor++] = c;
+			m_buff_len++;
+			update_input_line();
+		}
+		break;
+	}
+
+	return false;
+}
+
+/* Arrows, Home, End, Del and the brackets of a paste, everything else after '^[' is dropped */
+static void handle_escape_sequence(char c)
+{
+	if(m_esc_state == ESC_STARTED)
+	{
+		m_esc_state = c == '[' ? ESC_CSI : ESC_NONE;
+		m_esc_param = 0;
+		return;
+	}
+
+	if(c >= '0' && c <= '9')
+	{
+		m_esc_param = m_esc_param < 1000 ? m_esc_param * 10 + (c - '0') : m_esc_param;
+		return;
+	}
+
+	m_esc_state = ESC_NONE;
+	switch (c)
+	{
+	case 'A': // Up Arrow
+		if(m_hist_browse >= m_history.count)
+		{
+			// Lines other shells added meanwhile come first
+			sync_history();
+			m_hist_browse = m_history.count;
+		}
+
+		if(m_hist_browse > m_history.first)
+		{
+			uint32_t len = 0;
+			const char *text = get_history_text(--m_hist_browse, &len);
+			show_history_cmd(text, len);
+		}
+		break;
+	case 'B': // Down Arrow
+		if(m_hist_browse < m_history.count)
+		{
+			uint32_t len = 0;
+			const char *text = ++m_hist_browse < m_history.count ? get_history_text(m_hist_browse, &len) : "";
+			show_history_cmd(text, len);
+		}
+		break;
+	case 'C': // Right Arrow
+		if(m_cursor < m_buff_len)
+		{
+			m_cursor++;
+			update_input_line();
+		}
+		break;
+	case 'D': // Left Arrow
+		if(m_cursor > 0)
+		{
+			m_cursor--;
+			update_input_line();
+		}
+		break;
+	case 'H': // Home
+		m_cursor = 0;
+		update_input_line();
+		break;
+	case 'F': // End
+		m_cursor = m_buff_len;
+		update_input_line();
+		break;
+	case '~':
+		if(m_esc_param == 3 && m_cursor < m_buff_len) // Del
+		{
+			memmove(&m_buffer[m_cursor], &m_buffer[m_cursor + 1], m_buff_len - m_cursor);
+			m_buff_len--;
+			update_input_line();
+		} else if(m_esc_param == 1 || m_esc_param == 7) // Home, as sent by screen and some serial consoles
+		{
+			m_cursor = 0;
+			update_input_line();
+		} else if(m_esc_param == 4 || m_esc_param == 8) // End
+		{
+			m_cursor = m_buff_len;
+			update_input_line();
+		} else if(m_esc_param == ESC_PASTE_START || m_esc_param == ESC_PASTE_END)
+		{
+			m_is_pasting = m_esc_param == ESC_PASTE_START;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void show_history_cmd(const char *cmd, size_t len)
+{
+	m_buff_len = len < MAX_READLINE_LENGTH ? len : MAX_READLINE_LENGTH - 1;
+	memcpy(m_buffer, cmd, m_buff_len);
+	m_buffer[m_buff_len] = '\0';
+	m_cursor = m_buff_len;
+	update_input_line();
+}
+
+static void insert_input_text(const char *text, size_t len)
+{
+	if(len > MAX_READLINE_LENGTH - 1 - m_buff_len)
+	{
+		len = MAX_READLINE_LENGTH - 1 - m_buff_len;
+	}
+
+	memmove(&m_buffer[m_cursor + len], &m_buffer[m_cursor], m_buff_len - m_cursor + 1);
+	memcpy(&m_buffer[m_cursor], text, len);
+	m_cursor += len;
+	m_buff_len += len;
+}
+
+/* Text of a bracketed paste, in whole runs with a single update of the line each, instead of key by key. A newline still completes
+a line, so that a pasted script runs line by line, '^[' may start the closing bracket, any other control character is dropped.
+Return true once a newline completes the line in m_buffer */
+static bool paste_input_text(void)
+{
+	char c = m_input[m_input_pos];
+	if(c == 10)
+	{
+		m_input_pos++;
+		return true;
+	} else if(c == 27)
+	{
+		m_input_pos++;
+		m_esc_state = ESC_STARTED;
+		return false;
+	}
+
+	char text[INPUT_CHUNK];
+	size_t len = 0;
+	while(m_input_pos < m_input_len && m_input[m_input_pos] != 10 && m_input[m_input_pos] != 27)
+	{
+		c = m_input[m_input_pos++];
+		if(c == '\t')
+		{
+			// A tab would throw the columns of the line off, it separates arguments just as a blank does
+			text[len++] = ' ';
+		} else if(c >= 32 && c <= 126)
+		{
+			text[len++] = c;
+		}
+	}
+
+	insert_input_text(text, len);
+	update_input_line();
+	return false;
+}
+
+/* Complete the word in front of the cursor from the command names, then from the syntax graph of the remote command,
+no round trip to the device. Whatever is common to all candidates is inserted, the candidates are listed if that is nothing */
+static void complete_input_line(void)
+{
+	if(m_pending.is_pending)
+	{
+		return;
+	}
+
+	char line[MAX_READLINE_LENGTH];
+	memcpy(line, m_buffer, m_cursor);
+	line[m_cursor] = '\0';
+
+	size_t word_start = m_cursor;
+	while(word_start > 0 && !strchr(" \t", line[word_start - 1]))
+	{
+		word_start--;
+	}
+
+	const char *word = &m_buffer[word_start];
+	size_t word_len = m_cursor - word_start;
+
+	// Words before the one being completed, tokenized just like the line will be once entered
+	struct arg_slice slices[MAX_NUM_ARGS];
+	const char *reason = NULL;
+	line[word_start] = '\0';
+	int nr_words = get_args(line, slices, &reason);
+	if(nr_words < 0)
+	{
+		return;
+	}
+
+	char *words[MAX_NUM_ARGS];
+	for(int i = 0; i < nr_words; i++)
+	{
+		words[i] = line + slices[i].offset;
+	}
+
+	struct completion completions[MAX_COMPLETIONS];
+	size_t count = 0;
+	if(nr_words == 0)
+	{
+		count = collect_cmd_completions(word, word_len, completions);
+	} else if(strcmp(words[0], "fanout") == 0)
+	{
+		count = collect_fanout_completions(words, nr_words, word, word_len, completions);
+	} else if(m_active_session != NULL && is_local_cmd(words[0]) < 0)
+	{
+		struct remote_cmd **iter = tfind(words[0], &m_active_session->remote_cmd_tree, compare_cmd_name_in_remotecmd_tree);
+		if(iter != NULL && (*iter)->syntax != NULL)
+		{
+			count = collect_syntax_completions((*iter)->syntax, words + 1, nr_words - 1, word, word_len, completions);
+		}
+	}
+
+	// Longest prefix shared by all insertable candidates, along with a space if there is just one of them
+	size_t num_words = 0;
+	size_t common_len = 0;
+	const struct completion *first = NULL;
+	for(size_t i = 0; i < count; i++)
+	{
+		if(completions[i].is_hint)
+		{
+			continue;
+		}
+
+		if(first == NULL)
+		{
+			first = &completions[i];
+			common_len = first->len;
+		}
+
+		size_t j = 0;
+		while(j < common_len && j < completions[i].len && completions[i].name[j] == first->name[j])
+		{
+			j++;
+		}
+		common_len = j;
+		num_words++;
+	}
+
+	if(first != NULL && common_len > word_len)
+	{
+		insert_input_text(first->name + word_len, common_len - word_len);
+		if(num_words == 1 && count == 1)
+		{
+			insert_input_text(" ", 1);
+		}
+		update_input_line();
+		return;
+	}
+
+	if(num_words == 1 && count == 1)
+	{
+		insert_input_text(" ", 1);
+		update_input_line();
+		return;
+	}
+
+	if(count > 0)
+	{
+		begin_notification();
+		printf("\n");
+		for(size_t i = 0; i < count; i++)
+		{
+			printf("%.*s  ", (int)completions[i].len, completions[i].name);
+		}
+		printf("\n");
+		end_notification();
+	}
+}
+
+/* Local commands, and the ones of the active session */
+static size_t collect_cmd_completions(const char *word, size_t word_len, struct completion *completions)
+{
+	size_t count = 0;
+	for(int i = 0; i < NUM_INTERNAL_CMDS; i++)
+	{
+		if(strncmp(m_local_cmds[i].cmd, word, word_len) == 0)
+		{
+			add_completion(completions, &count, m_local_cmds[i].cmd, strlen(m_local_cmds[i].cmd), false);
+		}
+	}
+
+	for(int i = 0; m_active_session != NULL && i < MAX_REMOTE_CMDS; i++)
+	{
+		const char *cmd = m_active_session->remote_cmds[i].cmd;
+		if(cmd[0] != '\0' && strncmp(cmd, word, word_len) == 0)
+		{
+			add_completion(completions, &count, cmd, strlen(cmd), false);
+		}
+	}
+
+	return count;
+}
+
+/* The remote command of fanout runs on many devices, it is completed from the lists of every open session, prefetched ones included */
+static size_t collect_fanout_completions(char **words, int nr_words, const char *word, size_t word_len, struct completion *completions)
+{
+	int i = 1;
+	while(i < nr_words && strncmp(words[i], "--", 2) == 0)
+	{
+		i += 2;
+	}
+
+	size_t count = 0;
+	for(int s = 0; s < MAX_SESSIONS && i <= nr_words; s++)
+	{
+		const struct remote_session *session = &m_sessions[s];
+		if(!session->is_used || session->state != SESSION_READY)
+		{
+			continue;
+		}
+
+		if(i < nr_words)
+		{
+			// Arguments, from the first device that exported the syntax of that command
+			struct remote_cmd **iter = tfind(words[i], &session->remote_cmd_tree, compare_cmd_name_in_remotecmd_tree);
+			if(iter != NULL && (*iter)->syntax != NULL)
+			{
+				return collect_syntax_completions((*iter)->syntax, words + i + 1, nr_words - i - 1, word, word_len, completions);
+			}
+			continue;
+		}
+
+		for(int j = 0; j < MAX_REMOTE_CMDS; j++)
+		{
+			const char *cmd = session->remote_cmds[j].cmd;
+			if(cmd[0] != '\0' && strncmp(cmd, word, word_len) == 0)
+			{
+				add_completion(completions, &count, cmd, strlen(cmd), false);
+			}
+		}
+	}
+
+	return count;
+}
+
+/* Follow words from the command name node as evaluate_syntax_args() would, but along every matching path at once,
+then offer the children of wherever they lead to */
+static size_t collect_syntax_completions(const struct syntax_graph *graph, char **words, int nr_words, const char *word, size_t word_len, struct completion *completions)
+{
+	uint32_t nodes[MAX_COMPLETIONS] = { 0 };
+	size_t num_nodes = 1;
+	for(int i = 0; i < nr_words && num_nodes > 0; i++)
+	{
+		uint32_t next[MAX_COMPLETIONS];
+		size_t num_next = 0;
+		for(size_t n = 0; n < num_nodes; n++)
+		{
+			const struct syntax_node *node = &graph->nodes[nodes[n]];
+			bool is_literal = false;
+			for(uint32_t c = 0; c < node->num_children && !is_literal; c++)
+			{
+				const struct syntax_node *child = &graph->nodes[node->children[c]];
+				is_literal = (child->flags & CLID_SYNTAX_NODE_ANY_VALUE) == 0 && is_syntax_node_matched(child, words[i], strlen(words[i]));
+			}
+
+			// An exact literal wins over the placeholders, as in GraphNode::getMatchingSubnodes()
+			for(uint32_t c = 0; c < node->num_children && num_next < MAX_COMPLETIONS; c++)
+			{
+				const struct syntax_node *child = &graph->nodes[node->children[c]];
+				bool is_any_value = (child->flags & CLID_SYNTAX_NODE_ANY_VALUE) != 0;
+				if(is_literal ? (!is_any_value && is_syntax_node_matched(child, words[i], strlen(words[i]))) : is_any_value)
+				{
+					size_t k = 0;
+					while(k < num_next && next[k] != node->children[c])
+					{
+						k++;
+					}
+					if(k == num_next)
+					{
+						next[num_next++] = node->children[c];
+					}
+				}
+			}
+		}
+
+		memcpy(nodes, next, num_next * sizeof(uint32_t));
+		num_nodes = num_next;
+	}
+
+	size_t count = 0;
+	bool is_end_offered = false;
+	for(size_t n = 0; n < num_nodes; n++)
+	{
+		const struct syntax_node *node = &graph->nodes[nodes[n]];
+		if(word_len == 0 && !is_end_offered && (node->flags & CLID_SYNTAX_NODE_HANDLER) != 0)
+		{
+			add_completion(completions, &count, "<cr>", 4, true);
+			is_end_offered = true;
+		}
+
+		for(uint32_t c = 0; c < node->num_children; c++)
+		{
+			const struct syntax_node *child = &graph->nodes[node->children[c]];
+			bool is_any_value = (child->flags & CLID_SYNTAX_NODE_ANY_VALUE) != 0;
+			if(is_any_value || (child->name_len >= word_len && memcmp(child->name, word, word_len) == 0))
+			{
+				add_completion(completions, &count, child->name, child->name_len, is_any_value);
+			}
+		}
+	}
+
+	return count;
+}
+
+static void add_completion(struct completion *completions, size_t *count, const char *name, size_t len, bool is_hint)
+{
+	for(size_t i = 0; i < *count; i++)
+	{
+		if(completions[i].len == len && memcmp(completions[i].name, name, len) == 0)
+		{
+			return;
+		}
+	}
+
+	if(*count < MAX_COMPLETIONS)
+	{
+		completions[*count].name = name;
+		completions[*count].len = len;
+		completions[*count].is_hint = is_hint;
+		(*count)++;
+	}
+}
+
+static void submit_input_line(void)
+{
+	if(m_buff_len > 0)
+	{
+		append_history(m_buffer, m_buff_len);
+	}
+	m_hist_browse = m_history.count;
+
+	if(m_pending.is_pending || m_num_queued > 0)
+	{
+		// Pipelined behind the running remote command, clid runs only one job per shell at a time
+		strcpy(m_queued_lines[(m_queued_head + m_num_queued) % MAX_QUEUED_LINES], m_buffer);
+		m_num_queued++;
+	} else
+	{
+		printf("\n");
+		execute_line(m_buffer);
+	}
+
+	m_buff_len = 0;
+	m_cursor = 0;
+	m_buffer[0] = '\0';
+
+	if(!m_pending.is_pending && !m_is_exit)
+	{
+		// Bare prompt, the next key only adds to it
+		print_prompt();
+		m_shown_len = 0;
+		m_shown_cursor = 0;
+		m_is_shown = true;
+	}
+}
+
+/* A remote command only sends its request in here, see handle_exec_reply() for its reply */
+static void execute_line(const char *line)
+{
+	snprintf(m_args_buff, sizeof(m_args_buff), "%s", line);
+
+	struct arg_slice slices[MAX_NUM_ARGS];
+	const char *reason = NULL;
+	m_nr_args = get_args(m_args_buff, slices, &reason);
+	if(m_nr_args < 0)
+	{
+		printf("Invalid command, %s!\n\n", reason);
+		m_nr_args = 0;
+		return;
+	}
+
+	for(int i = 0; i < m_nr_args; i++)
+	{
+		m_args[i] = m_args_buff + slices[i].offset;
+	}
+
+	// A trailing "&" is no argument of the command, it asks for a job instead
+	bool is_background = m_nr_args >= 1 && strcmp(m_args[m_nr_args - 1], "&") == 0;
+	if(is_background)
+	{
+		m_nr_args--;
+	}
+
+	int index = 0;
+	if(m_nr_args >= 1)
+	{
+		if((index = is_local_cmd(m_args[0])) >= 0)
+		{
+			if(is_background)
+			{
+				printf("Only remote commands can run in the background!\n\n");
+				return;
+			}
+			execute_local_cmd(index, m_args);
+		} else if(is_background)
+		{
+			start_job();
+		} else
+		{
+			execute_remote_cmd(false, STDOUT_FILENO, NULL);
+		}
+	}
+}
+
+/* Lines typed while the previous remote command ran, in order, until one of them waits for its reply again */
+static void run_queued_lines(void)
+{
+	while(!m_pending.is_pending && m_num_queued > 0 && !m_is_exit)
+	{
+		char line[MAX_READLINE_LENGTH];
+		strcpy(line, m_queued_lines[m_queued_head]);
+		m_queued_head = (m_queued_head + 1) % MAX_QUEUED_LINES;
+		m_num_queued--;
+
+		// Echoed now, as if it was typed right at this prompt
+		print_prompt();
+		printf("%s\n", line);
+		execute_line(line);
+	}
+
+	if(!m_pending.is_pending && !m_is_exit)
+	{
+		notify_jobs();
+		redraw_input_line();
+		process_input();
+	}
+}
+
+static void print_prompt(void)
+{
+	printf("%s", m_active_session != NULL ? m_active_session->prompt : m_local_prompt);
+}
+
+/* Clear the current line and print prompt and input again, with the cursor where it was.
+Nothing is shown while a remote command runs, what is typed meanwhile comes with the next prompt */
+static void redraw_input_line(void)
+{
+	if(m_pending.is_pending)
+	{
+		return;
+	}
+
+	printf("\33[2K\r");
+	if(m_is_searching)
+	{
+		printf("(%sreverse-i-search)`%s': ", m_is_search_failed ? "failed " : "", m_search_query);
+	} else
+	{
+		print_prompt();
+	}
+	printf("%s", m_buffer);
+	if(m_cursor < m_buff_len)
+	{
+		printf("\033[%zuD", m_buff_len - m_cursor);
+	}
+
+	memcpy(m_shown, m_buffer, m_buff_len);
+	m_shown_len = m_buff_len;
+	m_shown_cursor = m_cursor;
+	m_is_shown = !m_is_searching;
+}
+
+/* Bring the line on the terminal from m_shown to m_buffer with as few bytes as it takes: the cursor goes to the first change,
+then either the rest of the line is written again or only the changed part, with characters inserted or deleted in place,
+whichever is shorter. On a serial console or a slow hop every byte of a redraw is lag */
+static void update_input_line(void)
+{
+	if(m_pending.is_pending)
+	{
+		return;
+	}
+
+	if(!m_is_shown || m_is_searching)
+	{
+		redraw_input_line();
+		return;
+	}
+
+	size_t prefix = 0;
+	while(prefix < m_shown_len && prefix < m_buff_len && m_shown[prefix] == m_buffer[prefix])
+	{
+		prefix++;
+	}
+
+	size_t suffix = 0;
+	while(prefix + suffix < m_shown_len && prefix + suffix < m_buff_len && m_shown[m_shown_len - 1 - suffix] == m_buffer[m_buff_len - 1 - suffix])
+	{
+		suffix++;
+	}
+
+	static char out[3 * MAX_READLINE_LENGTH + 32];
+	size_t len = 0;
+	size_t pos = m_shown_cursor;
+	size_t old_len = m_shown_len - prefix - suffix;
+	size_t new_len = m_buff_len - prefix - suffix;
+	if(old_len > 0 || new_len > 0)
+	{
+		len += encode_cursor_move(out + len, pos, prefix);
+
+		size_t common = old_len < new_len ? old_len : new_len;
+		size_t diff = old_len < new_len ? new_len - old_len : old_len - new_len;
+		size_t rewrite_cost = m_buff_len - prefix + (m_shown_len > m_buff_len ? 3 : 0);
+		size_t edit_cost = new_len + (diff == 0 ? 0 : diff == 1 ? 3 : 3 + (size_t)snprintf(NULL, 0, "%zu", diff));
+		if(rewrite_cost <= edit_cost)
+		{
+			memcpy(out + len, &m_buffer[prefix], m_buff_len - prefix);
+			len += m_buff_len - prefix;
+			if(m_shown_len > m_buff_len)
+			{
+				memcpy(out + len, "\33[K", 3);
+				len += 3;
+			}
+			pos = m_buff_len;
+		} else
+		{
+			memcpy(out + len, &m_buffer[prefix], common);
+			len += common;
+			if(new_len > old_len)
+			{
+				len += encode_csi(out + len, diff, '@');
+				memcpy(out + len, &m_buffer[prefix + common], diff);
+				len += diff;
+			} else if(old_len > new_len)
+			{
+				len += encode_csi(out + len, diff, 'P');
+			}
+			pos = prefix + new_len;
+		}
+	}
+
+	len += encode_cursor_move(out + len, pos, m_cursor);
+	fwrite(out, 1, len, stdout);
+
+	memcpy(m_shown, m_buffer, m_buff_len);
+	m_shown_len = m_buff_len;
+	m_shown_cursor = m_cursor;
+}
+
+/* Backspaces or characters of the line written again if they are fewer bytes than the escape sequence, all of the line up to
+to is the same on the terminal as in m_buffer */
+static size_t encode_cursor_move(char *out, size_t from, size_t to)
+{
+	size_t n = from > to ? from - to : to - from;
+	size_t csi_len = n == 1 ? 3 : 3 + (size_t)snprintf(NULL, 0, "%zu", n);
+	if(n == 0)
+	{
+		return 0;
+	} else if(n > csi_len)
+	{
+		return encode_csi(out, n, from > to ? 'D' : 'C');
+	}
+
+	if(from > to)
+	{
+		memset(out, '\b', n);
+	} else
+	{
+		memcpy(out, &m_buffer[from], n);
+	}
+	return n;
+}
+
+/* '^[' '[' <n> <final>, the count left out if it is 1 */
+static size_t encode_csi(char *out, size_t n, char final)
+{
+	return n == 1 ? (size_t)sprintf(out, "\33[%c", final) : (size_t)sprintf(out, "\33[%zu%c", n, final);
+}
+
+/* Whatever is printed in between shows up above the line being typed */
+static void begin_notification(void)
+{
+	m_is_shown = false;
+	if(!m_pending.is_pending)
+	{
+		printf("\33[2K\r");
+	}
+}
+
+static void end_notification(void)
+{
+	redraw_input_line();
+}
+
+/* Split line into arguments in a single pass and in place: quotes and backslashes are dropped while the line is walked, and each argument
+is '\0'-terminated right where it ends, so that line + offset of its slice is a C string. Nothing is allocated and arguments have no length limit.
+Outside of quotes a backslash takes the next character as is, within "..." only \" and \\ do so, '...' is taken literally.
+Return the number of arguments, or -1 with reason telling what is wrong with the line */
+static int get_args(char *line, struct arg_slice slices[], const char **reason)
+{
+	const char *r = line;
+	char *w = line; // Never ahead of r
+	int nr_args = 0;
+	for(;;)
+	{
+		while(*r == ' ' || *r == '\t')
+		{
+			r++;
+		}
+
+		if(*r == '\0')
+		{
+			return nr_args;
+		}
+
+		if(nr_args == MAX_NUM_ARGS)
+		{
+			*reason = "too many arguments";
+			return -1;
+		}
+
+		char *start = w;
+		char quote = '\0';
+		while(*r != '\0' && (quote != '\0' || (*r != ' ' && *r != '\t')))
+		{
+			if(quote == '\0' && (*r == '\'' || *r == '"'))
+			{
+				quote = *r++;
+			} else if(*r == quote)
+			{
+				quote = '\0';
+				r++;
+			} else if(*r == '\\' && (quote == '\0' || (quote == '"' && (r[1] == '"' || r[1] == '\\'))))
+			{
+				if(r[1] == '\0')
+				{
+					*reason = "trailing backslash";
+					return -1;
+				}
+
+				r++;
+				*w++ = *r++;
+			} else
+			{
+				*w++ = *r++;
+			}
+		}
+
+		if(quote != '\0')
+		{
+			*reason = "unterminated quote";
+			return -1;
+		}
+
+		// Step over the separator before it may be overwritten by the '\0'
+		if(*r != '\0')
+		{
+			r++;
+		}
+
+		slices[nr_args].offset = (uint32_t)(start - line);
+		slices[nr_args].len = (uint32_t)(w - start);
+		*w++ = '\0';
+		nr_args++;
+	}
+}
+
+static int is_local_cmd(char *str)
+{
+	int i = 0;
+	while(i < NUM_INTERNAL_CMDS)
+	{
+		if(strcmp(str,m_local_cmds[i].cmd) == 0)
+		{
+			return i;
+		}
+		
+		i++;
+	}
+
+	return -1;
+}
+
+void execute_local_cmd(int index, char **args)
+{
+	if(m_local_cmds[index].handler == NULL)
+	{
+		printf("Handler for command %s not found!\n", m_local_cmds[index].cmd);
+		return;
+	}
+
+	m_local_cmds[index].handler(args);
+}
+
+static bool setup_local_cmds(void)
+{
+	strcpy(m_local_cmds[0].cmd, "help");
+	m_local_cmds[0].handler = &local_help;
+	strcpy(m_local_cmds[0].description, "List all local and remote commands, respective syntaxes and description.");
+	strcpy(m_local_cmds[0].syntax, "help");
+
+	strcpy(m_local_cmds[1].cmd, "exit");
+	m_local_cmds[1].handler = &local_exit;
+	strcpy(m_local_cmds[1].description, "Disconnect from remote device and exit current shell.");
+	strcpy(m_local_cmds[1].syntax, "exit");
+
+	strcpy(m_local_cmds[2].cmd, "history");
+	m_local_cmds[2].handler = &local_history;
+	strcpy(m_local_cmds[2].description, "List the last <n> commands of the history shared by all shells, 50 by default. Ctrl-R searches it.");
+	strcpy(m_local_cmds[2].syntax, "history [ <n> ]");
+
+	strcpy(m_local_cmds[3].cmd, "scan");
+	m_local_cmds[3].handler = &local_scan;
+	strcpy(m_local_cmds[3].description, "Scan remote devices being active.");
+	strcpy(m_local_cmds[3].syntax, "scan");
+	
+	strcpy(m_local_cmds[4].cmd, "connect");
+	m_local_cmds[4].handler = &local_connect;
+	strcpy(m_local_cmds[4].description, "Connect to remote device via an index returned by scan command, earlier sessions stay open.");
+	strcpy(m_local_cmds[4].syntax, "connect { --idx <index> | --ip <ip> | --least-busy [ <pat> ] }");
+	
+	strcpy(m_local_cmds[5].cmd, "disconnect");
+	m_local_cmds[5].handler = &local_disconnect;
+	strcpy(m_local_cmds[5].description, "Disconnect from the remote device of the current session.");
+	strcpy(m_local_cmds[5].syntax, "disconnect");
+
+	strcpy(m_local_cmds[6].cmd, "time");
+	m_local_cmds[6].handler = &local_time;
+	strcpy(m_local_cmds[6].description, "Execute a remote command and print where its time was spent.");
+	strcpy(m_local_cmds[6].syntax, "time <remote_cmd> [ <args> ]");
+
+	strcpy(m_local_cmds[7].cmd, "fanout");
+	m_local_cmds[7].handler = &local_fanout;
+	strcpy(m_local_cmds[7].description, "Execute a remote command on all scanned devices at once, or on those whose hostname or ip contains <pat>.");
+	strcpy(m_local_cmds[7].syntax, "fanout [ --host <pat> ] [ --jobs <n> ] <remote_cmd> [ <args> ]");
+
+	strcpy(m_local_cmds[8].cmd, "sessions");
+	m_local_cmds[8].handler = &local_sessions;
+	strcpy(m_local_cmds[8].description, "List remote devices currently connected to, the current one is marked with '*', prefetched ones with 'p'.");
+	strcpy(m_local_cmds[8].syntax, "sessions");
+
+	strcpy(m_local_cmds[9].cmd, "use");
+	m_local_cmds[9].handler = &local_use;
+	strcpy(m_local_cmds[9].description, "Switch to an open session, by its index in sessions, its ip or its hostname.");
+	strcpy(m_local_cmds[9].syntax, "use { <index> | <ip> | <hostname> }");
+
+	strcpy(m_local_cmds[10].cmd, "save");
+	m_local_cmds[10].handler = &local_save;
+	strcpy(m_local_cmds[10].description, "Execute a remote command and write its output to <file> while it is received.");
+	strcpy(m_local_cmds[10].syntax, "save <file> <remote_cmd> [ <args> ]");
+
+	strcpy(m_local_cmds[11].cmd, "pager");
+	m_local_cmds[11].handler = &local_pager;
+	strcpy(m_local_cmds[11].description, "Stop outputs longer than the terminal at --More--: space for a page, enter for a line, q for no more.");
+	strcpy(m_local_cmds[11].syntax, "pager { on | off }");
+
+	strcpy(m_local_cmds[12].cmd, "prefetch");
+	m_local_cmds[12].handler = &local_prefetch;
+	strcpy(m_local_cmds[12].description, "Keep up to <budget> connections to scanned devices open in the background, connect to them is then instant.");
+	strcpy(m_local_cmds[12].syntax, "prefetch { on [ <budget> ] | off }");
+
+	strcpy(m_local_cmds[13].cmd, "jobs");
+	m_local_cmds[13].handler = &local_jobs;
+	strcpy(m_local_cmds[13].description, "List remote commands run in the background with a trailing '&', running or with their output kept for fg.");
+	strcpy(m_local_cmds[13].syntax, "jobs");
+
+	strcpy(m_local_cmds[14].cmd, "fg");
+	m_local_cmds[14].handler = &local_fg;
+	strcpy(m_local_cmds[14].description, "Show the output of a job, the latest one by default, and wait for the rest of it. Ctrl-C leaves it running in the background.");
+	strcpy(m_local_cmds[14].syntax, "fg [ <id> ]");
+
+	strcpy(m_local_cmds[15].cmd, "wait");
+	m_local_cmds[15].handler = &local_wait;
+	strcpy(m_local_cmds[15].description, "Wait until a job, or every job, is done. Ctrl-C stops waiting, the jobs keep running.");
+	strcpy(m_local_cmds[15].syntax, "wait [ <id> ]");
+
+	strcpy(m_local_cmds[16].cmd, "kill");
+	m_local_cmds[16].handler = &local_kill;
+	strcpy(m_local_cmds[16].description, "Give up on a job, the latest one by default, and drop its output.");
+	strcpy(m_local_cmds[16].syntax, "kill [ <id> ]");
+
+	return true;
+}
+
+static bool local_help(char **args)
+{
+	(void)args;
+
+	if(m_nr_args > 1)
+	{
+		printf("help: Too many arguments!\n\n");
+		return false;
+	}
+
+	printf("%-64s %-128s\n", "Syntax", "Description");
+	printf("%-64s %-128s\n", "------", "-----------");
+	for(int i = 0; i < NUM_INTERNAL_CMDS; i++)
+	{
+		printf("%-64s %-128s\n", m_local_cmds[i].syntax, m_local_cmds[i].description);
+	}
+	for(int i = 0; m_active_session != NULL && i < MAX_REMOTE_CMDS; i++)
+	{
+		if(m_active_session->remote_cmds[i].cmd[0] != '\0')
+		{
+			printf("%-64s %-128s\n", m_active_session->remote_cmds[i].cmd, m_active_session->remote_cmds[i].description);
+		}
+	}
+	printf("\n");
+
+	printf("Syntax Explanation:\n");
+	printf("%-20s %-128s\n", "Syntax Form", "Meaning");
+	printf("%-20s %-128s\n", "-----------", "-------");
+	printf("%-20s %-128s\n", "abc", "string literal value");
+	printf("%-20s %-128s\n", "<abc>", "any value");
+	printf("%-20s %-128s\n", "{ abc | def }", "alternative values");
+	printf("%-20s %-128s\n", "[ abc ]", "optional value");
+	printf("%-20s %-128s\n", "[ abc | def ]", "optional alternative values, simplified form of [ { abc | def } ]");
+	printf("\n");
+
+	return true;
+}
+
+static bool local_exit(char **args)
+{
+	(void)args;
+
+	printf("Exiting the shell...\n");
+
+	if(m_nr_args > 1)
+	{
+		printf("exit: Too many arguments!\n\n");
+		return false;
+	}
+
+	printf("Exited the shell successfully!\n\n");
+	m_is_exit = true;
+	return true;
+}
+
+static bool local_history(char **args)
+{
+	if(m_nr_args > 2)
+	{
+		printf("history: Too many arguments!\n\n");
+		return false;
+	}
+
+	int num = m_nr_args == 2 ? atoi(args[1]) : HISTORY_LIST_DEFAULT;
+	if(num <= 0)
+	{
+		printf("history: Invalid number of entries %s!\n\n", args[1]);
+		return false;
+	}
+
+	sync_history();
+	uint32_t id = m_history.count - m_history.first > (uint32_t)num ? m_history.count - num : m_history.first;
+
+	printf("%-7s %-128s\n", "Index", "Command");
+	printf("%-7s %-128s\n", "-----", "-------");
+	for(; id < m_history.count; id++)
+	{
+		uint32_t len = 0;
+		const char *text = get_history_text(id, &len);
+		printf("%-7u %.*s\n", id - m_history.first + 1, (int)len, text);
+	}
+	printf("\n");
+
+	return true;
+}
+
+static bool local_scan(char **args)
+{
+	(void)args;
+
+	if(m_nr_args > 1)
+	{
+		printf("scan: Too many arguments!\n\n");
+		return false;
+	}
+
+	probe_remote_hosts();
+	wait_probe_replies();
+
+	printf("%-10s %-64s %-25s %-7s %-7s %-7s\n", "Unique ID", "Hostname", "IP Address", "Port", "Shells", "Jobs");
+	printf("%-10s %-64s %-25s %-7s %-7s %-7s\n", "---------", "--------", "----------", "----", "------", "----");
+	MUTEX_LOCK(&m_remote_hosts_mtx);
+	for(int i = 0; i < MAX_NUM_REMOTE_HOSTS; i++)
+	{
+		if(strcmp(m_remote_hosts[i].hostname, "") != 0)
+		{
+			char index[5];
+			char port[7];
+			sprintf(index, "%d", i + 1);
+			sprintf(port, "%hu", TCP_CLID_PORT);
+
+			// Only clid's own beacon tells the load, "-" for devices heard of by the ITCGW broadcast only
+			char clients[7] = "-";
+			char jobs[7] = "-";
+			if(m_remote_hosts[i].has_load)
+			{
+				sprintf(clients, "%hu", m_remote_hosts[i].active_clients);
+				sprintf(jobs, "%hu", m_remote_hosts[i].jobs_in_flight);
+			}
+			printf("%-10s %-64s %-25s %-7s %-7s %-7s\n", index, m_remote_hosts[i].hostname, m_remote_hosts[i].ip, port, clients, jobs);
+		}
+	}
+	MUTEX_UNLOCK(&m_remote_hosts_mtx);
+	printf("\n");
+
+	return true;
+}
+
+static bool local_connect(char **args)
+{
+	char ipaddr[25];
+	
+	if(m_nr_args == 2 && strcmp(args[1], "--least-busy") == 0)
+	{
+		args[2] = NULL;
+	} else if(m_nr_args != 3)
+	{
+		printf("scan: Invalid number of arguments!\n\n");
+		return false;
+	}
+
+	if(strcmp(args[1], "--least-busy") == 0)
+	{
+		wait_probe_replies();
+		if(!find_least_busy_host(args[2], ipaddr))
+		{
+			printf("No scanned device %s%s tells its load, is its clid too old to send a beacon?\n\n", args[2] ? "matching " : "", args[2] ? args[2] : "");
+			return false;
+		}
+		printf ("Connecting to least busy device %s ...\n", ipaddr);
+	} else if(strcmp(args[1], "--idx") == 0)
+	{
+		int index = atoi(args[2]);
+
+		if(index != 0)
+		{
+			wait_probe_replies();
+			MUTEX_LOCK(&m_remote_hosts_mtx);
+			if(index < 0 || index > MAX_NUM_REMOTE_HOSTS)
+			{
+				MUTEX_UNLOCK(&m_remote_hosts_mtx);
+				printf("Index %d out of range!\n", index);
+				return false;
+			} else if(strcmp(m_remote_hosts[index - 1].ip, "0.0.0.0") == 0)
+			{
+				MUTEX_UNLOCK(&m_remote_hosts_mtx);
+				printf("Remote host for index %d not found in scan table!\n", index);
+				return false;
+			}
+
+			// The udp thread may drop the host any time, keep our own copy of its ip
+			strcpy(ipaddr, m_remote_hosts[index - 1].ip);
+			MUTEX_UNLOCK(&m_remote_hosts_mtx);
+			printf ("Connecting to device via index %d ...\n", index);
+		} else
+		{
+			printf("scan: Unknown argument %s!\n\n", args[2]);
+			return false;
+		}
+	} else if(strcmp(args[1], "--ip") == 0)
+	{
+		snprintf(ipaddr, sizeof(ipaddr), "%s", args[2]);
+		printf ("Connecting to device via ipaddr %s ...\n", ipaddr);
+	} else
+	{
+		printf ("Error: Unknown option: %s\n", args[1]);
+		return false;
+	}
+
+	struct remote_session *session = connect_to_remote_host_via_ipaddr(ipaddr);
+	if(session == NULL)
+	{
+		printf("\n");
+		return false;
+	}
+
+	m_active_session = session;
+	send_v2_get_syntax_request(session, NULL, 0);
+
+	printf("\n");
+	return true;
+}
+
+static bool local_disconnect(char **args)
+{
+	(void)args;
+
+	if(m_active_session == NULL)
+	{
+		printf("disconnect: Not connected to any remote device!\n\n");
+		return false;
+	}
+
+	printf("Disconnecting from remote device...\n");
+	close_session(m_active_session);
+
+	printf("Disconnected from remote device successfully!\n\n");
+	return true;
+}
+
+static bool local_time(char **args)
+{
+	if(m_nr_args < 2)
+	{
+		printf("time: Missing command!\n\n");
+		return false;
+	}
+
+	if(is_local_cmd(args[1]) >= 0)
+	{
+		printf("time: Only remote commands can be timed!\n\n");
+		return false;
+	}
+
+	// Drop "time" itself, the remote command is then sent exactly as if it was typed alone
+	memmove(&args[0], &args[1], (m_nr_args - 1) * sizeof(char *));
+	m_nr_args--;
+	args[m_nr_args] = NULL;
+
+	execute_remote_cmd(true, STDOUT_FILENO, NULL);
+	return true;
+}
+
+static bool local_save(char **args)
+{
+	if(m_nr_args < 3)
+	{
+		printf("save: Missing file or command!\n\n");
+		return false;
+	}
+
+	if(is_local_cmd(args[2]) >= 0)
+	{
+		printf("save: Only the output of remote commands can be saved!\n\n");
+		return false;
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s", args[1]);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0)
+	{
+		printf("save: Failed to open %s, errno = %d!\n\n", path, errno);
+		return false;
+	}
+
+	// Drop "save <file>", the remote command is then sent exactly as if it was typed alone
+	memmove(&args[0], &args[2], (m_nr_args - 2) * sizeof(char *));
+	m_nr_args -= 2;
+	args[m_nr_args] = NULL;
+
+	execute_remote_cmd(false, fd, path);
+	return true;
+}
+
+static bool local_pager(char **args)
+{
+	if(m_nr_args != 2 || (strcmp(args[1], "on") != 0 && strcmp(args[1], "off") != 0))
+	{
+		printf("Usage: pager { on | off }\n\n");
+		return false;
+	}
+
+	m_is_pager_on = strcmp(args[1], "on") == 0;
+	printf("Pager is %s\n\n", m_is_pager_on ? "on, outputs longer than the terminal stop at --More--" : "off");
+	return true;
+}
+
+static bool local_fanout(char **args)
+{
+	const char *pattern = NULL;
+	int jobs = FANOUT_DEFAULT_JOBS;
+	int i = 1;
+	while(i < m_nr_args && strncmp(args[i], "--", 2) == 0)
+	{
+		if(i + 1 >= m_nr_args)
+		{
+			printf("fanout: Missing value of %s!\n\n", args[i]);
+			return false;
+		} else if(strcmp(args[i], "--host") == 0)
+		{
+			pattern = args[i + 1];
+		} else if(strcmp(args[i], "--jobs") == 0)
+		{
+			jobs = atoi(args[i + 1]);
+			if(jobs < 1 || jobs > FANOUT_MAX_JOBS)
+			{
+				printf("fanout: --jobs must be within 1 and %d!\n\n", FANOUT_MAX_JOBS);
+				return false;
+			}
+		} else
+		{
+			printf("fanout: Unknown option %s!\n\n", args[i]);
+			return false;
+		}
+
+		i += 2;
+	}
+
+	if(i >= m_nr_args || is_local_cmd(args[i]) >= 0)
+	{
+		printf("fanout: Missing remote command!\n\n");
+		return false;
+	}
+
+	struct fanout_host *hosts = calloc(MAX_NUM_REMOTE_HOSTS, sizeof(struct fanout_host));
+	if(hosts == NULL)
+	{
+		printf("Failed to calloc fan-out hosts!\n");
+		return false;
+	}
+
+	wait_probe_replies();
+	size_t count = collect_fanout_hosts(pattern, hosts);
+	if(count == 0)
+	{
+		printf("fanout: No scanned device %s%s!\n\n", pattern ? "matches " : "found", pattern ? pattern : "");
+		free(hosts);
+		return false;
+	}
+
+	struct fanout fanout = { .hosts = hosts, .count = count, .nr_args = m_nr_args - i, .args = (const char *const *)&args[i] };
+	for(size_t j = 0; j < count; j++)
+	{
+		hosts[j].fanout = &fanout;
+	}
+
+	printf("Executing remote command %s on %zu devices, %d at once...\n", args[i], count, jobs);
+	uint64_t start_ns = get_time_ns();
+	run_fanout(&fanout, jobs);
+	print_fanout_results(hosts, count);
+	printf("%zu devices in %.1f ms\n\n", count, (double)(get_time_ns() - start_ns) / 1000000);
+
+	for(size_t j = 0; j < count; j++)
+	{
+		free(hosts[j].output);
+	}
+	free(hosts);
+
+	return true;
+}
+
+static bool local_sessions(char **args)
+{
+	(void)args;
+
+	if(m_nr_args > 1)
+	{
+		printf("sessions: Too many arguments!\n\n");
+		return false;
+	}
+
+	printf("%-3s %-10s %-64s %-25s %-8s %-8s\n", "", "Index", "Hostname", "IP Address", "Protocol", "Commands");
+	printf("%-3s %-10s %-64s %-25s %-8s %-8s\n", "", "-----", "--------", "----------", "--------", "--------");
+	for(int i = 0; i < MAX_SESSIONS; i++)
+	{
+		struct remote_session *session = &m_sessions[i];
+		if(!session->is_used || session->state != SESSION_READY)
+		{
+			continue;
+		}
+
+		int num_cmds = 0;
+		for(int j = 0; j < MAX_REMOTE_CMDS; j++)
+		{
+			if(session->remote_cmds[j].cmd[0] != '\0')
+			{
+				num_cmds++;
+			}
+		}
+
+		char index[8];
+		char proto[8];
+		char cmds[8];
+		snprintf(index, sizeof(index), "%d", i + 1);
+		snprintf(proto, sizeof(proto), "v%hhu", session->proto);
+		snprintf(cmds, sizeof(cmds), "%d", num_cmds);
+		printf("%-3s %-10s %-64s %-25s %-8s %-8s\n", session == m_active_session ? "*" : session->is_prefetched ? "p" : "", index,
+			session->hostname[0] != '\0' ? session->hostname : "-", session->ip, proto, cmds);
+	}
+	printf("\n");
+
+	return true;
+}
+
+/* Nothing goes over the network here, the session and its command list are already there */
+static bool local_use(char **args)
+{
+	if(m_nr_args != 2)
+	{
+		printf("use: Invalid number of arguments!\n\n");
+		return false;
+	}
+
+	struct remote_session *session = find_session(args[1]);
+	if(session == NULL)
+	{
+		printf("use: No open session to %s, see sessions!\n\n", args[1]);
+		return false;
+	}
+
+	m_active_session = session;
+	if(session->is_prefetched)
+	{
+		session->is_prefetched = false;
+		touch_cmd_cache(session->ip);
+	}
+	printf("Switched to device: tcp://%s:%d\n\n", session->ip, TCP_CLID_PORT);
+	return true;
+}
+
+/* Connections are opened by the main loop as devices show up in the scan table, see start_prefetches() */
+static bool local_prefetch(char **args)
+{
+	int budget = PREFETCH_DEFAULT_BUDGET;
+	if(m_nr_args == 3 && strcmp(args[1], "on") == 0)
+	{
+		budget = atoi(args[2]);
+		if(budget < 1 || budget > MAX_SESSIONS - 1)
+		{
+			printf("prefetch: <budget> must be within 1 and %d!\n\n", MAX_SESSIONS - 1);
+			return false;
+		}
+	} else if(m_nr_args != 2 || (strcmp(args[1], "on") != 0 && strcmp(args[1], "off") != 0))
+	{
+		printf("Usage: prefetch { on [ <budget> ] | off }\n\n");
+		return false;
+	}
+
+	if(strcmp(args[1], "off") == 0)
+	{
+		stop_prefetches();
+		printf("Prefetch is off, background connections are closed\n\n");
+		return true;
+	}
+
+	m_prefetch_budget = budget;
+	m_prefetch_scan_ns = 0;
+	printf("Prefetch is on, up to %d devices are connected to in the background\n\n", budget);
+	return true;
+}
+
+static bool local_jobs(char **args)
+{
+	(void)args;
+
+	if(m_nr_args > 1)
+	{
+		printf("jobs: Too many arguments!\n\n");
+		return false;
+	}
+
+	printf("%-6s %-32s %-10s %-12s %-25s %s\n", "Id", "Status", "Elapsed", "Bytes", "IP Address", "Command");
+	printf("%-6s %-32s %-10s %-12s %-25s %s\n", "--", "------", "-------", "-----", "----------", "-------");
+	uint64_t now = get_time_ns();
+	for(int i = 0; i < MAX_JOBS; i++)
+	{
+		struct bg_job *job = &m_jobs[i];
+		if(!job->is_used)
+		{
+			continue;
+		}
+
+		char id[16];
+		char elapsed[16];
+		char bytes[24];
+		snprintf(id, sizeof(id), "[%d]", job->id);
+		snprintf(elapsed, sizeof(elapsed), "%.1f s", (double)((job->state == JOB_DONE ? job->finished_ns : now) - job->started_ns) / 1000000000);
+		snprintf(bytes, sizeof(bytes), "%llu", (unsigned long long)job->spool_len);
+		printf("%-6s %-32s %-10s %-12s %-25s %s\n", id, job->status, elapsed, bytes, job->ip, job->cmdline);
+
+		// Listed, no need to tell above the next prompt too
+		job->is_notified = job->state == JOB_DONE;
+	}
+	printf("\n");
+
+	return true;
+}
+
+/* The job becomes the pending command: its spool is shown as if the output arrived right now, the rest streams in as usual.
+A finished job is gone once shown, its output was kept for this only */
+static bool local_fg(char **args)
+{
+	if(m_nr_args > 2)
+	{
+		printf("fg: Too many arguments!\n\n");
+		return false;
+	}
+
+	struct bg_job *job = find_job(m_nr_args == 2 ? args[1] : NULL);
+	if(job == NULL)
+	{
+		if(m_nr_args == 2)
+		{
+			printf("fg: No such job %s, see jobs!\n\n", args[1]);
+		} else
+		{
+			printf("fg: No jobs!\n\n");
+		}
+		return false;
+	}
+
+	printf("[%d] %s  %s\n", job->id, job->status, job->cmdline);
+	start_cmd_output(STDOUT_FILENO, NULL);
+	m_pending.is_pending = true;
+	m_pending.session = NULL;
+	m_pending.request = NULL;
+	m_pending.job = job;
+	m_pending.is_timed = false;
+	m_pending.timing.is_valid = false;
+	m_pending.sent_ns = job->started_ns;
+
+	if(job->has_reply)
+	{
+		printf("Re-interpret TCP packet: errorcode: %u\n", job->errorcode);
+		printf("Re-interpret TCP packet: result: %u\n", job->result);
+		printf("Re-interpret TCP packet: cmd_output:\n");
+	}
+
+	static char chunk[OUTPUT_BUFF_SIZE];
+	for(uint64_t pos = 0; pos < job->spool_len && !m_output.is_quit;)
+	{
+		size_t n = job->spool_len - pos < sizeof(chunk) ? job->spool_len - pos : sizeof(chunk);
+		if(pread(fileno(job->spool), chunk, n, (off_t)pos) != (ssize_t)n)
+		{
+			printf("Failed to read job spool, errno = %d!\n", errno);
+			break;
+		}
+		write_cmd_output(chunk, n);
+		pos += n;
+	}
+
+	if(job->state == JOB_DONE)
+	{
+		remove_job(job);
+		complete_cmd_output();
+	}
+	return true;
+}
+
+/* The prompt is back once they are done, or on Ctrl-C without giving up on any of them */
+static bool local_wait(char **args)
+{
+	if(m_nr_args > 2)
+	{
+		printf("wait: Too many arguments!\n\n");
+		return false;
+	}
+
+	struct bg_job *job = NULL;
+	if(m_nr_args == 2 && (job = find_job(args[1])) == NULL)
+	{
+		printf("wait: No such job %s, see jobs!\n\n", args[1]);
+		return false;
+	}
+
+	for(;;)
+	{
+		bool is_running = false;
+		for(int i = 0; i < MAX_JOBS && !is_running; i++)
+		{
+			is_running = m_jobs[i].is_used && m_jobs[i].state == JOB_RUNNING && (job == NULL || job == &m_jobs[i]);
+		}
+
+		if(!is_running)
+		{
+			break;
+		}
+
+		if(!wait_client())
+		{
+			printf("wait: Interrupted, the jobs keep running!\n\n");
+			return false;
+		}
+	}
+
+	notify_jobs();
+	printf("\n");
+	return true;
+}
+
+/* A running job is cancelled on clid's side too, a finished one only loses the output fg would show */
+static bool local_kill(char **args)
+{
+	if(m_nr_args > 2)
+	{
+		printf("kill: Too many arguments!\n\n");
+		return false;
+	}
+
+	struct bg_job *job = find_job(m_nr_args == 2 ? args[1] : NULL);
+	if(job == NULL)
+	{
+		if(m_nr_args == 2)
+		{
+			printf("kill: No such job %s, see jobs!\n\n", args[1]);
+		} else
+		{
+			printf("kill: No jobs!\n\n");
+		}
+		return false;
+	}
+
+	printf("[%d] %s  %s\n\n", job->id, job->state == JOB_DONE ? "Removed" : "Killed", job->cmdline);
+	remove_job(job);
+	return true;
+}
+
+static bool setup_udp_server(void)
+{
+	m_udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(m_udp_fd < 0)
+	{
+		printf("Failed to create UDP socket(), errno = %d!\n", errno);
+		return false;
+	}
+
+	int broadcast_opt = 1;
+	int res = setsockopt(m_udp_fd, SOL_SOCKET, SO_BROADCAST, &broadcast_opt, sizeof(int));
+	if(res < 0)
+	{
+		printf("Failed to setsockopt() SO_BROADCAST, errno = %d!\n", errno);
+		close(m_udp_fd);
+		return false;
+	}
+
+	res = setsockopt(m_udp_fd, SOL_SOCKET, SO_REUSEADDR, &broadcast_opt, sizeof(int));
+	if(res < 0)
+	{
+		printf("Failed to setsockopt() SO_REUSEADDR, errno = %d!\n", errno);
+		close(m_udp_fd);
+		return false;
+	}
+
+	// Best effort, the default is too small for a lab of boards that happen to broadcast at once
+	int rcvbuf_size = UDP_RCVBUF_SIZE;
+	if(setsockopt(m_udp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf_size, sizeof(int)) < 0)
+	{
+		printf("Failed to setsockopt() SO_RCVBUF, errno = %d!\n", errno);
+	}
+
+	struct sockaddr_in myUDPaddr;
+	size_t size = sizeof(struct sockaddr_in);
+	memset(&myUDPaddr, 0, size);
+	myUDPaddr.sin_family = AF_INET;
+	myUDPaddr.sin_addr.s_addr = INADDR_ANY;
+	myUDPaddr.sin_port = htons(UDP_BROADCAST_PORT);
+
+	res = bind(m_udp_fd, (struct sockaddr *)((void *)&myUDPaddr), size);
+	if(res < 0)
+	{
+		printf("Failed to bind(), errno = %d!\n", errno);
+		close(m_udp_fd);
+		return false;
+	}
+
+	// printf("Setup my UDP successfully on %s:%d\n", inet_ntoa(myUDPaddr.sin_addr), ntohs(myUDPaddr.sin_port));
+	return true;
+}
+
+static bool setup_udp_thread(void)
+{
+	int res = pthread_mutex_init(&m_remote_hosts_mtx, NULL);
+	if(res != 0)
+	{
+		printf("Failed to pthread_mutex_init server, error code = %d\n", res);
+		return false;
+	}
+	
+	res = pthread_mutex_init(&m_udp_thread_mtx, NULL);
+	if(res != 0)
+	{
+		printf("Failed to pthread_mutex_init server, error code = %d\n", res);
+		return false;
+	}
+
+	MUTEX_LOCK(&m_udp_thread_mtx);
+	res = pthread_create(&m_udp_thread_id, NULL, udp_loop, NULL);
+	if(res != 0)
+	{
+		printf("Failed to pthread_create, error code = %d\n", res);
+		return false;
+	}
+	MUTEX_LOCK(&m_udp_thread_mtx);
+	MUTEX_UNLOCK(&m_udp_thread_mtx);
+
+	return true;
+}
+
+static void* udp_loop(void *data)
+{
+	(void)data;
+
+	setup_udp_remote_hosts();
+
+	MUTEX_UNLOCK(&m_udp_thread_mtx);
+	while(!m_is_exit)
+	{
+		// The wheel needs a look once a second at most, and not at all while nothing was scanned
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		MUTEX_LOCK(&m_remote_hosts_mtx);
+		int timeout_ms = m_num_remote_hosts == 0 ? -1 : 1000 - (int)(now.tv_nsec / 1000000);
+		MUTEX_UNLOCK(&m_remote_hosts_mtx);
+
+		struct pollfd pfd = { .fd = m_udp_fd, .events = POLLIN };
+		int res = poll(&pfd, 1, timeout_ms);
+		if(res < 0 && errno != EINTR)
+		{
+			printf("Failed to poll() in UDP discovery loop, errno = %d!\n", errno);
+			return NULL;
+		}
+
+		if(res > 0 && handle_receive_broadcast_msg(m_udp_fd) == false)
+		{
+			printf("Failed to handle_receive_broadcast_msg()!\n");
+			return NULL;
+		}
+
+		MUTEX_LOCK(&m_remote_hosts_mtx);
+		advance_alive_wheel(get_alive_tick());
+		MUTEX_UNLOCK(&m_remote_hosts_mtx);
+	}
+
+	close(m_udp_fd);
+	return NULL;
+}
+
+/* Take whatever beacons are queued, a batch at a time, and update the scan table once per batch */
+static bool handle_receive_broadcast_msg(int sockfd)
+{
+	static char buffs[BEACON_BATCH][MAX_BEACON_SIZE];
+	struct iovec iovs[BEACON_BATCH];
+	struct mmsghdr msgs[BEACON_BATCH];
+
+	for(int i = 0; i < BEACON_BATCH; i++)
+	{
+		iovs[i].iov_base = buffs[i];
+		iovs[i].iov_len = MAX_BEACON_SIZE;
+	}
+
+	int res = BEACON_BATCH;
+	while(res == BEACON_BATCH)
+	{
+		memset(msgs, 0, sizeof(msgs));
+		for(int i = 0; i < BEACON_BATCH; i++)
+		{
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		res = recvmmsg(sockfd, msgs, BEACON_BATCH, MSG_DONTWAIT, NULL);
+		if(res < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			{
+				return true;
+			}
+
+			printf("Failed to recvmmsg(), errno = %d!\n", errno);
+			return false;
+		}
+
+		uint64_t tick = get_alive_tick();
+		MUTEX_LOCK(&m_remote_hosts_mtx);
+		for(int i = 0; i < res; i++)
+		{
+			struct clid_beacon beacon;
+			if(clid_is_beacon((const uint8_t *)buffs[i], msgs[i].msg_len))
+			{
+				char tcp_ip[INET_ADDRSTRLEN];
+				if(clid_beacon_decode((const uint8_t *)buffs[i], msgs[i].msg_len, &beacon)
+					&& inet_ntop(AF_INET, &beacon.tcp_ip, tcp_ip, sizeof(tcp_ip)) != NULL)
+				{
+					update_remote_host(beacon.hostname, tcp_ip, &beacon, tick);
+				}
+				continue;
+			}
+
+			char hostname[MAX_HOST_NAME_LENGTH];
+			char tcp_ip[25];
+			if(parse_beacon(buffs[i], msgs[i].msg_len, hostname, tcp_ip))
+			{
+				update_remote_host(hostname, tcp_ip, NULL, tick);
+			}
+		}
+		MUTEX_UNLOCK(&m_remote_hosts_mtx);
+	}
+
+	return true;
+}
+
+/* Ask every clid on the networks of this host for its beacon now, rather than at its next broadcast */
+static void probe_remote_hosts(void)
+{
+	uint8_t probe[CLID_PROBE_SIZE];
+	size_t len = clid_probe_encode(probe);
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(CLID_PROBE_PORT);
+
+	// The limited broadcast would only leave through the interface of the default route
+	int num_sent = 0;
+	struct ifaddrs *ifaddrs = NULL;
+	if(getifaddrs(&ifaddrs) == 0)
+	{
+		for(struct ifaddrs *ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next)
+		{
+			if(ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET || !(ifa->ifa_flags & IFF_BROADCAST)
+				|| !(ifa->ifa_flags & IFF_UP) || ifa->ifa_broadaddr == NULL)
+			{
+				continue;
+			}
+
+			addr.sin_addr = ((struct sockaddr_in *)(void *)ifa->ifa_broadaddr)->sin_addr;
+			num_sent += sendto(m_udp_fd, probe, len, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == (ssize_t)len ? 1 : 0;
+		}
+		freeifaddrs(ifaddrs);
+	}
+
+	if(num_sent == 0)
+	{
+		addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+		sendto(m_udp_fd, probe, len, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+	}
+
+	m_probe_sent_ns = get_time_ns();
+}
+
+/* Give the answers to the last probe the time to come in, if the probe is that recent */
+static void wait_probe_replies(void)
+{
+	uint64_t elapsed_ns = get_time_ns() - m_probe_sent_ns;
+	if(m_probe_sent_ns != 0 && elapsed_ns < (uint64_t)PROBE_WAIT_MS * 1000000)
+	{
+		usleep((useconds_t)(((uint64_t)PROBE_WAIT_MS * 1000000 - elapsed_ns) / 1000));
+	}
+}
+
+/* Among the scanned devices whose hostname or ip contains pattern (any if NULL), the one with the fewest jobs in flight, then shells */
+static bool find_least_busy_host(const char *pattern, char *ip)
+{
+	int best = NO_REMOTE_HOST;
+	MUTEX_LOCK(&m_remote_hosts_mtx);
+	for(int i = 0; i < MAX_NUM_REMOTE_HOSTS; i++)
+	{
+		const struct remote_host_info *host = &m_remote_hosts[i];
+		if(host->hostname[0] == '\0' || !host->has_load)
+		{
+			continue;
+		}
+
+		if(pattern != NULL && strstr(host->hostname, pattern) == NULL && strstr(host->ip, pattern) == NULL)
+		{
+			continue;
+		}
+
+		if(best == NO_REMOTE_HOST || host->jobs_in_flight < m_remote_hosts[best].jobs_in_flight
+			|| (host->jobs_in_flight == m_remote_hosts[best].jobs_in_flight && host->active_clients < m_remote_hosts[best].active_clients))
+		{
+			best = i;
+		}
+	}
+
+	if(best != NO_REMOTE_HOST)
+	{
+		strcpy(ip, m_remote_hosts[best].ip);
+	}
+	MUTEX_UNLOCK(&m_remote_hosts_mtx);
+
+	return best != NO_REMOTE_HOST;
+}
+
+/* Called for the ITCGW text broadcast with beacon NULL, then the load of the device is left as clid last told it */
+static void update_remote_host(const char *hostname, const char *ip, const struct clid_beacon *beacon, uint64_t tick)
+{
+	uint32_t hash = hash_hostname(hostname, strlen(hostname));
+	int index = find_remote_host(hostname, hash);
+	if(index == NO_REMOTE_HOST)
+	{
+		index = add_remote_host(hostname, hash, ip, tick);
+		if(index == NO_REMOTE_HOST)
+		{
+			return;
+		}
+	} else
+	{
+		// Its slot of the wheel will see the new expiry when it comes round
+		m_remote_hosts[index].expiry_tick = tick + CHECK_ALIVE_INTERVAL;
+		if(strcmp(m_remote_hosts[index].ip, ip) != 0)
+		{
+			strcpy(m_remote_hosts[index].ip, ip);
+		}
+	}
+
+	if(beacon != NULL)
+	{
+		m_remote_hosts[index].has_load = true;
+		m_remote_hosts[index].active_clients = beacon->active_clients;
+		m_remote_hosts[index].jobs_in_flight = beacon->jobs_in_flight;
+		m_remote_hosts[index].registry_epoch = beacon->registry_epoch;
+		m_remote_hosts[index].registry_version = beacon->registry_version;
+	}
+}
+
+/* "Broadcast Message: ITCGW from host <hostname> listening on tcp://<ip>:<port>/", anything else is ignored */
+static bool parse_beacon(const char *msg, size_t len, char *hostname, char *ip)
+{
+	static const char prefix[] = "Broadcast Message: ITCGW from host <";
+	static const char middle[] = "> listening on tcp://";
+	const char *end = msg + len;
+
+	if(len < sizeof(prefix) - 1 || memcmp(msg, prefix, sizeof(prefix) - 1) != 0)
+	{
+		return false;
+	}
+	const char *p = msg + sizeof(prefix) - 1;
+
+	const char *name_end = memchr(p, '>', end - p);
+	if(name_end == NULL || name_end == p || name_end - p >= MAX_HOST_NAME_LENGTH || memchr(p, '\0', name_end - p) != NULL)
+	{
+		return false;
+	}
+	size_t name_len = name_end - p;
+
+	if((size_t)(end - name_end) < sizeof(middle) - 1 || memcmp(name_end, middle, sizeof(middle) - 1) != 0)
+	{
+		return false;
+	}
+	const char *ip_start = name_end + sizeof(middle) - 1;
+
+	const char *ip_end = memchr(ip_start, ':', end - ip_start);
+	if(ip_end == NULL || ip_end == ip_start || ip_end - ip_start >= 25 || memchr(ip_start, '\0', ip_end - ip_start) != NULL)
+	{
+		return false;
+	}
+
+	// The port is always TCP_CLID_PORT, only check that the message is complete
+	const char *q = ip_end + 1;
+	while(q < end && *q >= '0' && *q <= '9' && q - ip_end <= 5)
+	{
+		q++;
+	}
+	if(q == ip_end + 1 || q == end || *q != '/')
+	{
+		return false;
+	}
+
+	memcpy(hostname, p, name_len);
+	hostname[name_len] = '\0';
+	memcpy(ip, ip_start, ip_end - ip_start);
+	ip[ip_end - ip_start] = '\0';
+
+	return true;
+}
+
+/* FNV-1a */
+static uint32_t hash_hostname(const char *hostname, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= (uint8_t)hostname[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static int find_remote_host(const char *hostname, uint32_t hash)
+{
+	int index = m_remote_host_buckets[hash & (REMOTE_HOST_HASH_SIZE - 1)];
+	while(index != NO_REMOTE_HOST)
+	{
+		if(m_remote_hosts[index].hash == hash && strcmp(m_remote_hosts[index].hostname, hostname) == 0)
+		{
+			return index;
+		}
+		index = m_remote_hosts[index].next_in_bucket;
+	}
+
+	return NO_REMOTE_HOST;
+}
+
+static int add_remote_host(const char *hostname, uint32_t hash, const char *ip, uint64_t tick)
+{
+	int index = m_free_remote_host;
+	if(index == NO_REMOTE_HOST)
+	{
+		if(!m_is_scan_table_full)
+		{
+			printf("No more than %d devices is accepted!\n", MAX_NUM_REMOTE_HOSTS);
+			m_is_scan_table_full = true;
+		}
+		return NO_REMOTE_HOST;
+	}
+
+	struct remote_host_info *host = &m_remote_hosts[index];
+	m_free_remote_host = host->next_in_bucket;
+	m_num_remote_hosts++;
+
+	strcpy(host->hostname, hostname);
+	strcpy(host->ip, ip);
+	host->has_load = false;
+	host->prefetch_retry_ns = 0;
+	host->hash = hash;
+	host->next_in_bucket = m_remote_host_buckets[hash & (REMOTE_HOST_HASH_SIZE - 1)];
+	m_remote_host_buckets[hash & (REMOTE_HOST_HASH_SIZE - 1)] = index;
+
+	host->expiry_tick = tick + CHECK_ALIVE_INTERVAL;
+	host->next_in_wheel = m_alive_wheel[host->expiry_tick & (ALIVE_WHEEL_SIZE - 1)];
+	m_alive_wheel[host->expiry_tick & (ALIVE_WHEEL_SIZE - 1)] = index;
+
+	return index;
+}
+
+/* Caller has already taken it off the wheel */
+static void remove_remote_host(int index)
+{
+	struct remote_host_info *host = &m_remote_hosts[index];
+	int *link = &m_remote_host_buckets[host->hash & (REMOTE_HOST_HASH_SIZE - 1)];
+	while(*link != index)
+	{
+		link = &m_remote_hosts[*link].next_in_bucket;
+	}
+	*link = host->next_in_bucket;
+
+	host->hostname[0] = '\0';
+	strcpy(host->ip, "0.0.0.0");
+	host->next_in_bucket = m_free_remote_host;
+	m_free_remote_host = index;
+	m_num_remote_hosts--;
+	m_is_scan_table_full = false;
+}
+
+static uint64_t get_alive_tick(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec;
+}
+
+/* Drop the devices not heard of for CHECK_ALIVE_INTERVAL, those that were go to the slot of their new expiry */
+static void advance_alive_wheel(uint64_t tick)
+{
+	if(tick <= m_alive_tick)
+	{
+		return;
+	}
+
+	// Seconds the loop did not get to (a suspended shell) are all in the slots of one round
+	uint64_t from = tick - m_alive_tick > ALIVE_WHEEL_SIZE ? tick - ALIVE_WHEEL_SIZE + 1 : m_alive_tick + 1;
+	for(uint64_t t = from; t <= tick; t++)
+	{
+		int index = m_alive_wheel[t & (ALIVE_WHEEL_SIZE - 1)];
+		m_alive_wheel[t & (ALIVE_WHEEL_SIZE - 1)] = NO_REMOTE_HOST;
+		while(index != NO_REMOTE_HOST)
+		{
+			struct remote_host_info *host = &m_remote_hosts[index];
+			int next = host->next_in_wheel;
+			if(host->expiry_tick <= tick)
+			{
+				remove_remote_host(index);
+			} else
+			{
+				host->next_in_wheel = m_alive_wheel[host->expiry_tick & (ALIVE_WHEEL_SIZE - 1)];
+				m_alive_wheel[host->expiry_tick & (ALIVE_WHEEL_SIZE - 1)] = index;
+			}
+			index = next;
+		}
+	}
+
+	m_alive_tick = tick;
+}
+
+static bool setup_udp_remote_hosts(void)
+{
+	MUTEX_LOCK(&m_remote_hosts_mtx);
+	for(int i = 0; i < MAX_NUM_REMOTE_HOSTS; i++)
+	{
+		m_remote_hosts[i].hostname[0] = '\0';
+		strcpy(m_remote_hosts[i].ip, "0.0.0.0");
+		m_remote_hosts[i].next_in_bucket = i + 1 < MAX_NUM_REMOTE_HOSTS ? i + 1 : NO_REMOTE_HOST;
+		m_remote_hosts[i].next_in_wheel = NO_REMOTE_HOST;
+	}
+	m_free_remote_host = 0;
+
+	for(int i = 0; i < REMOTE_HOST_HASH_SIZE; i++)
+	{
+		m_remote_host_buckets[i] = NO_REMOTE_HOST;
+	}
+
+	for(int i = 0; i < ALIVE_WHEEL_SIZE; i++)
+	{
+		m_alive_wheel[i] = NO_REMOTE_HOST;
+	}
+	m_alive_tick = get_alive_tick();
+	MUTEX_UNLOCK(&m_remote_hosts_mtx);
+
+	return true;
+}
+
+static int compare_cmd_name_in_remotecmd_tree(const void *pa, const void *pb)
+{
+	const char *cmd_name = pa;
+	const struct remote_cmd *remote_cmd = pb;
+
+	return strcmp(cmd_name, remote_cmd->cmd);
+}
+
+static int compare_remotecmd_in_remotecmd_tree(const void *pa, const void *pb)
+{
+	const struct remote_cmd *remote_cmda = pa;
+	const struct remote_cmd *remote_cmdb = pb;
+	
+	return strcmp(remote_cmda->cmd, remote_cmdb->cmd);
+}
+
+/* $XDG_STATE_HOME/clishell/history, ~/.local/state/clishell/history without it. Kept in memory only if there is no such file to map */
+static void open_history(void)
+{
+	char path[PATH_MAX];
+	if(!get_clishell_path("XDG_STATE_HOME", ".local/state", "history", path, sizeof(path)) || !map_history_file(path))
+	{
+		printf("History is kept for this session only!\n");
+		if(!map_history_memory())
+		{
+			return;
+		}
+	}
+
+	reload_history();
+	m_hist_browse = m_history.count;
+}
+
+static bool map_history_file(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd < 0)
+	{
+		printf("Failed to open history %s, errno = %d!\n", path, errno);
+		return false;
+	}
+
+	// Whoever comes first lays the file out, a file of another layout starts over. It is never shrunk,
+	// other shells may have it mapped and would get SIGBUS past its end, a new header is enough to empty it
+	flock(fd, LOCK_EX);
+	struct history_file_header header;
+	struct stat st;
+	bool is_sized = fstat(fd, &st) == 0 && st.st_size >= HISTORY_HEADER_SIZE + HISTORY_DATA_SIZE;
+	bool is_valid = is_sized && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+			memcmp(header.magic, HISTORY_MAGIC, HISTORY_MAGIC_SIZE) == 0 && header.data_size == HISTORY_DATA_SIZE;
+	if(!is_valid)
+	{
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, HISTORY_MAGIC, HISTORY_MAGIC_SIZE);
+		header.data_size = HISTORY_DATA_SIZE;
+		if((!is_sized && ftruncate(fd, HISTORY_HEADER_SIZE + HISTORY_DATA_SIZE) < 0) || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+		{
+			printf("Failed to lay out history %s, errno = %d!\n", path, errno);
+			flock(fd, LOCK_UN);
+			close(fd);
+			return false;
+		}
+	}
+	flock(fd, LOCK_UN);
+
+	void *addr = mmap(NULL, HISTORY_HEADER_SIZE + HISTORY_DATA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(addr == MAP_FAILED)
+	{
+		printf("Failed to mmap history %s, errno = %d!\n", path, errno);
+		close(fd);
+		return false;
+	}
+
+	m_history.fd = fd;
+	m_history.header = addr;
+	m_history.data = (uint8_t *)addr + HISTORY_HEADER_SIZE;
+	return true;
+}
+
+static bool map_history_memory(void)
+{
+	void *addr = mmap(NULL, HISTORY_HEADER_SIZE + HISTORY_DATA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(addr == MAP_FAILED)
+	{
+		printf("Failed to mmap history, errno = %d!\n", errno);
+		return false;
+	}
+
+	m_history.header = addr;
+	m_history.data = (uint8_t *)addr + HISTORY_HEADER_SIZE;
+	memcpy(m_history.header->magic, HISTORY_MAGIC, HISTORY_MAGIC_SIZE);
+	m_history.header->data_size = HISTORY_DATA_SIZE;
+	return true;
+}
+
+static void close_history(void)
+{
+	if(m_history.header != NULL)
+	{
+		munmap(m_history.header, HISTORY_HEADER_SIZE + HISTORY_DATA_SIZE);
+	}
+
+	if(m_history.fd >= 0)
+	{
+		close(m_history.fd);
+	}
+
+	for(uint32_t i = 0; i < m_history.grams_cap; i++)
+	{
+		free(m_history.grams[i].ids);
+	}
+	free(m_history.grams);
+	free(m_history.offsets);
+	memset(&m_history, 0, sizeof(m_history));
+	m_history.fd = -1;
+}
+
+/* Pick up the records other shells appended since, and drop the entries they overwrote */
+static void sync_history(void)
+{
+	if(m_history.header == NULL)
+	{
+		return;
+	}
+
+	uint64_t head = __atomic_load_n(&m_history.header->head, __ATOMIC_ACQUIRE);
+	if(head < m_history.known_head || head - m_history.known_head > HISTORY_DATA_SIZE)
+	{
+		// Started over, or so much was written that where this shell stopped is gone
+		reload_history();
+		return;
+	}
+
+	uint64_t pos = m_history.known_head;
+	while(pos < head)
+	{
+		uint64_t size = 0;
+		uint32_t text_len = 0;
+		if(!read_history_record(pos, &size, &text_len) || size > head - pos)
+		{
+			// Overwritten while being read, what was appended meanwhile is lost to this shell
+			break;
+		}
+
+		if(text_len != HISTORY_PAD)
+		{
+			add_history_entry(pos);
+		}
+		pos += size;
+	}
+	m_history.known_head = head;
+
+	uint64_t oldest = head > HISTORY_DATA_SIZE ? head - HISTORY_DATA_SIZE : 0;
+	while(m_history.first < m_history.count && m_history.offsets[m_history.first] < oldest)
+	{
+		m_history.first++;
+	}
+
+	// Overwritten entries still take their offsets and postings, start over once they are most of them. Nothing holds an id across a sync
+	if(m_history.first > m_history.count / 2)
+	{
+		reload_history();
+	}
+}
+
+/* Walk the ring backwards from its head, as far as records are intact, and index them all again */
+static void reload_history(void)
+{
+	for(uint32_t i = 0; i < m_history.grams_cap; i++)
+	{
+		free(m_history.grams[i].ids);
+	}
+	free(m_history.grams);
+	m_history.grams = NULL;
+	m_history.num_grams = 0;
+	m_history.grams_cap = 0;
+	m_history.count = 0;
+	m_history.first = 0;
+
+	uint64_t head = __atomic_load_n(&m_history.header->head, __ATOMIC_ACQUIRE);
+	uint64_t oldest = head > HISTORY_DATA_SIZE ? head - HISTORY_DATA_SIZE : 0;
+	uint64_t start = head;
+	while(start - oldest >= 2 * sizeof(uint32_t))
+	{
+		uint32_t size = 0;
+		memcpy(&size, m_history.data + (start - sizeof(uint32_t)) % HISTORY_DATA_SIZE, sizeof(uint32_t));
+		uint64_t record_size = 0;
+		uint32_t text_len = 0;
+		if(size > start - oldest || !read_history_record(start - size, &record_size, &text_len) || record_size != size)
+		{
+			break;
+		}
+
+		start -= size;
+	}
+
+	m_history.known_head = start;
+	sync_history();
+}
+
+/* Size of the record at pos and its text_len, false if it cannot be a record */
+static bool read_history_record(uint64_t pos, uint64_t *size, uint32_t *text_len)
+{
+	uint32_t place = pos % HISTORY_DATA_SIZE;
+	if(place % 8 != 0)
+	{
+		return false;
+	}
+
+	memcpy(text_len, m_history.data + place, sizeof(uint32_t));
+	*size = *text_len == HISTORY_PAD ? HISTORY_DATA_SIZE - place : (2 * sizeof(uint32_t) + *text_len + 7) & ~7ULL;
+	if(*size < 2 * sizeof(uint32_t) || *size > HISTORY_DATA_SIZE - place)
+	{
+		return false;
+	}
+
+	uint32_t trailer = 0;
+	memcpy(&trailer, m_history.data + place + *size - sizeof(uint32_t), sizeof(uint32_t));
+	return trailer == *size;
+}
+
+static void add_history_entry(uint64_t offset)
+{
+	if(m_history.count == m_history.cap)
+	{
+		// Bounded by what fits in the ring, sync_history() reloads once most entries below count were overwritten
+		uint32_t cap = m_history.cap ? m_history.cap * 2 : 1024;
+		uint64_t *offsets = realloc(m_history.offsets, cap * sizeof(uint64_t));
+		if(offsets == NULL)
+		{
+			printf("Failed to realloc history!\n");
+			return;
+		}
+		m_history.offsets = offsets;
+		m_history.cap = cap;
+	}
+
+	m_history.offsets[m_history.count] = offset;
+	index_history_entry(m_history.count++);
+}
+
+/* Empty if the entry was overwritten since, the file is shared and another shell may wrap around at any time */
+static const char *get_history_text(uint32_t id, uint32_t *len)
+{
+	uint64_t size = 0;
+	if(id < m_history.first || id >= m_history.count || !read_history_record(m_history.offsets[id], &size, len) || *len == HISTORY_PAD)
+	{
+		*len = 0;
+		return "";
+	}
+
+	return (const char *)m_history.data + m_history.offsets[id] % HISTORY_DATA_SIZE + sizeof(uint32_t);
+}
+
+/* Under the file lock, other shells may append at the same time. The same line twice in a row is kept once */
+static void append_history(const char *line, size_t len)
+{
+	if(m_history.header == NULL)
+	{
+		return;
+	}
+
+	if(m_history.fd >= 0)
+	{
+		flock(m_history.fd, LOCK_EX);
+	}
+
+	sync_history();
+	uint32_t last_len = 0;
+	const char *last = m_history.count > m_history.first ? get_history_text(m_history.count - 1, &last_len) : NULL;
+	if(last == NULL || last_len != len || memcmp(last, line, len) != 0)
+	{
+		uint64_t head = m_history.header->head;
+		uint32_t place = head % HISTORY_DATA_SIZE;
+		uint32_t size = (2 * sizeof(uint32_t) + len + 7) & ~7U;
+		if(size > HISTORY_DATA_SIZE - place)
+		{
+			uint32_t pad = HISTORY_PAD;
+			uint32_t pad_size = HISTORY_DATA_SIZE - place;
+			memcpy(m_history.data + place, &pad, sizeof(uint32_t));
+			memcpy(m_history.data + HISTORY_DATA_SIZE - sizeof(uint32_t), &pad_size, sizeof(uint32_t));
+			head += pad_size;
+			place = 0;
+		}
+
+		uint32_t text_len = (uint32_t)len;
+		memcpy(m_history.data + place, &text_len, sizeof(uint32_t));
+		memcpy(m_history.data + place + sizeof(uint32_t), line, len);
+		memset(m_history.data + place + sizeof(uint32_t) + len, 0, size - 2 * sizeof(uint32_t) - len);
+		memcpy(m_history.data + place + size - sizeof(uint32_t), &size, sizeof(uint32_t));
+
+		// Readers only look below head, the record is complete before it becomes part of the ring
+		__atomic_store_n(&m_history.header->head, head + size, __ATOMIC_RELEASE);
+		sync_history();
+	}
+
+	if(m_history.fd >= 0)
+	{
+		flock(m_history.fd, LOCK_UN);
+	}
+}
+
+/* Every trigram of the entry points to it, so that a search only verifies entries holding the rarest trigram of its query */
+static void index_history_entry(uint32_t id)
+{
+	uint32_t len = 0;
+	const uint8_t *text = (const uint8_t *)get_history_text(id, &len);
+	for(uint32_t i = 0; i + 3 <= len; i++)
+	{
+		struct history_gram *gram = find_history_gram(((uint32_t)text[i] << 16 | (uint32_t)text[i + 1] << 8 | text[i + 2]) + 1, true);
+		if(gram == NULL || (gram->count > 0 && gram->ids[gram->count - 1] == id))
+		{
+			continue;
+		}
+
+		if(gram->count == gram->cap)
+		{
+			uint32_t cap = gram->cap ? gram->cap * 2 : 4;
+			uint32_t *ids = realloc(gram->ids, cap * sizeof(uint32_t));
+			if(ids == NULL)
 			{
-				token[i] = *str++;
-				i++;
-				nr_chars++;
 				continue;
 			}
+			gram->ids = ids;
+			gram->cap = cap;
+		}
+
+		gram->ids[gram->count++] = id;
+	}
+}
+
+/* NULL if key has no entry, unless is_added, then one is made for it */
+static struct history_gram *find_history_gram(uint32_t key, bool is_added)
+{
+	if(is_added && 2 * (m_history.num_grams + 1) > m_history.grams_cap)
+	{
+		uint32_t cap = m_history.grams_cap ? m_history.grams_cap * 2 : 4096;
+		struct history_gram *grams = calloc(cap, sizeof(struct history_gram));
+		if(grams == NULL)
+		{
+			return NULL;
+		}
+
+		for(uint32_t i = 0; i < m_history.grams_cap; i++)
+		{
+			if(m_history.grams[i].key != 0)
+			{
+				uint32_t j = (m_history.grams[i].key * 2654435761U) & (cap - 1);
+				while(grams[j].key != 0)
+				{
+					j = (j + 1) & (cap - 1);
+				}
+				grams[j] = m_history.grams[i];
+			}
+		}
+
+		free(m_history.grams);
+		m_history.grams = grams;
+		m_history.grams_cap = cap;
+	}
+
+	if(m_history.grams_cap == 0)
+	{
+		return NULL;
+	}
+
+	uint32_t i = (key * 2654435761U) & (m_history.grams_cap - 1);
+	while(m_history.grams[i].key != 0)
+	{
+		if(m_history.grams[i].key == key)
+		{
+			return &m_history.grams[i];
+		}
+		i = (i + 1) & (m_history.grams_cap - 1);
+	}
+
+	if(!is_added)
+	{
+		return NULL;
+	}
+
+	m_history.grams[i].key = key;
+	m_history.num_grams++;
+	return &m_history.grams[i];
+}
+
+/* Newest entry older than before whose text contains query, history count if there is none */
+static uint32_t search_history(const char *query, size_t query_len, uint32_t before)
+{
+	if(query_len < 3)
+	{
+		// Too short to be indexed, but then the newest few entries nearly always match
+		for(uint32_t id = before; id-- > m_history.first;)
+		{
+			if(is_history_match(id, query, query_len))
+			{
+				return id;
+			}
+		}
+
+		return m_history.count;
+	}
+
+	const struct history_gram *rarest = NULL;
+	for(size_t i = 0; i + 3 <= query_len; i++)
+	{
+		const uint8_t *q = (const uint8_t *)query + i;
+		const struct history_gram *gram = find_history_gram(((uint32_t)q[0] << 16 | (uint32_t)q[1] << 8 | q[2]) + 1, false);
+		if(gram == NULL)
+		{
+			return m_history.count;
+		}
+
+		if(rarest == NULL || gram->count < rarest->count)
+		{
+			rarest = gram;
+		}
+	}
+
+	// ids are in ascending order, start right below before
+	uint32_t low = 0;
+	uint32_t high = rarest->count;
+	while(low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		if(rarest->ids[mid] < before)
+		{
+			low = mid + 1;
+		} else
+		{
+			high = mid;
+		}
+	}
+
+	while(low-- > 0 && rarest->ids[low] >= m_history.first)
+	{
+		if(is_history_match(rarest->ids[low], query, query_len))
+		{
+			return rarest->ids[low];
+		}
+	}
+
+	return m_history.count;
+}
+
+static bool is_history_match(uint32_t id, const char *query, size_t query_len)
+{
+	uint32_t len = 0;
+	const char *text = get_history_text(id, &len);
+	return memmem(text, len, query, query_len) != NULL;
+}
+
+/* Ctrl-R, incremental search of the history from its newest entry on */
+static void start_history_search(void)
+{
+	sync_history();
+	m_hist_browse = m_history.count;
+	snprintf(m_search_saved, sizeof(m_search_saved), "%s", m_buffer);
+	m_is_searching = true;
+	m_search_len = 0;
+	m_search_query[0] = '\0';
+	m_search_match = m_history.count;
+	m_is_search_failed = false;
+	redraw_input_line();
+}
+
+/* Newest match older than before, the line stays as it is if there is none */
+static void update_history_search(uint32_t before)
+{
+	uint32_t id = search_history(m_search_query, m_search_len, before);
+	if(id < m_history.count)
+	{
+		uint32_t len = 0;
+		const char *text = get_history_text(id, &len);
+		m_buff_len = len < MAX_READLINE_LENGTH ? len : MAX_READLINE_LENGTH - 1;
+		memcpy(m_buffer, text, m_buff_len);
+		m_buffer[m_buff_len] = '\0';
+
+		const char *found = memmem(m_buffer, m_buff_len, m_search_query, m_search_len);
+		m_cursor = found != NULL ? (size_t)(found - m_buffer) : m_buff_len;
+		m_search_match = id;
+		m_is_search_failed = false;
+	} else
+	{
+		m_is_search_failed = m_search_len > 0;
+	}
+
+	redraw_input_line();
+}
+
+/* Printable keys refine the query, Ctrl-R goes to the next older match, Ctrl-G gives up, anything else takes the match and does as usual */
+static void handle_search_byte(char c)
+{
+	switch (c)
+	{
+	case 18: // Ctrl-R
+		if(m_search_match < m_history.count && !m_is_search_failed)
+		{
+			update_history_search(m_search_match);
+		}
+		break;
+	case 7: // Ctrl-G
+		end_history_search(false);
+		break;
+	case 8: // Backspace
+	case 127:
+		if(m_search_len > 0)
+		{
+			m_search_query[--m_search_len] = '\0';
+			update_history_search(m_history.count);
+		}
+		break;
+	default:
+		if(c >= 32 && c <= 126 && m_search_len < sizeof(m_search_query) - 1)
+		{
+			m_search_query[m_search_len++] = c;
+			m_search_query[m_search_len] = '\0';
+
+			// A longer query only matches what the current match or older ones do
+			update_history_search(m_search_match < m_history.count ? m_search_match + 1 : m_history.count);
+		} else if(c < 32 || c == 127)
+		{
+			end_history_search(true);
+			handle_input_byte(c);
+		}
+		break;
+	}
+}
+
+static void end_history_search(bool is_accepted)
+{
+	m_is_searching = false;
+	if(!is_accepted)
+	{
+		snprintf(m_buffer, sizeof(m_buffer), "%s", m_search_saved);
+		m_buff_len = strlen(m_buffer);
+		m_cursor = m_buff_len;
+	}
+
+	redraw_input_line();
+}
+
+static struct remote_session *connect_to_remote_host_via_ipaddr(const char *ip)
+{
+	// A prefetch still on its way is no quicker than connecting right here
+	for(int i = 0; i < MAX_SESSIONS; i++)
+	{
+		if(m_sessions[i].is_used && m_sessions[i].state != SESSION_READY && strcmp(m_sessions[i].ip, ip) == 0)
+		{
+			close_session(&m_sessions[i]);
+		}
+	}
+
+	struct remote_session *session = find_session(ip);
+	if(session != NULL && session->is_prefetched)
+	{
+		session->is_prefetched = false;
+		touch_cmd_cache(ip);
+		printf("Connected to device: tcp://%s:%d, prefetched in the background\n", ip, TCP_CLID_PORT);
+		printf("Using protocol version %hhu\n", session->proto);
+		return session;
+	} else if(session != NULL)
+	{
+		printf("Already connected to device: tcp://%s:%d, switch to it!\n", ip, TCP_CLID_PORT);
+		return session;
+	}
+
+	session = get_free_session();
+	if(session == NULL)
+	{
+		printf("No more than %d sessions can be open, disconnect one of them first!\n", MAX_SESSIONS);
+		return NULL;
+	}
+
+	struct remote_cmd *remote_cmds = calloc(MAX_REMOTE_CMDS, sizeof(struct remote_cmd));
+	if(remote_cmds == NULL)
+	{
+		printf("Failed to calloc remote cmd list!\n");
+		return NULL;
+	}
+
+	memset(session, 0, sizeof(struct remote_session));
+	session->is_used = true;
+	session->remote_cmds = remote_cmds;
+	session->state = SESSION_CONNECTING;
+	snprintf(session->ip, sizeof(session->ip), "%s", ip);
+
+	MUTEX_LOCK(&m_remote_hosts_mtx);
+	for(int i = 0; i < MAX_NUM_REMOTE_HOSTS; i++)
+	{
+		if(m_remote_hosts[i].hostname[0] != '\0' && strcmp(m_remote_hosts[i].ip, ip) == 0)
+		{
+			snprintf(session->hostname, sizeof(session->hostname), "%s", m_remote_hosts[i].hostname);
+			break;
+		}
+	}
+	MUTEX_UNLOCK(&m_remote_hosts_mtx);
+
+	if(session->hostname[0] != '\0')
+	{
+		snprintf(session->prompt, sizeof(session->prompt), "%s@%s:%hu$ ", session->hostname, session->ip, TCP_CLID_PORT);
+	} else
+	{
+		snprintf(session->prompt, sizeof(session->prompt), "%s:%hu$ ", session->ip, TCP_CLID_PORT);
+	}
+
+	session->conn = clid_connect(m_client, ip, handle_session_conn, handle_session_push, session);
+	if(session->conn == NULL)
+	{
+		printf("Failed to connect to device: tcp://%s:%d, errno = %d!\n", ip, TCP_CLID_PORT, errno);
+		close_session(session);
+		return NULL;
+	}
+
+	// handle_session_conn() and handle_session_list() take it through the handshake and the command list
+	bool is_cancelled = false;
+	while(session->state == SESSION_CONNECTING || session->state == SESSION_LISTING)
+	{
+		if(!wait_client())
+		{
+			is_cancelled = true;
+			break;
+		}
+	}
+
+	if(is_cancelled || session->state != SESSION_READY)
+	{
+		if(is_cancelled)
+		{
+			printf("Cancelled!\n");
+		}
+		close_session(session);
+		return NULL;
+	}
+
+	touch_cmd_cache(ip);
+	return session;
+}
+
+/* host is an index of the sessions command, an ip or a hostname, prefetches still on their way are not found */
+static struct remote_session *find_session(const char *host)
+{
+	char *end = NULL;
+	long index = strtol(host, &end, 10);
+	if(end != host && *end == '\0')
+	{
+		return index >= 1 && index <= MAX_SESSIONS && m_sessions[index - 1].is_used && m_sessions[index - 1].state == SESSION_READY ? &m_sessions[index - 1] : NULL;
+	}
+
+	for(int i = 0; i < MAX_SESSIONS; i++)
+	{
+		if(m_sessions[i].is_used && m_sessions[i].state == SESSION_READY && (strcmp(m_sessions[i].ip, host) == 0 || strcmp(m_sessions[i].hostname, host) == 0))
+		{
+			return &m_sessions[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Close the connection and forget the commands of its clid, back to the local prompt if it was the active one */
+static void close_session(struct remote_session *session)
+{
+	if(!session->is_used)
+	{
+		return;
+	}
+
+	if(m_pending.is_pending && m_pending.session == session)
+	{
+		cancel_pending_cmd();
+	}
+
+	if(session->conn != NULL)
+	{
+		clid_conn_close(session->conn);
+	}
+
+	clear_remote_cmds(session);
+	free(session->remote_cmds);
+
+	memset(session, 0, sizeof(struct remote_session));
+
+	if(m_active_session == session)
+	{
+		m_active_session = NULL;
+	}
+}
+
+static void close_all_sessions(void)
+{
+	for(int i = 0; i < MAX_SESSIONS; i++)
+	{
+		close_session(&m_sessions[i]);
+	}
+}
+
+/* Slot for a session the user asked for, a prefetched one nobody used yet gives up its slot if there is no other */
+static struct remote_session *get_free_session(void)
+{
+	struct remote_session *prefetched = NULL;
+	for(int i = 0; i < MAX_SESSIONS; i++)
+	{
+		if(!m_sessions[i].is_used)
+		{
+			return &m_sessions[i];
+		} else if(m_sessions[i].is_prefetched && (prefetched == NULL || m_sessions[i].state != SESSION_READY))
+		{
+			prefetched = &m_sessions[i];
+		}
+	}
+
+	if(prefetched != NULL)
+	{
+		close_session(prefetched);
+	}
+
+	return prefetched;
+}
+
+/* Keep up to m_prefetch_budget background connections, to devices the shell connected to before first (their command list is cached),
+then to any other scanned device. Never takes the last free slots away from sessions already open by the user */
+static void start_prefetches(void)
+{
+	uint64_t now = get_time_ns();
+	if(m_prefetch_budget == 0 || now < m_prefetch_scan_ns)
+	{
+		return;
+	}
+	m_prefetch_scan_ns = now + (uint64_t)PREFETCH_SCAN_PERIOD_MS * 1000000;
+
+	int num_prefetched = 0;
+	int num_free = 0;
+	for(int i = 0; i < MAX_SESSIONS; i++)
+	{
+		num_prefetched += m_sessions[i].is_used && m_sessions[i].is_prefetched;
+		num_free += !m_sessions[i].is_used;
+	}
+
+	char ip[25];
+	char hostname[MAX_HOST_NAME_LENGTH];
+	while(num_prefetched < m_prefetch_budget && num_free > 0 && pick_prefetch_host(ip, hostname))
+	{
+		if(start_prefetch(ip, hostname))
+		{
+			num_prefetched++;
+			num_free--;
+		}
+	}
+}
+
+/* Scanned device without a session, nor a prefetch that failed lately. The one the shell connected to last wins, a device
+never connected to yet comes after all those. The device is marked as tried right away, it is not picked again until it failed */
+static bool pick_prefetch_host(char *ip, char *hostname)
+{
+	char ips[PREFETCH_CANDIDATES][25];
+	char hostnames[PREFETCH_CANDIDATES][MAX_HOST_NAME_LENGTH];
+	int indexes[PREFETCH_CANDIDATES];
+	int num_candidates = 0;
+	uint64_t now = get_time_ns();
+
+	MUTEX_LOCK(&m_remote_hosts_mtx);
+	for(int i = 0; i < MAX_NUM_REMOTE_HOSTS && num_candidates < PREFETCH_CANDIDATES; i++)
+	{
+		const struct remote_host_info *host = &m_remote_hosts[i];
+		if(host->hostname[0] == '\0' || host->prefetch_retry_ns > now)
+		{
+			continue;
+		}
+
+		bool is_open = false;
+		for(int j = 0; j < MAX_SESSIONS && !is_open; j++)
+		{
+			is_open = m_sessions[j].is_used && strcmp(m_sessions[j].ip, host->ip) == 0;
+		}
+
+		if(!is_open)
+		{
+			strcpy(ips[num_candidates], host->ip);
+			strcpy(hostnames[num_candidates], host->hostname);
+			indexes[num_candidates++] = i;
+		}
+	}
+	MUTEX_UNLOCK(&m_remote_hosts_mtx);
+
+	if(num_candidates == 0)
+	{
+		return false;
+	}
+
+	// The cache file is touched whenever the user connects, its age tells how recently the device was used
+	int best = 0;
+	time_t best_mtime = 0;
+	for(int i = 0; i < num_candidates; i++)
+	{
+		char path[PATH_MAX];
+		struct stat st;
+		if(get_cmd_cache_path(ips[i], path, sizeof(path)) && stat(path, &st) == 0 && st.st_mtime > best_mtime)
+		{
+			best = i;
+			best_mtime = st.st_mtime;
+		}
+	}
+
+	strcpy(ip, ips[best]);
+	strcpy(hostname, hostnames[best]);
+
+	// Moved on by fail_prefetch() if this one does not work out, an entry reused by another device meanwhile just waits a bit longer
+	MUTEX_LOCK(&m_remote_hosts_mtx);
+	m_remote_hosts[indexes[best]].prefetch_retry_ns = now + (uint64_t)PREFETCH_TIMEOUT_MS * 1000000;
+	MUTEX_UNLOCK(&m_remote_hosts_mtx);
+
+	return true;
+}
+
+/* Connect without waiting, the client takes the session through CLID_HELLO_REQUEST and the command list, see handle_session_conn() */
+static bool start_prefetch(const char *ip, const char *hostname)
+{
+	struct remote_session *session = NULL;
+	for(int i = 0; i < MAX_SESSIONS && session == NULL; i++)
+	{
+		if(!m_sessions[i].is_used)
+		{
+			session = &m_sessions[i];
+		}
+	}
+
+	struct remote_cmd *remote_cmds = session != NULL ? calloc(MAX_REMOTE_CMDS, sizeof(struct remote_cmd)) : NULL;
+	if(remote_cmds == NULL)
+	{
+		return false;
+	}
+
+	memset(session, 0, sizeof(struct remote_session));
+	session->is_used = true;
+	session->remote_cmds = remote_cmds;
+	session->state = SESSION_CONNECTING;
+	session->is_prefetched = true;
+	session->deadline_ns = get_time_ns() + (uint64_t)PREFETCH_TIMEOUT_MS * 1000000;
+	snprintf(session->ip, sizeof(session->ip), "%s", ip);
+	snprintf(session->hostname, sizeof(session->hostname), "%s", hostname);
+	snprintf(session->prompt, sizeof(session->prompt), "%s@%s:%hu$ ", session->hostname, session->ip, TCP_CLID_PORT);
+
+	session->conn = clid_connect(m_client, ip, handle_session_conn, handle_session_push, session);
+	if(session->conn == NULL)
+	{
+		free(remote_cmds);
+		memset(session, 0, sizeof(struct remote_session));
+		return false;
+	}
+
+	return true;
+}
+
+/* Quietly, nobody asked for this session. The device is not tried again for a while */
+static void fail_prefetch(struct remote_session *session)
+{
+	uint64_t retry_ns = get_time_ns() + (uint64_t)PREFETCH_RETRY_PERIOD * 1000000000ULL;
+	MUTEX_LOCK(&m_remote_hosts_mtx);
+	for(int i = 0; i < MAX_NUM_REMOTE_HOSTS; i++)
+	{
+		if(strcmp(m_remote_hosts[i].ip, session->ip) == 0)
+		{
+			m_remote_hosts[i].prefetch_retry_ns = retry_ns;
+		}
+	}
+	MUTEX_UNLOCK(&m_remote_hosts_mtx);
+
+	close_session(session);
+}
+
+static void stop_prefetches(void)
+{
+	m_prefetch_budget = 0;
+	for(int i = 0; i < MAX_SESSIONS; i++)
+	{
+		if(m_sessions[i].is_prefetched)
+		{
+			close_session(&m_sessions[i]);
+		}
+	}
+}
+
+static bool add_remote_cmd(struct remote_session *session, const char *cmd, uint32_t cmd_len, const char *desc, uint32_t desc_len)
+{
+	if(cmd_len >= MAX_ARG_LENGTH)
+	{
+		printf("Command name of length %u is too long, skip it!\n", cmd_len);
+		return true;
+	}
+
+	if(desc_len >= sizeof(session->remote_cmds[0].description))
+	{
+		desc_len = sizeof(session->remote_cmds[0].description) - 1;
+	}
+
+	for(int j = 0; j < MAX_REMOTE_CMDS; j++)
+	{
+		if(session->remote_cmds[j].cmd[0] == '\0')
+		{
+			memcpy(session->remote_cmds[j].cmd, cmd, cmd_len);
+			session->remote_cmds[j].cmd[cmd_len] = '\0';
+			memcpy(session->remote_cmds[j].description, desc, desc_len);
+			session->remote_cmds[j].description[desc_len] = '\0';
+
+			struct remote_cmd **iter;
+			iter = tfind(session->remote_cmds[j].cmd, &session->remote_cmd_tree, compare_cmd_name_in_remotecmd_tree);
+			if(iter != NULL)
+			{
+				printf("Command \"%s\" already added in remote cmd tree, something wrong!\n", session->remote_cmds[j].cmd);
+				session->remote_cmds[j].cmd[0] = '\0';
+				session->remote_cmds[j].description[0] = '\0';
+			} else
+			{
+				tsearch(&session->remote_cmds[j], &session->remote_cmd_tree, compare_remotecmd_in_remotecmd_tree);
+			}
+
+			return true;
+		}
+	}
+
+	printf("No more than %d remote cmd can be added!\n", MAX_REMOTE_CMDS);
+	return false;
+}
+
+static bool remove_remote_cmd(struct remote_session *session, const char *cmd, uint32_t cmd_len)
+{
+	char name[MAX_ARG_LENGTH];
+	if(cmd_len >= MAX_ARG_LENGTH)
+	{
+		return false;
+	}
+
+	memcpy(name, cmd, cmd_len);
+	name[cmd_len] = '\0';
+
+	struct remote_cmd **iter;
+	iter = tfind(name, &session->remote_cmd_tree, compare_cmd_name_in_remotecmd_tree);
+	if(iter == NULL)
+	{
+		return false;
+	}
+
+	struct remote_cmd *remote_cmd = *iter;
+	tdelete(name, &session->remote_cmd_tree, compare_cmd_name_in_remotecmd_tree);
+	remote_cmd->cmd[0] = '\0';
+	remote_cmd->description[0] = '\0';
+	free(remote_cmd->syntax);
+	remote_cmd->syntax = NULL;
+
+	return true;
+}
+
+/* Read num_cmds times cmd_len, cmd, cmd_desc_len, cmd_desc as in CLID_GET_LIST_CMD_REPLY, also the format of the cache file */
+static bool add_remote_cmd_list(struct remote_session *session, struct clid_v2_reader *reader, uint32_t num_cmds)
+{
+	for(uint32_t i = 0; i < num_cmds && !reader->error; i++)
+	{
+		uint32_t cmd_len, cmd_desc_len;
+		const char *cmd = clid_v2_read_string(reader, &cmd_len);
+		const char *cmd_desc = clid_v2_read_string(reader, &cmd_desc_len);
+		if(reader->error)
+		{
+			break;
+		}
+
+		if(!add_remote_cmd(session, cmd, cmd_len, cmd_desc, cmd_desc_len))
+		{
+			return false;
+		}
+	}
+
+	return !reader->error;
+}
+
+static void clear_remote_cmds(struct remote_session *session)
+{
+	// The tree nodes point into remote_cmds, only their syntax graphs are allocated on their own
+	tdestroy(session->remote_cmd_tree, do_nothing);
+	session->remote_cmd_tree = NULL;
+	for(int i = 0; i < MAX_REMOTE_CMDS; i++)
+	{
+		free(session->remote_cmds[i].syntax);
+	}
+	memset(session->remote_cmds, 0, MAX_REMOTE_CMDS * sizeof(struct remote_cmd));
+	session->registry_epoch = 0;
+	session->registry_version = 0;
+}
+
+/* $XDG_CACHE_HOME/clishell/<ip>.cmds, ~/.cache/clishell/<ip>.cmds without it */
+static bool get_cmd_cache_path(const char *ip, char *path, size_t size)
+{
+	char name[INET6_ADDRSTRLEN + 8];
+	snprintf(name, sizeof(name), "%s.cmds", ip);
+	return get_clishell_path("XDG_CACHE_HOME", ".cache", name, path, size);
+}
+
+/* $<xdg_var>/clishell/<name>, ~/<fallback>/clishell/<name> without it. Missing directories are created on the way */
+static bool get_clishell_path(const char *xdg_var, const char *fallback, const char *name, char *path, size_t size)
+{
+	const char *xdg_home = getenv(xdg_var);
+	const char *home = getenv("HOME");
+	int len = 0;
+	if(xdg_home != NULL && xdg_home[0] != '\0')
+	{
+		len = snprintf(path, size, "%s", xdg_home);
+		mkdir(path, 0700);
+	} else if(home != NULL && home[0] != '\0')
+	{
+		len = snprintf(path, size, "%s/%s", home, fallback);
+		for(char *c = path + strlen(home) + 1; (size_t)len < size && *c != '\0'; c++)
+		{
+			if(*c == '/')
+			{
+				*c = '\0';
+				mkdir(path, 0700);
+				*c = '/';
+			}
+		}
+		mkdir(path, 0700);
+	} else
+	{
+		return false;
+	}
+
+	len += snprintf(path + len, size - len, "/clishell");
+	mkdir(path, 0700);
+
+	len += snprintf(path + len, size - len, "/%s", name);
+	return len > 0 && (size_t)len < size;
+}
+
+/* Fill the session with the list cached by an earlier connection to the same device. Return false if there is none */
+static bool load_cmd_cache(struct remote_session *session)
+{
+	char path[PATH_MAX];
+	if(!get_cmd_cache_path(session->ip, path, sizeof(path)))
+	{
+		return false;
+	}
+
+	FILE *file = fopen(path, "rb");
+	if(file == NULL)
+	{
+		return false;
+	}
+
+	uint8_t *buff = malloc(MAX_CMD_CACHE_SIZE);
+	size_t len = buff != NULL ? fread(buff, 1, MAX_CMD_CACHE_SIZE, file) : 0;
+	fclose(file);
+
+	bool is_loaded = false;
+	if(len > CMD_CACHE_MAGIC_SIZE && memcmp(buff, CMD_CACHE_MAGIC, CMD_CACHE_MAGIC_SIZE) == 0)
+	{
+		struct clid_v2_reader reader;
+		clid_v2_reader_init(&reader, buff + CMD_CACHE_MAGIC_SIZE, len - CMD_CACHE_MAGIC_SIZE);
+		uint32_t epoch = clid_v2_read_varint(&reader);
+		uint32_t version = clid_v2_read_varint(&reader);
+		uint32_t num_cmds = clid_v2_read_varint(&reader);
+		if(!reader.error && epoch != 0 && add_remote_cmd_list(session, &reader, num_cmds))
+		{
+			session->registry_epoch = epoch;
+			session->registry_version = version;
+			is_loaded = true;
+		}
+	}
+
+	if(!is_loaded)
+	{
+		printf("Ignoring invalid command list cache %s!\n", path);
+		clear_remote_cmds(session);
+	}
+
+	free(buff);
+	return is_loaded;
+}
+
+/* Tell prefetch the user went to this device just now, see pick_prefetch_host() */
+static void touch_cmd_cache(const char *ip)
+{
+	char path[PATH_MAX];
+	if(get_cmd_cache_path(ip, path, sizeof(path)))
+	{
+		utimensat(AT_FDCWD, path, NULL, 0);
+	}
+}
+
+/* magic, then registry_epoch, registry_version, num_cmds and the commands, encoded as in CLID_GET_LIST_CMD_REPLY.
+Written aside and renamed, a shell connecting to the same device meanwhile never reads half a file */
+static void save_cmd_cache(const struct remote_session *session)
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 16];
+	if(session->registry_epoch == 0 || !get_cmd_cache_path(session->ip, path, sizeof(path)))
+	{
+		return;
+	}
+
+	uint8_t *buff = malloc(MAX_CMD_CACHE_SIZE);
+	if(buff == NULL)
+	{
+		return;
+	}
+
+	uint32_t num_cmds = 0;
+	for(int i = 0; i < MAX_REMOTE_CMDS; i++)
+	{
+		num_cmds += (session->remote_cmds[i].cmd[0] != '\0');
+	}
+
+	memcpy(buff, CMD_CACHE_MAGIC, CMD_CACHE_MAGIC_SIZE);
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, buff + CMD_CACHE_MAGIC_SIZE, MAX_CMD_CACHE_SIZE - CMD_CACHE_MAGIC_SIZE);
+	clid_v2_write_varint(&writer, session->registry_epoch);
+	clid_v2_write_varint(&writer, session->registry_version);
+	clid_v2_write_varint(&writer, num_cmds);
+	for(int i = 0; i < MAX_REMOTE_CMDS; i++)
+	{
+		if(session->remote_cmds[i].cmd[0] != '\0')
+		{
+			clid_v2_write_string(&writer, session->remote_cmds[i].cmd, strlen(session->remote_cmds[i].cmd));
+			clid_v2_write_string(&writer, session->remote_cmds[i].description, strlen(session->remote_cmds[i].description));
+		}
+	}
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+	FILE *file = fopen(tmp_path, "wb");
+	bool is_written = file != NULL && !writer.error && fwrite(buff, 1, CMD_CACHE_MAGIC_SIZE + writer.len, file) == CMD_CACHE_MAGIC_SIZE + writer.len;
+	if(file != NULL && fclose(file) != 0)
+	{
+		is_written = false;
+	}
+
+	if(!is_written || rename(tmp_path, path) < 0)
+	{
+		printf("Failed to write command list cache %s, errno = %d!\n", path, errno);
+		unlink(tmp_path);
+	}
+
+	free(buff);
+}
+
+static void do_nothing(void *tree_node_data)
+{
+	(void)tree_node_data;
+}
+
+static bool apply_cmd_list(struct remote_session *session, const struct clid_list_reply *reply)
+{
+	if(reply->errorcode == CLID_STATUS_LIST_UNCHANGED)
+	{
+		if(session->registry_epoch == 0 || reply->registry_epoch != session->registry_epoch || reply->registry_version != session->registry_version)
+		{
+			printf("Received CLID_STATUS_LIST_UNCHANGED for a list we do not have, from tcp://%s:%d!\n", session->ip, TCP_CLID_PORT);
+			return false;
+		}
+
+		return true;
+	}
+
+	// A new list replaces whatever came from the cache
+	clear_remote_cmds(session);
+	for(uint32_t i = 0; i < reply->num_cmds; i++)
+	{
+		const struct clid_cmd_info *cmd = &reply->cmds[i];
+		if(!add_remote_cmd(session, cmd->name, cmd->name_len, cmd->desc, cmd->desc_len))
+		{
+			return false;
+		}
+	}
+
+	// A v1 or an older clid sends no version, its list cannot be cached then
+	if(reply->registry_epoch != 0)
+	{
+		session->registry_epoch = reply->registry_epoch;
+		session->registry_version = reply->registry_version;
+		save_cmd_cache(session);
+	}
+
+	return true;
+}
+
+/* cmd NULL asks for the syntax of all commands. Nothing to wait for, handle_syntax_frame() takes the reply whenever it comes */
+static bool send_v2_get_syntax_request(struct remote_session *session, const char *cmd, uint32_t cmd_len)
+{
+	if(session->proto != CLID_PROTO_V2 || cmd_len >= MAX_ARG_LENGTH)
+	{
+		return false;
+	}
+
+	uint8_t payload[2 * CLID_VARINT_MAX_SIZE + MAX_ARG_LENGTH];
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, payload, sizeof(payload));
+	clid_v2_write_varint(&writer, cmd != NULL ? 1 : 0);
+	if(cmd != NULL)
+	{
+		clid_v2_write_string(&writer, cmd, cmd_len);
+	}
+
+	if(clid_send_request(session->conn, CLID_GET_SYNTAX_REQUEST, 0, payload, writer.len, CMD_EXECUTION_TIMEOUT * 1000, handle_syntax_frame, session) == NULL)
+	{
+		printf("Failed to send CLID_GET_SYNTAX_REQUEST, errno = %d!\n", errno);
+		return false;
+	}
+
+	return true;
+}
+
+/* An older clid never answers, the request just times out then */
+static void handle_syntax_frame(struct clid_request *request, int status, const struct clid_v2_frame *frame, void *user_data)
+{
+	(void)request;
+
+	if(status == CLID_CLIENT_OK && frame->type == CLID_V2_TYPE(CLID_GET_SYNTAX_REPLY))
+	{
+		handle_get_syntax_reply(user_data, frame);
+	}
+}
+
+/* An older clid never answers, its commands are then only checked by their handlers as before */
+static void handle_get_syntax_reply(struct remote_session *session, const struct clid_v2_frame *frame)
+{
+	struct clid_v2_reader reader;
+	clid_v2_reader_init(&reader, frame->payload, frame->payload_length);
+	uint32_t errorcode = clid_v2_read_varint(&reader);
+	uint32_t num_cmds = clid_v2_read_varint(&reader);
+	for(uint32_t i = 0; i < num_cmds && errorcode == CLID_STATUS_OK && !reader.error; i++)
+	{
+		uint32_t cmd_len, syntax_len;
+		const char *cmd = clid_v2_read_string(&reader, &cmd_len);
+		const uint8_t *syntax = (const uint8_t *)clid_v2_read_string(&reader, &syntax_len);
+		if(reader.error || cmd_len >= MAX_ARG_LENGTH)
+		{
+			continue;
+		}
+
+		char name[MAX_ARG_LENGTH];
+		memcpy(name, cmd, cmd_len);
+		name[cmd_len] = '\0';
+
+		struct remote_cmd **iter = tfind(name, &session->remote_cmd_tree, compare_cmd_name_in_remotecmd_tree);
+		if(iter != NULL)
+		{
+			free((*iter)->syntax);
+			(*iter)->syntax = decode_syntax_graph(syntax, syntax_len);
+		}
+	}
+
+	if(reader.error)
+	{
+		printf("Received truncated CLID_GET_SYNTAX_REPLY from tcp://%s:%d!\n", session->ip, TCP_CLID_PORT);
+	}
+}
+
+/* NULL if there is no syntax, or one this shell does not understand. Every index is checked here, so walking the graph never has to */
+static struct syntax_graph *decode_syntax_graph(const uint8_t *syntax, uint32_t syntax_len)
+{
+	struct clid_v2_reader reader;
+	clid_v2_reader_init(&reader, syntax, syntax_len);
+	uint32_t version = clid_v2_read_varint(&reader);
+	uint32_t num_nodes = clid_v2_read_varint(&reader);
+	uint32_t num_edges = clid_v2_read_varint(&reader);
+	if(reader.error || version != CLID_SYNTAX_VERSION || num_nodes == 0 || num_nodes > CLID_MAX_SYNTAX_NODES || num_edges > syntax_len)
+	{
+		return NULL;
+	}
+
+	size_t nodes_offset = sizeof(struct syntax_graph);
+	size_t children_offset = nodes_offset + num_nodes * sizeof(struct syntax_node);
+	size_t names_offset = children_offset + num_edges * sizeof(uint32_t);
+	uint8_t *buff = malloc(names_offset + syntax_len);
+	if(buff == NULL)
+	{
+		return NULL;
+	}
+
+	// Names point into our own copy of the syntax, the reply it came with is gone soon
+	struct syntax_graph *graph = (struct syntax_graph *)((void *)buff);
+	graph->num_nodes = num_nodes;
+	graph->nodes = (struct syntax_node *)((void *)(buff + nodes_offset));
+	uint32_t *children = (uint32_t *)((void *)(buff + children_offset));
+	memcpy(buff + names_offset, syntax, syntax_len);
+	clid_v2_reader_init(&reader, buff + names_offset, syntax_len);
+	clid_v2_read_varint(&reader);
+	clid_v2_read_varint(&reader);
+	clid_v2_read_varint(&reader);
+
+	uint32_t edge = 0;
+	for(uint32_t i = 0; i < num_nodes && !reader.error; i++)
+	{
+		struct syntax_node *node = &graph->nodes[i];
+		node->flags = clid_v2_read_varint(&reader);
+		node->name = clid_v2_read_string(&reader, &node->name_len);
+		node->num_children = clid_v2_read_varint(&reader);
+		node->children = &children[edge];
+		if(node->num_children > num_edges - edge)
+		{
+			reader.error = true;
+			break;
+		}
+
+		for(uint32_t c = 0; c < node->num_children; c++)
+		{
+			children[edge] = clid_v2_read_varint(&reader);
+			reader.error = reader.error || children[edge] >= num_nodes;
+			edge++;
+		}
+	}
+
+	if(reader.error || edge != num_edges)
+	{
+		free(buff);
+		return NULL;
+	}
+
+	return graph;
+}
+
+/* Same verdict as CmdSyntaxGraph::findCmdHandler() on the device, and the same usage printed if the arguments do not lead to a handler */
+static bool check_remote_cmd_syntax(const struct syntax_graph *graph)
+{
+	uint32_t node = evaluate_syntax_args(graph, 0, m_nr_args - 1, m_args + 1, false);
+	if((graph->nodes[node].flags & CLID_SYNTAX_NODE_HANDLER) != 0)
+	{
+		return true;
+	}
+
+	printf("Usage: %s ", m_args[0]);
+	node = evaluate_syntax_args(graph, 0, m_nr_args - 1, m_args + 1, true);
+	print_next_syntax_args(graph, node);
+	printf("\n\n");
+
+	return false;
+}
+
+/* Port of CmdSyntaxGraph::evaluateCommandArguments(), is_printed stands for its validArgs */
+static uint32_t evaluate_syntax_args(const struct syntax_graph *graph, uint32_t node, int nr_args, char **args, bool is_printed)
+{
+	for(int i = 0; i < nr_args; i++)
+	{
+		const struct syntax_node *current = &graph->nodes[node];
+		size_t arg_len = strlen(args[i]);
+
+		// Prefer an exact literal, otherwise all any-value subnodes match
+		uint32_t match = 0;
+		uint32_t num_matches = 0;
+		for(uint32_t c = 0; c < current->num_children && num_matches == 0; c++)
+		{
+			const struct syntax_node *child = &graph->nodes[current->children[c]];
+			if((child->flags & CLID_SYNTAX_NODE_ANY_VALUE) == 0 && is_syntax_node_matched(child, args[i], arg_len))
+			{
+				match = current->children[c];
+				num_matches = 1;
+			}
+		}
 
-			printf("Invalid argurment with minuses '-'!\n");
-			free(token);
-			return -1;
-		} else if((*str >= '0' && *str <= '9'))
+		bool is_literal = num_matches == 1;
+		for(uint32_t c = 0; c < current->num_children && !is_literal; c++)
+		{
+			if((graph->nodes[current->children[c]].flags & CLID_SYNTAX_NODE_ANY_VALUE) != 0 && num_matches++ == 0)
+			{
+				match = current->children[c];
+			}
+		}
+
+		if(num_matches == 0)
+		{
+			return node;
+		} else if(num_matches == 1)
 		{
-			/* If there were a token starting with two minus, not allowed to have digit right after the two minus */
-			/* Or if there were a token starting with one minus, but not negative interger (instead, it's a single flag like -D, -a, -v,...), no more than two characters accepted */
-			if((start_with_two_minus && i == 2) || (start_with_one_minus && is_single_flag))
+			if((graph->nodes[match].flags & CLID_SYNTAX_NODE_HANDLER) != 0 && i == nr_args - 1)
 			{
-				printf("Invalid argurment with digits '0-9'!\n");
-				free(token);
-				return -1;
+				return match;
 			}
 
-			/* If there were a token starting with a digit, not allowed to have '-' or alphabets right then */
-			if(i == 0)
+			node = match;
+			if(is_printed)
+			{
+				printf("%.*s ", (int)graph->nodes[node].name_len, graph->nodes[node].name);
+			}
+			continue;
+		}
+
+		// Several any-value subnodes, whichever path leads to a handler with the remaining arguments wins
+		for(uint32_t c = 0; c < current->num_children; c++)
+		{
+			if((graph->nodes[current->children[c]].flags & CLID_SYNTAX_NODE_ANY_VALUE) != 0)
 			{
-				start_with_int = true;
+				uint32_t res = evaluate_syntax_args(graph, current->children[c], nr_args - (i + 1), args + (i + 1), false);
+				if((graph->nodes[res].flags & CLID_SYNTAX_NODE_HANDLER) != 0)
+				{
+					return res;
+				}
 			}
+		}
+
+		if(is_printed)
+		{
+			printf("%s ", args[i]);
+		}
+		return match;
+	}
+
+	return node;
+}
 
-			token[i] = *str++;
-			i++;
-			nr_chars++;
-		} else if((*str >= 'a' && *str <= 'z') || (*str >= 'A' && *str <= 'Z')) 
+/* Port of CmdSyntaxGraph::printNextPossibleArguments(). A path never has more steps than nodes, even in a malformed graph */
+static void print_next_syntax_args(const struct syntax_graph *graph, uint32_t node)
+{
+	for(uint32_t steps = 0; steps < graph->num_nodes; steps++)
+	{
+		const struct syntax_node *current = &graph->nodes[node];
+		if(current->num_children == 0)
+		{
+			break;
+		} else if(current->num_children == 1)
 		{
-			/* Or if there were a token starting with one minus, but not negative interger (instead, it's a single flag like -D, -a, -v,...), no more than two characters accepted */
-			/* Or if there were a token starting with a digit, not allowed to have alphabets right then */
-			if((start_with_one_minus && i != 1) || (start_with_int))
+			// See the cases in printNextPossibleArguments(), an optional last argument is the only one put in brackets here
+			bool has_prev_handler = (current->flags & CLID_SYNTAX_NODE_HANDLER) != 0;
+			node = current->children[0];
+			const struct syntax_node *next = &graph->nodes[node];
+			if(has_prev_handler && (next->flags & CLID_SYNTAX_NODE_HANDLER) != 0 && next->num_children == 0)
+			{
+				printf("[ %.*s ] ", (int)next->name_len, next->name);
+			} else
 			{
-				printf("Invalid argurment with alphabets 'a-z' or 'A-Z'!\n");
-				free(token);
-				return -1;
-			} else if(start_with_one_minus && i == 1)
+				printf("%.*s ", (int)next->name_len, next->name);
+			}
+		} else if(current->num_children == 2 && graph->nodes[current->children[0]].num_children > 0 &&
+			graph->nodes[current->children[0]].children[0] == current->children[1])
+		{
+			// A -> B -> C along with A -> C, that is A [ B ] C
+			const struct syntax_node *optional = &graph->nodes[current->children[0]];
+			node = current->children[1];
+			printf("[ %.*s ] %.*s ", (int)optional->name_len, optional->name, (int)graph->nodes[node].name_len, graph->nodes[node].name);
+		} else
+		{
+			printf("{ ");
+			for(uint32_t c = 0; c < current->num_children; c++)
 			{
-				is_single_flag = true;
+				const struct syntax_node *child = &graph->nodes[current->children[c]];
+				printf("%s%.*s%s", c > 0 ? "| " : "", (int)child->name_len, child->name, c < current->num_children - 1 ? " " : "");
 			}
+			printf(" }");
+			break;
+		}
+	}
+}
+
+static bool is_syntax_node_matched(const struct syntax_node *node, const char *arg, size_t arg_len)
+{
+	return node->name_len == arg_len && memcmp(node->name, arg, arg_len) == 0;
+}
 
-			token[i] = *str++;
-			i++;
-			nr_chars++;
-		} else if(*str == '.')
+/* Up, or down. A session nobody used yet fails quietly, a foreground connect tells why, and one that was ready went down */
+static void handle_session_conn(struct clid_conn *conn, int status, void *user_data)
+{
+	struct remote_session *session = user_data;
+	if(status != CLID_CLIENT_OK)
+	{
+		// The client closes it right after this
+		session->conn = NULL;
+		if(session->state == SESSION_READY && session->is_prefetched)
 		{
-			/* Or if there were a token starting with a digit, only floating point '.' is accepted */
-			/* Or if there were a token starting with a minus '-', floating point '.' is also accepted */
-			if(start_with_int || (start_with_one_minus && !is_single_flag))
+			fail_prefetch(session);
+		} else if(session->state == SESSION_READY)
+		{
+			bool is_active = session == m_active_session;
+			begin_notification();
+			printf("%sRemote device tcp://%s:%d went down, disconnected from it!\n", is_active ? "\n" : "", session->ip, TCP_CLID_PORT);
+			close_session(session);
+			if(is_active)
 			{
-				token[i] = *str++;
-				i++;
-				nr_chars++;
+				// Back to the local prompt, along with whatever was pipelined behind the command
+				printf("\n");
+				m_is_prompt_needed = true;
 			} else
 			{
-				printf("Invalid argurment with dots '.'!\n");
-				free(token);
-				return -1;
+				end_notification();
 			}
 		} else
 		{
-			/* Any characters except for 0-9, a-z, A-Z and '-' are not allowed */
-			printf("Invalid argurment, unknown character: '%c'\n", *str);
-			free(token);
-			return -1;
+			if(session->state == SESSION_CONNECTING && !session->is_prefetched)
+			{
+				printf("Failed to connect to device: tcp://%s:%d, %s!\n", session->ip, TCP_CLID_PORT, clid_client_strerror(status));
+			}
+			session->state = SESSION_FAILED;
 		}
+		return;
 	}
 
-	token[i] = '\0';
-	// printf("get_token - Token with %d characters: \"%s\"\n", i, token);
+	// Only a v2 clid is prefetched, an old one would cost a connection for nothing but a list
+	session->proto = clid_conn_get_proto(conn);
+	if(session->is_prefetched && session->proto != CLID_PROTO_V2)
+	{
+		session->state = SESSION_FAILED;
+		return;
+	}
 
-	if(strlen(token) <= 0)
+	if(!session->is_prefetched)
 	{
-		free(token);
-		return 0;
+		printf("Connected to device: tcp://%s:%d\n", session->ip, TCP_CLID_PORT);
+		printf("Using protocol version %hhu\n", session->proto);
+	}
+
+	// Whatever we got from this device last time, clid tells whether it is still valid
+	if(session->proto == CLID_PROTO_V2)
+	{
+		load_cmd_cache(session);
+	}
+
+	if(clid_list(conn, session->registry_epoch, session->registry_version, 0, handle_session_list, session) == NULL)
+	{
+		printf("Failed to send CLID_GET_LIST_CMD_REQUEST, errno = %d!\n", errno);
+		session->state = SESSION_FAILED;
+		return;
 	}
 
-	return nr_chars;
+	if(!session->is_prefetched)
+	{
+		printf("Sent CLID_GET_LIST_CMD_REQUEST successfully!\n");
+	}
+	session->state = SESSION_LISTING;
 }
 
-static int get_args(char *cmd, char *args[])
+/* Pushes of a newer clid that we do not know yet are just dropped, a change pushed before the list is already part of it */
+static void handle_session_push(struct clid_conn *conn, const struct clid_v2_frame *frame, void *user_data)
 {
-	char *token = malloc(MAX_ARG_LENGTH);
-	
-	int i = 0;
-	int nr_chars = 0;
-	while((nr_chars = get_token(cmd, token)) > 0)
+	(void)conn;
+
+	struct remote_session *session = user_data;
+	if(session->state == SESSION_READY && frame->type == CLID_V2_TYPE(CLID_CMD_LIST_CHANGED))
 	{
-		args[i] = token;
-		// printf("Token %d: \"%s\"\n", i, token);
-		token = malloc(MAX_ARG_LENGTH);
-		cmd += nr_chars;
-		i++;
+		handle_cmd_list_changed(session, frame);
 	}
+}
+
+/* Shared by connect and the background prefetch, the latter must not print anything unless the reply is broken */
+static void handle_session_list(struct clid_request *request, const struct clid_list_reply *reply, void *user_data)
+{
+	(void)request;
 
-	if(nr_chars == -1)
+	struct remote_session *session = user_data;
+	if(reply->status != CLID_CLIENT_OK)
 	{
-		/* If any invalid argument, must free the previous valid ones */
-		for(int j = 0; j < i; j++)
+		if(!session->is_prefetched)
 		{
-			free(args[j]);
-			args[j] = NULL;
+			printf("Failed to receive CLID_GET_LIST_CMD_REPLY from tcp://%s:%d, %s!\n", session->ip, TCP_CLID_PORT, clid_client_strerror(reply->status));
 		}
-		return 0;
+		session->state = SESSION_FAILED;
+		return;
+	}
+
+	if(!session->is_prefetched)
+	{
+		printf("Re-interpret TCP packet: errorcode: %u\n", reply->errorcode);
+		printf("Re-interpret TCP packet: num_cmds: %u\n", reply->num_cmds);
+	}
+
+	if(!apply_cmd_list(session, reply))
+	{
+		session->state = SESSION_FAILED;
+		return;
+	}
+
+	if(!session->is_prefetched && reply->errorcode == CLID_STATUS_LIST_UNCHANGED)
+	{
+		printf("Command list unchanged since the last connection, using the cached one!\n");
 	}
 
-	return i;
+	// Syntaxes for Tab come on the side, connect asks for them itself once the session is active
+	session->state = SESSION_READY;
+	session->deadline_ns = 0;
+	if(session->is_prefetched)
+	{
+		send_v2_get_syntax_request(session, NULL, 0);
+	}
 }
 
-static int is_local_cmd(char *str)
+/* Keep our copy of the command list in step with clid, no need to reconnect for a handler that just came up.
+Changes on idle sessions are applied silently, they show up once "use" switches to them */
+static void handle_cmd_list_changed(struct remote_session *session, const struct clid_v2_frame *frame)
 {
-	int i = 0;
-	while(i < NUM_INTERNAL_CMDS)
+	struct clid_v2_reader reader;
+	clid_v2_reader_init(&reader, frame->payload, frame->payload_length);
+	uint32_t change = clid_v2_read_varint(&reader);
+	uint32_t cmd_len, cmd_desc_len;
+	const char *cmd = clid_v2_read_string(&reader, &cmd_len);
+	const char *cmd_desc = clid_v2_read_string(&reader, &cmd_desc_len);
+	if(reader.error)
 	{
-		if(strcmp(str,m_local_cmds[i].cmd) == 0)
+		printf("Received truncated CLID_CMD_LIST_CHANGED from tcp://%s:%d!\n", session->ip, TCP_CLID_PORT);
+		return;
+	}
+
+	// Its syntax comes along with the handler registration, clid has it by the time our request gets there
+	if(change == CLID_CMD_ADDED)
+	{
+		send_v2_get_syntax_request(session, cmd, cmd_len);
+	}
+
+	if(session != m_active_session)
+	{
+		if(change == CLID_CMD_ADDED)
 		{
-			return i;
+			add_remote_cmd(session, cmd, cmd_len, cmd_desc, cmd_desc_len);
+		} else if(change == CLID_CMD_REMOVED)
+		{
+			remove_remote_cmd(session, cmd, cmd_len);
 		}
-		
-		i++;
+		return;
 	}
 
-	return -1;
+	begin_notification();
+	if(change == CLID_CMD_ADDED && add_remote_cmd(session, cmd, cmd_len, cmd_desc, cmd_desc_len))
+	{
+		printf("Remote command %.*s is now available!\n", (int)cmd_len, cmd);
+	} else if(change == CLID_CMD_REMOVED && remove_remote_cmd(session, cmd, cmd_len))
+	{
+		printf("Remote command %.*s is gone!\n", (int)cmd_len, cmd);
+	}
+	end_notification();
 }
 
-void execute_local_cmd(int index, char **args)
+static void finish_pending_cmd(void)
 {
-	if(m_local_cmds[index].handler == NULL)
+	if(m_pending.is_timed)
 	{
-		printf("Handler for command %s not found!\n", m_local_cmds[index].cmd);
-		return;
+		print_exe_cmd_timing(&m_pending.timing, get_time_ns() - m_pending.sent_ns);
 	}
 
-	m_local_cmds[index].handler(args);
+	m_pending.is_pending = false;
+	m_is_prompt_needed = true;
 }
 
-static bool setup_local_cmds(void)
+/* Give up on the pending command along with whatever was typed ahead of its reply */
+static void cancel_pending_cmd(void)
 {
-	strcpy(m_local_cmds[0].cmd, "help");
-	m_local_cmds[0].handler = &local_help;
-	strcpy(m_local_cmds[0].description, "List all local and remote commands, respective syntaxes and description.");
-	strcpy(m_local_cmds[0].syntax, "help");
+	// A job brought to the foreground is only detached, it goes on in the background and its spool has all of the output
+	if(m_pending.job != NULL)
+	{
+		printf("[%d] Running in the background, fg %d shows its output\n\n", m_pending.job->id, m_pending.job->id);
+		m_pending.job = NULL;
+	}
 
-	strcpy(m_local_cmds[1].cmd, "exit");
-	m_local_cmds[1].handler = &local_exit;
-	strcpy(m_local_cmds[1].description, "Disconnect from remote device and exit current shell.");
-	strcpy(m_local_cmds[1].syntax, "exit");
+	if(m_pending.request != NULL)
+	{
+		clid_request_cancel(m_pending.request);
+		m_pending.request = NULL;
+	}
 
-	strcpy(m_local_cmds[2].cmd, "history");
-	m_local_cmds[2].handler = &local_history;
-	strcpy(m_local_cmds[2].description, "List all history commands in current shell session.");
-	strcpy(m_local_cmds[2].syntax, "history");
+	m_output.is_quit = true;
+	end_cmd_output();
+	m_pending.is_pending = false;
+	m_num_queued = 0;
+	m_input_pos = m_input_len;
+	m_buff_len = 0;
+	m_cursor = 0;
+	m_buffer[0] = '\0';
+	m_esc_state = ESC_NONE;
+	m_is_prompt_needed = true;
+}
 
-	strcpy(m_local_cmds[3].cmd, "scan");
-	m_local_cmds[3].handler = &local_scan;
-	strcpy(m_local_cmds[3].description, "Scan remote devices being active.");
-	strcpy(m_local_cmds[3].syntax, "scan");
-	
-	strcpy(m_local_cmds[4].cmd, "connect");
-	m_local_cmds[4].handler = &local_connect;
-	strcpy(m_local_cmds[4].description, "Connect to remote device via an index returned by scan command.");
-	strcpy(m_local_cmds[4].syntax, "connect { --idx <index> | --ip <ip> }");
-	
-	strcpy(m_local_cmds[5].cmd, "disconnect");
-	m_local_cmds[5].handler = &local_disconnect;
-	strcpy(m_local_cmds[5].description, "Disconnect from an already connected remote device.");
-	strcpy(m_local_cmds[5].syntax, "disconnect");
+/* The output goes to output_fd, which is closed once done with unless it is STDOUT_FILENO */
+static void execute_remote_cmd(bool is_timed, int output_fd, const char *output_path)
+{
+	struct remote_session *session = m_active_session;
+	bool is_valid = check_remote_cmd(session);
+	if(is_valid)
+	{
+		printf("Executing remote command %s...\n", m_args[0]);
+	}
 
-	return true;
+	uint64_t sent_ns = get_time_ns();
+	struct clid_request *request = is_valid ? clid_exec(session->conn, is_timed ? CLID_V2_FLAG_TIMING : 0, m_nr_args, (const char *const *)m_args,
+		CMD_EXECUTION_TIMEOUT * 1000, handle_exec_reply, NULL) : NULL;
+	if(request == NULL)
+	{
+		if(is_valid)
+		{
+			printf("Failed to send CLID_EXE_CMD_REQUEST, errno = %d!\n", errno);
+		}
+		if(output_fd != STDOUT_FILENO)
+		{
+			close(output_fd);
+		}
+		return;
+	}
+	printf("Sent CLID_EXE_CMD_REQUEST successfully!\n");
+
+	start_cmd_output(output_fd, output_path);
+
+	// The main loop takes it from here, see handle_exec_reply()
+	m_pending.is_pending = true;
+	m_pending.session = session;
+	m_pending.request = request;
+	m_pending.job = NULL;
+	m_pending.is_timed = is_timed;
+	m_pending.timing.is_valid = false;
+	m_pending.sent_ns = sent_ns;
 }
 
-static bool local_help(char **args)
+/* Each piece goes out as it arrives, so the output is never held in full */
+static void handle_exec_reply(struct clid_request *request, const struct clid_exec_reply *reply, void *user_data)
 {
-	(void)args;
+	(void)request;
+	(void)user_data;
 
-	if(m_nr_args > 1)
+	if(reply->status == CLID_CLIENT_ERR_CLOSED && m_pending.session != NULL)
 	{
-		printf("help: Too many arguments!\n\n");
+		// The device went down, handle_session_conn() tells so and closes the session right after
+		m_pending.request = NULL;
+		return;
+	} else if(reply->status != CLID_CLIENT_OK)
+	{
+		m_pending.request = NULL;
+		if(reply->status == CLID_CLIENT_ERR_TIMEOUT)
+		{
+			printf("\nNo reply within %d s, give up waiting for it!\n\n", CMD_EXECUTION_TIMEOUT + CLID_CLIENT_REPLY_GRACE_MS / 1000);
+		} else
+		{
+			printf("\nFailed to receive CLID_EXE_CMD_REPLY, %s!\n\n", clid_client_strerror(reply->status));
+		}
+		m_output.is_quit = true;
+		end_cmd_output();
+		finish_pending_cmd();
+		return;
+	}
+
+	if(reply->is_first)
+	{
+		printf("Re-interpret TCP packet: errorcode: %u\n", reply->errorcode);
+		printf("Re-interpret TCP packet: result: %u\n", reply->result);
+		printf("Re-interpret TCP packet: cmd_output:\n");
+		if(reply->timing != NULL)
+		{
+			m_pending.timing.clid_queue_us = reply->timing->clid_queue_us;
+			m_pending.timing.itc_us = reply->timing->itc_us;
+			m_pending.timing.cmdif_queue_us = reply->timing->cmdif_queue_us;
+			m_pending.timing.handler_us = reply->timing->handler_us;
+			m_pending.timing.relay_us = reply->timing->relay_us;
+			m_pending.timing.is_valid = true;
+		}
+	}
+
+	write_cmd_output(reply->output, reply->output_len);
+
+	if(reply->is_last)
+	{
+		m_pending.request = NULL;
+		complete_cmd_output();
+	}
+}
+
+/* Known to the session, with arguments its syntax takes. Why not is printed otherwise */
+static bool check_remote_cmd(struct remote_session *session)
+{
+	struct remote_cmd **iter = session != NULL ? tfind(m_args[0], &session->remote_cmd_tree, compare_cmd_name_in_remotecmd_tree) : NULL;
+	if(iter == NULL)
+	{
+		printf("Unknown command: %s!\n", m_args[0]);
 		return false;
 	}
 
-	printf("%-64s %-128s\n", "Syntax", "Description");
-	printf("%-64s %-128s\n", "------", "-----------");
-	for(int i = 0; i < NUM_INTERNAL_CMDS; i++)
+	// Wrong arguments get the same usage as from the handler, without waking it up
+	return (*iter)->syntax == NULL || check_remote_cmd_syntax((*iter)->syntax);
+}
+
+static void start_cmd_output(int fd, const char *path)
+{
+	m_output.fd = fd;
+	snprintf(m_output.path, sizeof(m_output.path), "%s", path != NULL ? path : "");
+	m_output.len = 0;
+	m_output.total = 0;
+	m_output.is_failed = false;
+	m_output.is_paused = false;
+	m_output.is_quit = false;
+	m_output.is_complete = false;
+	m_output.line = 0;
+	m_output.col = 0;
+
+	struct winsize ws;
+	m_output.is_paged = m_is_pager_on && fd == STDOUT_FILENO && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 2 && ws.ws_col > 0;
+	m_output.rows = m_output.is_paged ? ws.ws_row : 0;
+	m_output.cols = m_output.is_paged ? ws.ws_col : 0;
+}
+
+/* Bytes of the output in the order they arrive, whatever the fragments of the reply are */
+static void write_cmd_output(const char *data, size_t len)
+{
+	m_output.total += len;
+	if(m_output.is_quit || m_output.is_failed)
 	{
-		printf("%-64s %-128s\n", m_local_cmds[i].syntax, m_local_cmds[i].description);
+		return;
 	}
-	for(int i = 0; i < MAX_REMOTE_CMDS; i++)
+
+	if(!m_output.is_paged)
+	{
+		buffer_cmd_output(data, len);
+		return;
+	}
+
+	// Anything still spooled has to be shown first
+	size_t done = m_output.is_paused || m_output.spool_pos < m_output.spool_len ? 0 : page_cmd_output(data, len);
+	if(done < len)
+	{
+		spool_cmd_output(data + done, len - done);
+	}
+}
+
+/* Last fragment of the reply is in, the command finishes right away unless the pager still has some of it to show */
+static void complete_cmd_output(void)
+{
+	m_output.is_complete = true;
+	if(!m_output.is_paused && m_output.spool_pos == m_output.spool_len)
+	{
+		end_cmd_output();
+		finish_pending_cmd();
+	}
+}
+
+/* Also when the command is given up on, then without the newline or summary of a complete output */
+static void end_cmd_output(void)
+{
+	if(m_output.fd < 0)
+	{
+		return;
+	}
+
+	flush_cmd_output();
+	if(m_output.spool != NULL)
 	{
-		if(m_remote_cmds[i].cmd[0] != '\0')
+		fclose(m_output.spool);
+		m_output.spool = NULL;
+	}
+	m_output.spool_len = 0;
+	m_output.spool_pos = 0;
+	m_output.is_paused = false;
+
+	if(m_output.fd >= 0 && m_output.fd != STDOUT_FILENO)
+	{
+		bool is_closed = close(m_output.fd) == 0;
+		if(m_output.is_failed || !is_closed)
+		{
+			printf("Failed to write output to %s, errno = %d!\n", m_output.path, errno);
+		} else
 		{
-			printf("%-64s %-128s\n", m_remote_cmds[i].cmd, m_remote_cmds[i].description);
+			printf("%s %llu bytes of output to %s\n", m_output.is_complete ? "Saved" : "Saved only", (unsigned long long)m_output.total, m_output.path);
 		}
+	} else if(m_output.is_complete)
+	{
+		printf("\n");
 	}
-	printf("\n");
 
-	printf("Syntax Explanation:\n");
-	printf("%-20s %-128s\n", "Syntax Form", "Meaning");
-	printf("%-20s %-128s\n", "-----------", "-------");
-	printf("%-20s %-128s\n", "abc", "string literal value");
-	printf("%-20s %-128s\n", "<abc>", "any value");
-	printf("%-20s %-128s\n", "{ abc | def }", "alternative values");
-	printf("%-20s %-128s\n", "[ abc ]", "optional value");
-	printf("%-20s %-128s\n", "[ abc | def ]", "optional alternative values, simplified form of [ { abc | def } ]");
-	printf("\n");
+	m_output.fd = -1;
+}
 
-	return true;
+/* Show as much as fits before the next --More--, return how many bytes of data that is */
+static size_t page_cmd_output(const char *data, size_t len)
+{
+	for(size_t i = 0; i < len; i++)
+	{
+		if(data[i] == '\n' || ++m_output.col == m_output.cols)
+		{
+			m_output.col = 0;
+			if(++m_output.line >= m_output.rows - 1)
+			{
+				buffer_cmd_output(data, i + 1);
+				flush_cmd_output();
+				printf("\33[7m--More--\33[0m");
+				fflush(stdout);
+				m_output.is_paused = true;
+				return i + 1;
+			}
+		}
+	}
+
+	buffer_cmd_output(data, len);
+	return len;
+}
+
+static void buffer_cmd_output(const char *data, size_t len)
+{
+	while(len > 0 && !m_output.is_failed)
+	{
+		size_t n = OUTPUT_BUFF_SIZE - m_output.len < len ? OUTPUT_BUFF_SIZE - m_output.len : len;
+		memcpy(m_output.buff + m_output.len, data, n);
+		m_output.len += n;
+		data += n;
+		len -= n;
+		if(m_output.len == OUTPUT_BUFF_SIZE)
+		{
+			flush_cmd_output();
+		}
+	}
 }
 
-static bool local_exit(char **args)
+static void flush_cmd_output(void)
 {
-	(void)args;
+	if(m_output.len == 0 || m_output.is_failed)
+	{
+		m_output.len = 0;
+		return;
+	}
 
-	printf("Exiting the shell...\n");
+	// Whatever printf() still has comes first
+	if(m_output.fd == STDOUT_FILENO)
+	{
+		fflush(stdout);
+	}
 
-	if(m_nr_args > 1)
+	size_t written = 0;
+	while(written < m_output.len)
 	{
-		printf("exit: Too many arguments!\n\n");
-		return false;
+		ssize_t res = write(m_output.fd, m_output.buff + written, m_output.len - written);
+		if(res < 0 && errno == EINTR)
+		{
+			continue;
+		} else if(res <= 0)
+		{
+			m_output.is_failed = true;
+			break;
+		}
+		written += res;
 	}
 
-	printf("Exited the shell successfully!\n\n");
-	m_is_exit = true;
-	return true;
+	m_output.len = 0;
 }
 
-static bool local_history(char **args)
+static void spool_cmd_output(const char *data, size_t len)
 {
-	(void)args;
+	if(m_output.spool == NULL && (m_output.spool = tmpfile()) == NULL)
+	{
+		// Nowhere to keep it, rather show it all than lose it
+		printf("\33[2K\rFailed to create pager spool, errno = %d, paging is off for this output!\n", errno);
+		m_output.is_paged = false;
+		m_output.is_paused = false;
+		buffer_cmd_output(data, len);
+		return;
+	}
 
-	if(m_nr_args > 1)
+	if(pwrite(fileno(m_output.spool), data, len, (off_t)m_output.spool_len) != (ssize_t)len)
 	{
-		printf("history: Too many arguments!\n\n");
-		return false;
+		printf("\33[2K\rFailed to write pager spool, errno = %d!\n", errno);
+		m_output.is_failed = true;
+		return;
 	}
+	m_output.spool_len += len;
+}
 
-	printf("%-3s %-128s\n", "Index", "Command");
-	printf("%-3s %-128s\n", "-----", "-------");
-	struct history_cmd *iter = m_hist_cmd_queue.head;
-	for(int i = 0; i < m_num_hist_cmd; i++)
+/* At --More--: space for the next page, enter for the next line, q for nothing more of this output */
+static void handle_pager_key(char c)
+{
+	if(c == 'q' || c == 'Q')
+	{
+		m_output.is_quit = true;
+		m_output.spool_pos = m_output.spool_len;
+	} else if(c == ' ')
 	{
-		char index[5];
-		sprintf(index, "%d", i + 1);
-		printf("%-5s %-128s\n", index, iter->cmd);
-		iter = iter->next;
+		m_output.line = 0;
+	} else if(c == '\n' || c == '\r')
+	{
+		m_output.line = m_output.rows - 2;
+	} else
+	{
+		return;
 	}
-	printf("\n");
 
-	return true;
+	printf("\33[2K\r");
+	m_output.is_paused = false;
+	resume_cmd_output();
 }
 
-static bool local_scan(char **args)
+/* Show the spool up to the next --More--, then the output goes on as it arrives */
+static void resume_cmd_output(void)
 {
-	(void)args;
-
-	if(m_nr_args > 1)
+	static char chunk[OUTPUT_BUFF_SIZE];
+	while(!m_output.is_paused && m_output.spool_pos < m_output.spool_len)
 	{
-		printf("scan: Too many arguments!\n\n");
-		return false;
+		size_t n = m_output.spool_len - m_output.spool_pos < sizeof(chunk) ? m_output.spool_len - m_output.spool_pos : sizeof(chunk);
+		if(pread(fileno(m_output.spool), chunk, n, (off_t)m_output.spool_pos) != (ssize_t)n)
+		{
+			printf("Failed to read pager spool, errno = %d!\n", errno);
+			m_output.spool_pos = m_output.spool_len;
+			break;
+		}
+		m_output.spool_pos += page_cmd_output(chunk, n);
 	}
 
-	printf("%-10s %-64s %-25s %-7s\n", "Unique ID", "Hostname", "IP Address", "Port");
-	printf("%-10s %-64s %-25s %-7s\n", "---------", "--------", "----------", "----");
-	MUTEX_LOCK(&m_remote_hosts_mtx);
-	for(int i = 0; i < MAX_NUM_REMOTE_HOSTS; i++)
+	if(m_output.spool_pos == m_output.spool_len && m_output.spool != NULL)
 	{
-		if(strcmp(m_remote_hosts[i].hostname, "") != 0)
+		// All shown, the spool starts over for the next --More--
+		m_output.spool_pos = 0;
+		m_output.spool_len = 0;
+		if(ftruncate(fileno(m_output.spool), 0) < 0)
 		{
-			char index[5];
-			char port[7];
-			sprintf(index, "%d", i + 1);
-			sprintf(port, "%hu", TCP_CLID_PORT);
-			printf("%-10s %-64s %-25s %-7s\n", index, m_remote_hosts[i].hostname, m_remote_hosts[i].ip, port);
+			m_output.is_failed = true;
 		}
 	}
-	MUTEX_UNLOCK(&m_remote_hosts_mtx);
-	printf("\n");
 
-	return true;
+	flush_cmd_output();
+	if(!m_output.is_paused && m_output.is_complete)
+	{
+		end_cmd_output();
+		finish_pending_cmd();
+	}
 }
 
-static bool local_connect(char **args)
+static void print_exe_cmd_timing(const struct exe_cmd_timing *timing, uint64_t total_ns)
 {
-	char* ipaddr;
-	
-	if(m_nr_args != 3)
+	double total_ms = (double)total_ns / 1000000;
+	if(!timing->is_valid)
 	{
-		printf("scan: Invalid number of arguments!\n\n");
-		return false;
+		// v1 clid, or a clid that does not know CLID_V2_FLAG_TIMING yet
+		printf("%-20s %10.3f ms (no per-hop breakdown from this clid)\n\n", "total", total_ms);
+		return;
 	}
 
-	if(strcmp(args[1], "--idx") == 0)
-	{
-		int index = atoi(args[2]);
+	uint64_t remote_us = (uint64_t)timing->clid_queue_us + timing->itc_us + timing->cmdif_queue_us + timing->handler_us + timing->relay_us;
+	double rest_ms = total_ms - (double)remote_us / 1000;
+
+	printf("%-20s %10s\n", "Hop", "Time");
+	printf("%-20s %10s\n", "---", "----");
+	printf("%-20s %10.3f ms\n", "clid queue", (double)timing->clid_queue_us / 1000);
+	printf("%-20s %10.3f ms\n", "itc (both ways)", (double)timing->itc_us / 1000);
+	printf("%-20s %10.3f ms\n", "cmdif queue", (double)timing->cmdif_queue_us / 1000);
+	printf("%-20s %10.3f ms\n", "handler", (double)timing->handler_us / 1000);
+	printf("%-20s %10.3f ms\n", "clid relay", (double)timing->relay_us / 1000);
+	printf("%-20s %10.3f ms\n", "network and shell", rest_ms > 0 ? rest_ms : 0);
+	printf("%-20s %10.3f ms\n\n", "total", total_ms);
+}
 
-		if(index != 0)
-		{
-			MUTEX_LOCK(&m_remote_hosts_mtx);
-			if(index < 0 || index > MAX_NUM_REMOTE_HOSTS - 1)
-			{
-				printf("Index %d out of range!\n", index);
-				return false;
-			} else if(strcmp(m_remote_hosts[index - 1].ip, "0.0.0.0") == 0)
-			{
-				printf("Remote host for index %d not found in scan table!\n", index);
-				return false;
-			}
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [ -c <ip> ] [ -f <script> [ -p <policy> ] ]\n", prog);
+	printf("\t-c <ip>\t\tConnect to the clid at <ip> right away\n");
+	printf("\t-f <script>\tRun the commands of <script>, one per line, on the clid of -c and exit. \"-\" reads them from stdin\n");
+	printf("\t-p <policy>\tsequential, stop-on-error or parallel, how clid runs the commands of the script. stop-on-error by default\n");
+}
 
-			ipaddr = m_remote_hosts[index - 1].ip;
-			MUTEX_UNLOCK(&m_remote_hosts_mtx);
-			printf ("Connecting to device via index %d ...\n", index);
-		} else
-		{
-			printf("scan: Unknown argument %s!\n\n", args[2]);
-			return false;
-		}
-	} else if(strcmp(args[1], "--ip") == 0)
+static bool parse_batch_policy(const char *str, uint32_t *policy)
+{
+	if(strcmp(str, "sequential") == 0)
 	{
-		ipaddr = args[2];
-		printf ("Connecting to device via ipaddr %s ...\n", ipaddr);
+		*policy = CLID_BATCH_SEQUENTIAL;
+	} else if(strcmp(str, "stop-on-error") == 0)
+	{
+		*policy = CLID_BATCH_STOP_ON_ERROR;
+	} else if(strcmp(str, "parallel") == 0)
+	{
+		*policy = CLID_BATCH_PARALLEL;
 	} else
 	{
-		printf ("Error: Unknown option: %s\n", args[1]);
 		return false;
 	}
 
-	connect_to_remote_host_via_ipaddr(ipaddr);
-
-	m_is_connected = true;
-	snprintf(m_connected_prompt, 35, "%s:%hu$ ", m_active_remote_ip, TCP_CLID_PORT);
-
-	printf("\n");
 	return true;
 }
 
-static bool local_disconnect(char **args)
+/* Send the whole script in CLID_EXE_BATCH_REQUESTs, so that it costs one round trip per batch rather than one per line.
+Return true only if every command succeeded */
+static bool run_script(char *ip, const char *path, uint32_t policy)
 {
-	(void)args;
-	printf("Disconnecting from remote device...\n");
-	m_is_connected = false;
-	
-	if(m_active_fd != -1)
+	bool is_stdin = strcmp(path, "-") == 0;
+	FILE *file = is_stdin ? stdin : fopen(path, "r");
+	if(file == NULL)
 	{
-		close(m_active_fd);
-		m_active_fd = -1;
+		printf("Failed to open script %s, errno = %d!\n", path, errno);
+		return false;
 	}
 
-	for(int i = 0; i < MAX_REMOTE_CMDS; i++)
+	struct script script = { .text = NULL };
+	bool is_loaded = load_script(file, path, &script);
+	if(!is_stdin)
 	{
-		if(m_remote_cmds[i].cmd[0] != '\0')
-		{
-			tdelete(m_remote_cmds[i].cmd, &m_remote_cmd_tree, compare_cmd_name_in_remotecmd_tree);
-
-			m_remote_cmds[i].cmd[0] = '\0';
-			m_remote_cmds[i].description[0] = '\0';
-		}
+		fclose(file);
 	}
 
-	tdestroy(m_remote_cmd_tree, do_nothing);
-
-	printf("Disconnected from remote device successfully!\n\n");
-	return true;
-}
-
-static bool setup_udp_server(void)
-{
-	m_udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if(m_udp_fd < 0)
+	if(!is_loaded)
 	{
-		printf("Failed to create UDP socket(), errno = %d!\n", errno);
+		destroy_script(&script);
 		return false;
 	}
 
-	int broadcast_opt = 1;
-	int res = setsockopt(m_udp_fd, SOL_SOCKET, SO_BROADCAST, &broadcast_opt, sizeof(int));
-	if(res < 0)
+	struct remote_session *session = connect_to_remote_host_via_ipaddr(ip);
+	if(session == NULL)
 	{
-		printf("Failed to setsockopt() SO_BROADCAST, errno = %d!\n", errno);
-		close(m_udp_fd);
+		destroy_script(&script);
 		return false;
 	}
 
-	res = setsockopt(m_udp_fd, SOL_SOCKET, SO_REUSEADDR, &broadcast_opt, sizeof(int));
-	if(res < 0)
+	// Tells the device going down like any active session, without redrawing a prompt nobody reads
+	m_active_session = session;
+	if(session->proto != CLID_PROTO_V2)
 	{
-		printf("Failed to setsockopt() SO_REUSEADDR, errno = %d!\n", errno);
-		close(m_udp_fd);
+		printf("clid at %s does not support batches, protocol version %d is needed!\n", ip, CLID_PROTO_V2);
+		destroy_script(&script);
 		return false;
 	}
 
-	struct sockaddr_in myUDPaddr;
-	size_t size = sizeof(struct sockaddr_in);
-	memset(&myUDPaddr, 0, size);
-	myUDPaddr.sin_family = AF_INET;
-	myUDPaddr.sin_addr.s_addr = INADDR_ANY;
-	myUDPaddr.sin_port = htons(UDP_BROADCAST_PORT);
-
-	res = bind(m_udp_fd, (struct sockaddr *)((void *)&myUDPaddr), size);
-	if(res < 0)
+	// Every line is checked before the first one runs, a typo must not leave a configuration half applied
+	bool is_valid = true;
+	for(size_t i = 0; i < script.count; i++)
 	{
-		printf("Failed to bind(), errno = %d!\n", errno);
-		close(m_udp_fd);
-		return false;
+		const char *cmd_name = get_script_arg(&script, &script.cmds[i], 0);
+		if(tfind(cmd_name, &session->remote_cmd_tree, compare_cmd_name_in_remotecmd_tree) == NULL)
+		{
+			printf("%s:%u: Unknown command: %s!\n", path, script.cmds[i].line, cmd_name);
+			is_valid = false;
+		}
 	}
 
-	// printf("Setup my UDP successfully on %s:%d\n", inet_ntoa(myUDPaddr.sin_addr), ntohs(myUDPaddr.sin_port));
-	return true;
-}
-
-static bool setup_udp_thread(void)
-{
-	int res = pthread_mutex_init(&m_remote_hosts_mtx, NULL);
-	if(res != 0)
+	if(!is_valid)
 	{
-		printf("Failed to pthread_mutex_init server, error code = %d\n", res);
+		destroy_script(&script);
 		return false;
 	}
-	
-	res = pthread_mutex_init(&m_udp_thread_mtx, NULL);
-	if(res != 0)
+
+	uint64_t start_ns = get_time_ns();
+	size_t num_ok = 0;
+	size_t num_failed = 0;
+	size_t num_skipped = 0;
+	size_t next = 0;
+	while(next < script.count)
 	{
-		printf("Failed to pthread_mutex_init server, error code = %d\n", res);
-		return false;
+		size_t num_sent = 0;
+		struct batch_reply reply = { .is_done = false };
+		struct clid_request *request = send_v2_batch_request(session, &script, next, policy, &num_sent, &reply);
+		if(request == NULL || !receive_v2_batch_reply(request, &reply))
+		{
+			free(reply.payload);
+			break;
+		}
+
+		uint8_t *payload = reply.payload;
+		struct clid_v2_reader reader;
+		clid_v2_reader_init(&reader, payload, reply.len);
+		uint32_t errorcode = clid_v2_read_varint(&reader);
+		uint32_t num_results = clid_v2_read_varint(&reader);
+		if(reader.error || errorcode != CLID_STATUS_OK || num_results != num_sent)
+		{
+			printf("Received invalid CLID_EXE_BATCH_REPLY, errorcode = %u, %u results for %zu commands!\n", errorcode, num_results, num_sent);
+			free(payload);
+			break;
+		}
+
+		for(size_t i = 0; i < num_sent; i++)
+		{
+			const struct script_cmd *cmd = &script.cmds[next + i];
+			uint32_t result = clid_v2_read_varint(&reader);
+			uint32_t output_len = 0;
+			const char *output = clid_v2_read_string(&reader, &output_len);
+			if(reader.error)
+			{
+				printf("Received truncated CLID_EXE_BATCH_REPLY!\n");
+				break;
+			}
+
+			printf("=== %s:%u %s: ", path, cmd->line, get_script_arg(&script, cmd, 0));
+			if(result == CLID_EXE_CMD_RESULT_SUCCESS)
+			{
+				printf("OK ===\n");
+				num_ok++;
+			} else if(result == CLID_BATCH_RESULT_SKIPPED)
+			{
+				printf("skipped ===\n");
+				num_skipped++;
+			} else
+			{
+				printf("failed with result %u ===\n", result);
+				num_failed++;
+			}
+
+			fwrite(output, 1, output_len, stdout);
+			if(output_len > 0 && output[output_len - 1] != '\n')
+			{
+				printf("\n");
+			}
+		}
+
+		free(payload);
+		if(reader.error)
+		{
+			break;
+		}
+		next += num_sent;
+
+		// The next batch would run after a failure otherwise
+		if(policy == CLID_BATCH_STOP_ON_ERROR && num_failed > 0)
+		{
+			break;
+		}
 	}
 
-	MUTEX_LOCK(&m_udp_thread_mtx);
-	res = pthread_create(&m_udp_thread_id, NULL, udp_loop, NULL);
-	if(res != 0)
+	// Whatever was not reported on did not run, because of a failure or because clid went away
+	size_t count = script.count;
+	num_skipped += count - num_ok - num_failed - num_skipped;
+	printf("\n%zu commands in %.1f ms: %zu OK, %zu failed, %zu skipped\n", count, (double)(get_time_ns() - start_ns) / 1000000, num_ok, num_failed, num_skipped);
+	fflush(stdout);
+
+	destroy_script(&script);
+	return num_ok == count;
+}
+
+/* One command per line, as it would be typed. Empty lines and lines starting with '#' are ignored.
+Each line is tokenized in place, its arguments are slices of script->text */
+static bool load_script(FILE *file, const char *path, struct script *script)
+{
+	if(!read_script_text(file, path, script))
 	{
-		printf("Failed to pthread_create, error code = %d\n", res);
 		return false;
 	}
-	MUTEX_LOCK(&m_udp_thread_mtx);
-	MUTEX_UNLOCK(&m_udp_thread_mtx);
 
-	return true;
-}
+	size_t cap = 0;
+	size_t args_cap = 0;
+	unsigned int line_no = 0;
+	bool is_valid = true;
+	char *next = NULL;
+	for(char *line = script->text; line != NULL; line = next)
+	{
+		line_no++;
+		char *eol = strchr(line, '\n');
+		next = eol != NULL ? eol + 1 : NULL;
+		size_t line_len = eol != NULL ? (size_t)(eol - line) : strlen(line);
+		while(line_len > 0 && line[line_len - 1] == '\r')
+		{
+			line_len--;
+		}
+		line[line_len] = '\0';
 
-static void* udp_loop(void *data)
-{
-	(void)data;
+		char *start = line + strspn(line, " \t");
+		if(*start == '\0' || *start == '#')
+		{
+			continue;
+		}
 
-	setup_udp_remote_hosts();
+		// A command always goes in one batch, even alone
+		if(line_len > MAX_BATCH_PAYLOAD)
+		{
+			printf("%s:%u: Line too long!\n", path, line_no);
+			is_valid = false;
+			continue;
+		}
 
-	MUTEX_UNLOCK(&m_udp_thread_mtx);
-	fd_set fdset;
-	int max_fd = -1;
-	int res = 0;
-	while(!m_is_exit)
-	{
-		FD_ZERO(&fdset);
-		FD_SET(m_udp_fd, &fdset);
-		max_fd = m_udp_fd + 1;
+		if(script->count == cap)
+		{
+			cap = cap ? cap * 2 : 64;
+			struct script_cmd *new_cmds = realloc(script->cmds, cap * sizeof(struct script_cmd));
+			if(new_cmds == NULL)
+			{
+				printf("Failed to realloc script commands!\n");
+				return false;
+			}
+			script->cmds = new_cmds;
+		}
 
-		MUTEX_LOCK(&m_remote_hosts_mtx);
-		for(int i = 0; i < MAX_NUM_REMOTE_HOSTS; i++)
+		if(args_cap - script->nr_args < MAX_NUM_ARGS)
 		{
-			if(m_remote_hosts[i].alive_timer_fd != -1)
+			args_cap = args_cap ? args_cap * 2 : 4 * MAX_NUM_ARGS;
+			struct arg_slice *new_args = realloc(script->args, args_cap * sizeof(struct arg_slice));
+			if(new_args == NULL)
 			{
-				FD_SET(m_remote_hosts[i].alive_timer_fd, &fdset);
-				max_fd = m_remote_hosts[i].alive_timer_fd >= max_fd ? m_remote_hosts[i].alive_timer_fd + 1 : max_fd;
+				printf("Failed to realloc script arguments!\n");
+				return false;
 			}
+			script->args = new_args;
 		}
-		MUTEX_UNLOCK(&m_remote_hosts_mtx);
 
-		res = select(max_fd, &fdset, NULL, NULL, NULL);
-		if(res < 0)
+		struct arg_slice *slices = &script->args[script->nr_args];
+		const char *reason = NULL;
+		int nr_args = get_args(start, slices, &reason);
+		if(nr_args < 0)
 		{
-			printf("Failed to select() in TCP server loop!\n");
-			return NULL;
+			printf("%s:%u: Invalid command, %s!\n", path, line_no, reason);
+			is_valid = false;
+			continue;
 		}
 
-		if(FD_ISSET(m_udp_fd, &fdset))
+		// Slices start at the line, script->text is what they are kept against
+		uint32_t line_offset = (uint32_t)(start - script->text);
+		for(int i = 0; i < nr_args; i++)
 		{
-			if(handle_receive_broadcast_msg(m_udp_fd) == false)
-			{
-				printf("Failed to handle_receive_broadcast_msg()!\n");
-				return NULL;
-			}
+			slices[i].offset += line_offset;
 		}
 
-		MUTEX_LOCK(&m_remote_hosts_mtx);
-		for(int i = 0; i < MAX_NUM_REMOTE_HOSTS; i++)
+		struct script_cmd *cmd = &script->cmds[script->count++];
+		cmd->line = line_no;
+		cmd->nr_args = nr_args;
+		cmd->first_arg = script->nr_args;
+		script->nr_args += nr_args;
+	}
+
+	return is_valid;
+}
+
+/* Whole file at once and '\0'-terminated, stdin is read up to its end as well. Slice offsets are 32 bits, so is the size of a script */
+static bool read_script_text(FILE *file, const char *path, struct script *script)
+{
+	size_t len = 0;
+	size_t cap = 0;
+	size_t res = 0;
+	do
+	{
+		if(cap - len < 2)
 		{
-			if((FD_ISSET(m_remote_hosts[i].alive_timer_fd, &fdset) && m_remote_hosts[i].alive_timer_fd != -1))
+			cap = cap ? cap * 2 : 64 * 1024;
+			char *text = cap <= UINT32_MAX ? realloc(script->text, cap) : NULL;
+			if(text == NULL)
 			{
-				tdelete(m_remote_hosts[i].hostname, &m_remote_host_tree, compare_hostname_remotehost_tree);
-				strcpy(m_remote_hosts[i].hostname, "");
-				strcpy(m_remote_hosts[i].ip, "0.0.0.0");
-				close(m_remote_hosts[i].alive_timer_fd);
-				m_remote_hosts[i].alive_timer_fd = -1;
+				printf("Failed to realloc script %s, %zu bytes!\n", path, cap);
+				return false;
 			}
+			script->text = text;
 		}
-		MUTEX_UNLOCK(&m_remote_hosts_mtx);
+
+		res = fread(script->text + len, 1, cap - len - 1, file);
+		len += res;
+	} while(res > 0);
+
+	if(ferror(file))
+	{
+		printf("Failed to read script %s, errno = %d!\n", path, errno);
+		return false;
 	}
 
-	close(m_udp_fd);
-	return NULL;
+	script->text[len] = '\0';
+	return true;
+}
+
+static const char *get_script_arg(const struct script *script, const struct script_cmd *cmd, int index)
+{
+	return script->text + script->args[cmd->first_arg + index].offset;
 }
 
-static bool handle_receive_broadcast_msg(int sockfd)
-{
-	struct sockaddr_in m_peerUDPaddr;
-	int MAX_ETHERNET_PACKET_SIZE = 1500;
-	char rx_buff[MAX_ETHERNET_PACKET_SIZE];
-	socklen_t length = sizeof(struct sockaddr_in);
+static void destroy_script(struct script *script)
+{
+	free(script->text);
+	free(script->args);
+	free(script->cmds);
+}
+
+static struct clid_request *send_v2_batch_request(struct remote_session *session, const struct script *script, size_t next, uint32_t policy, size_t *num_sent, struct batch_reply *reply)
+{
+	const struct script_cmd *cmds = script->cmds + next;
+	size_t count = script->count - next;
+	size_t payload_cap = 3 * CLID_VARINT_MAX_SIZE;
+	size_t n = 0;
+	while(n < count && n < CLID_MAX_BATCH_CMDS)
+	{
+		size_t cmd_size = CLID_VARINT_MAX_SIZE;
+		for(int i = 0; i < cmds[n].nr_args; i++)
+		{
+			cmd_size += CLID_VARINT_MAX_SIZE + script->args[cmds[n].first_arg + i].len;
+		}
+
+		if(n > 0 && payload_cap + cmd_size > MAX_BATCH_PAYLOAD)
+		{
+			break;
+		}
+
+		payload_cap += cmd_size;
+		n++;
+	}
 
-	memset(&m_peerUDPaddr, 0, length);
+	uint8_t *payload = malloc(payload_cap);
+	if(payload == NULL)
+	{
+		printf("Failed to malloc CLID_EXE_BATCH_REQUEST payload!\n");
+		return NULL;
+	}
 
-	int res = recvfrom(sockfd, rx_buff, MAX_ETHERNET_PACKET_SIZE, 0, (struct sockaddr *)((void *)&m_peerUDPaddr), &length);
-	if(res < 0)
+	struct clid_v2_writer writer;
+	clid_v2_writer_init(&writer, payload, payload_cap);
+	clid_v2_write_varint(&writer, CMD_EXECUTION_TIMEOUT);
+	clid_v2_write_varint(&writer, policy);
+	clid_v2_write_varint(&writer, (uint32_t)n);
+	for(size_t i = 0; i < n; i++)
 	{
-		if(errno != EINTR)
-		{
-			printf("Failed to recvfrom(), errno = %d!\n", errno);
-		} else
+		clid_v2_write_varint(&writer, cmds[i].nr_args);
+		for(int j = 0; j < cmds[i].nr_args; j++)
 		{
-			printf("Receiving message was interrupted, continue receiving!\n");
+			const struct arg_slice *arg = &script->args[cmds[i].first_arg + j];
+			clid_v2_write_string(&writer, script->text + arg->offset, arg->len);
 		}
-		return false;
 	}
 
-	rx_buff[res] = '\0';
+	// Every command of the batch may take up to CMD_EXECUTION_TIMEOUT, the reply is waited for until Ctrl-C
+	struct clid_request *request = clid_send_request(session->conn, CLID_EXE_BATCH_REQUEST, 0, payload, writer.len, 0, handle_batch_frame, reply);
+	free(payload);
+	if(request == NULL)
+	{
+		printf("Failed to send CLID_EXE_BATCH_REQUEST, errno = %d!\n", errno);
+		return NULL;
+	}
 
-	char hostname[MAX_HOST_NAME_LENGTH];
-	char tcp_ip[25];
-	uint16_t tcp_port;
-	/* Instead of format string "%s" as usual, we must use "%[^:]" meaning read to string tcp_ip until character ':'. */
-	res = sscanf(rx_buff, "Broadcast Message: ITCGW from host <%[^>]> listening on tcp://%[^:]:%hu/", hostname, tcp_ip, &tcp_port);
-	// printf("Received a greeting message from hostname <%s> on tcp://%s:%hu/\n", hostname, tcp_ip, tcp_port);
+	printf("Sent CLID_EXE_BATCH_REQUEST with %zu commands successfully!\n", n);
+	*num_sent = n;
+	return request;
+}
 
-	MUTEX_LOCK(&m_remote_hosts_mtx);
-	struct remote_host_info **iter;
-	iter = tfind(hostname, &m_remote_host_tree, compare_hostname_remotehost_tree);
-	if(iter != NULL)
+/* The reply is only decoded once complete, its entries may span fragments */
+static void handle_batch_frame(struct clid_request *request, int status, const struct clid_v2_frame *frame, void *user_data)
+{
+	(void)request;
+
+	struct batch_reply *reply = user_data;
+	if(status != CLID_CLIENT_OK)
 	{
-		/* Already added in tree */
-		// printf("Already connected, ignore broadcasting message from this remote device!\n");
-		restart_alive_timer((*iter)->alive_timer_fd);
-		MUTEX_UNLOCK(&m_remote_hosts_mtx);
-		return true;
-	} else
+		reply->status = status;
+		reply->is_done = true;
+		return;
+	}
+
+	// Once something is wrong with it, the rest of the reply is just waited for
+	if(reply->status == CLID_CLIENT_OK && frame->type != CLID_V2_TYPE(CLID_EXE_BATCH_REPLY))
 	{
-		int i = 0;
-		for(; i < MAX_NUM_REMOTE_HOSTS; i++)
+		printf("Received unexpected v2 frame type %hhu, request_id %u, drop it!\n", frame->type, frame->request_id);
+		reply->status = CLID_CLIENT_ERR_PROTOCOL;
+	} else if(reply->status == CLID_CLIENT_OK && reply->len + frame->payload_length > reply->cap)
+	{
+		size_t cap = (reply->len + frame->payload_length) * 2;
+		uint8_t *new_payload = realloc(reply->payload, cap);
+		if(new_payload == NULL)
 		{
-			if(strcmp(m_remote_hosts[i].hostname, "") == 0)
-			{
-				strcpy(m_remote_hosts[i].hostname, hostname);
-				strcpy(m_remote_hosts[i].ip, tcp_ip);
-				setup_alive_timer(&(m_remote_hosts[i].alive_timer_fd));
-				restart_alive_timer(m_remote_hosts[i].alive_timer_fd);
-				tsearch(&m_remote_hosts[i], &m_remote_host_tree, compare_host_remotehost_tree);
-				break;
-			}
-		}
-
-		if(i == MAX_NUM_REMOTE_HOSTS)
+			printf("Failed to realloc CLID_EXE_BATCH_REPLY buffer!\n");
+			reply->status = CLID_CLIENT_ERR_NOMEM;
+		} else
 		{
-			printf("No more than %d devices is accepted!\n", MAX_NUM_REMOTE_HOSTS);
-			return false;
+			reply->payload = new_payload;
+			reply->cap = cap;
 		}
 	}
-	MUTEX_UNLOCK(&m_remote_hosts_mtx);
 
-	return true;
-}
-
-static bool setup_alive_timer(int *timer_fd)
-{
-	*timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
-	if(*timer_fd < 0)
+	if(reply->status == CLID_CLIENT_OK && frame->payload_length > 0)
 	{
-		printf("Failed to timerfd_create(), errno = %d!\n", errno);
-		return false;
+		memcpy(reply->payload + reply->len, frame->payload, frame->payload_length);
+		reply->len += frame->payload_length;
 	}
 
-	// printf("Alive timer fd %d created successfully!\n", *stimer_fd);
-	return true;
+	reply->is_done = (frame->flags & CLID_V2_FLAG_MORE) == 0;
 }
 
-static bool restart_alive_timer(int timer_fd)
+/* Ctrl-C gives up on the batch, whatever clid still sends for it is dropped */
+static bool receive_v2_batch_reply(struct clid_request *request, struct batch_reply *reply)
 {
-	if(timer_fd < 0)
+	while(!reply->is_done)
 	{
-		printf("Failed to restart_alive_timer due to timer_fd = %d, errno = %d!\n", timer_fd, errno);
-		return false;
+		if(!wait_client())
+		{
+			clid_request_cancel(request);
+			printf("Cancelled, the commands clid already took still run!\n");
+			return false;
+		}
 	}
 
-	struct timespec now;
-	struct itimerspec its;
-
-	clock_gettime(CLOCK_REALTIME, &now);
-	memset(&its, 0, sizeof(struct itimerspec));
-	its.it_value.tv_sec = now.tv_sec + (time_t)CHECK_ALIVE_INTERVAL;
-	its.it_value.tv_nsec = now.tv_nsec;
-	int res = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
-	if(res < 0)
+	if(reply->status == CLID_CLIENT_ERR_CLOSED)
+	{
+		printf("Remote device went down in the middle of the script!\n");
+		return false;
+	} else if(reply->status != CLID_CLIENT_OK)
 	{
-		printf("Failed to timerfd_settime(), errno = %d!\n", errno);
+		printf("Failed to receive CLID_EXE_BATCH_REPLY, %s!\n", clid_client_strerror(reply->status));
 		return false;
 	}
 
 	return true;
 }
 
-static bool setup_udp_remote_hosts(void)
+/* Snapshot of the scanned devices, the discovery thread keeps updating m_remote_hosts meanwhile */
+static size_t collect_fanout_hosts(const char *pattern, struct fanout_host *hosts)
 {
+	size_t count = 0;
 	MUTEX_LOCK(&m_remote_hosts_mtx);
 	for(int i = 0; i < MAX_NUM_REMOTE_HOSTS; i++)
 	{
-		m_remote_hosts[i].hostname[0] = '\0';
-		strcpy(m_remote_hosts[i].ip, "0.0.0.0");
-		m_remote_hosts[i].alive_timer_fd = -1;
+		if(m_remote_hosts[i].hostname[0] == '\0')
+		{
+			continue;
+		}
+
+		if(pattern != NULL && strstr(m_remote_hosts[i].hostname, pattern) == NULL && strstr(m_remote_hosts[i].ip, pattern) == NULL)
+		{
+			continue;
+		}
+
+		strcpy(hosts[count].hostname, m_remote_hosts[i].hostname);
+		strcpy(hosts[count].ip, m_remote_hosts[i].ip);
+		count++;
 	}
 	MUTEX_UNLOCK(&m_remote_hosts_mtx);
 
-	return true;
+	return count;
 }
 
-static bool setup_remote_cmds_list(void)
+/* Talk to up to "jobs" hosts at once, all through the clid client. Ctrl-C gives up on the rest */
+static void run_fanout(struct fanout *fanout, int jobs)
 {
-	for(int i = 0; i < MAX_REMOTE_CMDS; i++)
+	bool is_cancelled = false;
+	while(fanout->done < fanout->count && !is_cancelled)
 	{
-		m_remote_cmds[i].cmd[0] = '\0';
-		m_remote_cmds[i].description[0] = '\0';
+		while(fanout->active < jobs && fanout->next < fanout->count)
+		{
+			start_fanout_host(fanout, &fanout->hosts[fanout->next++]);
+		}
+
+		// Hosts that failed right away may have been the last ones
+		if(fanout->done < fanout->count)
+		{
+			is_cancelled = !wait_client();
+		}
 	}
 
-	return true;
+	for(size_t i = 0; i < fanout->count && is_cancelled; i++)
+	{
+		finish_fanout_host(&fanout->hosts[i], "cancelled");
+	}
 }
 
-static int compare_hostname_remotehost_tree(const void *pa, const void *pb)
+/* The command is issued right away, the client sends it once the connection is up, a pooled one needs no connect at all */
+static void start_fanout_host(struct fanout *fanout, struct fanout_host *host)
 {
-	const char *hostname = pa;
-	const struct remote_host_info *peer = pb;
+	host->fanout = fanout;
+	host->state = FANOUT_RUNNING;
+	fanout->active++;
 
-	return strcmp(hostname, peer->hostname);
-}
-
-static int compare_host_remotehost_tree(const void *pa, const void *pb)
-{
-	const struct remote_host_info *peer_a = pa;
-	const struct remote_host_info *peer_b = pb;
-	
-	return strcmp(peer_a->hostname, peer_b->hostname);
+	host->conn = clid_connect(m_client, host->ip, handle_fanout_conn, NULL, host);
+	if(host->conn == NULL || clid_exec(host->conn, 0, fanout->nr_args, fanout->args, CMD_EXECUTION_TIMEOUT * 1000, handle_fanout_reply, host) == NULL)
+	{
+		finish_fanout_host(host, strerror(errno));
+	}
 }
 
-static int compare_cmd_name_in_remotecmd_tree(const void *pa, const void *pb)
+/* Failures only, the reply tells the rest */
+static void handle_fanout_conn(struct clid_conn *conn, int status, void *user_data)
 {
-	const char *cmd_name = pa;
-	const struct remote_cmd *remote_cmd = pb;
-
-	return strcmp(cmd_name, remote_cmd->cmd);
-}
+	(void)conn;
 
-static int compare_remotecmd_in_remotecmd_tree(const void *pa, const void *pb)
-{
-	const struct remote_cmd *remote_cmda = pa;
-	const struct remote_cmd *remote_cmdb = pb;
-	
-	return strcmp(remote_cmda->cmd, remote_cmdb->cmd);
+	struct fanout_host *host = user_data;
+	if(status != CLID_CLIENT_OK)
+	{
+		host->conn = NULL;
+		finish_fanout_host(host, clid_client_strerror(status));
+	}
 }
 
-static void add_new_cmd_to_history_queue(char *cmd)
+static void handle_fanout_reply(struct clid_request *request, const struct clid_exec_reply *reply, void *user_data)
 {
-	struct history_cmd *new_cmd = (struct history_cmd *)malloc(sizeof(struct history_cmd));
-	new_cmd->next = NULL;
-	strcpy(new_cmd->cmd, cmd);
+	(void)request;
 
-	/* Have not had any history command yet */
-	if(m_num_hist_cmd == 0)
+	struct fanout_host *host = user_data;
+	if(reply->status == CLID_CLIENT_ERR_TIMEOUT)
 	{
-		new_cmd->prev = NULL;
-		m_hist_cmd_queue.head = new_cmd;
-		m_hist_cmd_queue.tail = new_cmd;
-		m_num_hist_cmd++;
-	} else if(m_num_hist_cmd == MAX_HISTORY_CMDS)
+		char status[sizeof(host->status)];
+		snprintf(status, sizeof(status), "no reply within %d s", CMD_EXECUTION_TIMEOUT + CLID_CLIENT_REPLY_GRACE_MS / 1000);
+		finish_fanout_host(host, status);
+		return;
+	} else if(reply->status != CLID_CLIENT_OK)
 	{
-		/* Pop the first element from the queue to have slot for new cmd */
-		m_hist_cmd_queue.head = m_hist_cmd_queue.head->next;
-		free(m_hist_cmd_queue.head->prev);
+		finish_fanout_host(host, clid_client_strerror(reply->status));
+		return;
+	}
 
-		m_hist_cmd_queue.tail->next = new_cmd;
-		new_cmd->prev = m_hist_cmd_queue.tail;
-		m_hist_cmd_queue.tail = new_cmd;
-	} else
+	if(reply->is_first)
 	{
-		m_hist_cmd_queue.tail->next = new_cmd;
-		new_cmd->prev = m_hist_cmd_queue.tail;
-		m_hist_cmd_queue.tail = new_cmd;
-		m_num_hist_cmd++;
+		snprintf(host->status, sizeof(host->status), reply->result == CLID_EXE_CMD_RESULT_SUCCESS ? "OK" : "failed with result %u", reply->result);
 	}
 
-	m_hist_cmd_queue.search = m_hist_cmd_queue.tail;
-}
-
-static void destroy_history_queue(struct history_cmd_queue *hist_queue)
-{
-	if(hist_queue == NULL)
+	if(!append_fanout_output(host, reply->output, reply->output_len))
 	{
-		printf("Failed to destroy_history_queue due to history queue is NULL!\n");
 		return;
 	}
 
-	struct history_cmd *iter = hist_queue->head;
-	for(;iter != NULL;)
+	if(reply->is_last)
 	{
-		struct history_cmd *tmp = iter->next;
-		free(iter);
-		iter = tmp;
+		char status[sizeof(host->status)];
+		strcpy(status, host->status);
+		finish_fanout_host(host, status);
 	}
 }
 
-static bool connect_to_remote_host_via_ipaddr(char *ip)
+static bool append_fanout_output(struct fanout_host *host, const void *data, size_t len)
 {
-	if(m_active_fd != -1)
-	{
-		printf("Another connection still alive!\nDisconnect it first before connecting to ip address %s!\n", ip);
-		return true;
-	}
-
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if(sockfd < 0)
+	char *new_output = realloc(host->output, host->output_len + len);
+	if(new_output == NULL && host->output_len + len > 0)
 	{
-		printf("Failed to get socket(), errno = %d!\n", errno);
+		finish_fanout_host(host, "out of memory");
 		return false;
 	}
 
-	struct sockaddr_in serveraddr;
-	memset(&serveraddr, 0, sizeof(struct sockaddr_in));
-	serveraddr.sin_family = AF_INET;
-	serveraddr.sin_addr.s_addr = inet_addr(ip);
-	serveraddr.sin_port = htons(TCP_CLID_PORT);
+	host->output = new_output;
+	memcpy(host->output + host->output_len, data, len);
+	host->output_len += len;
+	return true;
+}
 
-	int res = connect(sockfd, (struct sockaddr *)((void *)&serveraddr), sizeof(struct sockaddr_in));
-	if(res < 0)
+/* The connection goes back to the client's pool for the next fan-out, unless it broke or a reply is still on its way */
+static void finish_fanout_host(struct fanout_host *host, const char *status)
+{
+	if(host->state == FANOUT_DONE)
 	{
-		printf("Failed to get connect(), errno = %d!\n", errno);
-		close(sockfd);
-		return false;
+		return;
 	}
 
-	strcpy(m_active_remote_ip, ip);
-	m_active_fd = sockfd;
-	printf("Connected to device: tcp://%s:%d\n", ip, TCP_CLID_PORT);
-
-	if(!send_get_list_cmd_request(sockfd))
+	if(host->conn != NULL)
 	{
-		return false;
+		clid_conn_release(host->conn);
+		host->conn = NULL;
 	}
 
-	if(!receive_get_list_cmd_reply(sockfd))
+	if(host->state == FANOUT_RUNNING)
 	{
-		return false;
+		host->fanout->active--;
 	}
+	host->fanout->done++;
 
-	return true;
+	snprintf(host->status, sizeof(host->status), "%s", status);
+	host->state = FANOUT_DONE;
 }
 
-static bool send_get_list_cmd_request(int sockfd)
+/* Hosts that answered the same are printed together, largest group first, so the odd ones stand out at the end */
+static void print_fanout_results(struct fanout_host *hosts, size_t count)
 {
-	size_t msg_len = offsetof(struct ethtcp_msg, payload) + sizeof(struct clid_get_list_cmd_request);
-	struct ethtcp_msg *req = malloc(msg_len);
-	if(req == NULL)
+	size_t *group_sizes = calloc(count, sizeof(size_t));
+	if(group_sizes == NULL)
 	{
-		printf("Failed to malloc locate mbox request message!\n");
-		return false;
+		printf("Failed to calloc fan-out groups!\n");
+		return;
 	}
 
-	uint32_t payload_length = sizeof(struct clid_get_list_cmd_request);
-	req->header.sender 					= htonl((uint32_t)getpid());
-	req->header.receiver 					= htonl(111);
-	req->header.protRev 					= htonl(15);
-	req->header.msgno 					= htonl(CLID_GET_LIST_CMD_REQUEST);
-	req->header.payloadLen 					= htonl(payload_length);
-
-	req->payload.clid_get_list_cmd_request.errorcode	= htonl(CLID_STATUS_OK);
-
-	int res = send(sockfd, req, msg_len, 0);
-	if(res < 0)
+	size_t num_groups = 0;
+	for(size_t i = 0; i < count; i++)
 	{
-		printf("Failed to send CLID_GET_LIST_CMD_REQUEST, errno = %d!\n", errno);
-		return false;
+		hosts[i].group = (int)i;
+		for(size_t j = 0; j < i; j++)
+		{
+			if(hosts[j].group == (int)j && strcmp(hosts[j].status, hosts[i].status) == 0 && hosts[j].output_len == hosts[i].output_len
+			   && (hosts[i].output_len == 0 || memcmp(hosts[j].output, hosts[i].output, hosts[i].output_len) == 0))
+			{
+				hosts[i].group = (int)j;
+				break;
+			}
+		}
+
+		num_groups += hosts[i].group == (int)i ? 1 : 0;
+		group_sizes[hosts[i].group]++;
 	}
 
-	free(req);
-	printf("Sent CLID_GET_LIST_CMD_REQUEST successfully!\n");
-	return true;
-}
+	for(size_t printed = 0; printed < num_groups; printed++)
+	{
+		size_t leader = 0;
+		for(size_t i = 1; i < count; i++)
+		{
+			leader = group_sizes[i] > group_sizes[leader] ? i : leader;
+		}
 
-static int recv_data(int sockfd, void *rx_buff, int nr_bytes_to_read)
-{
-	int length = 0;
-	int read_count = 0;
+		printf("=== %s from %zu device%s:", hosts[leader].status, group_sizes[leader], group_sizes[leader] > 1 ? "s" : "");
+		for(size_t i = leader; i < count; i++)
+		{
+			if(hosts[i].group == (int)leader)
+			{
+				printf(" %s (%s)", hosts[i].hostname, hosts[i].ip);
+			}
+		}
+		printf(" ===\n");
 
-	do
-	{
-		length = recv(sockfd, (char *)rx_buff + read_count, nr_bytes_to_read, 0);
-		if(length <= 0)
+		fwrite(hosts[leader].output, 1, hosts[leader].output_len, stdout);
+		if(hosts[leader].output_len > 0 && hosts[leader].output[hosts[leader].output_len - 1] != '\n')
 		{
-			return length;
+			printf("\n");
 		}
 
-		read_count += length;
-		nr_bytes_to_read = nr_bytes_to_read - length;
-	} while(nr_bytes_to_read > 0);
+		group_sizes[leader] = 0;
+	}
 
-	return read_count;
+	free(group_sizes);
+	fflush(stdout);
 }
 
-static bool receive_get_list_cmd_reply(int sockfd)
+/* The command runs on a connection of its own, one the pool still holds if there is, and its output goes to a spool file until fg */
+static void start_job(void)
 {
-	struct ethtcp_header *header;
-	int header_size = sizeof(struct ethtcp_header);
-	char rxbuff[header_size];
-	int size = 0;
-
-	size = recv_data(sockfd, rxbuff, header_size);
-
-	if(size == 0)
+	struct remote_session *session = m_active_session;
+	if(!check_remote_cmd(session))
 	{
-		printf("Clid from this fd %d just disconnected!\n", sockfd);
-		return true;
-	} else if(size < 0)
+		return;
+	}
+
+	struct bg_job *job = get_free_job();
+	if(job == NULL)
 	{
-		printf("Receive data from this clid failed, fd = %d!\n", sockfd);
-		return false;
+		printf("Too many jobs, at most %d, fg the finished ones first!\n\n", MAX_JOBS);
+		return;
 	}
 
-	header = (struct ethtcp_header *)rxbuff;
-	header->msgno 			= ntohl(header->msgno);
-	header->payloadLen 		= ntohl(header->payloadLen);
-	header->protRev			= ntohl(header->protRev);
-	header->receiver		= ntohl(header->receiver);
-	header->sender			= ntohl(header->sender);
+	size_t len = 0;
+	for(int i = 0; i < m_nr_args && len < sizeof(job->cmdline); i++)
+	{
+		len += snprintf(job->cmdline + len, sizeof(job->cmdline) - len, "%s%s", i > 0 ? " " : "", m_args[i]);
+	}
+	snprintf(job->ip, sizeof(job->ip), "%s", session->ip);
+	strcpy(job->status, "Running");
+	job->started_ns = get_time_ns();
 
-	printf("Receiving %d bytes from fd %d\n", size, sockfd);
-	printf("Re-interpret TCP packet: msgno: 0x%08x\n", header->msgno);
-	printf("Re-interpret TCP packet: payloadLen: %u\n", header->payloadLen);
-	printf("Re-interpret TCP packet: protRev: %u\n", header->protRev);
-	printf("Re-interpret TCP packet: receiver: %u\n", header->receiver);
-	printf("Re-interpret TCP packet: sender: %u\n", header->sender);
+	if((job->spool = tmpfile()) == NULL)
+	{
+		printf("Failed to create job spool, errno = %d!\n\n", errno);
+		remove_job(job);
+		return;
+	}
 
-	switch (header->msgno)
+	job->conn = clid_connect(m_client, job->ip, handle_job_conn, NULL, job);
+	if(job->conn == NULL || (job->request = clid_exec(job->conn, 0, m_nr_args, (const char *const *)m_args, CMD_EXECUTION_TIMEOUT * 1000,
+		handle_job_reply, job)) == NULL)
 	{
-	case CLID_GET_LIST_CMD_REPLY:
-		printf("Received CLID_GET_LIST_CMD_REPLY!\n");
-		handle_receive_get_list_cmd_reply(sockfd, header);
-		break;
-	
-	default:
-		printf("Received unknown TCP packet, drop it!\n");
-		break;
+		printf("Failed to send CLID_EXE_CMD_REQUEST, errno = %d!\n\n", errno);
+		remove_job(job);
+		return;
 	}
 
-	return true;
+	printf("[%d] Running in the background, fg %d shows its output\n\n", job->id, job->id);
 }
 
-static bool handle_receive_get_list_cmd_reply(int sockfd, struct ethtcp_header *header)
+static struct bg_job *get_free_job(void)
 {
-	struct clid_get_list_cmd_reply *rep;
-	uint32_t payloadLen = header->payloadLen;
-	char rxbuff[payloadLen];
-	int size = 0;
-
-	size = recv_data(sockfd, rxbuff, payloadLen);
-
-	if(size <= 0)
+	struct bg_job *job = NULL;
+	int id = 1;
+	for(int i = 0; i < MAX_JOBS; i++)
 	{
-		printf("Failed to receive data from this clid, fd = %d!\n", sockfd);
-		return false;
+		if(!m_jobs[i].is_used)
+		{
+			job = job == NULL ? &m_jobs[i] : job;
+		} else if(m_jobs[i].id >= id)
+		{
+			id = m_jobs[i].id + 1;
+		}
 	}
 
-	rep = (struct clid_get_list_cmd_reply *)rxbuff;
-	rep->errorcode 			= ntohl(rep->errorcode);
-	rep->payload_length		= ntohl(rep->payload_length);
-
-	printf("Receiving %d bytes from fd %d\n", size, sockfd);
-	printf("Re-interpret TCP packet: errorcode: %u\n", rep->errorcode);
-	printf("Re-interpret TCP packet: payload_length: %u\n", rep->payload_length);
+	if(job != NULL)
+	{
+		memset(job, 0, sizeof(*job));
+		job->is_used = true;
+		job->id = id;
+		job->state = JOB_RUNNING;
+	}
+	return job;
+}
 
-	unsigned long offset = 2;
-	uint16_t cmd_len = 0;
-	char cmd_buff[MAX_ARG_LENGTH];
-	uint16_t num_cmds = *((uint16_t *)(rep->payload));
-	printf("Re-interpret TCP packet: num_cmds: %hu\n", num_cmds);
-	for(int i = 0; i < num_cmds; i++)
+/* By the id jobs shows, with or without a leading '%', or the latest job if id is NULL */
+static struct bg_job *find_job(const char *id)
+{
+	int wanted = 0;
+	if(id != NULL)
 	{
-		int j = 0;
-		for(; j < MAX_REMOTE_CMDS; j++)
+		char *end = NULL;
+		wanted = (int)strtol(id[0] == '%' ? id + 1 : id, &end, 10);
+		if(end == NULL || *end != '\0' || wanted <= 0)
 		{
-			if(m_remote_cmds[j].cmd[0] == '\0')
-			{
-				/* This is command name */
-				cmd_len = *((uint16_t *)(rep->payload + offset));
-				offset += 2;
-				memcpy(cmd_buff, (rep->payload + offset), cmd_len);
-				cmd_buff[cmd_len] = '\0';
-				offset += cmd_len;
-				printf("Re-interpret TCP packet: cmd_len %d: %hu\n", i, cmd_len);
-				printf("Re-interpret TCP packet: cmd %d: %s\n", i, cmd_buff);
-				strcpy(m_remote_cmds[j].cmd, cmd_buff);
-
-				/* This is command description */
-				cmd_len = *((uint16_t *)(rep->payload + offset));
-				offset += 2;
-				memcpy(cmd_buff, (rep->payload + offset), cmd_len);
-				cmd_buff[cmd_len] = '\0';
-				offset += cmd_len;
-				printf("Re-interpret TCP packet: cmd_desc_len %d: %hu\n", i, cmd_len);
-				printf("Re-interpret TCP packet: cmd_desc %d: %s\n", i, cmd_buff);
-				strcpy(m_remote_cmds[j].description, cmd_buff);
-
-				struct remote_cmd **iter;
-				iter = tfind(m_remote_cmds[j].cmd, &m_remote_cmd_tree, compare_cmd_name_in_remotecmd_tree);
-				if(iter != NULL)
-				{
-					printf("Command \"%s\" already added in remote cmd tree, something wrong!\n", m_remote_cmds[j].cmd);
-				} else
-				{
-					tsearch(&m_remote_cmds[j], &m_remote_cmd_tree, compare_remotecmd_in_remotecmd_tree);
-				}
-
-				break;
-			}
+			return NULL;
 		}
+	}
 
-		if(j == MAX_REMOTE_CMDS)
+	struct bg_job *found = NULL;
+	for(int i = 0; i < MAX_JOBS; i++)
+	{
+		struct bg_job *job = &m_jobs[i];
+		if(job->is_used && (wanted != 0 ? job->id == wanted : found == NULL || job->id > found->id))
 		{
-			printf("No more than %d remote cmd can be added!\n", MAX_REMOTE_CMDS);
-			return false;
+			found = job;
 		}
 	}
-	
-	return true;
+	return found;
 }
 
-static void do_nothing(void *tree_node_data)
+/* Failures only, the reply tells the rest */
+static void handle_job_conn(struct clid_conn *conn, int status, void *user_data)
 {
-	(void)tree_node_data;
+	(void)conn;
+
+	struct bg_job *job = user_data;
+	if(status != CLID_CLIENT_OK)
+	{
+		job->conn = NULL;
+		finish_job(job, clid_client_strerror(status));
+	}
 }
 
-static bool send_exe_cmd_request(int sockfd)
+static void handle_job_reply(struct clid_request *request, const struct clid_exec_reply *reply, void *user_data)
 {
-	uint32_t total_len = 0;
-	uint16_t len = 0;
-	char cmds_buff[(strlen(m_args[0]) + 1) + 2 + m_nr_args*(MAX_ARG_LENGTH)]; // cmdName + num_args + series_of_args_in_string_format
+	struct bg_job *job = user_data;
+	spool_job_reply(job, reply);
+	if(!m_pending.is_pending || m_pending.job != job)
+	{
+		return;
+	}
 
-	len = strlen(m_args[0]) + 1; // Include '\0'
-	strcpy(&cmds_buff[total_len], m_args[0]);
-	total_len += len;
+	// Brought to the foreground by fg, the output also goes out as that of any other command. Gone once done, as fg of a finished job
+	if(job->state == JOB_DONE)
+	{
+		remove_job(job);
+	}
+	handle_exec_reply(request, reply, NULL);
+	if(reply->status == CLID_CLIENT_OK && !reply->is_last && job->state == JOB_DONE)
+	{
+		// The spool failed, the job is given up on
+		printf("\n%s!\n\n", job->status);
+		m_output.is_quit = true;
+		end_cmd_output();
+		finish_pending_cmd();
+	}
+}
 
-	*((uint16_t *)(&cmds_buff[total_len])) = m_nr_args;
-	total_len += 2;
+/* Kept until fg, in the foreground as well, so that Ctrl-C there leaves none of it behind */
+static void spool_job_reply(struct bg_job *job, const struct clid_exec_reply *reply)
+{
+	if(reply->status == CLID_CLIENT_ERR_TIMEOUT)
+	{
+		char status[sizeof(job->status)];
+		snprintf(status, sizeof(status), "No reply within %d s", CMD_EXECUTION_TIMEOUT + CLID_CLIENT_REPLY_GRACE_MS / 1000);
+		finish_job(job, status);
+		return;
+	} else if(reply->status != CLID_CLIENT_OK)
+	{
+		finish_job(job, clid_client_strerror(reply->status));
+		return;
+	}
 
-	for(int i = 0; i < m_nr_args; i++)
+	if(reply->is_first)
 	{
-		len = strlen(m_args[i]) + 1; // Include '\0'
-		strcpy(&cmds_buff[total_len], m_args[i]);
-		total_len += len;
+		job->has_reply = true;
+		job->errorcode = reply->errorcode;
+		job->result = reply->result;
 	}
 
-	size_t msg_len = offsetof(struct ethtcp_msg, payload) + offsetof(struct clid_exe_cmd_request, payload) + total_len;
-	struct ethtcp_msg *rep = malloc(msg_len);
-	if(rep == NULL)
+	if(reply->output_len > 0 && pwrite(fileno(job->spool), reply->output, reply->output_len, (off_t)job->spool_len) != (ssize_t)reply->output_len)
 	{
-		printf("Failed to malloc locate mbox reply message!\n");
-		return false;
+		char status[sizeof(job->status)];
+		snprintf(status, sizeof(status), "Failed to write job spool, errno = %d", errno);
+		finish_job(job, status);
+		return;
 	}
+	job->spool_len += reply->output_len;
 
-	uint32_t payload_length = offsetof(struct clid_exe_cmd_request, payload) + total_len;
-	rep->header.sender 					= htonl((uint32_t)getpid());
-	rep->header.receiver 					= htonl(111);
-	rep->header.protRev 					= htonl(15);
-	rep->header.msgno 					= htonl(CLID_EXE_CMD_REQUEST);
-	rep->header.payloadLen 					= htonl(payload_length);
+	if(reply->is_last)
+	{
+		char status[sizeof(job->status)];
+		snprintf(status, sizeof(status), reply->result == CLID_EXE_CMD_RESULT_SUCCESS ? "Done" : "Done with result %u", reply->result);
+		job->is_complete = true;
+		finish_job(job, status);
+	}
+}
 
-	rep->payload.clid_exe_cmd_request.errorcode		= htonl(CLID_STATUS_OK);
-	rep->payload.clid_exe_cmd_request.timeout		= htonl(CMD_EXECUTION_TIMEOUT);
-	rep->payload.clid_exe_cmd_request.payload_length	= htonl(total_len);
-	memcpy(rep->payload.clid_exe_cmd_request.payload, cmds_buff, total_len);
+/* The connection goes back to the client's pool, unless it broke or a reply is still on its way. Done is told with the next prompt */
+static void finish_job(struct bg_job *job, const char *status)
+{
+	if(job->state == JOB_DONE)
+	{
+		return;
+	}
 
-	int res = send(sockfd, rep, msg_len, 0);
-	if(res < 0)
+	if(job->conn != NULL)
 	{
-		printf("Failed to send CLID_EXE_CMD_REQUEST, errno = %d!\n", errno);
-		return false;
+		clid_conn_release(job->conn);
+		job->conn = NULL;
 	}
+	job->request = NULL;
 
-	free(rep);
-	printf("Sent CLID_EXE_CMD_REQUEST successfully!\n");
-	return true;
+	snprintf(job->status, sizeof(job->status), "%s", status);
+	job->state = JOB_DONE;
+	job->finished_ns = get_time_ns();
+	m_is_prompt_needed = true;
 }
 
-static bool receive_exe_cmd_reply(int sockfd)
+/* Whatever is left of the job is dropped, its output included */
+static void remove_job(struct bg_job *job)
 {
-	struct ethtcp_header *header;
-	int header_size = sizeof(struct ethtcp_header);
-	char rxbuff[header_size];
-	int size = 0;
-
-	size = recv_data(sockfd, rxbuff, header_size);
-
-	if(size == 0)
-	{
-		printf("Remote device went down, please disconnect it!\n\n");
-		return true;
-	} else if(size < 0)
+	if(job->request != NULL)
 	{
-		printf("Receive data from this clid failed, fd = %d!\n\n", sockfd);
-		return false;
+		clid_request_cancel(job->request);
+		job->request = NULL;
 	}
 
-	header = (struct ethtcp_header *)rxbuff;
-	header->msgno 			= ntohl(header->msgno);
-	header->payloadLen 		= ntohl(header->payloadLen);
-	header->protRev			= ntohl(header->protRev);
-	header->receiver		= ntohl(header->receiver);
-	header->sender			= ntohl(header->sender);
-
-	printf("Receiving %d bytes from fd %d\n", size, sockfd);
-	printf("Re-interpret TCP packet: msgno: 0x%08x\n", header->msgno);
-	printf("Re-interpret TCP packet: payloadLen: %u\n", header->payloadLen);
-	printf("Re-interpret TCP packet: protRev: %u\n", header->protRev);
-	printf("Re-interpret TCP packet: receiver: %u\n", header->receiver);
-	printf("Re-interpret TCP packet: sender: %u\n", header->sender);
+	if(job->conn != NULL)
+	{
+		clid_conn_release(job->conn);
+		job->conn = NULL;
+	}
 
-	switch (header->msgno)
+	if(job->spool != NULL)
 	{
-	case CLID_EXE_CMD_REPLY:
-		printf("Received CLID_EXE_CMD_REPLY!\n");
-		handle_receive_exe_cmd_reply(sockfd, header);
-		break;
-	
-	default:
-		printf("Received unknown TCP packet, drop it!\n");
-		break;
+		fclose(job->spool);
+		job->spool = NULL;
 	}
 
-	return true;
+	if(m_pending.job == job)
+	{
+		m_pending.job = NULL;
+	}
+	job->is_used = false;
 }
 
-static bool handle_receive_exe_cmd_reply(int sockfd, struct ethtcp_header *header)
+static void remove_all_jobs(void)
 {
-	struct clid_exe_cmd_reply *rep;
-	uint32_t payloadLen = header->payloadLen;
-	char rxbuff[payloadLen];
-	int size = 0;
-
-	size = recv_data(sockfd, rxbuff, payloadLen);
-
-	if(size <= 0)
+	for(int i = 0; i < MAX_JOBS; i++)
 	{
-		printf("Failed to receive data from this clid, fd = %d!\n", sockfd);
-		return false;
+		if(m_jobs[i].is_used)
+		{
+			remove_job(&m_jobs[i]);
+		}
 	}
+}
 
-	rep = (struct clid_exe_cmd_reply *)rxbuff;
-	rep->errorcode 			= ntohl(rep->errorcode);
-	rep->result			= ntohl(rep->result);
-	rep->payload_length		= ntohl(rep->payload_length);
-
-	printf("Receiving %d bytes from fd %d\n", size, sockfd);
-	printf("Re-interpret TCP packet: errorcode: %u\n", rep->errorcode);
-	printf("Re-interpret TCP packet: result: %u\n", rep->result);
-	printf("Re-interpret TCP packet: payload_length: %u\n", rep->payload_length);
+/* Jobs done since the last prompt, told right above the next one as a shell does */
+static void notify_jobs(void)
+{
+	bool is_cleared = false;
+	for(int i = 0; i < MAX_JOBS; i++)
+	{
+		struct bg_job *job = &m_jobs[i];
+		if(!job->is_used || job->state != JOB_DONE || job->is_notified)
+		{
+			continue;
+		}
 
-	char output[512];
-	memcpy(output, rep->payload, rep->payload_length);
-	output[rep->payload_length] = '\0';
-	
-	printf("Re-interpret TCP packet: cmd_output:\n%s\n", output);
+		if(!is_cleared)
+		{
+			printf("\33[2K\r");
+			is_cleared = true;
+		}
+		printf("[%d] %s  %s\n", job->id, job->status, job->cmdline);
+		job->is_notified = true;
+	}
+}
 
-	return true;
+static uint64_t get_time_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
 }
 
 void initTermios(void)
@@ -1793,10 +5901,19 @@ void initTermios(void)
 	current_term_settings = old_term_settings; /* make new settings same as old settings */
 	current_term_settings.c_lflag &= ~(ICANON | ECHO | ECHOE); /* disable buffered i/o */
 	tcsetattr(0, TCSANOW, &current_term_settings); /* use these new terminal i/o settings now */
+	if(isatty(STDOUT_FILENO))
+	{
+		printf("\33[?2004h"); /* bracketed paste, see paste_input_text() */
+	}
 }
 
 void resetTermios(void)
 {
+	if(isatty(STDOUT_FILENO))
+	{
+		printf("\33[?2004l");
+		fflush(stdout);
+	}
 	tcsetattr(0, TCSANOW, &old_term_settings);
 }
 